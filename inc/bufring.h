@@ -0,0 +1,58 @@
+/*****************************************************************************
+ * bufring.h
+ *
+ * Bounded single producer / single consumer ring of transfer buffers
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "sysdeps.h"
+
+#define BUFRING_ALIGN   4096
+
+typedef struct {
+  uint32_t len;
+  unsigned char *data;
+} CBuffer;
+
+// Fixed set of page aligned slots handed from one producer thread to one
+// consumer thread. Head and tail are only written by their owning side so no
+// lock is needed, a futex is only touched when the other side is asleep.
+class BufRing {
+public:
+  BufRing();
+  ~BufRing();
+
+  int Init(uint32_t slots, uint32_t slotSize);
+  void Reset(void);
+  void Close(void);
+  bool IsClosed(void);
+  uint32_t SlotSize(void);
+
+  // Producer side
+  CBuffer *GetFree(void);
+  void Put(void);
+
+  // Consumer side
+  CBuffer *GetFilled(void);
+  void Release(void);
+
+private:
+  void Wait(std::atomic<uint32_t> *event, std::atomic<int> *waiting, bool bProducer);
+  void Wake(std::atomic<uint32_t> *event, std::atomic<int> *waiting);
+
+  CBuffer *slots;
+  unsigned char *pool;
+  uint32_t count;
+  uint32_t size;
+
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> closed;
+  std::atomic<uint32_t> prodEvent;
+  std::atomic<uint32_t> consEvent;
+  std::atomic<int> prodWaiting;
+  std::atomic<int> consWaiting;
+};
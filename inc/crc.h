@@ -5,10 +5,22 @@
 #endif
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define CRC_16_L_SEED         0xFFFF
 extern const unsigned short crc_16_l_table[];
 
 #define CRC_16_L_STEP(xx_crc,xx_c) \
   (((xx_crc) >> 8) ^ crc_16_l_table[((xx_crc) ^ (xx_c)) & 0x00ff])
 
-unsigned short CalcCRC16(unsigned char *buf, int length);
\ No newline at end of file
+unsigned short CalcCRC16(unsigned char *buf, int length);
+// Streaming form of CalcCRC16, starts from crc = 0 like CRC32Update
+unsigned short CRC16Update(unsigned short crc, const unsigned char *buf, size_t length);
+
+// IEEE 802.3 CRC32 as used by GPT headers and sparse images. Streaming use
+// starts from crc = 0 and feeds the previous result back in for each chunk.
+uint32_t CRC32Update(uint32_t crc, const unsigned char *buf, size_t length);
+uint32_t CRC32UpdateTable(uint32_t crc, const unsigned char *buf, size_t length);
+uint32_t CalcCRC32(const unsigned char *buf, size_t length);
+const char *CRC32Engine(void);
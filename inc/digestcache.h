@@ -0,0 +1,61 @@
+/*****************************************************************************
+ * digestcache.h
+ *
+ * Persistent cache of host side image digests and sparse chunk maps
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include "sysdeps.h"
+
+#define DIGEST_CACHE_MAGIC    0x48434445  // "EDCH"
+#define DIGEST_CACHE_VERSION  1
+#define DIGEST_CACHE_PATH     512
+#define DIGEST_CACHE_MAX_SIZE (64*1024*1024)
+
+typedef enum {
+  DIGEST_CACHE_DELTA = 1,   // SHA-256 per block of a range, then one for the range
+  DIGEST_CACHE_SPARSE = 2   // SPARSE_CHUNK map of a sparse image
+} digest_cache_kind_e;
+
+// Every record lives in its own file named after a hash of the key. The header
+// repeats the key so a stale or colliding file is never taken for a hit.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t kind;
+  uint32_t unit;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t fileSize;
+  int64_t mtimeNs;
+  uint64_t offset;
+  uint64_t len;
+  uint32_t size;
+  uint32_t crc;
+} digest_cache_hdr_t;
+
+// Records are keyed by image path, inode, size and mtime so an image that is
+// rebuilt in place misses. Writers build a private temp file and rename it over
+// the record, several emmcdl processes can share one directory.
+class DigestCache {
+public:
+  DigestCache();
+
+  void SetDir(const char *szDir);
+  const char *GetDir(void);
+
+  int Load(int hFile, const char *szFile, uint32_t kind, uint32_t unit, uint64_t offset, uint64_t len,
+           unsigned char **data, uint32_t *size);
+  int Store(int hFile, const char *szFile, uint32_t kind, uint32_t unit, uint64_t offset, uint64_t len,
+            const unsigned char *data, uint32_t size);
+
+private:
+  int RecordPath(int hFile, const char *szFile, digest_cache_hdr_t *hdr, char *szPath);
+  int MakeDir(void);
+
+  char szCacheDir[DIGEST_CACHE_PATH];
+};
+
+extern DigestCache g_digestcache;
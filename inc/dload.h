@@ -28,6 +28,12 @@ when       who     what, where, why
 
 #define PACKET_TIMEOUT  1000
 
+// Stream writes, the programmer reports its block size and window in the hello response
+#define DLOAD_BLOCK_SIZE   1024
+#define DLOAD_MAX_BLOCK    0x8000
+#define DLOAD_MAX_WINDOW   16
+#define DLOAD_MAX_RETRY    3
+
 #define FEATURE_SECTOR_ADDRESSES   0x00000010
 
 // Packets that are used in dload mode
@@ -157,7 +163,10 @@ private:
   uint32_t HexDataLength(char *filename);
   __uint64_t GetNumDiskSectors();
   int ProgramPartitionEntry(PartitionEntry pe);
+  void ParseHelloResponse(unsigned char *rsp, int rspSize);
 
   SerialPort *sport;
   bool bSectorAddress;
+  uint32_t blockSize;
+  uint32_t windowSize;
 };
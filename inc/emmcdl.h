@@ -43,5 +43,6 @@ enum emmc_cmd_e {
   EMMC_CMD_RAW,
   EMMC_CMD_LOAD_FFU,
   EMMC_CMD_INFO,
-  EMMC_CMD_W_IMEI
+  EMMC_CMD_W_IMEI,
+  EMMC_CMD_MEMDUMP
 };
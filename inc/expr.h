@@ -0,0 +1,76 @@
+/*****************************************************************************
+ * expr.h
+ *
+ * Compiled arithmetic for rawprogram and patch attribute values
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+
+// Longest postfix program one attribute may compile to
+#define EXPR_MAX_OPS    64
+#define EXPR_MAX_DEPTH  16
+
+typedef enum {
+  EXPR_CONST = 0,
+  EXPR_DISK,        // NUM_DISK_SECTORS of the bound geometry
+  EXPR_NEG,
+  EXPR_ADD,
+  EXPR_SUB,
+  EXPR_MUL,
+  EXPR_DIV
+} expr_op_e;
+
+typedef struct {
+  uint64_t val;
+  uint32_t op;
+} expr_op_t;
+
+// Postfix programs for the value and, when a CRC32(start,len) term is added to
+// it, for the two arguments. The CRC itself is added once the data is known.
+typedef struct {
+  uint32_t numValue;
+  uint32_t numStart;
+  uint32_t numLen;
+  bool bCrc;
+  expr_op_t *ops;
+} expr_t;
+
+typedef struct {
+  uint64_t value;
+  bool bCrc;
+  uint64_t crcStart;
+  uint64_t crcLen;
+} expr_value_t;
+
+// Grammar is + - * / with the usual precedence, unary minus, parentheses,
+// decimal (ptool's trailing '.' allowed) and 0x hex literals, NUM_DISK_SECTORS
+// and at most one CRC32(start,len) added at the top level. 64 bit arithmetic
+// wraps, division is signed and x/0 is 0. The result is free()'d by the caller.
+int ExprCompile(const char *text, expr_t **expr);
+void ExprEval(const expr_t *expr, uint64_t diskSectors, expr_value_t *value);
+
+typedef struct {
+  uint32_t hash;
+  int status;
+  expr_t *expr;
+  char *text;
+} expr_entry_t;
+
+// Compiles each distinct attribute text once, a patch file repeats the same few
+// expressions and the same key is parsed again when the disk size becomes known
+class ExprCache {
+public:
+  ExprCache();
+  ~ExprCache();
+
+  int Evaluate(const char *text, uint64_t diskSectors, expr_value_t *value);
+
+private:
+  int Grow(void);
+
+  expr_entry_t **table;
+  uint32_t size;
+  uint32_t count;
+};
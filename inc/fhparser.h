@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * fhparser.h
+ *
+ * Single pass parser for the <data> documents a Firehose target sends back
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include "sysdeps.h"
+
+// Outcome of the <response value="..."> element in a target document
+typedef enum {
+  FH_RESP_NONE,
+  FH_RESP_ACK,
+  FH_RESP_NAK
+} fh_resp_e;
+
+typedef enum {
+  FH_EVENT_LOG,       // value of a <log> element
+  FH_EVENT_ATTR,      // any other attribute, element and name are set
+  FH_EVENT_RAWMODE,   // rawmode attribute of <response>
+  FH_EVENT_RESPONSE   // end of <response>, after all of its attributes
+} fh_event_e;
+
+// Strings point into the document being parsed and are not NUL terminated
+typedef struct {
+  fh_event_e type;
+  const char *element;
+  uint32_t elementLen;
+  const char *name;
+  uint32_t nameLen;
+  const char *value;
+  uint32_t valueLen;
+  fh_resp_e resp;
+  bool rawmode;
+} fh_event_t;
+
+typedef void (*fh_event_func)(void *ctx, const fh_event_t *ev);
+
+class FHParser {
+public:
+  FHParser(fh_event_func func, void *ctx);
+  int Parse(const char *doc, uint32_t len);
+
+  static bool Match(const char *str, uint32_t len, const char *lit);
+  static uint64_t ToInteger(const char *str, uint32_t len);
+
+private:
+  void Emit(fh_event_t *ev);
+
+  fh_event_func eventFunc;
+  void *eventCtx;
+};
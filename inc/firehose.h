@@ -24,13 +24,22 @@ when       who     what, where, why
 #include "serialport.h"
 #include "protocol.h"
 #include "partition.h"
-#include "list.h"
+#include "bufring.h"
+#include "fhparser.h"
+#include "metrics.h"
+#include "sha256.h"
 #include <stdio.h>
 #include <stdint.h>
 #include "sysdeps.h"
 
 #define MAX_RETRY   50
 
+// Number of payload buffers in flight between the file and USB threads, power of two
+#define FH_RING_SLOTS  4
+
+// Most <patch> elements sent in one <data> document, 1 sends each patch on its own
+#define FH_PATCH_BATCH 32
+
 typedef struct {
   unsigned char Version;
   char MemoryName[8];
@@ -42,23 +51,18 @@ typedef struct {
   int AckRawDataEveryNumPackets;
 } fh_configure_t;
 
-typedef struct {
-  struct listnode blist;
-  uint32_t len;
-  unsigned char data[4];
-} CBuffer;
-
 class Firehose;
 
 typedef struct {
    Firehose *fh;
    uint64_t sectors;
-   pthread_mutex_t *pmutex;
-   pthread_cond_t  *pcond;
-   listnode *prnode;
-   listnode *pwnode;
+   BufRing *pring;
+   int hRead;
    int hWrite;
    int DISK_SECTOR_SIZE;
+   uint32_t dwChunkSize;
+   sha256_ctx *psha;
+   int status;
 }  thread_info;
 class Firehose : public Protocol {
 public:
@@ -71,7 +75,15 @@ public:
   int DeviceReset(void);
   int DeviceNop();
   int FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sectorWrite, __uint64_t sectors, uint8_t partNum);
+  int FillSectors(uint32_t pattern, int64_t start_sector, __uint64_t num_sectors, uint8_t partNum);
+  int EraseSectors(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum);
+  uint32_t GetMaxPayloadSize(void);
   int ProgramPatchEntry(PartitionEntry pe, char *key);
+  int FlushPatches(void);
+  void SetPatchBatch(uint32_t count);
+  int GetStorageSectors(uint8_t partNum, __uint64_t *sectors);
+  void EnableVerify(void);
+  int GetDigest(int64_t startSector, __uint64_t sectors, uint8_t partNum, unsigned char *digest);
   int ProgramRawCommand(char *key);
   int PeekLogBuf(int64_t start, int64_t size);
   int WriteIMEI(char *imei);
@@ -86,7 +98,15 @@ protected:
 
 private:
   int ReadData(unsigned char *pOutBuf, uint32_t uiBufSize, bool bXML);
+  int ReadResponse(void);
+  void ParseResponse(void);
+  static void ResponseEvent(void *ctx, const fh_event_t *ev);
   int ReadStatus(void);
+  int SendCommand(const char *pkt, uint32_t len);
+  int SendPatch(const char *elem, uint32_t len);
+  int VerifyDigest(int64_t startSector, __uint64_t sectors, uint8_t partNum, const unsigned char *digest);
+  void WaitAck(metric_e id);
+  unsigned char *FillPayload(uint32_t pattern);
 
   SerialPort *sport;
   __uint64_t diskSectors;
@@ -95,10 +115,34 @@ private:
   bool m_read_back_verify;
   bool m_rawmode;
   unsigned char *m_payload;
+  unsigned char *m_fill;
+  uint32_t m_fill_pattern;
+  BufRing m_ring;
   unsigned char *m_buffer;
   unsigned char *m_buffer_ptr;
   uint32_t m_buffer_len;
+  const char *m_resp;
+  uint32_t m_resp_len;
+  fh_resp_e m_resp_value;
+  int m_resp_rawmode;
+  uint64_t m_resp_max_payload;
+  uint32_t m_max_xml;
+  uint64_t m_storage_sectors;
+  bool m_storage_pending;
+  bool m_verify;
+  bool m_digest;
+  bool m_digest_pending;
+  bool m_resp_digest_valid;
+  unsigned char m_resp_digest[SHA256_DIGEST_LEN];
+  FHParser m_parser;
+  uint64_t m_ack_ts;
+  metric_e m_ack_metric;
   uint32_t dwMaxPacketSize;
   int hLog;
   char *program_pkt;
+  char *m_patch_pkt;
+  uint32_t m_patch_len;
+  uint32_t m_patch_count;
+  uint32_t m_patch_batch;
+  uint32_t m_patch_off[FH_PATCH_BATCH + 1];
 };
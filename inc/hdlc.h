@@ -0,0 +1,47 @@
+/*****************************************************************************
+ * hdlc.h
+ *
+ * Async HDLC framing used by the DLOAD protocols
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HDLC_FLAG       0x7e
+#define HDLC_ESC        0x7d
+#define HDLC_ESC_MASK   0x20
+
+// Receive buffer, large enough for a response and whatever follows it in the same read
+#define HDLC_RX_SIZE    (64*1024)
+
+// Offset of the first flag or escape byte in buf, len if there is none
+size_t HdlcSpan(const unsigned char *buf, size_t len);
+
+// Frames in_buf with the CRC16 appended. *out_length is the room in out_buf on
+// entry, 2*(in_length+2)+2 covers any packet, and the frame length on return.
+int HdlcEncode(const unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length);
+
+// Unescapes a frame with or without its flags and checks the CRC16. The two CRC
+// bytes are left at the end of out_buf like the target sent them.
+int HdlcDecode(const unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length);
+
+// Splits the byte stream from the target into frames. Reads go straight into
+// the free space at the end of the buffer and frames are handed out in place.
+class HdlcFramer {
+public:
+  HdlcFramer();
+  ~HdlcFramer();
+
+  void Reset(void);
+  bool NextFrame(unsigned char **frame, uint32_t *len);
+  unsigned char *FreeSpace(uint32_t *len);
+  void Fill(uint32_t bytes);
+
+private:
+  unsigned char *buf;
+  uint32_t start;     // First byte not yet handed out
+  uint32_t scan;      // Bytes from start already known to hold no flag
+  uint32_t end;
+};
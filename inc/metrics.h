@@ -0,0 +1,69 @@
+/*****************************************************************************
+ * metrics.h
+ *
+ * Latency and throughput counters for download transfers
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+#include "sysdeps.h"
+
+// Histogram bucket i holds samples below 2^i microseconds, the last one is open ended
+#define METRIC_BUCKETS  32
+
+typedef enum {
+  METRIC_CMD_LATENCY,   // XML command written until the target ACK/NAK
+  METRIC_DATA_ACK,      // last raw byte written until the target ACK/NAK
+  METRIC_USB_WRITE,     // one raw data chunk sent to the target
+  METRIC_USB_READ,      // one raw data chunk received from the target
+  METRIC_FILE_READ,     // one chunk read from a host image file
+  METRIC_FILE_WRITE,    // one chunk written to a host dump file
+  METRIC_STALL_USB,     // USB side waiting on the host file side
+  METRIC_STALL_FILE,    // host file side waiting on the USB side
+  METRIC_COUNT
+} metric_e;
+
+typedef struct {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> totalNs;
+  std::atomic<uint64_t> minNs;
+  std::atomic<uint64_t> maxNs;
+  std::atomic<uint64_t> buckets[METRIC_BUCKETS];
+} metric_t;
+
+// Process wide counters. Each metric is normally fed by a single thread, the
+// atomics only make it safe for the summary and emitter to read concurrently.
+class Metrics {
+public:
+  Metrics();
+  ~Metrics();
+
+  static uint64_t Now(void);
+
+  void Reset(void);
+  void Record(metric_e id, uint64_t startNs, uint64_t bytes = 0);
+  void PrintSummary(void);
+  int WriteJSON(const char *szFileName);
+  int StartEmitter(uint32_t seconds);
+  void StopEmitter(void);
+
+private:
+  static void *EmitterThread(void *arg);
+  uint64_t Percentile(metric_e id, uint32_t pct);
+  const char *Bottleneck(void);
+  void Emit(uint64_t *lastBytes, uint64_t *lastNs);
+
+  metric_t metrics[METRIC_COUNT];
+  uint64_t startNs;
+  uint32_t emitSeconds;
+  std::atomic<int> emitStop;
+  pthread_t emitTid;
+  bool bEmitter;
+};
+
+extern Metrics g_metrics;
@@ -27,12 +27,37 @@ when       who     what, where, why
 
 #include "xmlparser.h"
 #include <stdio.h>
+#include <pthread.h>
+#include <atomic>
 
 #define MAX_PATH 512
 #define MAX_LIST_SIZE   100
 #define MAX_PATH_LEN    256
 #define SECTOR_SIZE	    512
 
+// Zero run detection for raw images. Blocks are tested ZERO_SCAN_BLOCK at a time and
+// runs of at least ZERO_RUN_MIN are erased on the target instead of being sent.
+#define ZERO_SCAN_BLOCK     4096
+#define ZERO_RUN_MIN        (1024*1024)
+#define ZERO_SCAN_BUFFER    (1024*1024)
+#define ZERO_SCAN_WINDOW    (64*1024*1024)
+
+// Host side patching holds the images DISK patches land in, in practice the GPTs
+#define HOST_PATCH_IMAGES   8
+#define HOST_PATCH_MAX_SIZE (1024*1024)
+
+// Delta flashing compares the image with the target DELTA_BLOCK at a time and only
+// programs the blocks that differ. Host digests are kept for DELTA_CACHE_FILES images.
+#define DELTA_BLOCK         (4*1024*1024)
+#define DELTA_CACHE_FILES   16
+
+// Compiled plans grow PLAN_GROW entries at a time
+#define PLAN_GROW           64
+
+// Images of the entries after the one being sent are hinted to the page cache,
+// at most READAHEAD_DEFAULT bytes ahead unless set otherwise
+#define READAHEAD_DEFAULT   (256*1024*1024)
+
 class Protocol;
 
 enum cmdEnum {
@@ -91,6 +116,50 @@ typedef struct {
   char  label[MAX_PATH];
 } PartitionEntry;
 
+typedef struct {
+  __uint64_t start_sector;
+  __uint64_t patch_value;
+  __uint64_t patch_offset;
+  __uint64_t patch_size;
+  __uint64_t crc_start;
+  __uint64_t crc_size;
+  char key[MAX_STRING_LEN];
+} host_patch_t;
+
+typedef struct {
+  __uint64_t start_sector;
+  __uint64_t num_sectors;
+  unsigned char *data;
+} host_image_t;
+
+typedef struct {
+  char filename[MAX_PATH];
+  __uint64_t offset;
+  __uint64_t num_sectors;
+  uint32_t num_blocks;
+  unsigned char *digests;   // One SHA-256 per block followed by one for the whole range
+} delta_digest_t;
+
+// One element of a rawprogram or patch file, parsed and resolved before any transfer
+typedef struct {
+  PartitionEntry pe;
+  int status;               // ParseEntryKey result, elements it doesn't know are sent raw
+  char *key;                // Element text inside the loaded XML
+  char path[MAX_PATH];      // Resolved image of program and simlock entries
+  __uint64_t file_size;
+  bool bSparse;
+  __uint64_t readahead_off;
+  __uint64_t readahead;     // Bytes hinted ahead of this entry being sent
+} plan_entry_t;
+
+// Hints are issued off the main thread, a slow share can block in posix_fadvise
+typedef struct {
+  plan_entry_t *plan;
+  uint32_t first;
+  uint32_t last;
+  std::atomic<bool> busy;
+} readahead_batch_t;
+
 //char *StringReplace(char *inp, const char *find, const char *rep);
 //char *StringSetValue(char *key, char *keyName, char *value);
 
@@ -102,9 +171,14 @@ public:
   Partition(__uint64_t ds=0)
   {
 	  num_entries = 0; cur_action = 0; d_sectors = ds;
-          bVerbose = false;
+          bVerbose = false; bZeroScan = false; bDelta = false;
+          host_patches = NULL; num_host_patches = 0; num_host_images = 0; host_lun = -1;
+          num_delta_cache = 0;
+          plan = NULL; num_plan = 0; bPlanned = false;
+          readahead_budget = READAHEAD_DEFAULT; readahead_bytes = 0; readahead_next = 0;
+          readahead_batch.busy = false; bReadAheadThread = false;
   };
-  ~Partition() {};
+  ~Partition() { FreeHostPatches(); FreeDeltaCache(); FreePlan(); };
   int PreLoadImage(char * fname, const char * imgdir = NULL);
   int ProgramImage(Protocol *proto);
   int ProgramPartitionEntry(Protocol *proto, PartitionEntry pe, char *key);
@@ -115,12 +189,18 @@ public:
   unsigned int CalcCRC32(unsigned char *buffer, int len);
   int ParseXMLKey(char *key, PartitionEntry *pe);
   void EnableVerbose(void);
+  void EnableZeroScan(void);
+  void EnableDelta(void);
+  void SetReadAhead(__uint64_t bytes);
+  int LoadHostPatches(Protocol *proto, char *szPatchFile);
+  int CompilePlan(void);
+  int WritePlanJSON(FILE *fp);
+  __uint64_t GetPartitionSize(void);
 
 private:
   int cur_action;
   __uint64_t d_sectors;
 
-  int Reflect(int data, int len);
   int ParseXMLOptions();
   int ParsePathList();
   //int ParseXMLString(char *line, const char *key, char *value);
@@ -128,5 +208,40 @@ private:
   int ParseXMLEvaluate(char *expr, __uint64_t &value, PartitionEntry *pe) const;
   bool CheckEmptyLine(char *str) const;
   int Log(const char *str,...);
+  int ProgramExtent(Protocol *proto, int hRead, PartitionEntry *pe, __uint64_t start, __uint64_t end, bool bZero);
+  int ProgramZeroScan(Protocol *proto, int hRead, PartitionEntry *pe);
+  int ProgramRange(Protocol *proto, int hRead, PartitionEntry *pe);
+  delta_digest_t *GetDeltaDigests(int hRead, PartitionEntry *pe, const char *szImage, int iSectorSize);
+  int ProgramDelta(Protocol *proto, int hRead, PartitionEntry *pe, const char *szImage);
+  void FreeDeltaCache(void);
+  int ResolvePlanEntry(plan_entry_t *entry);
+  void ReadAhead(uint32_t cur, int iSectorSize);
+  void ReadAheadJoin(void);
+  void FreePlan(void);
+  void GetImagePath(const char *filename, char *imgfname);
+  int ParseEntryKey(char *key, PartitionEntry *pe);
+  bool HostPatchTouches(PartitionEntry *pe, int iSectorSize);
+  int LoadHostImage(Protocol *proto, PartitionEntry *pe);
+  host_image_t *FindHostImage(__uint64_t offset, __uint64_t len, int iSectorSize);
+  int ApplyHostPatches(Protocol *proto);
+  void FreeHostPatches(void);
   bool bVerbose;
+  bool bZeroScan;
+  bool bDelta;
+  host_patch_t *host_patches;
+  uint32_t num_host_patches;
+  host_image_t host_images[HOST_PATCH_IMAGES];
+  uint32_t num_host_images;
+  int host_lun;
+  delta_digest_t delta_cache[DELTA_CACHE_FILES];
+  uint32_t num_delta_cache;
+  plan_entry_t *plan;
+  uint32_t num_plan;
+  bool bPlanned;
+  __uint64_t readahead_budget;
+  __uint64_t readahead_bytes;
+  uint32_t readahead_next;
+  readahead_batch_t readahead_batch;
+  pthread_t readahead_tid;
+  bool bReadAheadThread;
 };
@@ -0,0 +1,49 @@
+/*****************************************************************************
+ * progcache.h
+ *
+ * Process wide cache of flash programmer images served over Sahara
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include "sysdeps.h"
+
+#define PROG_CACHE_FILES  8
+#define PROG_CACHE_PATH   512
+
+typedef struct {
+  char path[PROG_CACHE_PATH];
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtimeNs;
+  uint64_t size;
+  unsigned char *data;      // Whole image, read once
+  bool bStale;              // Replaced on disk, unloaded once the last user is done
+  uint32_t refs;
+  uint64_t lastUse;
+} prog_image_t;
+
+// An image stays loaded after its session so the next device that asks for the
+// same programmer is served from memory. A programmer rebuilt or rewritten is
+// seen by its inode, size and mtime and loaded again, sessions still sending
+// the old one keep their copy.
+class ProgCache {
+public:
+  ProgCache();
+  ~ProgCache();
+
+  int Acquire(const char *szFile, prog_image_t **image);
+  void Release(prog_image_t *image);
+
+private:
+  int Load(prog_image_t *image, int fd, const char *szFile);
+  void Unload(prog_image_t *image);
+
+  prog_image_t images[PROG_CACHE_FILES];
+  uint64_t useCount;
+  pthread_mutex_t lock;
+};
+
+extern ProgCache g_progcache;
@@ -47,7 +47,13 @@ public:
   void SetDiskSectorSize(int size);
   __uint64_t GetNumDiskSectors(void);
   int GetDiskHandle(void);
+  virtual uint32_t GetMaxPayloadSize(void);
   virtual int WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset, uint32_t writeBytes, uint32_t *bytesWritten, uint8_t partNum);
+  virtual int FillSectors(uint32_t pattern, int64_t start_sector, __uint64_t num_sectors, uint8_t partNum);
+  virtual int EraseSectors(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum);
+  virtual int FlushPatches(void);
+  virtual int GetStorageSectors(uint8_t partNum, __uint64_t *sectors);
+  virtual int GetDigest(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum, unsigned char *digest);
 
   virtual int DeviceReset(void) = 0;
   virtual int WriteData(unsigned char *writeBuffer, int64_t writeOffset, uint32_t writeBytes, uint32_t *bytesWritten, uint8_t partNum) = 0;
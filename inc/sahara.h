@@ -22,6 +22,8 @@ when       who     what, where, why
 #pragma once
 
 #include "serialport.h"
+#include "progcache.h"
+#include "bufring.h"
 #include "sysdeps.h"
 
 #define SAHARA_VERSION 2
@@ -53,6 +55,16 @@ when       who     what, where, why
 #define SAHARA_MODE_MEMORY_DEBUG      0x2
 #define SAHARA_MODE_COMMAND           0x3
 
+// Largest command packet PBL sends, READ_DATA and friends are far smaller
+#define SAHARA_MAX_PACKET             0x400
+
+// Memory debug collection. Sahara is request/response and a PBL busy sending one
+// read may not take the next request, so only one is outstanding unless asked for.
+#define SAHARA_DUMP_READ_SIZE   (1024*1024)
+#define SAHARA_DUMP_DEPTH       1
+#define SAHARA_DUMP_SLOTS       8
+#define SAHARA_MAX_REGIONS      256
+
 /* Status codes for Sahara */
 enum boot_sahara_status
 {
@@ -246,6 +258,63 @@ typedef struct {
   uint32_t status;
 } done_t;
 
+// Where the region table is, follows cmd_hdr_t in MEMORY_DEBUG/64BIT_MEMORY_DEBUG
+typedef struct {
+  uint32_t table_addr;
+  uint32_t table_len;
+} memory_debug_t;
+
+typedef struct {
+  uint64_t table_addr;
+  uint64_t table_len;
+} memory_debug_64_t;
+
+typedef struct {
+  uint32_t cmd;
+  uint32_t len;
+  uint32_t addr;
+  uint32_t read_len;
+} memory_read_t;
+
+typedef struct {
+  uint32_t cmd;
+  uint32_t len;
+  uint64_t addr;
+  uint64_t read_len;
+} memory_read_64_t;
+
+// Region table entries as the target lays them out
+typedef struct {
+  uint32_t save_pref;
+  uint32_t mem_base;
+  uint32_t length;
+  char desc[20];
+  char filename[20];
+} dload_debug_t;
+
+typedef struct {
+  uint64_t save_pref;
+  uint64_t mem_base;
+  uint64_t length;
+  char desc[20];
+  char filename[20];
+} dload_debug_64_t;
+
+typedef struct {
+  uint64_t base;
+  uint64_t length;
+  char desc[21];
+  char filename[21];
+  bool bSelected;
+} sahara_region_t;
+
+typedef struct {
+  const char *szDir;        // Each region is written to its own file in here
+  const char *szRegions;    // Comma separated filenames or descriptions to keep, NULL for all
+  uint32_t readSize;        // Bytes asked for by each MEMORY_READ
+  uint32_t depth;           // MEMORY_READ requests outstanding at once
+} sahara_dump_t;
+
 typedef struct {
   uint32_t serial;
   uint32_t msm_id;
@@ -253,6 +322,20 @@ typedef struct {
   uint32_t pbl_sw;
 } pbl_info_t;
 
+// What the host is waiting for next. Each packet from PBL moves the handshake
+// on as soon as it arrives, the per state timeout only bounds a silent target.
+typedef enum {
+  SAHARA_STATE_WAIT_HELLO = 0,  // HELLO_REQ, sent by PBL on enumeration and after SWITCH_MODE
+  SAHARA_STATE_WAIT_CMD_READY,  // HELLO_RSP for command mode sent
+  SAHARA_STATE_COMMAND,         // EXECUTE_REQ/EXECUTE_DATA exchanges
+  SAHARA_STATE_IMAGE_TX,        // READ_DATA requests until END_TRANSFER
+  SAHARA_STATE_WAIT_DONE,       // DONE_REQ sent
+  SAHARA_STATE_WAIT_MEM_DEBUG,  // HELLO_RSP for memory debug mode sent
+  SAHARA_STATE_MEM_READ,        // MEMORY_READ requests for the region table and regions
+  SAHARA_STATE_DONE,            // Image is running
+  SAHARA_STATE_COUNT
+} sahara_state_e;
+
 class Sahara {
 public:
   Sahara(SerialPort *port,int hLogFile = 0);
@@ -261,9 +344,12 @@ public:
   int ConnectToDevice(bool bReadHello, int mode);
   int DumpDeviceInfo(pbl_info_t *pbl_info);
   int CheckDevice(void);
+  int MemoryDump(sahara_dump_t *opt);
+  uint64_t StateTime(sahara_state_e s);
+  void LogStateTimes(void);
 
 private:
-  int ModeSwitch(int mode, bool rsp = true);
+  int ModeSwitch(int mode);
   void HexToByte(const char *hex, unsigned char *bin, int len);
   void Log(const char *str,...);
 
@@ -272,6 +358,32 @@ private:
   int ReadData(int cmd, unsigned char *buf, int len);
   int PblHack(void);
 
+  void SetState(sahara_state_e next);
+  int SendHello(int mode);
+  int ReadPacket(unsigned char **pkt);
+  int ReadRaw(unsigned char *buf, uint32_t len);
+  int HandlePacket(unsigned char *pkt);
+  int SendImageData(unsigned char *pkt);
+  int RunUntil(sahara_state_e target);
+  int SendMemoryRead(uint64_t addr, uint64_t len);
+  int ReadMemory(unsigned char *buf, uint32_t len);
+  int ReadRegionTable(sahara_region_t **regions, uint32_t *count);
+  int DumpRegion(sahara_region_t *region, sahara_dump_t *opt, BufRing *ring);
+
   SerialPort *sport;
   int hLog;
+
+  sahara_state_e state;
+  uint64_t stateStart;
+  uint64_t stateNs[SAHARA_STATE_COUNT];
+  int hostMode;                 // Mode the next HELLO_REQ is answered with
+  prog_image_t *prog;           // Image served while in SAHARA_STATE_IMAGE_TX
+  uint64_t memTableAddr;        // From MEMORY_DEBUG
+  uint64_t memTableLen;
+  bool bMem64;
+
+  // Ports that don't deliver one packet per read leave the rest here
+  uint32_t rxBuf[SAHARA_MAX_PACKET / 4];
+  uint32_t rxLen;
+  uint32_t rxUsed;
 };
@@ -25,10 +25,8 @@ when       who     what, where, why
 #include "sysdeps.h"
 #include "crc.h"
 #include "usb.h"
+#include "hdlc.h"
 
-#define  ASYNC_HDLC_FLAG      0x7e
-#define  ASYNC_HDLC_ESC       0x7d
-#define  ASYNC_HDLC_ESC_MASK  0x20
 #define  MAX_PACKET_SIZE      0x20000
 
 class SerialPort {
@@ -42,15 +40,17 @@ public:
   int Read(unsigned char *data, uint32_t *length);
   int Flush();
   int SendSync(unsigned char *out_buf, int out_length, unsigned char *in_buf, int *in_length);
+  int SendPacket(unsigned char *out_buf, int out_length);
+  int ReadPacket(unsigned char *in_buf, int *in_length);
   int SetTimeout(int ms);
+  int SetQueueDepth(int depth);
   int64_t OutputBufferCount();
   int64_t InputBufferCount();
 private:
-  int HDLCEncodePacket(unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length);
-  int HDLCDecodePacket(unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length);
-  
   usb_handle* hPort;
   unsigned char *HDLCBuf;
+  HdlcFramer hdlcRx;
   int to_ms;
+  int queueDepth;
 
 };
@@ -0,0 +1,23 @@
+/*****************************************************************************
+ * sha256.h
+ *
+ * SHA-256 used to check programmed data against the target's digest
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN   32
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t bytes;
+  uint32_t used;
+  unsigned char block[64];
+} sha256_ctx;
+
+void SHA256Init(sha256_ctx *ctx);
+void SHA256Update(sha256_ctx *ctx, const unsigned char *buf, size_t len);
+void SHA256Final(sha256_ctx *ctx, unsigned char *digest);
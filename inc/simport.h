@@ -0,0 +1,46 @@
+/*****************************************************************************
+ * simport.h
+ *
+ * Simulated Firehose target linked in place of the USB SerialPort
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+#include "sysdeps.h"
+
+// Knobs for the simulated target, set before SerialPort::Open
+typedef struct {
+  bool sahara;             // Start out as PBL in Sahara image transfer mode instead of Firehose
+  uint32_t ackLatencyUs;   // Delay before every ACK/NAK becomes readable
+  uint32_t linkMBps;       // Bulk link bandwidth in both directions, 0 = unlimited
+  uint32_t maxPayload;     // Largest MaxPayloadSizeToTargetInBytes accepted by configure
+  bool rawmode;            // Report rawmode on program/read ACKs like current programmers
+  bool erase;              // Accept <erase>, older programmers NAK it
+  bool batch;              // Answer every element of a <data> document, not just the first
+  bool digest;             // Accept <getsha256digest>, older programmers NAK it
+  uint32_t diskMB;         // Size of the simulated storage
+  uint32_t sectorSize;
+  uint32_t saharaImageSize;  // Programmer bytes PBL asks for, they land at the start of the disk
+  uint32_t saharaReadSize;   // Largest READ_DATA request PBL sends
+  bool saharaMemDebug;       // PBL has crashed and offers its memory instead of asking for a programmer
+  uint32_t saharaRegions;    // Memory regions it offers, laid out after the table at the start of the disk
+  bool dload;                // A streaming download programmer answers SendPacket instead of Firehose
+  uint32_t dloadBlock;       // Block size it reports in the hello response
+  uint32_t dloadWindow;      // Stream writes it takes before the host must wait for a response
+  uint32_t dloadDropEvery;   // Lose one stream write in N, 0 = none
+} simport_config_t;
+
+typedef struct {
+  uint64_t commands;
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+} simport_stats_t;
+
+extern simport_config_t g_simport;
+extern simport_stats_t g_simstats;
+
+unsigned char *SimPortDisk(void);
+
+// Offset of the first memory debug region on the disk, the region table sits before it
+#define SIM_MEM_TABLE_SIZE  (64*1024)
@@ -27,6 +27,12 @@ when       who     what, where, why
 #define SPARSE_RAW_CHUNK  0xCAC1
 #define SPARSE_FILL_CHUNK 0xCAC2
 #define SPARSE_DONT_CARE  0xCAC3
+#define SPARSE_CRC32_CHUNK 0xCAC4
+
+// Staging buffer for RAW chunk data, rounded up to a multiple of the target payload
+#define SPARSE_BUFFER_SIZE  (8*1024*1024)
+#define SPARSE_BUFFER_ALIGN 4096
+#define SPARSE_PATH_LEN     512
 
 // Security Header struct. The first data read in from the FFU.
 typedef struct _SPARSE_HEADER
@@ -44,23 +50,47 @@ typedef struct _SPARSE_HEADER
 
 typedef struct _CHUNK_HEADER
 {
-  uint16_t wChunkType;        // 0xCAC1 -> raw; 0xCAC2 -> fill; 0xCAC3 -> don't care
+  uint16_t wChunkType;        // 0xCAC1 -> raw; 0xCAC2 -> fill; 0xCAC3 -> don't care; 0xCAC4 -> crc32
   uint16_t wReserved;         // Reserved should be all 0
   uint32_t dwChunkSize;       // Number of blocks this chunk takes in output image
   uint32_t dwTotalSize;       // Number of bytes in input file including chunk header round up to next block size
 } CHUNK_HEADER;
 
+// One chunk of the image as found by walking the headers, kept in the digest cache
+typedef struct _SPARSE_CHUNK
+{
+  uint16_t wChunkType;
+  uint16_t wReserved;
+  uint32_t dwChunkSize;       // Blocks in the output image
+  uint64_t qwDataOffset;      // Where RAW data starts in the sparse file
+  uint32_t dwFillValue;
+  uint32_t dwReserved;
+} SPARSE_CHUNK;
+
 class SparseImage {
 public:
   int PreLoadImage(char *szSparseFile);
-  int ProgramImage(Protocol *pProtocol, int64_t dwOffset);
+  int ProgramImage(Protocol *pProtocol, int64_t dwOffset, uint8_t partNum);
 
   SparseImage();
   ~SparseImage();
 
 private:
+  int ReadAt(unsigned char *pBuf, uint32_t dwBytes, uint64_t qwOffset);
+  int LoadChunkMap(void);
+  int FlushBuffer(Protocol *pProtocol, uint8_t partNum);
+
   SPARSE_HEADER SparseHeader;
   int hSparseImage;
   bool bSparseImage;
+  unsigned char *bpBufAlloc;
+  unsigned char *bpBuffer;
+  uint32_t dwBufferSize;
+  uint32_t dwBufferLen;
+  int64_t dwBufferOffset;
+  uint32_t dwBytesOut;
+  char szImageFile[SPARSE_PATH_LEN];
+  SPARSE_CHUNK *pChunkMap;
+  uint32_t dwChunkMapLen;
 
 };
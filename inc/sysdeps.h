@@ -383,7 +383,7 @@ static __inline__  int  emmcdl_write(int  fd, const void*  buf, size_t  len)
 #undef   write
 #define  write  ___xxx_write
 
-static __inline__ int   emmcdl_lseek(int  fd, int  pos, int  where)
+static __inline__ off_t  emmcdl_lseek(int  fd, off_t  pos, int  where)
 {
     return lseek(fd, pos, where);
 }
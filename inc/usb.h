@@ -62,11 +62,28 @@ struct usb_ifc_info
 
 typedef int (*ifc_match_func)(usb_ifc_info *ifc);
 
+/* Number of bulk URBs kept in flight per direction by default */
+#define USB_DEFAULT_QUEUE_DEPTH 8
+
+/* usbfs entry points, replaceable so transfers can be driven by a fake backend */
+struct usbfs_ops
+{
+    int (*ioctl)(int fd, unsigned long request, void *arg);
+        /* wait for a reapable URB, returns >0 ready, 0 on timeout */
+    int (*wait)(int fd, int timeout_ms);
+};
+
 usb_handle *usb_open(ifc_match_func callback);
 int usb_close(usb_handle *h);
 int usb_read(usb_handle *h, void *_data, int len);
 int usb_write(usb_handle *h, const void *_data, int len);
 int usb_wait_for_disconnect(usb_handle *h);
+int usb_set_queue_depth(usb_handle *h, int depth);
+    /* longest a read waits for data, it then returns what arrived so far
+     * instead of failing. 0 keeps the long default with retries.
+     */
+int usb_set_timeout(usb_handle *h, int timeout_ms);
+void usb_set_ops(struct usbfs_ops *ops);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,37 @@
+/*****************************************************************************
+ * usbreplay.h
+ *
+ * Fake usbfs backend that replays captured bulk IN transfers
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stdint.h>
+
+// One transfer the device sent, ending in a short or zero length packet.
+// A NULL data pointer marks where the device went quiet, the next wait for
+// an IN URB times out instead.
+typedef struct {
+  const unsigned char *data;
+  int len;
+  bool ready;   // Already waiting when the URBs are submitted, else it arrives as they are reaped
+} usb_replay_xfer_t;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t reaped;
+  uint64_t discarded;
+  uint64_t cancelled;   // Continuation URBs the short packet cut off
+  uint64_t refused;     // Continuations submitted after it
+  uint64_t timeouts;
+  uint64_t bulk;        // Synchronous USBDEVFS_BULK calls
+  uint32_t pending;     // URBs submitted and not yet reaped
+  uint64_t bytesOut;
+} usb_replay_stats_t;
+
+extern usb_replay_stats_t g_usbreplay;
+
+// Installs the backend with usb_set_ops. OUT data lands in outBuf, an OUT
+// transfer reaching byte outFailAt stalls with EPIPE, 0 never stalls.
+void UsbReplayStart(const usb_replay_xfer_t *in, int count, unsigned char *outBuf, uint64_t outSize, uint64_t outFailAt);
+void UsbReplayStop(void);
@@ -24,6 +24,7 @@ when       who     what, where, why
 
 
 #include "sysdeps.h"
+#include "expr.h"
 #include <stdio.h>
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
@@ -47,7 +48,7 @@ protected:
   char *keyEnd;
   const char *xmlFilename;
   const char *imgDir;
-
+  mutable ExprCache exprCache;
 
   int ParseXMLEvaluate(char *expr, __uint64_t &value) const;
 
@@ -0,0 +1,13 @@
+/*****************************************************************************
+ * zeroscan.h
+ *
+ * Fast test for all-zero blocks in image data
+ *
+ *****************************************************************************/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// True if every byte of buf is zero, returns at the first non-zero 64 bytes
+bool IsZeroBlock(const unsigned char *buf, size_t len);
@@ -0,0 +1,1760 @@
+/*****************************************************************************
+ * bench.cpp
+ *
+ * This file implements host side micro-benchmarks for emmcdl hot paths
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc.h"
+#include "digestcache.h"
+#include "dload.h"
+#include "expr.h"
+#include "firehose.h"
+#include "hdlc.h"
+#include "partition.h"
+#include "sahara.h"
+#include "sparse.h"
+#include "simport.h"
+#include "sysdeps.h"
+#include "usbfs.h"
+#include "usbreplay.h"
+
+#define NANO  1000000000ULL
+
+static uint64_t NowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANO + ts.tv_nsec;
+}
+
+// Original bit at a time implementation from Partition::CalcCRC32 kept as the baseline
+static int Reflect(int data, int len)
+{
+  int ref = 0;
+
+  for (int i=0; i < len; i++) {
+    if (data & 0x1) {
+      ref |= (1 << ((len - 1) - i));
+    }
+    data = (data >> 1);
+  }
+
+  return ref;
+}
+
+static uint32_t CRC32Bitwise(const unsigned char *buffer, size_t len)
+{
+  int gx = 0x04C11DB7;         // IEEE 32bit polynomial
+  int regs = 0xFFFFFFFF;       // init to all ones
+
+  for (size_t i=0; i < len; i++) {
+    unsigned char DataByte = (unsigned char)Reflect(buffer[i], 8);
+    for (int j=0; j < 8; j++) {
+      int MSB = (DataByte >> 7) & 1;
+      int regsMSB = (regs >> 31) & 1;
+      regs = regs << 1;
+      if (regsMSB ^ MSB) {
+        regs = regs ^ gx;
+      }
+      DataByte <<= 1;
+    }
+  }
+
+  return Reflect(regs, 32) ^ 0xFFFFFFFF;
+}
+
+static uint32_t CRC32Table(const unsigned char *buffer, size_t len)
+{
+  return CRC32UpdateTable(0, buffer, len);
+}
+
+static double TimeCRC(uint32_t (*fn)(const unsigned char *, size_t), const unsigned char *buf, size_t len, int loops, uint32_t *crc)
+{
+  uint64_t start = NowNs();
+  for (int i=0; i < loops; i++) {
+    *crc = fn(buf, len);
+  }
+  uint64_t elapsed = NowNs() - start + 1;
+  return ((double)len * loops * NANO / 1024 / 1024) / elapsed;
+}
+
+static int BenchCRC(int argc, char **argv)
+{
+  size_t len = 16*1024*1024;
+  uint32_t crcBit, crcTable, crcFast;
+  double mbBit, mbTable, mbFast;
+
+  if (argc > 0) {
+    len = (size_t)atoi(argv[0]) * 1024;
+  }
+  if (len == 0) {
+    return EINVAL;
+  }
+
+  unsigned char *buf = (unsigned char *)malloc(len);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+  for (size_t i=0; i < len; i++) {
+    buf[i] = (unsigned char)(i * 7 + i / 251);
+  }
+
+  // The bitwise version is slow enough that one pass over a smaller slice is plenty
+  size_t bitLen = len < 1024*1024 ? len : 1024*1024;
+  mbBit = TimeCRC(CRC32Bitwise, buf, bitLen, 1, &crcBit);
+  mbTable = TimeCRC(CRC32Table, buf, len, 4, &crcTable);
+  mbFast = TimeCRC(CalcCRC32, buf, len, 4, &crcFast);
+
+  printf("crc32 buffer %zu KB\n", len / 1024);
+  printf("  bitwise      %10.1f MB/s\n", mbBit);
+  printf("  slice-by-8   %10.1f MB/s  (%.0fx)\n", mbTable, mbTable / mbBit);
+  printf("  %-12s %10.1f MB/s  (%.0fx)\n", CRC32Engine(), mbFast, mbFast / mbBit);
+
+  // All implementations must agree or the numbers above mean nothing
+  int status = 0;
+  if (crcTable != crcFast || crcBit != CRC32Table(buf, bitLen)) {
+    printf("crc32 mismatch bitwise %08x table %08x fast %08x\n", crcBit, crcTable, crcFast);
+    status = EIO;
+  }
+
+  free(buf);
+  return status;
+}
+
+// Original byte at a time framing from SerialPort kept as the baseline
+static int HdlcEncodeBytewise(const unsigned char *in_buf, int in_length, unsigned char *out_buf)
+{
+  unsigned char *outPtr = out_buf;
+  unsigned short crc = CalcCRC16((unsigned char *)in_buf, in_length);
+
+  *outPtr++ = HDLC_FLAG;
+  for (int i = 0; i < in_length + 2; i++) {
+    if (i == in_length) {
+      in_buf = (const unsigned char *)&crc;
+    }
+    if (*in_buf == HDLC_FLAG || *in_buf == HDLC_ESC) {
+      *outPtr++ = HDLC_ESC;
+      *outPtr++ = *in_buf++ ^ HDLC_ESC_MASK;
+    } else {
+      *outPtr++ = *in_buf++;
+    }
+  }
+  *outPtr++ = HDLC_FLAG;
+  return (int)(outPtr - out_buf);
+}
+
+static int HdlcDecodeBytewise(const unsigned char *in_buf, int in_length, unsigned char *out_buf)
+{
+  unsigned char *outPtr = out_buf;
+
+  for (int i = 0; i < in_length; i++) {
+    if (in_buf[i] == HDLC_ESC) {
+      *outPtr++ = in_buf[++i] ^ HDLC_ESC_MASK;
+    } else if (in_buf[i] != HDLC_FLAG) {
+      *outPtr++ = in_buf[i];
+    }
+  }
+  return (int)(outPtr - out_buf);
+}
+
+// Stream write sized packets framed into one stream and split back out again,
+// the receive side takes the stream in 64KB reads like a USB bulk transfer
+static int BenchHdlc(int argc, char **argv)
+{
+  size_t len = 16*1024*1024;
+  const int pktSize = 4096 + 5;
+  int status = 0;
+
+  if (argc > 0) {
+    len = (size_t)atoi(argv[0]) * 1024;
+  }
+  int num = (int)(len / pktSize);
+  if (num == 0) {
+    return EINVAL;
+  }
+
+  unsigned char *data = (unsigned char *)malloc((size_t)num * pktSize);
+  unsigned char *stream = (unsigned char *)malloc((size_t)num * (2 * (pktSize + 2) + 2));
+  unsigned char *out = (unsigned char *)malloc((size_t)num * (2 * (pktSize + 2) + 2));
+  if (data == NULL || stream == NULL || out == NULL) {
+    free(data);
+    free(stream);
+    free(out);
+    return ENOMEM;
+  }
+  srand(1);
+  for (size_t i=0; i < (size_t)num * pktSize; i++) {
+    data[i] = (unsigned char)rand();
+  }
+
+  uint64_t start = NowNs();
+  size_t streamLen = 0;
+  for (int i=0; i < num; i++) {
+    streamLen += HdlcEncodeBytewise(data + (size_t)i * pktSize, pktSize, stream + streamLen);
+  }
+  uint64_t encBytewise = NowNs() - start + 1;
+
+  // Byte at a time, a frame ends at the first flag after some data
+  start = NowNs();
+  size_t outLen = 0;
+  size_t frameStart = 0;
+  for (size_t i=0; i < streamLen; i++) {
+    if (stream[i] == HDLC_FLAG) {
+      if (i > frameStart + 1) {
+        outLen += HdlcDecodeBytewise(stream + frameStart, (int)(i + 1 - frameStart), out + outLen) - 2;
+      }
+      frameStart = i + 1;
+    }
+  }
+  uint64_t decBytewise = NowNs() - start + 1;
+
+  start = NowNs();
+  size_t streamLenFast = 0;
+  for (int i=0; i < num && status == 0; i++) {
+    int frameLen = 2 * (pktSize + 2) + 2;
+    status = HdlcEncode(data + (size_t)i * pktSize, pktSize, out + streamLenFast, &frameLen);
+    streamLenFast += frameLen;
+  }
+  uint64_t encFast = NowNs() - start + 1;
+  // Both framings must be identical and decode back to the packets
+  if (status == 0 && (streamLenFast != streamLen || memcmp(stream, out, streamLen) != 0)) {
+    printf("hdlc encoders differ\n");
+    status = EIO;
+  }
+
+  HdlcFramer framer;
+  start = NowNs();
+  size_t pos = 0;
+  int frames = 0;
+  outLen = 0;
+  while (status == 0 && frames < num) {
+    unsigned char *frame;
+    uint32_t frameLen;
+    if (framer.NextFrame(&frame, &frameLen)) {
+      int pktLen = pktSize + 2;
+      status = HdlcDecode(frame, frameLen, out + outLen, &pktLen);
+      outLen += pktLen - 2;
+      frames++;
+      continue;
+    }
+    uint32_t room;
+    unsigned char *space = framer.FreeSpace(&room);
+    if (space == NULL || pos == streamLen) {
+      status = EIO;
+      break;
+    }
+    uint32_t bytes = (room < 64*1024) ? room : 64*1024;
+    if (bytes > streamLen - pos) {
+      bytes = (uint32_t)(streamLen - pos);
+    }
+    memcpy(space, stream + pos, bytes);
+    framer.Fill(bytes);
+    pos += bytes;
+  }
+  uint64_t decFast = NowNs() - start + 1;
+
+  double mb = (double)num * pktSize / 1024 / 1024;
+  printf("hdlc %d packets of %d bytes, %zu KB framed\n", num, pktSize, streamLen / 1024);
+  printf("  encode bytewise  %10.1f MB/s\n", mb * NANO / encBytewise);
+  printf("  encode span      %10.1f MB/s  (%.1fx)\n", mb * NANO / encFast, (double)encBytewise / encFast);
+  printf("  decode bytewise  %10.1f MB/s  (no CRC check)\n", mb * NANO / decBytewise);
+  printf("  decode framer    %10.1f MB/s  (%.1fx)\n", mb * NANO / decFast, (double)decBytewise / decFast);
+
+  if (status == 0 && (outLen != (size_t)num * pktSize || memcmp(out, data, outLen) != 0)) {
+    status = EIO;
+  }
+  if (status != 0) {
+    printf("hdlc round trip failed: %d\n", status);
+  }
+  free(data);
+  free(stream);
+  free(out);
+  return status;
+}
+
+// Image contents are a function of the byte offset so any misplaced data shows up
+static unsigned char Pattern(uint64_t off)
+{
+  return (unsigned char)(off * 7 + off / 4093);
+}
+
+// Caller unlinks szName once done with the file
+static int CreateTempFile(char *szName)
+{
+  strcpy(szName, "/tmp/emmcdl_benchXXXXXX");
+  return mkstemp(szName);
+}
+
+static int WriteFull(int fd, const void *buf, size_t len)
+{
+  return (emmcdl_write(fd, buf, len) == (ssize_t)len) ? 0 : EIO;
+}
+
+static void PrintResult(const char *name, uint64_t bytes, uint64_t cmds, uint64_t start)
+{
+  double secs = (double)(Metrics::Now() - start) / NANO;
+  printf("\r%-8s %10.1f MB/s %10.0f cmds/s   %lu MB %lu cmds in %.3f s%-20c\n", name,
+         (double)bytes / 1024 / 1024 / secs, cmds / secs, bytes / 1024 / 1024, cmds, secs, ' ');
+}
+
+// Straight <program> of a file through FastCopy and the reader thread
+static int BenchProgram(Firehose *pfh, uint64_t len)
+{
+  char szName[64];
+  int status = 0;
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+
+  unsigned char *buf = (unsigned char *)malloc(1024*1024);
+  if (buf == NULL) {
+    emmcdl_close(fd);
+    emmcdl_unlink(szName);
+    return ENOMEM;
+  }
+  for (uint64_t off = 0; off < len && status == 0; off += 1024*1024) {
+    for (int i=0; i < 1024*1024; i++) {
+      buf[i] = Pattern(off + i);
+    }
+    status = WriteFull(fd, buf, 1024*1024);
+  }
+  free(buf);
+  emmcdl_lseek(fd, 0, SEEK_SET);
+
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    status = pfh->FastCopy(fd, 0, pfh->GetDiskHandle(), 0, len / g_simport.sectorSize, 0);
+  }
+  PrintResult("program", len, g_simstats.commands - cmds, start);
+  emmcdl_close(fd);
+  emmcdl_unlink(szName);
+
+  unsigned char *disk = SimPortDisk();
+  for (uint64_t off = 0; off < len && status == 0; off++) {
+    if (disk[off] != Pattern(off)) {
+      printf("program mismatch at offset %lu\n", off);
+      status = EIO;
+    }
+  }
+  return status;
+}
+
+// <read> of what the program pass left on the disk back into a file
+static int BenchRead(Firehose *pfh, uint64_t len)
+{
+  char szName[64];
+  int status = 0;
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+
+  unsigned char *disk = SimPortDisk();
+  for (uint64_t off = 0; off < len; off++) {
+    disk[off] = Pattern(off);
+  }
+
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  status = pfh->FastCopy(pfh->GetDiskHandle(), 0, fd, 0, len / g_simport.sectorSize, 0);
+  PrintResult("read", len, g_simstats.commands - cmds, start);
+
+  unsigned char *buf = (unsigned char *)malloc(1024*1024);
+  if (buf == NULL) {
+    status = ENOMEM;
+  }
+  emmcdl_lseek(fd, 0, SEEK_SET);
+  for (uint64_t off = 0; off < len && status == 0; off += 1024*1024) {
+    if (emmcdl_read(fd, buf, 1024*1024) != 1024*1024) {
+      status = EIO;
+      break;
+    }
+    for (int i=0; i < 1024*1024; i++) {
+      if (buf[i] != Pattern(off + i)) {
+        printf("read mismatch at offset %lu\n", off + i);
+        status = EIO;
+        break;
+      }
+    }
+  }
+  free(buf);
+  emmcdl_close(fd);
+  emmcdl_unlink(szName);
+  return status;
+}
+
+// Every other FILL chunk is zero so both the erase and the pattern path are covered
+static uint32_t SparseFill(uint32_t chunk)
+{
+  return (chunk % 8 == 6) ? 0 : 0x5a5a0000 | chunk;
+}
+
+// Android style sparse image, 1MB RAW runs separated by FILL and DONT_CARE chunks
+static int BenchSparse(Firehose *pfh, uint64_t len)
+{
+  char szName[64];
+  int status = 0;
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+
+  // Keep a whole number of 4 chunk groups so every chunk type is covered
+  len -= len % (4*1024*1024);
+  const uint32_t block = 4096;
+  const uint32_t run = 1024*1024;
+  uint32_t chunks = (uint32_t)(len / run);
+  SPARSE_HEADER hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.dwMagic = SPARSE_MAGIC;
+  hdr.wVerMajor = 1;
+  hdr.wSparseHeaderSize = sizeof(SPARSE_HEADER);
+  hdr.wChunkHeaderSize = sizeof(CHUNK_HEADER);
+  hdr.dwBlockSize = block;
+  hdr.dwTotalBlocks = (uint32_t)(len / block);
+  hdr.dwTotalChunks = chunks;
+  status = WriteFull(fd, &hdr, sizeof(hdr));
+
+  unsigned char *buf = (unsigned char *)malloc(run);
+  if (buf == NULL) {
+    emmcdl_close(fd);
+    emmcdl_unlink(szName);
+    return ENOMEM;
+  }
+  uint64_t rawBytes = 0;
+  for (uint32_t i=0; i < chunks && status == 0; i++) {
+    CHUNK_HEADER ch;
+    uint64_t off = (uint64_t)i * run;
+    memset(&ch, 0, sizeof(ch));
+    ch.dwChunkSize = run / block;
+    if (i % 4 == 2) {
+      uint32_t fill = SparseFill(i);
+      ch.wChunkType = SPARSE_FILL_CHUNK;
+      ch.dwTotalSize = sizeof(ch) + sizeof(fill);
+      status = WriteFull(fd, &ch, sizeof(ch));
+      if (status == 0) status = WriteFull(fd, &fill, sizeof(fill));
+    }
+    else if (i % 4 == 3) {
+      ch.wChunkType = SPARSE_DONT_CARE;
+      ch.dwTotalSize = sizeof(ch);
+      status = WriteFull(fd, &ch, sizeof(ch));
+    }
+    else {
+      ch.wChunkType = SPARSE_RAW_CHUNK;
+      ch.dwTotalSize = sizeof(ch) + run;
+      for (uint32_t j=0; j < run; j++) {
+        buf[j] = Pattern(off + j);
+      }
+      status = WriteFull(fd, &ch, sizeof(ch));
+      if (status == 0) status = WriteFull(fd, buf, run);
+      rawBytes += run;
+    }
+  }
+  free(buf);
+  emmcdl_close(fd);
+
+  // Zero fills are erased, start from data that is not zero
+  memset(SimPortDisk(), 0xa5, len);
+
+  SparseImage sparse;
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    status = sparse.PreLoadImage(szName);
+  }
+  if (status == 0) {
+    status = sparse.ProgramImage(pfh, 0, 0);
+  }
+  PrintResult("sparse", rawBytes, g_simstats.commands - cmds, start);
+  emmcdl_unlink(szName);
+
+  unsigned char *disk = SimPortDisk();
+  for (uint64_t off = 0; off < (uint64_t)chunks * run && status == 0; off++) {
+    uint32_t i = (uint32_t)(off / run);
+    uint32_t fill = SparseFill(i);
+    if (i % 4 == 3) {
+      off += run - 1;
+      continue;
+    }
+    unsigned char expect = (i % 4 == 2) ? ((unsigned char *)&fill)[off % 4] : Pattern(off);
+    if (disk[off] != expect) {
+      printf("sparse mismatch at offset %lu\n", off);
+      status = EIO;
+    }
+  }
+  return status;
+}
+
+// Wipe of the whole range, <erase> on the target or zeros if it is refused
+static int BenchErase(Firehose *pfh, uint64_t len)
+{
+  int status = 0;
+  unsigned char *disk = SimPortDisk();
+  memset(disk, 0xa5, len);
+
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  status = pfh->EraseSectors(0, len / g_simport.sectorSize, 0);
+  PrintResult("erase", len, g_simstats.commands - cmds, start);
+
+  for (uint64_t off = 0; off < len && status == 0; off++) {
+    if (disk[off] != 0) {
+      printf("erase left data at offset %lu\n", off);
+      status = EIO;
+    }
+  }
+  return status;
+}
+
+// Raw image that is mostly zeros, 1MB of data every 4MB, programmed through the
+// partition entry path with zero run detection
+static int BenchZeroScan(Firehose *pfh, uint64_t len)
+{
+  char szName[64];
+  int status = 0;
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+
+  unsigned char *buf = (unsigned char *)malloc(1024*1024);
+  if (buf == NULL) {
+    emmcdl_close(fd);
+    emmcdl_unlink(szName);
+    return ENOMEM;
+  }
+  for (uint64_t off = 0; off < len && status == 0; off += 1024*1024) {
+    bool bData = (off / (1024*1024)) % 4 == 0;
+    for (int i=0; i < 1024*1024; i++) {
+      buf[i] = bData ? Pattern(off + i) : 0;
+    }
+    status = WriteFull(fd, buf, 1024*1024);
+  }
+  free(buf);
+  emmcdl_close(fd);
+
+  unsigned char *disk = SimPortDisk();
+  memset(disk, 0xa5, len);
+
+  Partition part;
+  PartitionEntry pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.eCmd = CMD_PROGRAM;
+  pe.num_sectors = len / g_simport.sectorSize;
+  pe.offset = (__uint64_t)-1;   // No file_sector_offset, as the XML parser leaves it
+  strcpy(pe.filename, szName);
+  part.EnableZeroScan();
+
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    status = part.ProgramPartitionEntry(pfh, pe, NULL);
+  }
+  PrintResult("zeroscan", len, g_simstats.commands - cmds, start);
+  emmcdl_unlink(szName);
+
+  for (uint64_t off = 0; off < len && status == 0; off++) {
+    bool bData = (off / (1024*1024)) % 4 == 0;
+    if (disk[off] != (bData ? Pattern(off) : 0)) {
+      printf("zeroscan mismatch at offset %lu\n", off);
+      status = EIO;
+    }
+  }
+  return status;
+}
+
+// Delta reflash of an image after two small edits, then again with nothing changed.
+// Only the blocks holding the edits should cross the link.
+static int BenchDelta(Firehose *pfh, uint64_t len)
+{
+  char szName[64];
+  int status = 0;
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+
+  unsigned char *buf = (unsigned char *)malloc(1024*1024);
+  if (buf == NULL) {
+    emmcdl_close(fd);
+    emmcdl_unlink(szName);
+    return ENOMEM;
+  }
+  for (uint64_t off = 0; off < len && status == 0; off += 1024*1024) {
+    for (int i=0; i < 1024*1024; i++) {
+      buf[i] = Pattern(off + i);
+    }
+    status = WriteFull(fd, buf, 1024*1024);
+  }
+
+  unsigned char *disk = SimPortDisk();
+  memset(disk, 0xa5, len);
+
+  PartitionEntry pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.eCmd = CMD_PROGRAM;
+  pe.num_sectors = len / g_simport.sectorSize;
+  pe.offset = (__uint64_t)-1;   // No file_sector_offset, as the XML parser leaves it
+  strcpy(pe.filename, szName);
+
+  const char *names[3] = { "deltanew", "delta", "deltanop" };
+  for (int pass = 0; pass < 3 && status == 0; pass++) {
+    if (pass == 1) {
+      memset(buf, 0x5a, 4096);
+      if (pwrite(fd, buf, 4096, len / 2) != 4096 || pwrite(fd, buf, 512, len - 512) != 512) {
+        status = errno;
+        break;
+      }
+    }
+    Partition part;
+    part.EnableDelta();
+    uint64_t cmds = g_simstats.commands;
+    uint64_t bytes = g_simstats.bytesIn;
+    uint64_t start = Metrics::Now();
+    status = part.ProgramPartitionEntry(pfh, pe, NULL);
+    PrintResult(names[pass], len, g_simstats.commands - cmds, start);
+    printf("         %lu KB sent\n", (g_simstats.bytesIn - bytes) / 1024);
+  }
+
+  for (uint64_t off = 0; off < len && status == 0; off += 1024*1024) {
+    if (pread(fd, buf, 1024*1024, off) != 1024*1024) {
+      status = EIO;
+    }
+    else if (memcmp(disk + off, buf, 1024*1024) != 0) {
+      printf("delta mismatch in MB %lu\n", off / (1024*1024));
+      status = EIO;
+    }
+  }
+  free(buf);
+  emmcdl_close(fd);
+  emmcdl_unlink(szName);
+  return status;
+}
+
+// Back to back <patch> commands, these are pure round trips to the target unless
+// they get batched. Later patches overwrite earlier ones so order is checked too.
+static int BenchPatch(Firehose *pfh, uint32_t count)
+{
+  PartitionEntry pe;
+  char key[MAX_STRING_LEN];
+  int status = 0;
+
+  uint32_t span = 64 * g_simport.sectorSize;
+  unsigned char *expect = (unsigned char *)malloc(span);
+  if (expect == NULL) {
+    return ENOMEM;
+  }
+  memcpy(expect, SimPortDisk(), span);
+
+  memset(&pe, 0, sizeof(pe));
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  for (uint32_t i=0; i < count && status == 0; i++) {
+    sprintf(key, "<patch SECTOR_SIZE_IN_BYTES=\"%u\" byte_offset=\"%u\" filename=\"DISK\" physical_partition_number=\"0\" "
+            "size_in_bytes=\"4\" start_sector=\"%u\" value=\"%u\" what=\"bench\" /", g_simport.sectorSize, (i * 4) % 512, i % 64, i);
+    status = pfh->ProgramPatchEntry(pe, key);
+    memcpy(expect + (i % 64) * g_simport.sectorSize + (i * 4) % 512, &i, 4);
+  }
+  if (status == 0) {
+    status = pfh->FlushPatches();
+  }
+  PrintResult("patch", 0, g_simstats.commands - cmds, start);
+
+  if (status == 0 && memcmp(expect, SimPortDisk(), span) != 0) {
+    printf("patch results do not match\n");
+    status = EIO;
+  }
+  free(expect);
+  return status;
+}
+
+// Writes gpt_main0.bin, gpt_backup0.bin and the rawprogram0.xml/patch0.xml pair that
+// places and patches them, laid out the way ptool generates them
+static int CreateGPTFiles(const char *szDir)
+{
+  char szName[MAX_PATH];
+  uint32_t ss = g_simport.sectorSize;
+  uint32_t entrySectors = 16384 / ss;
+  int status = 0;
+
+  unsigned char *buf = (unsigned char *)calloc(entrySectors + 2, ss);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+  for (uint32_t i=0; i < (entrySectors + 2) * ss; i++) {
+    buf[i] = Pattern(i);
+  }
+  memcpy(&buf[ss], "EFI PART", 8);
+
+  // Primary is MBR, header, entries. Backup is entries then header.
+  sprintf(szName, "%s/gpt_main0.bin", szDir);
+  int fd = emmcdl_open(szName, O_CREAT | O_TRUNC | O_WRONLY);
+  if (fd < 0) {
+    free(buf);
+    return errno;
+  }
+  status = WriteFull(fd, buf, (entrySectors + 2) * ss);
+  emmcdl_close(fd);
+  sprintf(szName, "%s/gpt_backup0.bin", szDir);
+  fd = emmcdl_open(szName, O_CREAT | O_TRUNC | O_WRONLY);
+  if (fd < 0) {
+    free(buf);
+    return errno;
+  }
+  if (status == 0) status = WriteFull(fd, &buf[2 * ss], entrySectors * ss);
+  if (status == 0) status = WriteFull(fd, &buf[ss], ss);
+  emmcdl_close(fd);
+  free(buf);
+
+  sprintf(szName, "%s/rawprogram0.xml", szDir);
+  FILE *fp = fopen(szName, "w");
+  if (fp == NULL) {
+    return errno;
+  }
+  fprintf(fp, "<?xml version=\"1.0\" ?>\n<data>\n");
+  fprintf(fp, "  <program SECTOR_SIZE_IN_BYTES=\"%u\" file_sector_offset=\"0\" filename=\"gpt_main0.bin\" label=\"PrimaryGPT\" "
+          "num_partition_sectors=\"%u\" physical_partition_number=\"0\" start_sector=\"0\"/>\n", ss, entrySectors + 2);
+  fprintf(fp, "  <program SECTOR_SIZE_IN_BYTES=\"%u\" file_sector_offset=\"0\" filename=\"gpt_backup0.bin\" label=\"BackupGPT\" "
+          "num_partition_sectors=\"%u\" physical_partition_number=\"0\" start_sector=\"NUM_DISK_SECTORS-%u.\"/>\n",
+          ss, entrySectors + 1, entrySectors + 1);
+  fprintf(fp, "</data>\n");
+  fclose(fp);
+
+  sprintf(szName, "%s/patch0.xml", szDir);
+  fp = fopen(szName, "w");
+  if (fp == NULL) {
+    return errno;
+  }
+  const char *fmt = "  <patch SECTOR_SIZE_IN_BYTES=\"%u\" byte_offset=\"%u\" filename=\"%s\" physical_partition_number=\"0\" "
+                    "size_in_bytes=\"%u\" start_sector=\"%s\" value=\"%s\" what=\"%s\"/>\n";
+  char szBackup[64], szLast[64], szLastEntry[64], szBackupEntry[64], szBackupArray[64], szBackupCRC[64];
+  uint32_t lastEntry = 3 * 128;   // entry 3 is the one that grows to the end of the disk
+  sprintf(szBackup, "NUM_DISK_SECTORS-1.");
+  sprintf(szLast, "NUM_DISK_SECTORS-%u.", entrySectors + 2);
+  sprintf(szLastEntry, "%u", 2 + lastEntry / ss);
+  sprintf(szBackupEntry, "NUM_DISK_SECTORS-%u.", entrySectors + 1 - lastEntry / ss);
+  sprintf(szBackupArray, "NUM_DISK_SECTORS-%u.", entrySectors + 1);
+  sprintf(szBackupCRC, "CRC32(NUM_DISK_SECTORS-%u.,16384)", entrySectors + 1);
+  fprintf(fp, "<?xml version=\"1.0\" ?>\n<patches>\n");
+  fprintf(fp, fmt, ss, lastEntry % ss + 40, "gpt_main0.bin", 8, szLastEntry, "NUM_DISK_SECTORS-1.", "File copy is left alone");
+  fprintf(fp, fmt, ss, lastEntry % ss + 40, "DISK", 8, szLastEntry, szLast, "Last partition in primary array");
+  fprintf(fp, fmt, ss, lastEntry % ss + 40, "DISK", 8, szBackupEntry, szLast, "Last partition in backup array");
+  fprintf(fp, fmt, ss, 48, "DISK", 8, "1", szLast, "Last usable LBA in primary header");
+  fprintf(fp, fmt, ss, 48, "DISK", 8, szBackup, szLast, "Last usable LBA in backup header");
+  fprintf(fp, fmt, ss, 32, "DISK", 8, "1", szBackup, "Backup LBA in primary header");
+  fprintf(fp, fmt, ss, 24, "DISK", 8, szBackup, szBackup, "Current LBA in backup header");
+  fprintf(fp, fmt, ss, 72, "DISK", 8, szBackup, szBackupArray, "Entries LBA in backup header");
+  fprintf(fp, fmt, ss, 88, "DISK", 4, "1", "CRC32(2,16384)", "Primary array CRC");
+  fprintf(fp, fmt, ss, 88, "DISK", 4, szBackup, szBackupCRC, "Backup array CRC");
+  fprintf(fp, fmt, ss, 16, "DISK", 4, "1", "0", "Clear primary header CRC");
+  fprintf(fp, fmt, ss, 16, "DISK", 4, "1", "CRC32(1,92)", "Primary header CRC");
+  fprintf(fp, fmt, ss, 16, "DISK", 4, szBackup, "0", "Clear backup header CRC");
+  fprintf(fp, fmt, ss, 16, "DISK", 4, szBackup, "CRC32(NUM_DISK_SECTORS-1.,92)", "Backup header CRC");
+  fprintf(fp, "</patches>\n");
+  fclose(fp);
+  return status;
+}
+
+// Program and patch a GPT pair on the target, then again with the patches applied on
+// the host. Both must leave the same bytes on the disk.
+static int BenchGPT(Firehose *pfh)
+{
+  char szDir[64], szRaw[MAX_PATH], szPatch[MAX_PATH], szName[MAX_PATH];
+  uint32_t ss = g_simport.sectorSize;
+  uint32_t entrySectors = 16384 / ss;
+  uint64_t diskSize = (uint64_t)g_simport.diskMB * 1024 * 1024;
+  uint64_t backup = diskSize - (entrySectors + 1) * ss;
+  uint32_t len = (entrySectors + 2) * ss;
+  int status = 0;
+
+  strcpy(szDir, "/tmp/emmcdl_gptXXXXXX");
+  if (mkdtemp(szDir) == NULL) {
+    return errno;
+  }
+  status = CreateGPTFiles(szDir);
+  sprintf(szRaw, "%s/rawprogram0.xml", szDir);
+  sprintf(szPatch, "%s/patch0.xml", szDir);
+
+  unsigned char *disk = SimPortDisk();
+  unsigned char *expect = (unsigned char *)malloc(2 * len);
+  if (expect == NULL) {
+    status = ENOMEM;
+  }
+
+  // Patched on the target, one command per patch or per batch
+  uint64_t cmds = g_simstats.commands;
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    Partition rawprg(0);
+    status = rawprg.PreLoadImage(szRaw);
+    if (status == 0) status = rawprg.ProgramImage(pfh);
+  }
+  if (status == 0) {
+    Partition patch(0);
+    status = patch.PreLoadImage(szPatch);
+    if (status == 0) status = patch.ProgramImage(pfh);
+  }
+  PrintResult("gpt", 0, g_simstats.commands - cmds, start);
+  if (status == 0) {
+    memcpy(expect, disk, len);
+    memcpy(expect + len, disk + backup, (entrySectors + 1) * ss);
+    memset(disk, 0, len);
+    memset(disk + backup, 0, (entrySectors + 1) * ss);
+  }
+
+  // Patched on the host, only the finished images are sent
+  cmds = g_simstats.commands;
+  start = Metrics::Now();
+  if (status == 0) {
+    Partition rawprg(0);
+    status = rawprg.PreLoadImage(szRaw);
+    if (status == 0) status = rawprg.LoadHostPatches(pfh, szPatch);
+    if (status == 0) status = rawprg.ProgramImage(pfh);
+  }
+  PrintResult("gpthost", 0, g_simstats.commands - cmds, start);
+
+  if (status == 0 && (memcmp(expect, disk, len) != 0 || memcmp(expect + len, disk + backup, (entrySectors + 1) * ss) != 0)) {
+    printf("host patched GPT differs from target patched GPT\n");
+    status = EIO;
+  }
+  // The header CRC has to hold or both sides got the patches wrong the same way
+  if (status == 0) {
+    unsigned char hdr[92];
+    uint32_t crc;
+    memcpy(hdr, disk + ss, sizeof(hdr));
+    memcpy(&crc, hdr + 16, 4);
+    memset(hdr + 16, 0, 4);
+    if (crc != CalcCRC32(hdr, sizeof(hdr))) {
+      printf("primary GPT header CRC is wrong\n");
+      status = EIO;
+    }
+  }
+
+  free(expect);
+  const char *files[] = { "gpt_main0.bin", "gpt_backup0.bin", "rawprogram0.xml", "patch0.xml" };
+  for (int i=0; i < 4; i++) {
+    sprintf(szName, "%s/%s", szDir, files[i]);
+    emmcdl_unlink(szName);
+  }
+  rmdir(szDir);
+  return status;
+}
+
+// Programs a rawprogram of RA_IMAGES images evicted from the page cache, once cold
+// and once with the next images hinted while the current one transfers
+#define RA_IMAGES 8
+static int BenchReadAhead(Firehose *pfh, uint64_t len)
+{
+  char szDir[64], szRaw[MAX_PATH], szName[MAX_PATH];
+  const char *names[] = { "racold", "readahead" };
+  uint64_t part = len / RA_IMAGES;
+  uint32_t ss = g_simport.sectorSize;
+  int status = 0;
+
+  strcpy(szDir, "/tmp/emmcdl_raXXXXXX");
+  if (mkdtemp(szDir) == NULL) {
+    return errno;
+  }
+  unsigned char *buf = (unsigned char *)malloc(1024*1024);
+  if (buf == NULL) {
+    rmdir(szDir);
+    return ENOMEM;
+  }
+  for (int i=0; i < RA_IMAGES && status == 0; i++) {
+    sprintf(szName, "%s/image%i.bin", szDir, i);
+    int fd = emmcdl_open(szName, O_CREAT | O_TRUNC | O_WRONLY);
+    if (fd < 0) {
+      status = errno;
+      break;
+    }
+    for (uint64_t off = 0; off < part && status == 0; off += 1024*1024) {
+      for (int j=0; j < 1024*1024; j++) {
+        buf[j] = Pattern(i * part + off + j);
+      }
+      status = WriteFull(fd, buf, 1024*1024);
+    }
+    emmcdl_close(fd);
+  }
+  free(buf);
+
+  sprintf(szRaw, "%s/rawprogram0.xml", szDir);
+  FILE *fp = (status == 0) ? fopen(szRaw, "w") : NULL;
+  if (status == 0 && fp == NULL) {
+    status = errno;
+  }
+  if (fp != NULL) {
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n<data>\n");
+    for (int i=0; i < RA_IMAGES; i++) {
+      fprintf(fp, "  <program SECTOR_SIZE_IN_BYTES=\"%u\" file_sector_offset=\"0\" filename=\"image%i.bin\" label=\"part%i\" "
+              "num_partition_sectors=\"%lu\" physical_partition_number=\"0\" start_sector=\"%lu\"/>\n",
+              ss, i, i, part / ss, i * part / ss);
+    }
+    fprintf(fp, "</data>\n");
+    fclose(fp);
+  }
+
+  for (int pass=0; pass < 2 && status == 0; pass++) {
+    // Every image starts out on the disk only
+    for (int i=0; i < RA_IMAGES; i++) {
+      sprintf(szName, "%s/image%i.bin", szDir, i);
+      int fd = emmcdl_open(szName, O_RDONLY);
+      if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        emmcdl_close(fd);
+      }
+    }
+    memset(SimPortDisk(), 0, len);
+
+    uint64_t cmds = g_simstats.commands;
+    uint64_t start = Metrics::Now();
+    Partition rawprg(0);
+    rawprg.SetReadAhead(pass ? READAHEAD_DEFAULT : 0);
+    status = rawprg.PreLoadImage(szRaw);
+    if (status == 0) status = rawprg.ProgramImage(pfh);
+    PrintResult(names[pass], len, g_simstats.commands - cmds, start);
+
+    unsigned char *disk = SimPortDisk();
+    for (uint64_t off = 0; off < part * RA_IMAGES && status == 0; off++) {
+      if (disk[off] != Pattern(off)) {
+        printf("%s mismatch at offset %lu\n", names[pass], off);
+        status = EIO;
+      }
+    }
+  }
+
+  for (int i=0; i < RA_IMAGES; i++) {
+    sprintf(szName, "%s/image%i.bin", szDir, i);
+    emmcdl_unlink(szName);
+  }
+  emmcdl_unlink(szRaw);
+  rmdir(szDir);
+  return status;
+}
+
+#define EXPR_NO_CRC ((uint64_t)-1)
+
+typedef struct {
+  const char *text;
+  int status;
+  uint64_t value;
+  uint64_t crcStart;
+  uint64_t crcLen;
+} expr_check_t;
+
+// What attribute texts must come to on a 1000 sector disk
+static const expr_check_t exprChecks[] = {
+  { "2+3*4",                    0,      14,                   EXPR_NO_CRC, EXPR_NO_CRC },
+  { "(2+3)*4",                  0,      20,                   EXPR_NO_CRC, EXPR_NO_CRC },
+  { "10-4-3",                   0,      3,                    EXPR_NO_CRC, EXPR_NO_CRC },
+  { "-5+8",                     0,      3,                    EXPR_NO_CRC, EXPR_NO_CRC },
+  { "2*-3",                     0,      (uint64_t)-6,         EXPR_NO_CRC, EXPR_NO_CRC },
+  { "- -7",                     0,      7,                    EXPR_NO_CRC, EXPR_NO_CRC },
+  { "-7/2",                     0,      (uint64_t)-3,         EXPR_NO_CRC, EXPR_NO_CRC },
+  { "7/0",                      0,      0,                    EXPR_NO_CRC, EXPR_NO_CRC },
+  { "0x10+0XfF",                0,      271,                  EXPR_NO_CRC, EXPR_NO_CRC },
+  { "33.5",                     0,      33,                   EXPR_NO_CRC, EXPR_NO_CRC },
+  { "",                         0,      0,                    EXPR_NO_CRC, EXPR_NO_CRC },
+  { "NUM_DISK_SECTORS-33.",     0,      967,                  EXPR_NO_CRC, EXPR_NO_CRC },
+  { "(NUM_DISK_SECTORS-1)*512", 0,      999*512,              EXPR_NO_CRC, EXPR_NO_CRC },
+  { "CRC32(2,92*128)",          0,      0,                    2,           11776 },
+  { "CRC32(NUM_DISK_SECTORS-33.,92*128)+5", 0, 5,             967,         11776 },
+  { "1+CRC32(1,2)",             0,      1,                    1,           2 },
+  { "2+",                       EINVAL, 0,                    0,           0 },
+  { "(1",                       EINVAL, 0,                    0,           0 },
+  { "0x",                       EINVAL, 0,                    0,           0 },
+  { "1 2",                      EINVAL, 0,                    0,           0 },
+  { "NUM_SECTORS",              EINVAL, 0,                    0,           0 },
+  { "CRC32(1,2)*3",             EINVAL, 0,                    0,           0 },
+  { "1-CRC32(1,2)",             EINVAL, 0,                    0,           0 },
+  { "CRC32(1,2)+CRC32(3,4)",    EINVAL, 0,                    0,           0 },
+};
+
+static int CheckExpr(void)
+{
+  ExprCache cache;
+  expr_value_t v;
+  int status = 0;
+
+  for (uint32_t i=0; i < sizeof(exprChecks) / sizeof(exprChecks[0]); i++) {
+    const expr_check_t *c = &exprChecks[i];
+    memset(&v, 0, sizeof(v));
+    int ret = cache.Evaluate(c->text, 1000, &v);
+    if (ret != c->status || (ret == 0 && (v.value != c->value || v.crcStart != c->crcStart || v.crcLen != c->crcLen))) {
+      printf("expr \"%s\" gave status %i value %li crc %li,%li\n", c->text, ret, v.value, v.crcStart, v.crcLen);
+      status = EINVAL;
+    }
+  }
+
+  // The same text from the cache follows the disk size it is evaluated against
+  if (cache.Evaluate("NUM_DISK_SECTORS-33.", 2000, &v) != 0 || v.value != 1967) {
+    printf("expr cache kept the old disk size\n");
+    status = EINVAL;
+  }
+
+  // And through the XML parser, CRC32 arguments land in the patch entry
+  Partition part(1000);
+  PartitionEntry pe;
+  char patchKey[] = "<patch SECTOR_SIZE_IN_BYTES=\"512\" byte_offset=\"0x10\" filename=\"DISK\" physical_partition_number=\"0\" "
+                    "size_in_bytes=\"4\" start_sector=\"NUM_DISK_SECTORS-1.\" value=\"CRC32(NUM_DISK_SECTORS-33.,32*128)\" what=\"CRC\"/>";
+  memset(&pe, 0, sizeof(pe));
+  int ret = part.ParseXMLKey(patchKey, &pe);
+  if (ret != 0 || pe.eCmd != CMD_PATCH || pe.start_sector != 999 || pe.patch_offset != 16 || pe.patch_size != 4 ||
+      pe.patch_value != 0 || pe.crc_start != 967 || pe.crc_size != 4096) {
+    printf("patch key gave status %i start %lu offset %lu value %lu crc %lu,%lu\n", ret,
+           pe.start_sector, pe.patch_offset, pe.patch_value, pe.crc_start, pe.crc_size);
+    status = EINVAL;
+  }
+  return status;
+}
+
+// Compile a rawprogram with num entries naming one small image and a patch file
+// with num expressions, then dump the plan as JSON. Nothing goes to the target.
+static int BenchPlan(uint32_t num)
+{
+  char szDir[64], szRaw[MAX_PATH], szPatch[MAX_PATH], szName[MAX_PATH];
+  uint32_t ss = g_simport.sectorSize;
+  uint64_t xmlBytes = 0;
+  int status = 0;
+
+  strcpy(szDir, "/tmp/emmcdl_planXXXXXX");
+  if (mkdtemp(szDir) == NULL) {
+    return errno;
+  }
+  sprintf(szName, "%s/image.bin", szDir);
+  int fd = emmcdl_open(szName, O_CREAT | O_TRUNC | O_WRONLY);
+  if (fd < 0) {
+    rmdir(szDir);
+    return errno;
+  }
+  unsigned char buf[4096];
+  memset(buf, 0x5a, sizeof(buf));
+  status = WriteFull(fd, buf, sizeof(buf));
+  emmcdl_close(fd);
+
+  sprintf(szRaw, "%s/rawprogram0.xml", szDir);
+  FILE *fp = (status == 0) ? fopen(szRaw, "w") : NULL;
+  if (status == 0 && fp == NULL) {
+    status = errno;
+  }
+  if (fp != NULL) {
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n<data>\n");
+    for (uint32_t i=0; i < num; i++) {
+      fprintf(fp, "  <program SECTOR_SIZE_IN_BYTES=\"%u\" file_sector_offset=\"0\" filename=\"%s\" label=\"part%u\" "
+              "num_partition_sectors=\"%u\" physical_partition_number=\"0\" start_sector=\"%u\"/>\n",
+              ss, (i & 1) ? "image.bin" : "", i, (uint32_t)sizeof(buf) / ss, 34 + i * 8);
+    }
+    // Simlock images are optional, a missing one must not fail the plan
+    fprintf(fp, "  <simlock SECTOR_SIZE_IN_BYTES=\"%u\" filename=\"simlock.bin\" num_partition_sectors=\"8\" "
+            "physical_partition_number=\"0\" start_sector=\"26\"/>\n", ss);
+    fprintf(fp, "</data>\n");
+    xmlBytes += ftell(fp);
+    fclose(fp);
+  }
+
+  sprintf(szPatch, "%s/patch0.xml", szDir);
+  fp = (status == 0) ? fopen(szPatch, "w") : NULL;
+  if (status == 0 && fp == NULL) {
+    status = errno;
+  }
+  if (fp != NULL) {
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n<patches>\n");
+    for (uint32_t i=0; i < num; i++) {
+      fprintf(fp, "  <patch SECTOR_SIZE_IN_BYTES=\"%u\" byte_offset=\"%u\" filename=\"DISK\" physical_partition_number=\"0\" "
+              "size_in_bytes=\"8\" start_sector=\"NUM_DISK_SECTORS-%u.\" value=\"NUM_DISK_SECTORS-%u.\" what=\"Entry %u\"/>\n",
+              ss, (i * 8) % ss, 1 + i % 33, 34 + i, i);
+    }
+    fprintf(fp, "</patches>\n");
+    xmlBytes += ftell(fp);
+    fclose(fp);
+  }
+
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    Partition rawprg(0);
+    Partition patch(0);
+    status = rawprg.PreLoadImage(szRaw);
+    if (status == 0) status = rawprg.CompilePlan();
+    if (status == 0) status = patch.PreLoadImage(szPatch);
+    if (status == 0) status = patch.CompilePlan();
+    // XML parsed and entries compiled from it
+    PrintResult("plan", xmlBytes, 2 * num + 1, start);
+
+    start = Metrics::Now();
+    sprintf(szName, "%s/plan.json", szDir);
+    fp = (status == 0) ? fopen(szName, "w") : NULL;
+    if (fp != NULL) {
+      status = rawprg.WritePlanJSON(fp);
+      if (status == 0) status = patch.WritePlanJSON(fp);
+      uint64_t jsonBytes = ftell(fp);
+      fclose(fp);
+      PrintResult("planjson", jsonBytes, 2 * num + 1, start);
+    }
+  }
+
+  if (status == 0) {
+    status = CheckExpr();
+  }
+
+  // A known element whose attribute doesn't evaluate fails the plan, an unknown one is still sent raw
+  const char *bad[] = {
+    "<program SECTOR_SIZE_IN_BYTES=\"512\" filename=\"image.bin\" num_partition_sectors=\"8\" physical_partition_number=\"0\" start_sector=\"34+\"/>",
+    "<vendorcmd physical_partition_number=\"0\" start_sector=\"34+\"/>",
+  };
+  sprintf(szName, "%s/bad.xml", szDir);
+  for (int i=0; i < 2 && status == 0; i++) {
+    fp = fopen(szName, "w");
+    if (fp == NULL) {
+      status = errno;
+      break;
+    }
+    fprintf(fp, "<?xml version=\"1.0\" ?>\n<data>\n  %s\n</data>\n", bad[i]);
+    fclose(fp);
+    Partition part(0);
+    int ret = part.PreLoadImage(szName);
+    if (ret == 0) ret = part.CompilePlan();
+    if ((ret != 0) != (i == 0)) {
+      printf("plan of %s gave status %i\n", bad[i], ret);
+      status = EINVAL;
+    }
+  }
+
+  const char *files[] = { "image.bin", "rawprogram0.xml", "patch0.xml", "plan.json", "bad.xml" };
+  for (int i=0; i < 5; i++) {
+    sprintf(szName, "%s/%s", szDir, files[i]);
+    emmcdl_unlink(szName);
+  }
+  rmdir(szDir);
+  return status;
+}
+
+static int BenchFirehose(int argc, char **argv)
+{
+  const char *szTest = (argc > 0) ? argv[0] : "all";
+  uint64_t len = 64*1024*1024;
+  uint32_t payload = 1024*1024;
+  uint32_t patches = 1000;
+  uint32_t batch = FH_PATCH_BATCH;
+  bool bVerify = false;
+  int status = 0;
+
+  // Runs start cold unless a cache directory is given
+  g_digestcache.SetDir(NULL);
+  for (int i=1; i < argc; i++) {
+    if (strcasecmp(argv[i], "-size") == 0 && (i + 1) < argc) {
+      len = (uint64_t)atoi(argv[++i]) * 1024 * 1024;
+    }
+    else if (strcasecmp(argv[i], "-latency") == 0 && (i + 1) < argc) {
+      g_simport.ackLatencyUs = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-bw") == 0 && (i + 1) < argc) {
+      g_simport.linkMBps = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-payload") == 0 && (i + 1) < argc) {
+      payload = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-maxpayload") == 0 && (i + 1) < argc) {
+      g_simport.maxPayload = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-norawmode") == 0) {
+      g_simport.rawmode = false;
+    }
+    else if (strcasecmp(argv[i], "-noerase") == 0) {
+      g_simport.erase = false;
+    }
+    else if (strcasecmp(argv[i], "-nobatch") == 0) {
+      g_simport.batch = false;
+    }
+    else if (strcasecmp(argv[i], "-verify") == 0) {
+      bVerify = true;
+    }
+    else if (strcasecmp(argv[i], "-nodigest") == 0) {
+      g_simport.digest = false;
+    }
+    else if (strcasecmp(argv[i], "-cache") == 0 && (i + 1) < argc) {
+      g_digestcache.SetDir(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-patches") == 0 && (i + 1) < argc) {
+      patches = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-patchbatch") == 0 && (i + 1) < argc) {
+      batch = atoi(argv[++i]);
+    }
+    else {
+      return EINVAL;
+    }
+  }
+  len -= len % (1024*1024);
+  if (len == 0 || payload == 0) {
+    return EINVAL;
+  }
+  bool bAll = (strcasecmp(szTest, "all") == 0);
+  if (!bAll && strcasecmp(szTest, "program") != 0 && strcasecmp(szTest, "read") != 0 &&
+      strcasecmp(szTest, "sparse") != 0 && strcasecmp(szTest, "erase") != 0 && strcasecmp(szTest, "zeroscan") != 0 && strcasecmp(szTest, "gpt") != 0 &&
+      strcasecmp(szTest, "patch") != 0 && strcasecmp(szTest, "delta") != 0 && strcasecmp(szTest, "plan") != 0 &&
+      strcasecmp(szTest, "readahead") != 0) {
+    return EINVAL;
+  }
+  if (g_simport.diskMB < len / 1024 / 1024) {
+    g_simport.diskMB = (uint32_t)(len / 1024 / 1024);
+  }
+
+  SerialPort port;
+  status = port.Open(0);
+  if (status != 0) {
+    return status;
+  }
+
+  fh_configure_t cfg = { 4, "emmc", false, false, false, -1, (int)payload, 0 };
+  Firehose fh(&port, payload);
+  fh.SetDiskSectorSize(g_simport.sectorSize);
+  fh.SetPatchBatch(batch);
+  if (bVerify) fh.EnableVerify();
+  status = fh.ConnectToFlashProg(&cfg);
+  if (status != 0) {
+    printf("configure failed %i\n", status);
+    return status;
+  }
+
+  printf("firehose sim: ack latency %u us, link %u MB/s, payload %u (target max %u), rawmode %s\n",
+         g_simport.ackLatencyUs, g_simport.linkMBps, fh.GetMaxPayloadSize(), g_simport.maxPayload,
+         g_simport.rawmode ? "on" : "off");
+
+  if (status == 0 && (bAll || strcasecmp(szTest, "program") == 0)) {
+    status = BenchProgram(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "read") == 0)) {
+    status = BenchRead(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "sparse") == 0)) {
+    status = BenchSparse(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "erase") == 0)) {
+    status = BenchErase(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "zeroscan") == 0)) {
+    status = BenchZeroScan(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "delta") == 0)) {
+    status = BenchDelta(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "patch") == 0)) {
+    status = BenchPatch(&fh, patches);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "gpt") == 0)) {
+    status = BenchGPT(&fh);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "readahead") == 0)) {
+    status = BenchReadAhead(&fh, len);
+  }
+  if (status == 0 && (bAll || strcasecmp(szTest, "plan") == 0)) {
+    status = BenchPlan(patches);
+  }
+
+  return status;
+}
+
+// Load a programmer into a simulated PBL for loads devices in a row. The first load
+// starts with the file out of the page cache, the rest are served from memory.
+static int BenchSahara(int argc, char **argv)
+{
+  uint32_t size = 1024*1024;
+  uint32_t loads = 8;
+  char szName[64];
+  int status = 0;
+
+  for (int i=0; i < argc; i++) {
+    if (strcasecmp(argv[i], "-size") == 0 && (i + 1) < argc) {
+      size = (uint32_t)atoi(argv[++i]) * 1024;
+    }
+    else if (strcasecmp(argv[i], "-readsize") == 0 && (i + 1) < argc) {
+      g_simport.saharaReadSize = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-loads") == 0 && (i + 1) < argc) {
+      loads = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-latency") == 0 && (i + 1) < argc) {
+      g_simport.ackLatencyUs = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-bw") == 0 && (i + 1) < argc) {
+      g_simport.linkMBps = atoi(argv[++i]);
+    }
+    else {
+      return EINVAL;
+    }
+  }
+  if (size == 0 || g_simport.saharaReadSize == 0) {
+    return EINVAL;
+  }
+  g_simport.sahara = true;
+  g_simport.saharaImageSize = size;
+  g_simport.diskMB = size / (1024*1024) + 1;
+
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    return errno;
+  }
+  unsigned char *buf = (unsigned char *)malloc(size);
+  if (buf == NULL) {
+    emmcdl_close(fd);
+    emmcdl_unlink(szName);
+    return ENOMEM;
+  }
+  for (uint32_t i=0; i < size; i++) {
+    buf[i] = Pattern(i);
+  }
+  status = WriteFull(fd, buf, size);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  emmcdl_close(fd);
+  free(buf);
+
+  printf("sahara sim: programmer %u KB, read requests up to %u bytes, ack latency %u us, link %u MB/s\n",
+         size / 1024, g_simport.saharaReadSize, g_simport.ackLatencyUs, g_simport.linkMBps);
+  for (uint32_t n=0; n < loads && status == 0; n++) {
+    SerialPort port;
+    status = port.Open(0);
+    if (status != 0) {
+      break;
+    }
+    // Detection and load as emmcdl does them, each in its own session
+    uint64_t start = Metrics::Now();
+    Sahara probe(&port);
+    status = probe.CheckDevice();
+    uint64_t detectNs = Metrics::Now() - start;
+    Sahara sh(&port);
+    if (status == 0) {
+      status = sh.ConnectToDevice(true, SAHARA_MODE_IMAGE_TX_PENDING);
+    }
+    if (status == 0) {
+      status = sh.LoadFlashProg(szName);
+    }
+    PrintResult(n ? "sahara" : "saharacold", size, g_simstats.commands, start);
+    printf("  detect %.3f ms, hello %.3f ms, image %.3f ms, done %.3f ms\n", (double)detectNs / 1000000,
+           (double)sh.StateTime(SAHARA_STATE_WAIT_HELLO) / 1000000,
+           (double)sh.StateTime(SAHARA_STATE_IMAGE_TX) / 1000000,
+           (double)sh.StateTime(SAHARA_STATE_WAIT_DONE) / 1000000);
+
+    unsigned char *disk = SimPortDisk();
+    for (uint32_t off = 0; off < size && status == 0; off++) {
+      if (disk[off] != Pattern(off)) {
+        printf("programmer mismatch at offset %u\n", off);
+        status = EIO;
+      }
+    }
+  }
+  emmcdl_unlink(szName);
+  return status;
+}
+
+// RAM dump from a crashed target, regions are checked against the simulated memory
+static int BenchRamDump(int argc, char **argv)
+{
+  sahara_dump_t opt = { NULL, NULL, SAHARA_DUMP_READ_SIZE, SAHARA_DUMP_DEPTH };
+  uint32_t sizeMB = 64;
+  char szDir[64];
+  char szPath[128];
+  int status = 0;
+
+  for (int i=0; i < argc; i++) {
+    if (strcasecmp(argv[i], "-size") == 0 && (i + 1) < argc) {
+      sizeMB = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-regions") == 0 && (i + 1) < argc) {
+      g_simport.saharaRegions = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-only") == 0 && (i + 1) < argc) {
+      opt.szRegions = argv[++i];
+    }
+    else if (strcasecmp(argv[i], "-readsize") == 0 && (i + 1) < argc) {
+      opt.readSize = atoi(argv[++i]) * 1024;
+    }
+    else if (strcasecmp(argv[i], "-depth") == 0 && (i + 1) < argc) {
+      opt.depth = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-latency") == 0 && (i + 1) < argc) {
+      g_simport.ackLatencyUs = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-bw") == 0 && (i + 1) < argc) {
+      g_simport.linkMBps = atoi(argv[++i]);
+    }
+    else {
+      return EINVAL;
+    }
+  }
+  if (sizeMB == 0 || g_simport.saharaRegions == 0 || opt.readSize == 0 || opt.depth == 0) {
+    return EINVAL;
+  }
+  g_simport.sahara = true;
+  g_simport.saharaMemDebug = true;
+  g_simport.diskMB = sizeMB + 1;
+
+  strcpy(szDir, "/tmp/emmcdl_benchXXXXXX");
+  if (mkdtemp(szDir) == NULL) {
+    return errno;
+  }
+  opt.szDir = szDir;
+
+  SerialPort port;
+  status = port.Open(0);
+  if (status != 0) {
+    return status;
+  }
+  unsigned char *disk = SimPortDisk();
+  uint64_t diskSize = (uint64_t)g_simport.diskMB * 1024 * 1024;
+  for (uint64_t off = SIM_MEM_TABLE_SIZE; off < diskSize; off++) {
+    disk[off] = Pattern(off);
+  }
+
+  printf("ramdump sim: %u MB in %u regions, read requests of %u KB, %u outstanding, ack latency %u us, link %u MB/s\n",
+         sizeMB, g_simport.saharaRegions, opt.readSize / 1024, opt.depth, g_simport.ackLatencyUs, g_simport.linkMBps);
+  uint64_t start = Metrics::Now();
+  Sahara sh(&port);
+  status = sh.MemoryDump(&opt);
+  uint64_t bytes = 0;
+  for (uint32_t i=0; i < g_simport.saharaRegions; i++) {
+    dload_debug_64_t entry;
+    memcpy(&entry, disk + i * sizeof(entry), sizeof(entry));
+    snprintf(szPath, sizeof(szPath), "%s/%s", szDir, entry.filename);
+    int fd = emmcdl_open(szPath, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    unsigned char *buf = (unsigned char *)malloc(entry.length);
+    if (buf == NULL || pread(fd, buf, entry.length, 0) != (ssize_t)entry.length) {
+      printf("%s is short\n", szPath);
+      status = EIO;
+    }
+    for (uint64_t off = 0; off < entry.length && status == 0; off++) {
+      if (buf[off] != Pattern(entry.mem_base + off)) {
+        printf("%s differs at offset %lu\n", szPath, off);
+        status = EIO;
+      }
+    }
+    bytes += entry.length;
+    free(buf);
+    emmcdl_close(fd);
+    emmcdl_unlink(szPath);
+  }
+  rmdir(szDir);
+  PrintResult("ramdump", bytes, g_simstats.commands, start);
+  return status;
+}
+
+// Image streamed to a simulated DLOAD programmer, checked against the disk afterwards
+static int BenchDload(int argc, char **argv)
+{
+  uint32_t sizeMB = 64;
+  char szName[64];
+  int status = 0;
+
+  for (int i=0; i < argc; i++) {
+    if (strcasecmp(argv[i], "-size") == 0 && (i + 1) < argc) {
+      sizeMB = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-block") == 0 && (i + 1) < argc) {
+      g_simport.dloadBlock = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-window") == 0 && (i + 1) < argc) {
+      g_simport.dloadWindow = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-drop") == 0 && (i + 1) < argc) {
+      g_simport.dloadDropEvery = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-latency") == 0 && (i + 1) < argc) {
+      g_simport.ackLatencyUs = atoi(argv[++i]);
+    }
+    else if (strcasecmp(argv[i], "-bw") == 0 && (i + 1) < argc) {
+      g_simport.linkMBps = atoi(argv[++i]);
+    }
+    else {
+      return EINVAL;
+    }
+  }
+  if (sizeMB == 0 || g_simport.dloadDropEvery == 1) {
+    return EINVAL;
+  }
+  g_simport.dload = true;
+  g_simport.diskMB = sizeMB;
+
+  uint64_t len = (uint64_t)sizeMB * 1024 * 1024;
+  unsigned char *buf = (unsigned char *)malloc(len);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+  for (uint64_t off = 0; off < len; off++) {
+    buf[off] = Pattern(off);
+  }
+  int fd = CreateTempFile(szName);
+  if (fd < 0) {
+    free(buf);
+    return errno;
+  }
+  status = WriteFull(fd, buf, len);
+  emmcdl_lseek(fd, 0, SEEK_SET);
+
+  SerialPort port;
+  if (status == 0) {
+    status = port.Open(0);
+  }
+  Dload dl(&port);
+  if (status == 0) {
+    status = dl.ConnectToFlashProg(4);
+  }
+  printf("dload sim: %u MB, block %u, window %u, ack latency %u us, link %u MB/s, drop 1 in %u\n",
+         sizeMB, g_simport.dloadBlock, g_simport.dloadWindow, g_simport.ackLatencyUs, g_simport.linkMBps,
+         g_simport.dloadDropEvery);
+  uint64_t start = Metrics::Now();
+  if (status == 0) {
+    status = dl.OpenPartition(PRTN_EMMCUSER);
+  }
+  if (status == 0) {
+    status = dl.FastCopySerial(fd, 0, (uint32_t)(len / SECTOR_SIZE));
+  }
+  if (status == 0) {
+    status = dl.ClosePartition();
+  }
+  if (status == 0 && memcmp(SimPortDisk(), buf, len) != 0) {
+    printf("Disk contents differ from the image\n");
+    status = EIO;
+  }
+  PrintResult("dload", len, g_simstats.commands, start);
+  free(buf);
+  emmcdl_close(fd);
+  emmcdl_unlink(szName);
+  return status;
+}
+
+static int UsbExpectRead(usb_handle *h, unsigned char *rx, int len, const unsigned char *want, int wantLen)
+{
+  int n = usb_read(h, rx, len);
+  if (n != wantLen || (n > 0 && memcmp(rx, want, n) != 0)) {
+    printf("usb read of %d returned %d, expected %d\n", len, n, wantLen);
+    return EIO;
+  }
+  return 0;
+}
+
+// Captured responses played back through the URB handling at one queue depth
+static int UsbReplayCheck(usb_handle *h, int depth, const unsigned char *data, unsigned char *rx, unsigned char *out)
+{
+  usb_replay_xfer_t script[] = {
+    { data, 40000, false },                       // Short packet in the third URB of four
+    { data + 40000, 100, false },                 // Must not land in the URB cut off after it
+    { data + 1000, 150000, true },                // Chain longer than the queue, the short packet stops submits
+    { data + 3, 8, true },
+    { NULL, 0, false },                           // Device goes quiet
+    { data, 2 * MAX_USBFS_BULK_SIZE, false },     // Ends in a zero length packet
+    { data + 7, 512, false },                     // Read sized to the response
+  };
+  bool async = depth > 1;
+  int status = 0;
+
+  status = usb_set_queue_depth(h, depth);
+  UsbReplayStart(script, sizeof(script) / sizeof(script[0]), NULL, 0, 0);
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 64*1024, data, 40000);
+  }
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 64*1024, data + 40000, 100);
+  }
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 256*1024, data + 1000, 150000);
+  }
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 64*1024, data + 3, 8);
+  }
+  if (status == 0) {
+    // Within the caller's timeout the read comes back empty, every URB of the
+    // chain is discarded and the handle stays usable
+    usb_set_timeout(h, 50);
+    int n = usb_read(h, rx, 64*1024);
+    usb_set_timeout(h, 0);
+    if (n != 0 || g_usbreplay.timeouts != 1 || g_usbreplay.pending != 0 || (async && g_usbreplay.discarded != 4)) {
+      printf("usb read timeout returned %d, %lu timeouts, %lu URBs discarded, %u pending\n", n,
+             g_usbreplay.timeouts, g_usbreplay.discarded, g_usbreplay.pending);
+      status = EIO;
+    }
+  }
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 64*1024, data, 2 * MAX_USBFS_BULK_SIZE);
+  }
+  if (status == 0) {
+    status = UsbExpectRead(h, rx, 512, data + 7, 512);
+  }
+  if (status == 0 && async && (g_usbreplay.cancelled == 0 || g_usbreplay.refused == 0)) {
+    printf("usb short packets cut off %lu URBs, refused %lu\n", g_usbreplay.cancelled, g_usbreplay.refused);
+    status = EIO;
+  }
+
+  UsbReplayStart(NULL, 0, out, 100000, 0);
+  if (status == 0 && (usb_write(h, data, 100000) != 100000 || memcmp(out, data, 100000) != 0)) {
+    printf("usb write didn't arrive intact\n");
+    status = EIO;
+  }
+  // Endpoint stalls partway, whatever is still queued behind it comes back
+  UsbReplayStart(NULL, 0, NULL, 0, 50000);
+  if (status == 0) {
+    int n = usb_write(h, data, 100000);
+    if (n != -1 || errno != EPIPE || g_usbreplay.pending != 0 || (async && g_usbreplay.discarded == 0)) {
+      printf("usb write stall returned %d errno %d, %lu URBs discarded, %u pending\n", n, errno,
+             g_usbreplay.discarded, g_usbreplay.pending);
+      status = EIO;
+    }
+  }
+  UsbReplayStop();
+  return status;
+}
+
+// URB handling in usbfs.c driven by the replay backend, checked at the synchronous and default depths
+static int BenchUsb(int argc, char **argv)
+{
+  uint32_t sizeMB = (argc > 0) ? atoi(argv[0]) : 256;
+  const int xferSize = 1024*1024;
+  unsigned char *data = (unsigned char *)malloc(xferSize);
+  unsigned char *rx = (unsigned char *)malloc(2 * xferSize);
+  unsigned char *out = (unsigned char *)malloc(xferSize);
+  usb_replay_xfer_t *script = (usb_replay_xfer_t *)calloc(sizeMB, sizeof(usb_replay_xfer_t));
+  usb_handle *h = usbfs_handle_new("replay", 0, 0x81, 0x01);
+  int depths[2] = { 1, USB_DEFAULT_QUEUE_DEPTH };
+  int status = 0;
+
+  if (data == NULL || rx == NULL || out == NULL || script == NULL || h == NULL) {
+    status = ENOMEM;
+  }
+  for (int i = 0; status == 0 && i < xferSize; i++) {
+    data[i] = Pattern(i);
+  }
+  for (uint32_t i = 0; status == 0 && i < sizeMB; i++) {
+    script[i].data = data;
+    script[i].len = xferSize;
+  }
+
+  for (int d = 0; status == 0 && d < 2; d++) {
+    status = UsbReplayCheck(h, depths[d], data, rx, out);
+    if (status != 0) {
+      printf("usb replay failed at queue depth %d\n", depths[d]);
+      break;
+    }
+    printf("usb replay: queue depth %d\n", depths[d]);
+
+    UsbReplayStart(script, sizeMB, NULL, 0, 0);
+    uint64_t start = Metrics::Now();
+    for (uint32_t i = 0; status == 0 && i < sizeMB; i++) {
+      status = UsbExpectRead(h, rx, 2 * xferSize, data, xferSize);
+    }
+    PrintResult("usbread", (uint64_t)sizeMB * xferSize, g_usbreplay.submitted + g_usbreplay.bulk, start);
+
+    UsbReplayStart(NULL, 0, NULL, 0, 0);
+    start = Metrics::Now();
+    for (uint32_t i = 0; status == 0 && i < sizeMB; i++) {
+      if (usb_write(h, data, xferSize) != xferSize) {
+        status = EIO;
+      }
+    }
+    PrintResult("usbwrite", (uint64_t)sizeMB * xferSize, g_usbreplay.submitted + g_usbreplay.bulk, start);
+    UsbReplayStop();
+  }
+
+  usbfs_handle_free(h);
+  free(script);
+  free(out);
+  free(rx);
+  free(data);
+  return status;
+}
+
+static int PrintUsage(void)
+{
+  printf("Usage: emmcdl_bench <test> [options]\n");
+  printf("       crc [KB]                         CRC32 bitwise vs slice-by-8 vs hardware (default 16384 KB)\n");
+  printf("       hdlc [KB]                        HDLC framing bytewise vs span copy with the framer (default 16384 KB)\n");
+  printf("       usb [MB]                         Replay captured bulk transfers through the usbfs URB code (default 256 MB)\n");
+  printf("       sahara                           Load a flash programmer into a simulated PBL\n");
+  printf("          [-size KB]                    Programmer size (default 1024)\n");
+  printf("          [-readsize bytes]             Largest READ_DATA request from the target (default 1048576)\n");
+  printf("          [-loads num]                  Devices loaded one after another (default 8)\n");
+  printf("          [-latency us] [-bw MB/s]      As for fh\n");
+  printf("       ramdump                          Collect a RAM dump from a simulated crashed target\n");
+  printf("          [-size MB]                    Memory offered (default 64)\n");
+  printf("          [-regions num]                Regions it is split into (default 4)\n");
+  printf("          [-only name,...]              Regions to collect like emmcdl -MemRegions (default all)\n");
+  printf("          [-readsize KB]                Memory asked for per read request (default %u)\n", SAHARA_DUMP_READ_SIZE / 1024);
+  printf("          [-depth num]                  Read requests kept outstanding (default %u)\n", SAHARA_DUMP_DEPTH);
+  printf("          [-latency us] [-bw MB/s]      As for fh\n");
+  printf("       dload                            Stream an image to a simulated DLOAD programmer\n");
+  printf("          [-size MB]                    Image size (default 64)\n");
+  printf("          [-block bytes]                Block size the programmer reports (default 4096)\n");
+  printf("          [-window num]                 Packets the programmer takes ahead of its responses (default 8)\n");
+  printf("          [-drop num]                   Lose one stream write in num to exercise retransmission (default 0)\n");
+  printf("          [-latency us] [-bw MB/s]      As for fh\n");
+  printf("       fh [program|read|sparse|erase|zeroscan|delta|patch|gpt|readahead|plan|all]\n");
+  printf("          [-size MB]                    Data moved per workload (default 64)\n");
+  printf("          [-latency us]                 Simulated target delay before each ACK/NAK (default 0)\n");
+  printf("          [-bw MB/s]                    Simulated link bandwidth (default unlimited)\n");
+  printf("          [-payload bytes]              Host MaxPayloadSizeToTargetInBytes (default 1048576)\n");
+  printf("          [-maxpayload bytes]           Largest payload the target accepts (default 1048576)\n");
+  printf("          [-norawmode]                  Target omits rawmode from its ACKs\n");
+  printf("          [-noerase]                    Target NAKs <erase> like older programmers\n");
+  printf("          [-nobatch]                    Target only answers the first element of each document\n");
+  printf("          [-verify]                     Check each programmed range by SHA-256 digest\n");
+  printf("          [-nodigest]                   Target NAKs <getsha256digest>, verify falls back to read back\n");
+  printf("          [-cache dir]                  Keep image digests in dir like emmcdl -DigestCache (default off)\n");
+  printf("          [-patches num]                Patch commands to send, entries per plan XML (default 1000)\n");
+  printf("          [-patchbatch num]             Patches per document from the host (default %u)\n", FH_PATCH_BATCH);
+  return EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    return PrintUsage();
+  }
+
+  if (strcasecmp(argv[1], "crc") == 0) {
+    return BenchCRC(argc - 2, argv + 2);
+  }
+  if (strcasecmp(argv[1], "hdlc") == 0) {
+    return BenchHdlc(argc - 2, argv + 2);
+  }
+  if (strcasecmp(argv[1], "usb") == 0) {
+    return BenchUsb(argc - 2, argv + 2);
+  }
+  if (strcasecmp(argv[1], "sahara") == 0) {
+    int status = BenchSahara(argc - 2, argv + 2);
+    if (status == EINVAL) {
+      return PrintUsage();
+    }
+    return status;
+  }
+  if (strcasecmp(argv[1], "ramdump") == 0) {
+    int status = BenchRamDump(argc - 2, argv + 2);
+    if (status == EINVAL) {
+      return PrintUsage();
+    }
+    return status;
+  }
+  if (strcasecmp(argv[1], "dload") == 0) {
+    int status = BenchDload(argc - 2, argv + 2);
+    if (status == EINVAL) {
+      return PrintUsage();
+    }
+    return status;
+  }
+  if (strcasecmp(argv[1], "fh") == 0) {
+    int status = BenchFirehose(argc - 2, argv + 2);
+    if (status == EINVAL) {
+      return PrintUsage();
+    }
+    return status;
+  }
+
+  return PrintUsage();
+}
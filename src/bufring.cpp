@@ -0,0 +1,158 @@
+/*****************************************************************************
+ * bufring.cpp
+ *
+ * This class implements the buffer ring used between transfer threads
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "bufring.h"
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr)
+{
+  syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+BufRing::BufRing()
+{
+  slots = NULL;
+  pool = NULL;
+  count = 0;
+  size = 0;
+  Reset();
+}
+
+BufRing::~BufRing()
+{
+  if (slots) free(slots);
+  if (pool) free(pool);
+}
+
+int BufRing::Init(uint32_t numSlots, uint32_t slotSize)
+{
+  uint32_t stride = (slotSize + BUFRING_ALIGN - 1) & ~(BUFRING_ALIGN - 1);
+  void *mem = NULL;
+
+  // Slot count must be a power of two so the free running indices can wrap
+  if (numSlots == 0 || (numSlots & (numSlots - 1)) != 0 || slotSize == 0) {
+    return EINVAL;
+  }
+
+  // Already set up with buffers large enough
+  if (pool != NULL && numSlots == count && slotSize <= size) {
+    Reset();
+    return 0;
+  }
+
+  if (slots) free(slots);
+  if (pool) free(pool);
+  slots = NULL;
+  pool = NULL;
+  count = 0;
+  size = 0;
+
+  slots = (CBuffer *)calloc(numSlots, sizeof(CBuffer));
+  if (slots == NULL || posix_memalign(&mem, BUFRING_ALIGN, (size_t)numSlots * stride) != 0) {
+    return ENOMEM;
+  }
+  pool = (unsigned char *)mem;
+
+  for (uint32_t i = 0; i < numSlots; i++) {
+    slots[i].data = pool + (size_t)i * stride;
+    slots[i].len = 0;
+  }
+  count = numSlots;
+  size = slotSize;
+  Reset();
+  return 0;
+}
+
+void BufRing::Reset(void)
+{
+  head = 0;
+  tail = 0;
+  closed = 0;
+  prodEvent = 0;
+  consEvent = 0;
+  prodWaiting = 0;
+  consWaiting = 0;
+}
+
+void BufRing::Close(void)
+{
+  closed = 1;
+  // Always bump the events so a side about to sleep sees the change
+  prodEvent++;
+  futex_wake(&prodEvent);
+  consEvent++;
+  futex_wake(&consEvent);
+}
+
+bool BufRing::IsClosed(void)
+{
+  return closed != 0;
+}
+
+uint32_t BufRing::SlotSize(void)
+{
+  return size;
+}
+
+void BufRing::Wait(std::atomic<uint32_t> *event, std::atomic<int> *waiting, bool bProducer)
+{
+  uint32_t val = *event;
+  *waiting = 1;
+  // Check again after announcing ourselves, the other side may have just moved
+  bool bReady = bProducer ? (head - tail < count) : (head != tail);
+  if (!bReady && !closed) {
+    futex_wait(event, val);
+  }
+  *waiting = 0;
+}
+
+void BufRing::Wake(std::atomic<uint32_t> *event, std::atomic<int> *waiting)
+{
+  if (waiting->exchange(0)) {
+    (*event)++;
+    futex_wake(event);
+  }
+}
+
+CBuffer *BufRing::GetFree(void)
+{
+  while (head - tail >= count) {
+    if (closed) return NULL;
+    Wait(&prodEvent, &prodWaiting, true);
+  }
+  if (closed) return NULL;
+  return &slots[head & (count - 1)];
+}
+
+void BufRing::Put(void)
+{
+  head++;
+  Wake(&consEvent, &consWaiting);
+}
+
+CBuffer *BufRing::GetFilled(void)
+{
+  while (head == tail) {
+    if (closed) return NULL;
+    Wait(&consEvent, &consWaiting, false);
+  }
+  if (closed) return NULL;
+  return &slots[tail & (count - 1)];
+}
+
+void BufRing::Release(void)
+{
+  tail++;
+  Wake(&prodEvent, &prodWaiting);
+}
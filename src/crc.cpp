@@ -1,4 +1,5 @@
 
+#include <string.h>
 #include "crc.h"
 
 /* CRC table for 16 bit CRC, with generator polynomial 0x8408,
@@ -40,12 +41,243 @@ const unsigned short crc_16_l_table[] = {
   0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
 };
 
-unsigned short CalcCRC16(unsigned char *buf, int length)
+/* Slice-by-4 for the 16 bit CRC, table[k] advances a byte through k more
+** zero bytes. The first two bytes of each step carry the CRC itself.
+*/
+typedef struct {
+  unsigned short table[4][256];
+} crc16_tables_t;
+
+static crc16_tables_t *CRC16Tables(void)
 {
-  unsigned short crc = CRC_16_L_SEED;
-  for (int i=0; i < length; i++) {
-    crc = CRC_16_L_STEP(crc, *buf++);
+  static crc16_tables_t tables;
+  for (int i = 0; i < 256; i++) {
+    tables.table[0][i] = crc_16_l_table[i];
   }
+  for (int k = 1; k < 4; k++) {
+    for (int i = 0; i < 256; i++) {
+      unsigned short crc = tables.table[k-1][i];
+      tables.table[k][i] = CRC_16_L_STEP(crc, 0);
+    }
+  }
+  return &tables;
+}
+
+unsigned short CRC16Update(unsigned short crc, const unsigned char *buf, size_t length)
+{
+  // Built once, function local statics are initialized thread safe
+  static const crc16_tables_t *t = CRC16Tables();
+
   crc ^= CRC_16_L_SEED;
+  while (length >= 4) {
+    crc ^= buf[0] | (buf[1] << 8);
+    crc = t->table[3][crc & 0xff] ^ t->table[2][crc >> 8] ^
+          t->table[1][buf[2]] ^ t->table[0][buf[3]];
+    buf += 4;
+    length -= 4;
+  }
+  while (length--) {
+    crc = CRC_16_L_STEP(crc, *buf++);
+  }
+  return crc ^ CRC_16_L_SEED;
+}
+
+unsigned short CalcCRC16(unsigned char *buf, int length)
+{
+  return CRC16Update(0, buf, length);
+}
+
+/* CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320). The tables for the
+** slice-by-8 loop are built on first use, table[0] is the classic bytewise
+** table and table[k] advances a byte through k more zero bytes.
+*/
+#define CRC_32_POLY           0xEDB88320
+#define CRC_32_SEED           0xFFFFFFFF
+
+static uint32_t crc_32_table[8][256];
+
+static void CRC32InitTables(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC_32_POLY : 0);
+    }
+    crc_32_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t crc = crc_32_table[k-1][i];
+      crc_32_table[k][i] = (crc >> 8) ^ crc_32_table[0][crc & 0xff];
+    }
+  }
+}
+
+static uint32_t CRC32Slice8(uint32_t crc, const unsigned char *buf, size_t length)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  // Eight bytes per step, two independent 32 bit lookups chains
+  while (length >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, buf, 4);
+    memcpy(&hi, buf + 4, 4);
+    lo ^= crc;
+    crc = crc_32_table[7][lo & 0xff] ^ crc_32_table[6][(lo >> 8) & 0xff] ^
+          crc_32_table[5][(lo >> 16) & 0xff] ^ crc_32_table[4][lo >> 24] ^
+          crc_32_table[3][hi & 0xff] ^ crc_32_table[2][(hi >> 8) & 0xff] ^
+          crc_32_table[1][(hi >> 16) & 0xff] ^ crc_32_table[0][hi >> 24];
+    buf += 8;
+    length -= 8;
+  }
+#endif
+  while (length--) {
+    crc = (crc >> 8) ^ crc_32_table[0][(crc ^ *buf++) & 0xff];
+  }
   return crc;
-}
\ No newline at end of file
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+/* Carry-less multiply folding, 4x128 bits per step then down to 32 bits with
+** a Barrett reduction. Constants are x^n mod P for the bit reflected poly.
+*/
+__attribute__((target("pclmul")))
+static uint32_t CRC32Pclmul(uint32_t crc, const unsigned char *buf, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+  const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+  const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+  __m128i x1, x2, x3, x4, t;
+
+  if (length < 64) {
+    return CRC32Slice8(crc, buf, length);
+  }
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf), _mm_cvtsi32_si128(crc));
+  x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+  x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+  x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+  buf += 64;
+  length -= 64;
+
+#define CRC_32_FOLD(x, k, next) \
+  t = _mm_clmulepi64_si128(x, k, 0x11); \
+  x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), t), next)
+
+  while (length >= 64) {
+    CRC_32_FOLD(x1, k1k2, _mm_loadu_si128((const __m128i *)buf));
+    CRC_32_FOLD(x2, k1k2, _mm_loadu_si128((const __m128i *)(buf + 16)));
+    CRC_32_FOLD(x3, k1k2, _mm_loadu_si128((const __m128i *)(buf + 32)));
+    CRC_32_FOLD(x4, k1k2, _mm_loadu_si128((const __m128i *)(buf + 48)));
+    buf += 64;
+    length -= 64;
+  }
+
+  // Fold the four lanes into one, then any remaining whole 16 byte blocks
+  CRC_32_FOLD(x1, k3k4, x2);
+  CRC_32_FOLD(x1, k3k4, x3);
+  CRC_32_FOLD(x1, k3k4, x4);
+  while (length >= 16) {
+    CRC_32_FOLD(x1, k3k4, _mm_loadu_si128((const __m128i *)buf));
+    buf += 16;
+    length -= 16;
+  }
+#undef CRC_32_FOLD
+
+  // 128 -> 64 bits
+  t = _mm_clmulepi64_si128(k3k4, x1, 0x01);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+  // 64 -> 32 bits
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), t);
+  // Barrett reduction
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, t);
+  crc = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+  return CRC32Slice8(crc, buf, length);
+}
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+
+/* ARMv8 CRC32 instructions implement the same IEEE polynomial directly */
+static uint32_t CRC32Armv8(uint32_t crc, const unsigned char *buf, size_t length)
+{
+  while (length >= 8) {
+    uint64_t data;
+    memcpy(&data, buf, 8);
+    crc = __crc32d(crc, data);
+    buf += 8;
+    length -= 8;
+  }
+  while (length--) {
+    crc = __crc32b(crc, *buf++);
+  }
+  return crc;
+}
+#pragma GCC pop_options
+#endif
+
+typedef uint32_t (*crc32_func)(uint32_t crc, const unsigned char *buf, size_t length);
+
+static const char *crc_32_engine = "slice-by-8";
+
+static crc32_func CRC32Select(void)
+{
+  CRC32InitTables();
+#if defined(__GNUC__) && defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL)) {
+    crc_32_engine = "pclmulqdq";
+    return CRC32Pclmul;
+  }
+#endif
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    crc_32_engine = "armv8-crc32";
+    return CRC32Armv8;
+  }
+#endif
+  return CRC32Slice8;
+}
+
+static crc32_func CRC32Impl(void)
+{
+  // Resolved once, function local statics are initialized thread safe
+  static crc32_func impl = CRC32Select();
+  return impl;
+}
+
+uint32_t CRC32Update(uint32_t crc, const unsigned char *buf, size_t length)
+{
+  return CRC32Impl()(crc ^ CRC_32_SEED, buf, length) ^ CRC_32_SEED;
+}
+
+uint32_t CRC32UpdateTable(uint32_t crc, const unsigned char *buf, size_t length)
+{
+  CRC32Impl();
+  return CRC32Slice8(crc ^ CRC_32_SEED, buf, length) ^ CRC_32_SEED;
+}
+
+uint32_t CalcCRC32(const unsigned char *buf, size_t length)
+{
+  return CRC32Update(0, buf, length);
+}
+
+const char *CRC32Engine(void)
+{
+  CRC32Impl();
+  return crc_32_engine;
+}
@@ -0,0 +1,199 @@
+/*****************************************************************************
+ * digestcache.cpp
+ *
+ * This class implements the on-disk cache of image digests and chunk maps
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "digestcache.h"
+#include "sha256.h"
+#include "crc.h"
+
+#define NANO 1000000000ULL
+
+DigestCache g_digestcache;
+
+// Per user cache directory, $XDG_CACHE_HOME/emmcdl or ~/.cache/emmcdl
+DigestCache::DigestCache()
+{
+  const char *base = getenv("XDG_CACHE_HOME");
+
+  szCacheDir[0] = '\0';
+  if (base != NULL && base[0] != '\0') {
+    snprintf(szCacheDir, sizeof(szCacheDir), "%s/emmcdl", base);
+  }
+  else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+    snprintf(szCacheDir, sizeof(szCacheDir), "%s/.cache/emmcdl", base);
+  }
+}
+
+// NULL or an empty string turns the cache off
+void DigestCache::SetDir(const char *szDir)
+{
+  if (szDir == NULL) {
+    szCacheDir[0] = '\0';
+  }
+  else {
+    snprintf(szCacheDir, sizeof(szCacheDir), "%s", szDir);
+  }
+}
+
+const char *DigestCache::GetDir(void)
+{
+  return szCacheDir;
+}
+
+// Create every missing component, another process may be doing the same
+int DigestCache::MakeDir(void)
+{
+  char path[DIGEST_CACHE_PATH];
+
+  snprintf(path, sizeof(path), "%s", szCacheDir);
+  for (char *p = path + 1; ; p++) {
+    if (*p == '/' || *p == '\0') {
+      char c = *p;
+      *p = '\0';
+      if (emmcdl_mkdir(path, 0755) != 0 && errno != EEXIST) {
+        return errno;
+      }
+      *p = c;
+      if (c == '\0') {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Fill in the identity of the open image and name the record after it
+int DigestCache::RecordPath(int hFile, const char *szFile, digest_cache_hdr_t *hdr, char *szPath)
+{
+  struct stat st;
+  char key[DIGEST_CACHE_PATH + 128];
+  unsigned char digest[SHA256_DIGEST_LEN];
+  sha256_ctx sha;
+
+  if (szCacheDir[0] == '\0') {
+    return ENOENT;
+  }
+  if (fstat(hFile, &st) != 0) {
+    return errno;
+  }
+  hdr->magic = DIGEST_CACHE_MAGIC;
+  hdr->version = DIGEST_CACHE_VERSION;
+  hdr->dev = st.st_dev;
+  hdr->ino = st.st_ino;
+  hdr->fileSize = st.st_size;
+#ifdef _WIN32
+  hdr->mtimeNs = (int64_t)st.st_mtime * NANO;
+#else
+  hdr->mtimeNs = (int64_t)st.st_mtim.tv_sec * NANO + st.st_mtim.tv_nsec;
+#endif
+
+  int len = snprintf(key, sizeof(key), "%s|%lu|%lu|%lu|%li|%u|%u|%lu|%lu", szFile, hdr->dev, hdr->ino, hdr->fileSize,
+                     hdr->mtimeNs, hdr->kind, hdr->unit, hdr->offset, hdr->len);
+  SHA256Init(&sha);
+  SHA256Update(&sha, (unsigned char *)key, len);
+  SHA256Final(&sha, digest);
+
+  len = snprintf(szPath, DIGEST_CACHE_PATH, "%s/", szCacheDir);
+  for (int i=0; i < 16 && len < DIGEST_CACHE_PATH - 8; i++) {
+    len += sprintf(szPath + len, "%02x", digest[i]);
+  }
+  strcat(szPath, ".dc");
+  return 0;
+}
+
+// Returns 0 with a malloc'd copy of the record, ENOENT if there is no valid one
+int DigestCache::Load(int hFile, const char *szFile, uint32_t kind, uint32_t unit, uint64_t offset, uint64_t len,
+                      unsigned char **data, uint32_t *size)
+{
+  digest_cache_hdr_t want, hdr;
+  char szPath[DIGEST_CACHE_PATH];
+  int status;
+
+  memset(&want, 0, sizeof(want));
+  want.kind = kind;
+  want.unit = unit;
+  want.offset = offset;
+  want.len = len;
+  status = RecordPath(hFile, szFile, &want, szPath);
+  if (status != 0) {
+    return status;
+  }
+
+  int fd = emmcdl_open(szPath, O_RDONLY);
+  if (fd < 0) {
+    return ENOENT;
+  }
+  status = ENOENT;
+  if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+    uint32_t crc = hdr.crc;
+    hdr.crc = want.crc = 0;
+    want.size = hdr.size;
+    if (memcmp(&hdr, &want, sizeof(hdr)) == 0 && hdr.size <= DIGEST_CACHE_MAX_SIZE) {
+      unsigned char *buf = (unsigned char *)malloc(hdr.size ? hdr.size : 1);
+      if (buf != NULL && pread(fd, buf, hdr.size, sizeof(hdr)) == (ssize_t)hdr.size && CalcCRC32(buf, hdr.size) == crc) {
+        *data = buf;
+        *size = hdr.size;
+        status = 0;
+      }
+      else {
+        free(buf);
+      }
+    }
+  }
+  emmcdl_close(fd);
+  return status;
+}
+
+int DigestCache::Store(int hFile, const char *szFile, uint32_t kind, uint32_t unit, uint64_t offset, uint64_t len,
+                       const unsigned char *data, uint32_t size)
+{
+  digest_cache_hdr_t hdr;
+  char szPath[DIGEST_CACHE_PATH];
+  char szTemp[DIGEST_CACHE_PATH + 32];
+  int status;
+
+  if (size > DIGEST_CACHE_MAX_SIZE) {
+    return EINVAL;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.kind = kind;
+  hdr.unit = unit;
+  hdr.offset = offset;
+  hdr.len = len;
+  status = RecordPath(hFile, szFile, &hdr, szPath);
+  if (status == 0) {
+    status = MakeDir();
+  }
+  if (status != 0) {
+    return status;
+  }
+  hdr.size = size;
+  hdr.crc = CalcCRC32(data, size);
+
+  // Readers only ever see a complete record, rename replaces it in one step
+  snprintf(szTemp, sizeof(szTemp), "%s.%d.tmp", szPath, (int)getpid());
+  int fd = emmcdl_open_mode(szTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return errno;
+  }
+  if (emmcdl_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || emmcdl_write(fd, data, size) != (int)size) {
+    status = EIO;
+  }
+  emmcdl_close(fd);
+  if (status == 0 && rename(szTemp, szPath) != 0) {
+    status = errno;
+  }
+  if (status != 0) {
+    emmcdl_unlink(szTemp);
+  }
+  return status;
+}
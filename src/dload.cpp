@@ -20,10 +20,21 @@ when       who     what, where, why
 11/08/11   pgw     Initial version.
 =============================================================================*/
 
+#include <stdlib.h>
 #include "dload.h"
 #include "partition.h"
 #include "diskwriter.h"
 #define ERROR_WRITE_FAULT -19
+
+// One stream write in flight, identified on the wire by the address it carries
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  uint32_t seq;       // Order it last went out in, a later packet answered first means it was lost
+  uint32_t retries;
+  bool bAcked;
+  unsigned char *pkt;
+} dload_slot_t;
 //using namespace std;
 
 void Dload::HexToByte(const char *hex, unsigned char *bin, int len)
@@ -41,9 +52,33 @@ Dload::Dload(SerialPort *port)
 {
   // Initialize the serial port
   bSectorAddress = false;
+  blockSize = DLOAD_BLOCK_SIZE;
+  windowSize = 1;
   sport = port;
 }
 
+void Dload::ParseHelloResponse(unsigned char *rsp, int rspSize)
+{
+  // Older programmers may stop short of any of these fields, keep the defaults then
+  blockSize = DLOAD_BLOCK_SIZE;
+  windowSize = 1;
+  if( rspSize >= 39 ) {
+    uint32_t size = rsp[35] | (rsp[36] << 8) | (rsp[37] << 16) | ((uint32_t)rsp[38] << 24);
+    size &= ~(SECTOR_SIZE - 1);
+    if( size > DLOAD_MAX_BLOCK ) size = DLOAD_MAX_BLOCK;
+    if( size >= SECTOR_SIZE ) blockSize = size;
+  }
+  // Window size follows the variable length flash id
+  if( rspSize >= 44 ) {
+    int pos = 44 + rsp[43];
+    if( rspSize >= pos + 2 ) {
+      uint32_t window = rsp[pos] | (rsp[pos+1] << 8);
+      if( window > DLOAD_MAX_WINDOW ) window = DLOAD_MAX_WINDOW;
+      if( window > 0 ) windowSize = window;
+    }
+  }
+}
+
 int Dload::ConnectToFlashProg(unsigned char ver)
 {
   unsigned char hello[] = {EHOST_HELLO_REQ,'Q','C','O','M',' ','f','a','s','t',' ','d','o','w','n','l','o','a','d',' ','p','r','o','t','o','c','o','l',' ','h','o','s','t',ver,2,1};
@@ -77,7 +112,8 @@ int Dload::ConnectToFlashProg(unsigned char ver)
   }
 
 
-  printf("Got hello response\n");
+  ParseHelloResponse(rsp,rspSize);
+  printf("Got hello response, block size %u window %u\n",blockSize,windowSize);
   for(; i < 10; i++) { 
     rspSize = sizeof(rsp);
     sport->SendSync(security,sizeof(security),rsp,&rspSize);
@@ -172,61 +208,145 @@ int Dload::ClosePartition()
 
 int Dload::FastCopySerial(int hInFile, uint32_t offset, uint32_t sectors)
 {
-  int status = 0;
-  unsigned char rsp[32];
-  uint32_t bytesRead=0;
+  dload_slot_t slots[DLOAD_MAX_WINDOW];
+  unsigned char rsp[1060];
+  unsigned char *buf;
+  uint32_t start = offset;
   uint32_t count = 0;
-  uint32_t readSize = 1024;
+  uint32_t head = 0;
+  uint32_t pending = 0;
+  uint32_t seq = 0;
+  uint64_t written = 0;
+  uint64_t lastPrint = 0;
+  bool bEnd = false;
   int rspSize;
-  unsigned char streamwrite[1050] = {EHOST_STREAM_WRITE_REQ,0};
+  int status = 0;
 
-  // For now don't worry about sliding window do a write and wait for response
-  while( (status == 0) && (count < sectors)) {
-    if( (count + 2) > sectors) {
-      readSize = 512;
+  buf = (unsigned char *)malloc(windowSize * (blockSize + 5));
+  if( buf == NULL ) {
+    return ENOMEM;
+  }
+  for(uint32_t i=0; i < windowSize; i++) {
+    slots[i].pkt = buf + i * (blockSize + 5);
+  }
+
+  // Keep up to a window of packets outstanding, the target answers each one with
+  // the address it wrote so responses are matched as they come back
+  while( status == 0 ) {
+    while( (pending < windowSize) && !bEnd && (count < sectors) ) {
+      dload_slot_t *slot = &slots[(head + pending) % windowSize];
+      uint32_t readSize = blockSize;
+      int bytesRead;
+      if( (sectors - count) < blockSize/SECTOR_SIZE ) {
+        readSize = (sectors - count) * SECTOR_SIZE;
+      }
+      // If int value is invalid then just write 0's
+      if( hInFile != -1 ) {
+        bytesRead = emmcdl_read(hInFile,&slot->pkt[5],readSize);
+        if( bytesRead < 0 ) {
+          status = errno;
+          break;
+        }
+      } else {
+        memset(&slot->pkt[5],0,readSize);
+        bytesRead = readSize;
+      }
+      // If we didn't read anything then we are done once the window drains
+      if( bytesRead == 0 ) {
+        bEnd = true;
+        break;
+      }
+
+      count += (bytesRead/SECTOR_SIZE);
+      slot->pkt[0] = EHOST_STREAM_WRITE_REQ;
+      slot->pkt[1] = offset & 0xff;
+      slot->pkt[2] = (offset >> 8) & 0xff;
+      slot->pkt[3] = (offset >> 16) & 0xff;
+      slot->pkt[4] = (offset >> 24) & 0xff;
+      slot->addr = offset;
+      slot->len = bytesRead + 5;
+      slot->seq = seq++;
+      slot->retries = 0;
+      slot->bAcked = false;
+      if( bSectorAddress ) {
+        offset += bytesRead/SECTOR_SIZE;
+      } else {
+        offset += bytesRead;
+      }
+      pending++;
+      status = sport->SendPacket(slot->pkt,slot->len);
     }
-    // If int value is invalid then just write 0's
-    if( hInFile != -1 ) {
-      if((bytesRead = emmcdl_read(hInFile,&streamwrite[5],readSize)) < 0 ) {
-        status = errno;
+    if( (status != 0) || (pending == 0) ) {
+      break;
+    }
+
+    dload_slot_t *lost = NULL;
+    rspSize = sizeof(rsp);
+    int rspStatus = sport->ReadPacket(rsp,&rspSize);
+    if( rspStatus == EBADF ) {
+      // The port is gone, there is nothing left to resend on
+      printf("Lost the port with %u packets unanswered\n",pending);
+      status = EIO;
+      break;
+    } else if( (rspStatus != 0) || (rspSize == 0) ) {
+      // Nothing came back in time, send the oldest packet again
+      lost = &slots[head];
+    } else if( (rsp[0] == EHOST_STREAM_WRITE_RSP) && (rspSize >= 5) ) {
+      uint32_t addr = rsp[1] | (rsp[2] << 8) | (rsp[3] << 16) | ((uint32_t)rsp[4] << 24);
+      dload_slot_t *acked = NULL;
+      for(uint32_t i=0; i < pending; i++) {
+        dload_slot_t *slot = &slots[(head + i) % windowSize];
+        if( !slot->bAcked && (slot->addr == addr) ) {
+          slot->bAcked = true;
+          acked = slot;
+          break;
+        }
+      }
+      // The target answers in order, anything sent before this one and still
+      // unanswered was lost. An address we don't have out is a resend answered twice.
+      for(uint32_t i=0; (acked != NULL) && (i < pending); i++) {
+        dload_slot_t *slot = &slots[(head + i) % windowSize];
+        if( !slot->bAcked && (slot->seq < acked->seq) ) {
+          lost = slot;
+          break;
+        }
       }
+    } else if( (rsp[0] == EHOST_LOG) && (rspSize >= 2) ) {
+      rsp[rspSize-2] = 0;
+      printf("%s", &rsp[1]);
     } else {
-      memset(&streamwrite[5],0,readSize);
-	  bytesRead = readSize;
+      printf("Device returned error: %i\n",rsp[0]);
+      lost = &slots[head];
     }
 
-    count += (bytesRead/512);
-    if( bytesRead > 0 ) {
-      // Write out the bytes we read to destination
-      streamwrite[1] = offset & 0xff;
-      streamwrite[2] = (offset >> 8) & 0xff;
-      streamwrite[3] = (offset >> 16) & 0xff;
-      streamwrite[4] = (offset >> 24) & 0xff;
-      rspSize = sizeof(rsp);
-
-      sport->SendSync(streamwrite,bytesRead+5,rsp,&rspSize);
-      if( (rspSize == 0) || (rsp[0] != EHOST_STREAM_WRITE_RSP) ) {
-        printf("Device returned error: %i\n",rsp[0]);
-        if( rsp[0] == EHOST_LOG && rspSize >= 2) {
-          rsp[rspSize-2] = 0;
-          printf("%s", &rsp[1]);
-        }
+    if( lost != NULL ) {
+      if( ++lost->retries > DLOAD_MAX_RETRY ) {
+        printf("Write to 0x%x failed after %i retries\n",lost->addr,DLOAD_MAX_RETRY);
         status = ERROR_WRITE_FAULT;
+        break;
       }
+      lost->seq = seq++;
+      status = sport->SendPacket(lost->pkt,lost->len);
+    }
+
+    // Retire the packets answered at the front of the window
+    while( (pending > 0) && slots[head].bAcked ) {
+      written += slots[head].len - 5;
+      head = (head + 1) % windowSize;
+      pending--;
+    }
+    if( (written - lastPrint) >= 1024*1024 ) {
+      lastPrint = written;
       if( bSectorAddress ) {
-        offset += bytesRead/SECTOR_SIZE;
-        printf("Destination sector: %i\r",(int)offset);
+        printf("Destination sector: %i\r",(int)(start + written/SECTOR_SIZE));
       } else {
-        offset += bytesRead;
-        printf("Destination offset: %i\r",(int)offset);
+        printf("Destination offset: %i\r",(int)(start + written));
       }
-    } else {
-      // If we didn't read anything then break
-      break;
     }
   }
 
   printf("\n");
+  free(buf);
 
   // If we hit end of file that means we sent it all
   return status;
@@ -33,6 +33,7 @@ when       who     what, where, why
 #include "serialport.h"
 #include "firehose.h"
 #include "ffu.h"
+#include "digestcache.h"
 #include "sysdeps.h"
 #include <ctype.h>
 
@@ -40,6 +41,8 @@ using namespace std;
 #define CLASS_DLOAD  0
 #define CLASS_SAHARA 1
 
+#define MAX_XML_FILES 8
+
 // **CORRECTED: Enhanced Configuration for Snapdragon 750G**
 static int m_protocol = FIREHOSE_PROTOCOL;
 static int m_class = CLASS_SAHARA;
@@ -47,6 +50,14 @@ static int m_sector_size = 512;
 static bool m_emergency = false;
 static bool m_verbose = false;
 static bool m_sparse_mode = false;  // NEW: Sparse image support
+static bool m_zero_scan = false;
+static bool m_delta = false;
+static char *m_plan_file = NULL;
+static int m_readahead_mb = -1;
+static int m_patch_batch = FH_PATCH_BATCH;
+static bool m_host_patch = false;
+static bool m_verify = false;
+static sahara_dump_t m_dump = { NULL, NULL, SAHARA_DUMP_READ_SIZE, SAHARA_DUMP_DEPTH };
 static SerialPort m_port;
 
 // **CORRECTED: UFS Configuration for Redmi Note 9 Pro 5G**
@@ -91,12 +102,30 @@ int PrintHelp()
   printf("       -l                               List available mass storage devices\n");
   printf("       -info                            List HW information about device attached to COM (eg -p COM8 -info)\n");
   printf("       -MaxPayloadSizeToTargetInBytes   The max bytes in firehose mode (DDR or large IMEM use 16384, default=16MB)\n");
+  printf("       -Metrics <file.json>             Write transfer latency histograms and a JSON summary at the end of the run\n");
+  printf("       -MetricsInterval <sec>           Print transfer rates as one JSON line on stderr every <sec> seconds\n");
+  printf("       -HostPatch                       Apply DISK patches to the GPT images on the host before sending them\n");
+  printf("       -PatchBatch <num>                Patches sent per firehose command (1 = one at a time, default=%i)\n", FH_PATCH_BATCH);
+  printf("       -Verify                          Check each programmed range against its SHA-256 digest on the target\n");
+  printf("       -UsbQueueDepth <num>             Bulk transfers kept in flight per direction (1 = synchronous, default=%i)\n", USB_DEFAULT_QUEUE_DEPTH);
   printf("       -SkipWrite                       Do not write actual data to disk (use this for UFS provisioning)\n");
   printf("       -SkipStorageInit                 Do not initialize storage device (use this for UFS provisioning)\n");
   printf("       -MemoryName <ufs/emmc>           Memory type default to UFS for Redmi Note 9 Pro 5G\n");
   printf("       -SetActivePartition <num>        Set the specified partition active for booting\n");
   printf("       -disk_sector_size <int>          Dump from start sector to end sector to file\n");
   printf("       -sparse                          Enable sparse image support for Android images\n");
+  printf("       -ZeroScan                        Erase runs of zeros in raw images on the target instead of sending them\n");
+  printf("                                        (the same <erase> ZERO entries and sparse zero fills use)\n");
+  printf("       -Delta                           Only program the parts of raw images that differ from what is on the target\n");
+  printf("       -Plan <file.json>                Write the compiled rawprogram and patch plan before downloading\n");
+  printf("       -DigestCache <dir|none>          Where image digests are kept between runs (default ~/.cache/emmcdl)\n");
+  printf("       -ReadAhead <MB>                  Images hinted to the page cache ahead of the one sent (0 = off, default=%i)\n",
+         READAHEAD_DEFAULT / (1024*1024));
+  printf("       -MemDump <dir>                   Collect the RAM dump of a crashed target in memory debug mode, one file per region\n");
+  printf("       -MemRegions <name,...>           Only dump regions with these file names or descriptions\n");
+  printf("       -MemReadSize <KB>                Memory asked for per read request (default=%i)\n", SAHARA_DUMP_READ_SIZE / 1024);
+  printf("       -MemReadDepth <num>              Read requests kept outstanding (default=%i)\n", SAHARA_DUMP_DEPTH);
+  printf("                                        (more than 1 needs a target that queues MEMORY_READ requests)\n");
   printf("       -xiaomi_mode                     Enable Xiaomi device compatibility mode\n");
   printf("       -d <start> <end>                 Dump from start sector to end sector to file\n");
   printf("       -d <PartName>                    Dump entire partition based on partition name\n");
@@ -180,8 +209,8 @@ int DetectXiaomiDevice() {
     
     // Enhanced detection for Xiaomi devices in EDL mode
     Sahara sh(&m_port);
-    if (!sh.CheckDevice()) {
-        status = 0;
+    status = sh.CheckDevice();
+    if (status == 0) {
         m_class = CLASS_SAHARA;
         m_protocol = FIREHOSE_PROTOCOL;
         
@@ -190,7 +219,8 @@ int DetectXiaomiDevice() {
             printf("Vendor ID: 0x%04x (Qualcomm EDL), Product ID: 0x%04x\n", 
                    QUALCOMM_VENDOR_ID, EDL_PRODUCT_ID);
         }
-    } else {
+    } else if (status != EPROTO) {
+        // Silent target, DLOAD only talks when spoken to
         Dload dl(&m_port);
         status = dl.IsDeviceInDload();
         if (status != 0) return status;
@@ -205,11 +235,12 @@ int DetectDeviceClass()
   int status = -1;
   // This is PBL so depends on the chip type
   Sahara sh(&m_port);
-  if (!sh.CheckDevice()) {
-    status = 0;
+  status = sh.CheckDevice();
+  if (status == 0) {
     m_class = CLASS_SAHARA;
     m_protocol = FIREHOSE_PROTOCOL;
-  } else {
+  } else if (status != EPROTO) {
+    // Silent target, DLOAD only talks when spoken to
     Dload dl(&m_port);
     status = dl.IsDeviceInDload();
     if( status != 0 ) return status;
@@ -255,6 +286,13 @@ int LoadFlashProg(char *mprgFile)
   return status;
 }
 
+int MemoryDump(void)
+{
+  Sahara sh(&m_port);
+  printf("Collecting memory dump to %s\n", m_dump.szDir);
+  return sh.MemoryDump(&m_dump);
+}
+
 int EraseDisk(__uint64_t start, __uint64_t num, int dnum, char *szPartName)
 {
   int status = 0;
@@ -269,7 +307,7 @@ int EraseDisk(__uint64_t start, __uint64_t num, int dnum, char *szPartName)
 	  status = fh.ConnectToFlashProg(&m_cfg);
 	  if (status != 0) return status;
 	  printf("Connected to UFS flash programmer, starting erase (Optimized for Gauguin)\n");
-	  fh.WipeDiskContents(start, num, szPartName);
+	  status = fh.WipeDiskContents(start, num, szPartName);
   } else {
     DiskWriter dw;
     // Initialize and print disk list
@@ -519,6 +557,34 @@ int FFURawProgram(char *szFFUFile, char *szOutputFile)
   return status;
 }
 
+// Compiled plans of all rawprogram and patch files as one JSON array
+static int WritePlanFile(const char *szFile, Partition **rawprg, Partition **patch, int count)
+{
+  FILE *fp = fopen(szFile, "w");
+  int status = 0;
+  int n = 0;
+
+  if (fp == NULL) {
+    printf("Failed to write plan to %s\n", szFile);
+    return errno;
+  }
+  fprintf(fp, "[");
+  for (int i = 0; i < count && status == 0; i++) {
+    Partition *plans[2] = { rawprg[i], patch[i] };
+    for (int p = 0; p < 2 && status == 0; p++) {
+      if (plans[p] != NULL) {
+        fprintf(fp, "%s\n", n++ ? "," : "");
+        status = plans[p]->WritePlanJSON(fp);
+      }
+    }
+  }
+  fprintf(fp, "\n]\n");
+  if (fclose(fp) != 0 && status == 0) {
+    status = errno;
+  }
+  return status;
+}
+
 // **CORRECTED: Enhanced Programming with Sparse Support for UFS**
 int EDownloadProgram(char *szSingleImage, char **szXMLFile, char **szimgDir)
 {
@@ -571,15 +637,25 @@ int EDownloadProgram(char *szSingleImage, char **szXMLFile, char **szimgDir)
       dl.ClosePartition();
     } else if(m_protocol == FIREHOSE_PROTOCOL) {
       fh.SetDiskSectorSize(m_sector_size);
+      fh.SetPatchBatch(m_patch_batch);
+      if(m_verify) fh.EnableVerify();
       if(m_verbose) fh.EnableVerbose();
       status = fh.ConnectToFlashProg(&m_cfg);
       if( status != 0 ) return status;
       printf("use FIREHOSE_PROTOCOL Connected to UFS flash programmer (Snapdragon 750G Optimized)\n");
 
-      // Download all XML files to device
-      for (int i = 0; szXMLFile[i] != NULL; i++) {
-        Partition rawprg(0);
-        if (m_verbose) rawprg.EnableVerbose();
+      // Compile every rawprogram and patch file before the first transfer so a broken
+      // XML or a missing image stops the download before anything is written
+      Partition *rawprg[MAX_XML_FILES] = {NULL};
+      Partition *patch[MAX_XML_FILES] = {NULL};
+      int count = 0;
+      for (; status == 0 && count < MAX_XML_FILES && szXMLFile[count] != NULL; count++) {
+        int i = count;
+        rawprg[i] = new Partition(0);
+        if (m_verbose) rawprg[i]->EnableVerbose();
+        if (m_zero_scan) rawprg[i]->EnableZeroScan();
+        if (m_delta) rawprg[i]->EnableDelta();
+        if (m_readahead_mb >= 0) rawprg[i]->SetReadAhead((__uint64_t)m_readahead_mb * 1024 * 1024);
         
         // **CORRECTED: Enhanced partition loading with sparse support for UFS**
         if (m_sparse_mode) {
@@ -587,29 +663,66 @@ int EDownloadProgram(char *szSingleImage, char **szXMLFile, char **szimgDir)
             // Note: rawprg.EnableSparseMode() would need to be implemented in partition.cpp
         }
         
-        status = rawprg.PreLoadImage(szXMLFile[i], szimgDir[i]);
-        if (status != 0) return status;
-        
-        // Optimize memory for this UFS partition
-        __uint64_t partition_size = rawprg.GetPartitionSize();
-        OptimizeMemoryForLargePartitions(partition_size);
-        
-        status = rawprg.ProgramImage(&fh);
+        status = rawprg[i]->PreLoadImage(szXMLFile[i], szimgDir[i]);
+        if (status != 0) break;
 
         // Only try to do patch if filename has rawprogram in it
         char *sptr = strstr(szXMLFile[i], "rawprogram");
-        if (sptr != NULL && status == 0) {
-          Partition patch(0);
-          if (m_verbose) patch.EnableVerbose();
-          int pstatus = 0;
-          // Check if patch file exist
-          char szPatchFile[MAX_STRING_LEN];
+        char szPatchFile[MAX_STRING_LEN];
+        bool bHostPatch = false;
+        if (sptr != NULL) {
           strncpy(szPatchFile, szXMLFile[i], sizeof(szPatchFile));
           const XMLParser xmlParser;
           xmlParser.StringReplace(szPatchFile, "rawprogram", "patch");
-          pstatus = patch.PreLoadImage(szPatchFile);
-          if( pstatus == 0 ) patch.ProgramImage(&fh);
         }
+        if (sptr != NULL && m_host_patch) {
+          bHostPatch = (rawprg[i]->LoadHostPatches(&fh, szPatchFile) == 0);
+          if (!bHostPatch) {
+            printf("Host patching not possible for %s, patching on the target\n", szPatchFile);
+          }
+        }
+
+        status = rawprg[i]->CompilePlan();
+        if (status != 0) {
+          printf("Failed to resolve %s\n", szXMLFile[i]);
+          break;
+        }
+
+        // Optimize memory for this UFS partition
+        __uint64_t partition_size = rawprg[i]->GetPartitionSize();
+        OptimizeMemoryForLargePartitions(partition_size);
+
+        if (sptr != NULL && !bHostPatch) {
+          patch[i] = new Partition(0);
+          if (m_verbose) patch[i]->EnableVerbose();
+          // Check if patch file exist
+          if (patch[i]->PreLoadImage(szPatchFile) == 0) {
+            status = patch[i]->CompilePlan();
+          }
+          else {
+            delete patch[i];
+            patch[i] = NULL;
+          }
+        }
+      }
+
+      if (status == 0 && m_plan_file != NULL) {
+        status = WritePlanFile(m_plan_file, rawprg, patch, count);
+      }
+
+      // Download all XML files to device
+      for (int i = 0; status == 0 && i < count; i++) {
+        status = rawprg[i]->ProgramImage(&fh);
+        if (status == 0 && patch[i] != NULL) {
+          patch[i]->ProgramImage(&fh);
+        }
+      }
+      for (int i = 0; i < MAX_XML_FILES; i++) {
+        delete rawprg[i];
+        delete patch[i];
+      }
+      if (status != 0) {
+        return status;
       }
 
       // If we want to set active partition then do that here
@@ -738,8 +851,8 @@ int main(int argc, char * argv[])
   int dnum = -1;
   int status = 0;
   char *szOutputFile = NULL;
-  char *szXMLFile[8] = {NULL};
-  char *szimgDir[8] = {NULL};
+  char *szXMLFile[MAX_XML_FILES] = {NULL};
+  char *szimgDir[MAX_XML_FILES] = {NULL};
   char **szSerialData = {NULL};
   uint32_t dwXMLCount = 0;
   char *szFFUImage = NULL;
@@ -753,6 +866,8 @@ int main(int argc, char * argv[])
   uint32_t dwGPP1=0,dwGPP2=0,dwGPP3=0,dwGPP4=0;
   bool bGppQuiet = false;
   bool xiaomi_mode = false;  // Xiaomi compatibility mode
+  char *szMetricsFile = NULL;
+  uint32_t dwMetricsInterval = 0;
 
   // Print out the version first thing so we know this
   printf("Version %i.%i - Redmi Note 9 Pro 5G (Gauguin) UFS Compatible\n", VERSION_MAJOR, VERSION_MINOR);
@@ -792,6 +907,79 @@ int main(int argc, char * argv[])
       printf("Sparse image mode enabled for UFS\n");
     }
     
+    if (strcasecmp(argv[i], "-ZeroScan") == 0) {
+      m_zero_scan = true;
+    }
+
+    if (strcasecmp(argv[i], "-Delta") == 0) {
+      m_delta = true;
+    }
+
+    if (strcasecmp(argv[i], "-Plan") == 0) {
+      if ((i + 1) < argc) {
+        m_plan_file = argv[++i];
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-ReadAhead") == 0) {
+      if ((i + 1) < argc) {
+        m_readahead_mb = atoi(argv[++i]);
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-DigestCache") == 0) {
+      if ((i + 1) < argc) {
+        i++;
+        g_digestcache.SetDir((strcasecmp(argv[i], "none") == 0) ? NULL : argv[i]);
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-MemDump") == 0) {
+      if ((i + 1) < argc) {
+        cmd = EMMC_CMD_MEMDUMP;
+        m_dump.szDir = argv[++i];
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-MemRegions") == 0) {
+      if ((i + 1) < argc) {
+        m_dump.szRegions = argv[++i];
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-MemReadSize") == 0) {
+      if ((i + 1) < argc) {
+        m_dump.readSize = atoi(argv[++i]) * 1024;
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-MemReadDepth") == 0) {
+      if ((i + 1) < argc) {
+        m_dump.depth = atoi(argv[++i]);
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
     // **CORRECTED: Xiaomi compatibility mode with proper vendor ID**
     if (strcasecmp(argv[i], "-xiaomi_mode") == 0) {
       xiaomi_mode = true;
@@ -967,6 +1155,50 @@ int main(int argc, char * argv[])
       }
     }
 
+    if (strcasecmp(argv[i], "-HostPatch") == 0) {
+      m_host_patch = true;
+    }
+
+    if (strcasecmp(argv[i], "-Verify") == 0) {
+      m_verify = true;
+    }
+
+    if (strcasecmp(argv[i], "-PatchBatch") == 0) {
+      if ((i + 1) < argc) {
+        m_patch_batch = atoi(argv[++i]);
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-UsbQueueDepth") == 0) {
+      if ((i + 1) < argc) {
+        m_port.SetQueueDepth(atoi(argv[++i]));
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-Metrics") == 0) {
+      if ((i + 1) < argc) {
+        szMetricsFile = argv[++i];
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
+    if (strcasecmp(argv[i], "-MetricsInterval") == 0) {
+      if ((i + 1) < argc) {
+        dwMetricsInterval = atoi(argv[++i]);
+      }
+      else {
+        PrintHelp();
+      }
+    }
+
     if (strcasecmp(argv[i], "-SkipWrite") == 0) {
       m_cfg.SkipWrite = true;
     }
@@ -1000,8 +1232,18 @@ int main(int argc, char * argv[])
   }
   
   setbuf(stdout, NULL);
+  g_metrics.Reset();
+  if (dwMetricsInterval > 0) {
+    g_metrics.StartEmitter(dwMetricsInterval);
+  }
   status = m_port.Open(dnum);
   if (status < 0) goto end;
+
+  // A crashed target waits in memory debug mode, probing it for command mode would only get a NAK
+  if (cmd == EMMC_CMD_MEMDUMP) {
+    status = MemoryDump();
+    goto end;
+  }
   
   // **CORRECTED: Enhanced device detection with proper Xiaomi EDL support**
   if (xiaomi_mode) {
@@ -1021,12 +1263,9 @@ int main(int argc, char * argv[])
      if (status != 0) return status;
      m_emergency = !fh.DeviceNop();
   } else if ( szFlashProg != NULL ) {
+     // Firehose connect waits for the programmer to answer configure, no need to sleep on it
      status = LoadFlashProg(szFlashProg);
-     if (status == 0) {
-       printf("Waiting for UFS flash programmer to boot (Snapdragon 750G Optimized)\n");
-       emmcdl_sleep_ms(2000);
-     }
-     else {
+     if (status != 0) {
        printf("\n!!!!!!!! WARNING: UFS Flash programmer failed to load trying to continue !!!!!!!!!\n\n");
        //goto end;
      }
@@ -1135,6 +1374,7 @@ int main(int argc, char * argv[])
   case EMMC_CMD_INFO:
     status = DumpDeviceInfo();
     break;
+  case EMMC_CMD_MEMDUMP:
   case EMMC_CMD_NONE:
     break;
   }
@@ -1142,6 +1382,14 @@ int main(int argc, char * argv[])
   // Print error information
 
 end:
+  g_metrics.StopEmitter();
+  if (szMetricsFile != NULL) {
+    g_metrics.PrintSummary();
+    if (g_metrics.WriteJSON(szMetricsFile) != 0) {
+      printf("Failed to write metrics to %s\n", szMetricsFile);
+    }
+  }
+
   // Display the error message and exit the process
   printf("\nStatus: %i %s\n",status, (char*)strerror(status));
   printf("=== Redmi Note 9 Pro 5G (Gauguin) UFS Flash Session Complete ===\n");
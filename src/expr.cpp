@@ -0,0 +1,412 @@
+/*****************************************************************************
+ * expr.cpp
+ *
+ * This file compiles and evaluates attribute expressions
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "expr.h"
+
+#define EXPR_CACHE_MIN 256
+
+typedef struct {
+  expr_op_t ops[EXPR_MAX_OPS];
+  uint32_t num;
+} expr_seg_t;
+
+typedef struct {
+  const char *p;
+  int depth;
+  bool bCrc;
+  expr_seg_t start;
+  expr_seg_t len;
+} expr_parse_t;
+
+static int ParseSum(expr_parse_t *ps, expr_seg_t *seg, bool bTop);
+
+static void SkipSpace(expr_parse_t *ps)
+{
+  while (*ps->p == ' ' || *ps->p == '\t') {
+    ps->p++;
+  }
+}
+
+static bool Match(expr_parse_t *ps, const char *word)
+{
+  size_t len = strlen(word);
+  SkipSpace(ps);
+  if (strncmp(ps->p, word, len) == 0) {
+    ps->p += len;
+    return true;
+  }
+  return false;
+}
+
+static int Emit(expr_seg_t *seg, uint32_t op, uint64_t val)
+{
+  if (seg->num >= EXPR_MAX_OPS) {
+    return EINVAL;
+  }
+  seg->ops[seg->num].op = op;
+  seg->ops[seg->num].val = val;
+  seg->num++;
+  return 0;
+}
+
+static uint64_t EvalSegment(const expr_op_t *ops, uint32_t num, uint64_t diskSectors)
+{
+  uint64_t stack[EXPR_MAX_OPS];
+  int sp = 0;
+
+  for (uint32_t i=0; i < num; i++) {
+    switch (ops[i].op) {
+    case EXPR_CONST:
+      stack[sp++] = ops[i].val;
+      break;
+    case EXPR_DISK:
+      stack[sp++] = diskSectors;
+      break;
+    case EXPR_NEG:
+      stack[sp-1] = 0 - stack[sp-1];
+      break;
+    case EXPR_ADD:
+      sp--;
+      stack[sp-1] += stack[sp];
+      break;
+    case EXPR_SUB:
+      sp--;
+      stack[sp-1] -= stack[sp];
+      break;
+    case EXPR_MUL:
+      sp--;
+      stack[sp-1] *= stack[sp];
+      break;
+    case EXPR_DIV:
+      sp--;
+      if (stack[sp] == 0) {
+        stack[sp-1] = 0;
+      }
+      else if ((int64_t)stack[sp] == -1) {
+        stack[sp-1] = 0 - stack[sp-1];
+      }
+      else {
+        stack[sp-1] = (uint64_t)((int64_t)stack[sp-1] / (int64_t)stack[sp]);
+      }
+      break;
+    }
+  }
+  return (sp > 0) ? stack[0] : 0;
+}
+
+// A segment without NUM_DISK_SECTORS is the same for every disk, keep only its value
+static void FoldSegment(expr_seg_t *seg)
+{
+  for (uint32_t i=0; i < seg->num; i++) {
+    if (seg->ops[i].op == EXPR_DISK) {
+      return;
+    }
+  }
+  seg->ops[0].val = EvalSegment(seg->ops, seg->num, 0);
+  seg->ops[0].op = EXPR_CONST;
+  seg->num = 1;
+}
+
+static int ParseNumber(expr_parse_t *ps, uint64_t *value)
+{
+  const char *p = ps->p;
+  uint64_t val = 0;
+
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+    const char *digits = p;
+    for (;; p++) {
+      if (*p >= '0' && *p <= '9') val = (val << 4) | (uint64_t)(*p - '0');
+      else if (*p >= 'a' && *p <= 'f') val = (val << 4) | (uint64_t)(*p - 'a' + 10);
+      else if (*p >= 'A' && *p <= 'F') val = (val << 4) | (uint64_t)(*p - 'A' + 10);
+      else break;
+    }
+    if (p == digits) {
+      return EINVAL;
+    }
+  }
+  else {
+    for (; *p >= '0' && *p <= '9'; p++) {
+      val = val * 10 + (uint64_t)(*p - '0');
+    }
+    // ptool writes sector counts as "33." and fractions are dropped like atoll did
+    if (*p == '.') {
+      for (p++; *p >= '0' && *p <= '9'; p++);
+    }
+  }
+  ps->p = p;
+  *value = val;
+  return 0;
+}
+
+static int ParsePrimary(expr_parse_t *ps, expr_seg_t *seg)
+{
+  int status;
+
+  SkipSpace(ps);
+  if (*ps->p >= '0' && *ps->p <= '9') {
+    uint64_t val;
+    status = ParseNumber(ps, &val);
+    if (status == 0) status = Emit(seg, EXPR_CONST, val);
+    return status;
+  }
+  if (Match(ps, "NUM_DISK_SECTORS")) {
+    return Emit(seg, EXPR_DISK, 0);
+  }
+  if (Match(ps, "(")) {
+    if (++ps->depth > EXPR_MAX_DEPTH) {
+      return EINVAL;
+    }
+    status = ParseSum(ps, seg, false);
+    ps->depth--;
+    if (status == 0 && !Match(ps, ")")) {
+      status = EINVAL;
+    }
+    return status;
+  }
+  // CRC32 anywhere but added at the top level has no value until the data is known
+  return EINVAL;
+}
+
+static int ParseUnary(expr_parse_t *ps, expr_seg_t *seg)
+{
+  if (Match(ps, "-")) {
+    int status = ParseUnary(ps, seg);
+    if (status == 0) status = Emit(seg, EXPR_NEG, 0);
+    return status;
+  }
+  if (Match(ps, "+")) {
+    return ParseUnary(ps, seg);
+  }
+  return ParsePrimary(ps, seg);
+}
+
+static int ParseProduct(expr_parse_t *ps, expr_seg_t *seg)
+{
+  int status = ParseUnary(ps, seg);
+
+  while (status == 0) {
+    uint32_t op;
+    if (Match(ps, "*")) op = EXPR_MUL;
+    else if (Match(ps, "/")) op = EXPR_DIV;
+    else break;
+    status = ParseUnary(ps, seg);
+    if (status == 0) status = Emit(seg, op, 0);
+  }
+  return status;
+}
+
+static int ParseCRC(expr_parse_t *ps)
+{
+  int status = EINVAL;
+
+  if (ps->bCrc || !Match(ps, "(")) {
+    return EINVAL;
+  }
+  ps->bCrc = true;
+  if (ParseSum(ps, &ps->start, false) == 0 && Match(ps, ",") &&
+      ParseSum(ps, &ps->len, false) == 0 && Match(ps, ")")) {
+    // The CRC only adds to the value, it can't be scaled
+    SkipSpace(ps);
+    if (*ps->p != '*' && *ps->p != '/') {
+      status = 0;
+    }
+  }
+  return status;
+}
+
+static int ParseSum(expr_parse_t *ps, expr_seg_t *seg, bool bTop)
+{
+  bool bFirst = true;
+  uint32_t op = EXPR_ADD;
+  int status = 0;
+
+  while (status == 0) {
+    if (!bFirst) {
+      if (Match(ps, "+")) op = EXPR_ADD;
+      else if (Match(ps, "-")) op = EXPR_SUB;
+      else break;
+    }
+    if (bTop && op == EXPR_ADD && Match(ps, "CRC32")) {
+      status = ParseCRC(ps);
+      if (status == 0 && bFirst) status = Emit(seg, EXPR_CONST, 0);
+    }
+    else {
+      status = ParseProduct(ps, seg);
+      if (status == 0 && !bFirst) status = Emit(seg, op, 0);
+    }
+    bFirst = false;
+  }
+  return status;
+}
+
+int ExprCompile(const char *text, expr_t **expr)
+{
+  expr_parse_t ps;
+  expr_seg_t value;
+  int status = 0;
+
+  *expr = NULL;
+  ps.p = text;
+  ps.depth = 0;
+  ps.bCrc = false;
+  ps.start.num = 0;
+  ps.len.num = 0;
+  value.num = 0;
+
+  // An empty attribute has always read as 0
+  SkipSpace(&ps);
+  if (*ps.p == '\0') {
+    status = Emit(&value, EXPR_CONST, 0);
+  }
+  else {
+    status = ParseSum(&ps, &value, true);
+    SkipSpace(&ps);
+    if (status == 0 && *ps.p != '\0') {
+      status = EINVAL;
+    }
+  }
+  if (status != 0) {
+    return status;
+  }
+
+  FoldSegment(&value);
+  if (ps.bCrc) {
+    FoldSegment(&ps.start);
+    FoldSegment(&ps.len);
+  }
+  uint32_t num = value.num + ps.start.num + ps.len.num;
+  expr_t *e = (expr_t *)malloc(sizeof(expr_t) + num * sizeof(expr_op_t));
+  if (e == NULL) {
+    return ENOMEM;
+  }
+  e->numValue = value.num;
+  e->numStart = ps.start.num;
+  e->numLen = ps.len.num;
+  e->bCrc = ps.bCrc;
+  e->ops = (expr_op_t *)(e + 1);
+  memcpy(e->ops, value.ops, value.num * sizeof(expr_op_t));
+  memcpy(e->ops + e->numValue, ps.start.ops, ps.start.num * sizeof(expr_op_t));
+  memcpy(e->ops + e->numValue + e->numStart, ps.len.ops, ps.len.num * sizeof(expr_op_t));
+  *expr = e;
+  return 0;
+}
+
+void ExprEval(const expr_t *expr, uint64_t diskSectors, expr_value_t *value)
+{
+  value->value = EvalSegment(expr->ops, expr->numValue, diskSectors);
+  value->bCrc = expr->bCrc;
+  if (expr->bCrc) {
+    value->crcStart = EvalSegment(expr->ops + expr->numValue, expr->numStart, diskSectors);
+    value->crcLen = EvalSegment(expr->ops + expr->numValue + expr->numStart, expr->numLen, diskSectors);
+  }
+  else {
+    value->crcStart = (uint64_t)-1;
+    value->crcLen = (uint64_t)-1;
+  }
+}
+
+ExprCache::ExprCache()
+{
+  table = NULL;
+  size = 0;
+  count = 0;
+}
+
+ExprCache::~ExprCache()
+{
+  for (uint32_t i=0; i < size; i++) {
+    if (table[i] != NULL) {
+      free(table[i]->expr);
+      free(table[i]);
+    }
+  }
+  free(table);
+}
+
+static uint32_t HashText(const char *text)
+{
+  uint32_t hash = 2166136261u;
+  for (; *text; text++) {
+    hash = (hash ^ (unsigned char)*text) * 16777619u;
+  }
+  return hash;
+}
+
+// Open addressing, kept at most half full
+int ExprCache::Grow(void)
+{
+  uint32_t newSize = size ? size * 2 : EXPR_CACHE_MIN;
+  expr_entry_t **newTable = (expr_entry_t **)calloc(newSize, sizeof(expr_entry_t *));
+  if (newTable == NULL) {
+    return ENOMEM;
+  }
+  for (uint32_t i=0; i < size; i++) {
+    if (table[i] != NULL) {
+      uint32_t j = table[i]->hash & (newSize - 1);
+      while (newTable[j] != NULL) {
+        j = (j + 1) & (newSize - 1);
+      }
+      newTable[j] = table[i];
+    }
+  }
+  free(table);
+  table = newTable;
+  size = newSize;
+  return 0;
+}
+
+int ExprCache::Evaluate(const char *text, uint64_t diskSectors, expr_value_t *value)
+{
+  uint32_t hash = HashText(text);
+  expr_entry_t *entry = NULL;
+
+  if (size > 0) {
+    for (uint32_t i = hash & (size - 1); table[i] != NULL; i = (i + 1) & (size - 1)) {
+      if (table[i]->hash == hash && strcmp(table[i]->text, text) == 0) {
+        entry = table[i];
+        break;
+      }
+    }
+  }
+
+  if (entry == NULL) {
+    expr_t *expr;
+    int status = ExprCompile(text, &expr);
+    if (status == ENOMEM || ((count + 1) * 2 > size && Grow() != 0)) {
+      free(expr);
+      return ENOMEM;
+    }
+    size_t len = strlen(text);
+    entry = (expr_entry_t *)malloc(sizeof(expr_entry_t) + len + 1);
+    if (entry == NULL) {
+      free(expr);
+      return ENOMEM;
+    }
+    entry->hash = hash;
+    entry->status = status;
+    entry->expr = expr;
+    entry->text = (char *)(entry + 1);
+    memcpy(entry->text, text, len + 1);
+
+    uint32_t i = hash & (size - 1);
+    while (table[i] != NULL) {
+      i = (i + 1) & (size - 1);
+    }
+    table[i] = entry;
+    count++;
+  }
+
+  if (entry->status != 0) {
+    return entry->status;
+  }
+  ExprEval(entry->expr, diskSectors, value);
+  return 0;
+}
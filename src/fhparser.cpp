@@ -0,0 +1,153 @@
+/*****************************************************************************
+ * fhparser.cpp
+ *
+ * Walks a Firehose response document once and reports what it finds as
+ * typed events, so callers never search the raw text.
+ *
+ *****************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "fhparser.h"
+#include "xmlparser.h"
+
+FHParser::FHParser(fh_event_func func, void *ctx)
+{
+  eventFunc = func;
+  eventCtx = ctx;
+}
+
+bool FHParser::Match(const char *str, uint32_t len, const char *lit)
+{
+  return (strlen(lit) == len) && (strncmp(str, lit, len) == 0);
+}
+
+uint64_t FHParser::ToInteger(const char *str, uint32_t len)
+{
+  uint64_t value = 0;
+
+  for (uint32_t i=0; i < len && isdigit(str[i]); i++) {
+    value = value * 10 + (str[i] - '0');
+  }
+  return value;
+}
+
+void FHParser::Emit(fh_event_t *ev)
+{
+  if (eventFunc != NULL) {
+    eventFunc(eventCtx, ev);
+  }
+}
+
+int FHParser::Parse(const char *doc, uint32_t len)
+{
+  const char *p = doc;
+  const char *end = doc + len;
+  fh_event_t ev;
+
+  while (p < end && (p = (const char *)memchr(p, '<', end - p)) != NULL) {
+    p++;
+    if (p >= end) {
+      break;
+    }
+
+    // Declarations, comments and closing tags carry nothing we need
+    if (*p == '?' || *p == '!' || *p == '/') {
+      const char *term = (*p == '?') ? "?>" : (*p == '!' && end - p > 2 && p[1] == '-' && p[2] == '-') ? "-->" : ">";
+      const char *q = (const char *)memmem(p, end - p, term, strlen(term));
+      if (q == NULL) {
+        return ERROR_INVALID_DATA;
+      }
+      p = q + strlen(term);
+      continue;
+    }
+
+    // Element name
+    const char *elem = p;
+    while (p < end && !isspace(*p) && *p != '>' && *p != '/') p++;
+    uint32_t elemLen = p - elem;
+    bool bResponse = Match(elem, elemLen, "response");
+    bool bLog = Match(elem, elemLen, "log");
+    fh_resp_e resp = FH_RESP_NONE;
+
+    // Attributes up to the end of the start tag
+    for (;;) {
+      while (p < end && isspace(*p)) p++;
+      if (p >= end) {
+        return ERROR_INVALID_DATA;
+      }
+      if (*p == '>') {
+        p++;
+        break;
+      }
+      if (*p == '/') {
+        p++;
+        continue;
+      }
+
+      const char *name = p;
+      while (p < end && !isspace(*p) && *p != '=' && *p != '>' && *p != '/') p++;
+      uint32_t nameLen = p - name;
+      while (p < end && isspace(*p)) p++;
+      if (p >= end || *p != '=') {
+        // Attribute with no value, nothing to report
+        continue;
+      }
+      p++;
+      while (p < end && isspace(*p)) p++;
+      if (p >= end || (*p != '"' && *p != '\'')) {
+        return ERROR_INVALID_DATA;
+      }
+      char quote = *p++;
+      const char *value = p;
+      p = (const char *)memchr(p, quote, end - p);
+      if (p == NULL) {
+        return ERROR_INVALID_DATA;
+      }
+      uint32_t valueLen = p - value;
+      p++;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.element = elem;
+      ev.elementLen = elemLen;
+      ev.name = name;
+      ev.nameLen = nameLen;
+      ev.value = value;
+      ev.valueLen = valueLen;
+      if (bLog && Match(name, nameLen, "value")) {
+        ev.type = FH_EVENT_LOG;
+        Emit(&ev);
+      }
+      else if (bResponse && Match(name, nameLen, "value")) {
+        if (Match(value, valueLen, "ACK")) {
+          resp = FH_RESP_ACK;
+        }
+        else if (Match(value, valueLen, "NAK")) {
+          resp = FH_RESP_NAK;
+        }
+      }
+      else if (bResponse && Match(name, nameLen, "rawmode")) {
+        ev.type = FH_EVENT_RAWMODE;
+        ev.rawmode = (valueLen == 4 && strncasecmp(value, "true", 4) == 0);
+        Emit(&ev);
+      }
+      else {
+        ev.type = FH_EVENT_ATTR;
+        Emit(&ev);
+      }
+    }
+
+    // The verdict goes out once everything else about the response is known
+    if (bResponse) {
+      memset(&ev, 0, sizeof(ev));
+      ev.type = FH_EVENT_RESPONSE;
+      ev.element = elem;
+      ev.elementLen = elemLen;
+      ev.resp = resp;
+      Emit(&ev);
+    }
+  }
+
+  return 0;
+}
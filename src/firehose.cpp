@@ -44,9 +44,17 @@ Firehose::~Firehose()
 	  free(program_pkt);
 	  program_pkt = NULL;
   }
+  if (m_fill != NULL) {
+    free(m_fill);
+    m_fill = NULL;
+  }
+  if (m_patch_pkt != NULL) {
+    free(m_patch_pkt);
+    m_patch_pkt = NULL;
+  }
 }
 
-Firehose::Firehose(SerialPort *port,uint32_t maxPacketSize, int hLogFile)
+Firehose::Firehose(SerialPort *port,uint32_t maxPacketSize, int hLogFile) : m_parser(ResponseEvent, this)
 {
   // Initialize the serial port
   dwMaxPacketSize = maxPacketSize;
@@ -56,51 +64,206 @@ Firehose::Firehose(SerialPort *port,uint32_t maxPacketSize, int hLogFile)
   sport = port;
   sport->SetTimeout(0);
   m_payload = NULL;
+  m_fill = NULL;
+  m_fill_pattern = 0;
   program_pkt = NULL;
   m_buffer_len = 0;
   m_buffer = NULL;
   m_buffer_ptr = NULL;
+  m_resp = NULL;
+  m_resp_len = 0;
+  m_resp_value = FH_RESP_NONE;
+  m_resp_rawmode = -1;
+  m_resp_max_payload = 0;
+  m_max_xml = MAX_XML_LEN;
+  m_storage_sectors = 0;
+  m_storage_pending = false;
+  m_verify = false;
+  m_digest = true;
+  m_digest_pending = false;
+  m_resp_digest_valid = false;
+  m_patch_pkt = NULL;
+  m_patch_len = 0;
+  m_patch_count = 0;
+  m_patch_batch = FH_PATCH_BATCH;
+  m_ack_ts = 0;
+  m_ack_metric = METRIC_CMD_LATENCY;
 }
 
-int Firehose::ReadData(unsigned char *pOutBuf, uint32_t dwBufSize, bool bXML)
+// Block count from a getstorageinfo log line. Current programmers print JSON with
+// "total_blocks", older eMMC ones print "Device Total Logical Blocks: 0x...".
+static uint64_t StorageBlocks(const char *value, uint32_t len)
 {
-  uint32_t dwBytesRead = 0;
-  bool bFoundXML = false;
-  int status = 0;
+  char line[MAX_STRING_LEN];
+  const char *p;
+  int base = 10;
+
+  len = (len < sizeof(line) - 1) ? len : sizeof(line) - 1;
+  memcpy(line, value, len);
+  line[len] = '\0';
+  if ((p = strstr(line, "total_blocks")) == NULL) {
+    if ((p = strstr(line, "Total Logical Blocks")) == NULL) {
+      return 0;
+    }
+    base = 0;
+  }
+  while (*p != '\0' && (*p < '0' || *p > '9')) {
+    p++;
+  }
+  return strtoull(p, NULL, base);
+}
 
-  if (bXML) {
-    memset(pOutBuf, 0, dwBufSize);
-    // First check if there is data available in our buffer
-    for (int i=0; i < 3;i++){
-      for (; m_buffer_len > 0 && dwBytesRead < dwBufSize;m_buffer_len--) {
-        *pOutBuf++ = *m_buffer_ptr++;
-        dwBytesRead++;
-
-        // Check for end of XML 
-        if (dwBytesRead >= 7 && (strncmp(((char *)pOutBuf) - 7, "</data>", 7) == 0)) {
-          m_buffer_len--;
-          bFoundXML = true;
-          break;
+// getsha256digest answers with a log line holding the digest as 64 hex digits
+static bool DigestValue(const char *value, uint32_t len, unsigned char *digest)
+{
+  char line[MAX_STRING_LEN];
+  const char *p;
+
+  len = (len < sizeof(line) - 1) ? len : sizeof(line) - 1;
+  memcpy(line, value, len);
+  line[len] = '\0';
+  if ((p = strstr(line, "Digest")) == NULL) {
+    return false;
+  }
+  for (p += 6; *p == ' ' || *p == ':' || *p == '='; p++);
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+  }
+  for (int i=0; i < SHA256_DIGEST_LEN; i++, p += 2) {
+    char hex[3] = { p[0], p[1], 0 };
+    char *end;
+    if (hex[0] == 0 || hex[1] == 0) {
+      return false;
+    }
+    digest[i] = (unsigned char)strtoul(hex, &end, 16);
+    if (*end != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parser callbacks land here, state changes as the target describes them
+void Firehose::ResponseEvent(void *ctx, const fh_event_t *ev)
+{
+  Firehose *fh = (Firehose *)ctx;
+
+  switch (ev->type) {
+  case FH_EVENT_LOG:
+    fh->Log("LOG: %.*s", ev->valueLen, ev->value);
+    // Only worth scanning while a request for the value is outstanding
+    if (fh->m_storage_pending) {
+      fh->m_storage_sectors = StorageBlocks(ev->value, ev->valueLen);
+      fh->m_storage_pending = (fh->m_storage_sectors == 0);
+    }
+    if (fh->m_digest_pending) {
+      fh->m_resp_digest_valid = DigestValue(ev->value, ev->valueLen, fh->m_resp_digest);
+      fh->m_digest_pending = !fh->m_resp_digest_valid;
+    }
+    break;
+  case FH_EVENT_RAWMODE:
+    fh->m_resp_rawmode = ev->rawmode ? 1 : 0;
+    break;
+  case FH_EVENT_ATTR:
+    // Configure NAK tells us the largest payload the target will take
+    if (FHParser::Match(ev->element, ev->elementLen, "response")) {
+      if (FHParser::Match(ev->name, ev->nameLen, "MaxPayloadSizeToTargetInBytesSupported")) {
+        fh->m_resp_max_payload = FHParser::ToInteger(ev->value, ev->valueLen);
+      }
+      else if (FHParser::Match(ev->name, ev->nameLen, "MaxPayloadSizeToTargetInBytes") && fh->m_resp_max_payload == 0) {
+        fh->m_resp_max_payload = FHParser::ToInteger(ev->value, ev->valueLen);
+      }
+      // Configure ACK says how large an XML document the target will buffer
+      else if (FHParser::Match(ev->name, ev->nameLen, "MaxXMLSizeInBytes")) {
+        uint64_t size = FHParser::ToInteger(ev->value, ev->valueLen);
+        if (size > 0) {
+          fh->m_max_xml = (size < MAX_XML_LEN) ? (uint32_t)size : MAX_XML_LEN;
         }
       }
+    }
+    break;
+  case FH_EVENT_RESPONSE:
+    fh->m_resp_value = ev->resp;
+    break;
+  }
+}
 
-      // If buffer length hits 0 means we didn't find end of XML so read more data
-      if (!bFoundXML) {
-        // Zero out the buffer to remove any other data and reset pointer
-        memset(m_buffer, 0, dwMaxPacketSize);
-        m_buffer_len = dwMaxPacketSize;
-        m_buffer_ptr = m_buffer;
-        if ((status = sport->Read(m_buffer, &m_buffer_len)) <  0) {
-          //m_buffer_len = 0;
-          //printf("x%s\n", m_buffer);
-          Log("xml sport->Read fail\n");
-        }
-        //printf("x%s\n", m_buffer);
+// Run the current document through the parser, one pass with no string searches
+void Firehose::ParseResponse(void)
+{
+  m_resp_value = FH_RESP_NONE;
+  m_resp_rawmode = -1;
+  m_resp_max_payload = 0;
+  if (m_parser.Parse(m_resp, m_resp_len) != 0) {
+    Log("Malformed response: %.*s", m_resp_len, m_resp);
+  }
+}
 
-      } else {
+// Frame the next <data> document in the receive buffer. m_resp points into m_buffer
+// and stays valid until the next read from the port.
+int Firehose::ReadResponse(void)
+{
+  static const char endTag[] = "</data>";
+  const uint32_t endLen = sizeof(endTag) - 1;
+  uint32_t scanned = 0;
+
+  // Keep appending while the port delivers, give up after 3 empty reads
+  for (int i=0; i < 3;) {
+    // memchr finds the candidates, only those get compared against the full tag
+    unsigned char *end = m_buffer_ptr + m_buffer_len;
+    unsigned char *p = m_buffer_ptr + scanned;
+    while ((p = (unsigned char *)memchr(p, '<', end - p)) != NULL) {
+      if ((uint32_t)(end - p) < endLen) {
         break;
       }
+      if (memcmp(p, endTag, endLen) == 0) {
+        m_resp = (char *)m_buffer_ptr;
+        m_resp_len = (p + endLen) - m_buffer_ptr;
+        m_buffer_ptr += m_resp_len;
+        m_buffer_len -= m_resp_len;
+        return m_resp_len;
+      }
+      p++;
     }
+    scanned = (p != NULL) ? (p - m_buffer_ptr) : m_buffer_len;
+
+    // Partial document, slide it to the front and append more data behind it
+    if (m_buffer_len == dwMaxPacketSize) {
+      Log("Dropping %i bytes with no end of XML\n", m_buffer_len);
+      m_buffer_len = 0;
+      scanned = 0;
+    }
+    if (m_buffer_ptr != m_buffer) {
+      memmove(m_buffer, m_buffer_ptr, m_buffer_len);
+      m_buffer_ptr = m_buffer;
+    }
+    uint32_t dwBytesRead = dwMaxPacketSize - m_buffer_len;
+    if (sport->Read(m_buffer + m_buffer_len, &dwBytesRead) < 0) {
+      Log("xml sport->Read fail\n");
+      dwBytesRead = 0;
+    }
+    if (dwBytesRead == 0) {
+      i++;
+    }
+    m_buffer_len += dwBytesRead;
+  }
+
+  return -1;
+}
+
+int Firehose::ReadData(unsigned char *pOutBuf, uint32_t dwBufSize, bool bXML)
+{
+  uint32_t dwBytesRead = 0;
+  int status = 0;
+
+  if (bXML) {
+    // Copy out the next framed document for callers that want their own buffer
+    if (ReadResponse() < 0 || dwBufSize == 0) {
+      return -1;
+    }
+    dwBytesRead = (m_resp_len < dwBufSize) ? m_resp_len : dwBufSize - 1;
+    memcpy(pOutBuf, m_resp, dwBytesRead);
+    pOutBuf[dwBytesRead] = '\0';
   } else {
     // First copy over any extra data that may be present from previous read
     dwBytesRead = dwBufSize;
@@ -122,6 +285,7 @@ int Firehose::ReadData(unsigned char *pOutBuf, uint32_t dwBufSize, bool bXML)
 
     if ((status = sport->Read(pOutBuf, &dwBytesRead)) < 0) {
       Log("sport->Read fail\n");
+      dwBytesRead = 0;
     }
     dwBytesRead += m_buffer_len;
     m_buffer_ptr = m_buffer;
@@ -147,10 +311,21 @@ int Firehose::ConnectToFlashProg(fh_configure_t *cfg)
   if (m_payload == NULL || program_pkt == NULL || m_buffer == NULL) {
     m_payload = (unsigned char *)malloc(dwMaxPacketSize);
     program_pkt = (char *)malloc(MAX_XML_LEN);
+    m_patch_pkt = (char *)malloc(MAX_XML_LEN);
     m_buffer = (unsigned char *)malloc(dwMaxPacketSize);
-    if (m_payload == NULL || program_pkt == NULL || m_buffer == NULL) {
+    // Fill data gets its own buffer, m_payload is overwritten by every status read
+    m_fill = (unsigned char *)calloc(1, dwMaxPacketSize);
+    m_fill_pattern = 0;
+    if (m_payload == NULL || program_pkt == NULL || m_buffer == NULL || m_fill == NULL || m_patch_pkt == NULL) {
       return ENOMEM;
     }
+    m_buffer_ptr = m_buffer;
+    m_buffer_len = 0;
+  }
+
+  // Transfer ring shared by the file and USB threads, sized for the largest payload we may send
+  if (m_ring.Init(FH_RING_SLOTS, dwMaxPacketSize) != 0) {
+    return ENOMEM;
   }
 
   // Read any pending data from the flash programmer
@@ -172,8 +347,8 @@ int Firehose::ConnectToFlashProg(fh_configure_t *cfg)
   sprintf(program_pkt, "<?xml version = \"1.0\" ?><data><configure MemoryName=\"%s\" ZLPAwareHost=\"%i\" SkipStorageInit=\"%i\" SkipWrite=\"%i\" MaxPayloadSizeToTargetInBytes=\"%i\" AckRawDataEveryNumPackets=\"%i\"/></data>",
     cfg->MemoryName, cfg->ZLPAwareHost, cfg->SkipStorageInit, cfg->SkipWrite, dwMaxPacketSize, cfg->AckRawDataEveryNumPackets);
   Log(program_pkt);
-  status = sport->Write((unsigned char *)program_pkt, strlen(program_pkt));
-  if (status == 0) {
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  if (status >= 0) {
     // Wait until we get the ACK or NAK back
     for (; retry < MAX_RETRY; retry++)
     {
@@ -186,10 +361,7 @@ int Firehose::ConnectToFlashProg(fh_configure_t *cfg)
       else if (status == ERROR_INVALID_DATA)
       {
         // Received NAK to configure request check reason if it is MaxPayloadSizeToTarget then reduce and retry
-        XMLParser xmlparse;
-        uint64_t u64MaxSize = 0;
-        // Make sure we got a configure response and set our max packet size
-        xmlparse.ParseXMLInteger((char *)m_payload, "MaxPayloadSizeToTargetInBytes", &u64MaxSize);
+        uint64_t u64MaxSize = m_resp_max_payload;
 
         // If device can't handle a packet this large then change the the largest size they can use and reconfigure
         if ((u64MaxSize > 0) && (u64MaxSize  <  dwMaxPacketSize)) {
@@ -215,18 +387,139 @@ int Firehose::ConnectToFlashProg(fh_configure_t *cfg)
   return status;
 }
 
+// Ask the target how many sectors the physical partition has
+int Firehose::GetStorageSectors(uint8_t partNum, __uint64_t *sectors)
+{
+  int status = 0;
+
+  sprintf(program_pkt, "<?xml version=\"1.0\" ?><data><getstorageinfo physical_partition_number=\"%i\"/></data>", partNum);
+  Log(program_pkt);
+  m_storage_sectors = 0;
+  m_storage_pending = true;
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  if (status >= 0) {
+    status = ReadStatus();
+  }
+  m_storage_pending = false;
+  if (status == 0 && m_storage_sectors == 0) {
+    Log("No block count in getstorageinfo response\n");
+    status = ERROR_INVALID_DATA;
+  }
+  *sectors = m_storage_sectors;
+  return status;
+}
+
+void Firehose::EnableVerify(void)
+{
+  m_verify = true;
+}
+
+// Ask the target for the SHA-256 of a range as it is stored now. Programmers that
+// NAK getsha256digest are remembered so later calls fail without a round trip.
+int Firehose::GetDigest(int64_t startSector, __uint64_t sectors, uint8_t partNum, unsigned char *digest)
+{
+  int status;
+
+  if (!m_digest) {
+    return ERROR_INVALID_DATA;
+  }
+  if (startSector < 0) {
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data><getsha256digest SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" "
+            "physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\"/></data>", DISK_SECTOR_SIZE, sectors, partNum, startSector);
+  }
+  else {
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data><getsha256digest SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" "
+            "physical_partition_number=\"%i\" start_sector=\"%li\"/></data>", DISK_SECTOR_SIZE, sectors, partNum, startSector);
+  }
+  Log(program_pkt);
+  m_resp_digest_valid = false;
+  m_digest_pending = true;
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  if (status < 0) {
+    m_digest_pending = false;
+    return status;
+  }
+  // Large ranges take the target a while to hash
+  status = EBUSY;
+  for (int retry=0; retry < MAX_RETRY && status == EBUSY; retry++) {
+    status = ReadStatus();
+  }
+  m_digest_pending = false;
+  if (status == 0 && m_resp_digest_valid) {
+    memcpy(digest, m_resp_digest, SHA256_DIGEST_LEN);
+    return 0;
+  }
+  if (status == 0 || status == ERROR_INVALID_DATA) {
+    m_digest = false;
+    return ERROR_INVALID_DATA;
+  }
+  return status;
+}
+
+// Check a programmed range against the digest of the data sent. The target hashes
+// what it stored so nothing comes back over USB. Programmers without getsha256digest
+// get the range read back in chunks and hashed here instead.
+int Firehose::VerifyDigest(int64_t startSector, __uint64_t sectors, uint8_t partNum, const unsigned char *digest)
+{
+  unsigned char stored[SHA256_DIGEST_LEN];
+  int status = 0;
+
+  if (m_digest) {
+    status = GetDigest(startSector, sectors, partNum, stored);
+    if (status == ERROR_INVALID_DATA) {
+      printf("\nTarget has no getsha256digest, verifying by read back\n");
+      status = 0;
+    }
+    else if (status != 0) {
+      return status;
+    }
+  }
+
+  if (!m_digest) {
+    uint32_t chunkSectors = dwMaxPacketSize / DISK_SECTOR_SIZE;
+    unsigned char *buf = (unsigned char *)malloc(dwMaxPacketSize);
+    sha256_ctx sha;
+    if (buf == NULL) {
+      return ENOMEM;
+    }
+    SHA256Init(&sha);
+    for (__uint64_t done = 0; done < sectors && status == 0;) {
+      uint32_t n = (sectors - done < chunkSectors) ? (uint32_t)(sectors - done) : chunkSectors;
+      uint32_t bytesRead = 0;
+      status = ReadData(buf, (startSector + (int64_t)done) * DISK_SECTOR_SIZE, n * DISK_SECTOR_SIZE, &bytesRead, partNum);
+      if (status == 0) {
+        SHA256Update(&sha, buf, n * DISK_SECTOR_SIZE);
+      }
+      done += n;
+    }
+    free(buf);
+    if (status != 0) {
+      return status;
+    }
+    SHA256Final(&sha, stored);
+  }
+
+  if (memcmp(stored, digest, SHA256_DIGEST_LEN) != 0) {
+    printf("\nVerify failed, %lu sectors at %li do not match what was sent\n", sectors, startSector);
+    return EIO;
+  }
+  Log("Verified %lu sectors at %li\n", sectors, startSector);
+  return 0;
+}
+
 int Firehose::DeviceReset()
 {
 	int status = 0;
     char reset_pkt[] = "<?xml version=\"1.0\" ?><data><power value=\"reset\"/></data>";
+	FlushPatches();
 	status = sport->Write((unsigned char *)reset_pkt, sizeof(reset_pkt));
-	return status;
+	return (status < 0) ? status : 0;
 }
 
 int Firehose::DeviceNop(){
     int status = 0;
     char nop_pkt[] = "<?xml version=\"1.0\" ?><data><nop /></data>";
-    status = sport->Write((unsigned char *)nop_pkt, sizeof(nop_pkt));
+    status = SendCommand(nop_pkt, sizeof(nop_pkt));
     status =  ReadStatus();
     return status;
 }
@@ -235,7 +528,7 @@ int Firehose::WriteIMEI(char * imei)
 {
     int status = 0;
     char wimei[] = "<?xml version=\"1.0\" ?><data><writeIMEI len=\"16\"/></data>";
-    status = sport->Write((unsigned char *)wimei, sizeof(wimei));
+    status = SendCommand(wimei, sizeof(wimei));
     Log((char *)wimei);
     // Read response
     memcpy(m_payload, imei, 16);
@@ -249,28 +542,46 @@ int Firehose::WriteIMEI(char * imei)
     return status;
 }
 
+// Write an XML command and start timing until its ACK/NAK comes back
+int Firehose::SendCommand(const char *pkt, uint32_t len)
+{
+  // Queued patches were issued before this command so they go out first
+  if (m_patch_count > 0) {
+    int status = FlushPatches();
+    if (status != 0) {
+      return status;
+    }
+  }
+  WaitAck(METRIC_CMD_LATENCY);
+  return sport->Write((unsigned char *)pkt, len);
+}
+
+void Firehose::WaitAck(metric_e id)
+{
+  m_ack_metric = id;
+  m_ack_ts = Metrics::Now();
+}
+
 int Firehose::ReadStatus(void)
 {
   // Make sure we read an ACK back
-  while (ReadData(m_payload, MAX_XML_LEN, true) > 0)
+  while (ReadResponse() > 0)
   {
-    // Check for ACK packet
-    Log((char *)m_payload);
-    if (strstr((char *)m_payload, "ACK") != NULL) {
-    	char *ptr = strstr((char *)m_payload, "rawmode");
-    	if (ptr != NULL ){
-    		m_read_back_verify = false;
-    		if (strstr(ptr, "true") != NULL) {
-    		    m_rawmode = true;
-    		} else {
-    			m_rawmode = false;
-    		}
-    	} else {
-    		m_read_back_verify = true;
-    	}
+    ParseResponse();
+    if (m_resp_value != FH_RESP_NONE && m_ack_ts != 0) {
+      g_metrics.Record(m_ack_metric, m_ack_ts);
+      m_ack_ts = 0;
+    }
+    if (m_resp_value == FH_RESP_ACK) {
+      if (m_resp_rawmode >= 0) {
+        m_read_back_verify = false;
+        m_rawmode = (m_resp_rawmode == 1);
+      } else {
+        m_read_back_verify = true;
+      }
       return 0;
     }
-    else if (strstr((char *)m_payload, "NAK") != NULL) {
+    else if (m_resp_value == FH_RESP_NAK) {
       Log("\n---Target returned NAK---\n");
       return ERROR_INVALID_DATA;
     }
@@ -278,34 +589,116 @@ int Firehose::ReadStatus(void)
   return EBUSY;
 }
 
+static const char patch_start[] = "<?xml version=\"1.0\" ?><data>";
+static const char patch_end[] = "</data>\n";
+
+void Firehose::SetPatchBatch(uint32_t count)
+{
+  m_patch_batch = (count < FH_PATCH_BATCH) ? count : FH_PATCH_BATCH;
+}
+
+// One patch element in its own document, wait for the ACK
+int Firehose::SendPatch(const char *elem, uint32_t len)
+{
+  int status = 0;
+
+  memset(program_pkt,0,MAX_XML_LEN);
+  sprintf(program_pkt,"%s%.*s%s", patch_start, (int)len, elem, patch_end);
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  if( status < 0 ) return status;
+
+  Log(program_pkt);
+  return ReadStatus();
+}
+
 int Firehose::ProgramPatchEntry(PartitionEntry pe, char *key)
 {
   char tmp_key[MAX_STRING_LEN];
   int status = 0;
   
   // Make sure we get a valid parameter passed in
-  if (key == NULL) return EINVAL;
+  if (key == NULL || strlen(key) >= MAX_STRING_LEN - 1) return EINVAL;
 
   strcpy(tmp_key,key);
-  memset(program_pkt,0,MAX_XML_LEN);
-  sprintf(program_pkt,"<?xml version=\"1.0\" ?><data>");
   const XMLParser xmlParser;
   xmlParser.StringReplace(tmp_key,".","");
   xmlParser.StringReplace(tmp_key,".","");
-  strncpy(&program_pkt[strlen(program_pkt)],tmp_key,MAX_STRING_LEN);
-  strcat(program_pkt,"></data>\n");
-  status= sport->Write((unsigned char*)program_pkt,strlen(program_pkt));
-  if( status != 0 ) return status;
+  strcat(tmp_key,">");
+  uint32_t len = strlen(tmp_key);
 
-  Log(program_pkt);
-  // There is no response to patch requests
+  if (m_patch_batch <= 1 || m_patch_pkt == NULL) {
+    return SendPatch(tmp_key, len);
+  }
 
-  return ReadStatus();
+  // Queue the element, the batch goes out once full or ahead of any other command
+  if (m_patch_count == 0) {
+    strcpy(m_patch_pkt, patch_start);
+    m_patch_len = strlen(patch_start);
+  }
+  else if (m_patch_len + len + sizeof(patch_end) > m_max_xml) {
+    status = FlushPatches();
+    if (status != 0) return status;
+    strcpy(m_patch_pkt, patch_start);
+    m_patch_len = strlen(patch_start);
+  }
+  m_patch_off[m_patch_count++] = m_patch_len;
+  memcpy(&m_patch_pkt[m_patch_len], tmp_key, len);
+  m_patch_len += len;
+
+  if (m_patch_count >= m_patch_batch) {
+    return FlushPatches();
+  }
+  return 0;
+}
+
+// Send the queued patches as one document, the target answers each element in turn.
+// If it NAKs or goes quiet early the whole batch is sent again one patch at a time,
+// patches only store values so applying one twice does no harm.
+int Firehose::FlushPatches(void)
+{
+  uint32_t count = m_patch_count;
+  uint32_t acked = 0;
+  int status = 0;
+
+  if (count == 0) return 0;
+
+  // Clear first, SendCommand flushes anything still queued
+  m_patch_count = 0;
+  m_patch_off[count] = m_patch_len;
+  if (count == 1) {
+    return SendPatch(&m_patch_pkt[m_patch_off[0]], m_patch_off[1] - m_patch_off[0]);
+  }
+
+  strcpy(&m_patch_pkt[m_patch_len], patch_end);
+  status = SendCommand(m_patch_pkt, strlen(m_patch_pkt));
+  if (status < 0) return status;
+  Log(m_patch_pkt);
+
+  for (; acked < count; acked++) {
+    status = ReadStatus();
+    if (status != 0) break;
+  }
+  if (acked == count) {
+    return 0;
+  }
+
+  // Swallow anything else the target has to say about the batch
+  if (status == ERROR_INVALID_DATA) {
+    while (ReadStatus() != EBUSY);
+  }
+  printf("Target answered %u of %u batched patches, sending them one at a time\n", acked, count);
+  m_patch_batch = 1;
+  status = 0;
+  for (uint32_t i=0; i < count && status == 0; i++) {
+    status = SendPatch(&m_patch_pkt[m_patch_off[i]], m_patch_off[i+1] - m_patch_off[i]);
+  }
+  return status;
 }
 
 int Firehose::WriteData(unsigned char *writeBuffer, int64_t writeOffset, uint32_t writeBytes, uint32_t *bytesWritten, uint8_t partNum)
 {
   uint32_t dwBytesRead;
+  sha256_ctx sha;
   int status = 0;
 
   // If we are provided with a buffer read the data directly into there otherwise read into our internal buffer
@@ -325,12 +718,12 @@ int Firehose::WriteData(unsigned char *writeBuffer, int64_t writeOffset, uint32_
       "<program SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%u\" physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\"/>"
       "\n</data>", DISK_SECTOR_SIZE, writeBytes / DISK_SECTOR_SIZE, partNum, (writeOffset / DISK_SECTOR_SIZE));
   }
-  status = sport->Write((unsigned char*)program_pkt, strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log((char *)program_pkt);
 
   // This should have log information from device
   // Get the response after read is done
-  if (ReadStatus() != 0) return status;
+  if ((status = ReadStatus()) != 0) return status;
 
   struct timespec ts;
   int ret;
@@ -348,15 +741,21 @@ int Firehose::WriteData(unsigned char *writeBuffer, int64_t writeOffset, uint32_
   //uint64_t dwBufSize = writeBytes;
 
   // loop through and write the data
+  SHA256Init(&sha);
   dwBytesRead = dwMaxPacketSize;
   for (uint32_t i = 0; i < writeBytes; i += dwBytesRead) {
     if ((writeBytes - i)  < dwMaxPacketSize) {
       dwBytesRead = (writeBytes - i);
     }
+    uint64_t usbTs = Metrics::Now();
     status = sport->Write(&writeBuffer[i], dwBytesRead);
-    if (status != 0) {
+    if (status < 0) {
       return status;
     }
+    g_metrics.Record(METRIC_USB_WRITE, usbTs, dwBytesRead);
+    if (m_verify) {
+      SHA256Update(&sha, &writeBuffer[i], dwBytesRead);
+    }
     *bytesWritten += dwBytesRead;
     printf("Sectors remaining %8u%-*c\r", (writeBytes - i), speedWidth, '\0');
   }
@@ -374,13 +773,128 @@ int Firehose::WriteData(unsigned char *writeBuffer, int64_t writeOffset, uint32_
             (((((double)*bytesWritten*NANO)/1024/1024)) / (now - ticks + 1)), tmstr, &speedWidth);
 
   // Get the response after read is done
+  WaitAck(METRIC_DATA_ACK);
   status = ReadStatus();
 
   // Read and display any other log packets we may have
 
+  if (status == 0 && m_verify) {
+    unsigned char digest[SHA256_DIGEST_LEN];
+    SHA256Final(&sha, digest);
+    status = VerifyDigest(writeOffset / DISK_SECTOR_SIZE, writeBytes / DISK_SECTOR_SIZE, partNum, digest);
+  }
+
   return status;
 }
 
+uint32_t Firehose::GetMaxPayloadSize(void)
+{
+  return dwMaxPacketSize;
+}
+
+unsigned char *Firehose::FillPayload(uint32_t pattern)
+{
+  // Only rebuild the buffer when the pattern changes
+  if (pattern != m_fill_pattern) {
+    uint32_t *fill = (uint32_t *)m_fill;
+    for (uint32_t i = 0; i < dwMaxPacketSize / sizeof(uint32_t); i++) {
+      fill[i] = pattern;
+    }
+    m_fill_pattern = pattern;
+  }
+  return m_fill;
+}
+
+int Firehose::FillSectors(uint32_t pattern, int64_t start_sector, __uint64_t num_sectors, uint8_t partNum)
+{
+  int status = 0;
+
+  // Zero fill is erased on the target like a ZERO entry
+  if (pattern == 0) {
+    return EraseSectors(start_sector, num_sectors, partNum);
+  }
+
+  // The same pre-built payload is sent for the whole range under one <program>
+  unsigned char *pFill = FillPayload(pattern);
+
+  memset(program_pkt, 0, MAX_XML_LEN);
+  if (start_sector >= 0) {
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data>\n"
+      "<program SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" physical_partition_number=\"%i\" start_sector=\"%li\"/>"
+      "\n</data>", DISK_SECTOR_SIZE, num_sectors, partNum, start_sector);
+  }
+  else { // If start sector is negative write to back of disk
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data>\n"
+      "<program SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\"/>"
+      "\n</data>", DISK_SECTOR_SIZE, num_sectors, partNum, start_sector);
+  }
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  Log((char *)program_pkt);
+
+  // Wait until device returns with ACK or NAK
+  while ((status = ReadStatus()) == EBUSY);
+  if (status != 0) {
+    return status;
+  }
+
+  uint32_t chunk = dwMaxPacketSize & ~(DISK_SECTOR_SIZE - 1);
+  __uint64_t bytesLeft = num_sectors * DISK_SECTOR_SIZE;
+  while (bytesLeft > 0) {
+    uint32_t bytes = (bytesLeft < chunk) ? (uint32_t)bytesLeft : chunk;
+    uint64_t usbTs = Metrics::Now();
+    status = sport->Write(pFill, bytes);
+    if (status < 0) {
+      return status;
+    }
+    g_metrics.Record(METRIC_USB_WRITE, usbTs, bytes);
+    bytesLeft -= bytes;
+    if (sport->InputBufferCount() > 0) {
+      status = ReadStatus();
+      if (status != EBUSY && status != 0) {
+        return ERROR_INVALID_DATA;
+      }
+    }
+    printf("Sectors remaining %8lu%-*c\r", bytesLeft / DISK_SECTOR_SIZE, speedWidth, '\0');
+  }
+
+  // Get the response after raw transfer is completed
+  WaitAck(METRIC_DATA_ACK);
+  return ReadStatus();
+}
+
+int Firehose::EraseSectors(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum)
+{
+  int status = 0;
+
+  // Programmer erases (or unmaps) the range itself, nothing crosses the link but the command
+  memset(program_pkt, 0, MAX_XML_LEN);
+  if (start_sector >= 0) {
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data>\n"
+      "<erase SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" physical_partition_number=\"%i\" start_sector=\"%li\"/>"
+      "\n</data>", DISK_SECTOR_SIZE, num_sectors, partNum, start_sector);
+  }
+  else { // If start sector is negative erase from back of disk
+    sprintf(program_pkt, "<?xml version=\"1.0\" ?><data>\n"
+      "<erase SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%lu\" physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\"/>"
+      "\n</data>", DISK_SECTOR_SIZE, num_sectors, partNum, start_sector);
+  }
+  status = SendCommand(program_pkt, strlen(program_pkt));
+  Log((char *)program_pkt);
+  if (status < 0) {
+    return status;
+  }
+
+  // Large erases can take a while on the target, keep waiting while it is busy
+  while ((status = ReadStatus()) == EBUSY);
+  if (status != ERROR_INVALID_DATA) {
+    return status;
+  }
+
+  // Older programmers NAK erase, stream zeros instead
+  printf("Target rejected erase, writing zeros over %lu sectors\n", num_sectors);
+  return FastCopy(-1, 0, hDisk, start_sector, num_sectors, partNum);
+}
+
 int Firehose::WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset, uint32_t writeBytes, uint32_t *bytesWritten, uint8_t partNum)
 {
   uint32_t dwBytesRead;
@@ -402,12 +916,12 @@ int Firehose::WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset,
       "<simlock SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%u\" physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\" len=\"%u\" />"
       "\n</data>", DISK_SECTOR_SIZE, *bytesWritten, partNum, (writeOffset), (writeBytes));
   }
-  status = sport->Write((unsigned char*)program_pkt, strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log((char *)program_pkt);
 
   // This should have log information from device
   // Get the response after read is done
-  if (ReadStatus() != 0) return status;
+  if ((status = ReadStatus()) != 0) return status;
 
   struct timespec ts;
   int ret;
@@ -429,10 +943,12 @@ int Firehose::WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset,
     if ((writeBytes - i)  < dwMaxPacketSize) {
       dwBytesRead = (writeBytes - i);
     }
+    uint64_t usbTs = Metrics::Now();
     status = sport->Write(&writeBuffer[i], dwBytesRead);
-    if (status != 0) {
+    if (status < 0) {
       return status;
     }
+    g_metrics.Record(METRIC_USB_WRITE, usbTs, dwBytesRead);
     *bytesWritten += dwBytesRead;
     printf("Sectors remaining %8u%-*c\r", (writeBytes - i), speedWidth, '\0');
   }
@@ -450,6 +966,7 @@ int Firehose::WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset,
                 (((((double)*bytesWritten*NANO)/1024/1024)) / (now - ticks + 1)), tmstr, &speedWidth);
 
   // Get the response after read is done
+  WaitAck(METRIC_DATA_ACK);
   status = ReadStatus();
 
   // Read and display any other log packets we may have
@@ -477,7 +994,7 @@ int Firehose::ReadData(unsigned char *readBuffer, int64_t readOffset, uint32_t r
       "<read SECTOR_SIZE_IN_BYTES=\"%i\" num_partition_sectors=\"%i\" physical_partition_number=\"%i\" start_sector=\"NUM_DISK_SECTORS%li\"/>"
       "\n</data>", DISK_SECTOR_SIZE, (int)readBytes / DISK_SECTOR_SIZE, partNum, (readOffset / DISK_SECTOR_SIZE));
   }
-  status = sport->Write((unsigned char*)program_pkt, strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log((char *)program_pkt);
 
   // Wait until device returns with ACK or NAK
@@ -502,12 +1019,14 @@ int Firehose::ReadData(unsigned char *readBuffer, int64_t readOffset, uint32_t r
     }
 
     uint32_t offset = 0;
+    uint64_t usbTs = Metrics::Now();
     while (offset < bytesToRead) {
       dwBytesRead = ReadData(&readBuffer[offset], bytesToRead - offset, false);
       if (dwBytesRead > 0 ) {
         offset += dwBytesRead;
       }
     }
+    g_metrics.Record(METRIC_USB_READ, usbTs, bytesToRead);
 
     // Now either write the data to the buffer or handle given
     readBuffer += bytesToRead;
@@ -527,6 +1046,7 @@ int Firehose::ReadData(unsigned char *readBuffer, int64_t readOffset, uint32_t r
             ((((double)readBytes*NANO)/1024/1024) / (now - ticks + 1)), tmstr, &speedWidth);
 
   // Get the response after read is done first response should be finished command
+  WaitAck(METRIC_DATA_ACK);
   status = ReadStatus();
 
   return status;
@@ -540,7 +1060,7 @@ int Firehose::CreateGPP(uint32_t dwGPP1, uint32_t dwGPP2, uint32_t dwGPP3, uint3
                         "<createstoragedrives DRIVE4_SIZE_IN_KB=\"%i\" DRIVE5_SIZE_IN_KB=\"%i\" DRIVE6_SIZE_IN_KB=\"%i\" DRIVE7_SIZE_IN_KB=\"%i\" />"
                         "</data>",dwGPP1,dwGPP2,dwGPP3,dwGPP4);
   
-  status= sport->Write((unsigned char*)program_pkt,strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log((char *)program_pkt);
   
   // Read response
@@ -560,7 +1080,7 @@ int Firehose::SetActivePartition(int prtn_num)
                         "<setbootablestoragedrive value=\"%i\" />"
                         "</data>\n",prtn_num);
 
-  status= sport->Write((unsigned char*)program_pkt,strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log((char *)program_pkt);
 
   // Read response
@@ -597,62 +1117,58 @@ int Firehose::ProgramRawCommand(char *key)
   sprintf(program_pkt, "<?xml version=\"1.0\" ?><data>");
   strncpy(&program_pkt[strlen(program_pkt)], key, MAX_XML_LEN - strlen(program_pkt));
   strcat(program_pkt, "></data>\n");
-  status = sport->Write((unsigned char*)program_pkt, strlen(program_pkt));
+  status = SendCommand(program_pkt, strlen(program_pkt));
   Log("Programming RAW command: %s\n",(char *)program_pkt);
+  if (status < 0) {
+    return status;
+  }
 
   // Read and log any response to command we sent
   dwBytesRead = ReadData(m_payload, dwMaxPacketSize, false);
   Log("%s\n",(char *)m_payload);
 
-  return status;
+  return 0;
 }
 
 
 void *WriterThread(void *arg) {
-   int DISK_SECTOR_SIZE = ((thread_info *)arg)->DISK_SECTOR_SIZE;
-   uint64_t sectors = ((thread_info *)arg)->sectors;
-   pthread_mutex_t *pmutex = ((thread_info *)arg)->pmutex;
-   pthread_cond_t  *pcond = ((thread_info *)arg)->pcond;
-   int hWrite = ((thread_info *)arg)->hWrite;
-   listnode *prnode = ((thread_info *)arg)->prnode;
-   listnode *pwnode = ((thread_info *)arg)->pwnode;
+   thread_info *info = (thread_info *)arg;
+   int DISK_SECTOR_SIZE = info->DISK_SECTOR_SIZE;
+   uint64_t sectors = info->sectors;
+   int hWrite = info->hWrite;
+   BufRing *pring = info->pring;
    ssize_t ret;
 
-   pthread_cleanup_push((void (*)(void*))pthread_mutex_unlock,pmutex);
    CBuffer *pbuffer;
    ssize_t bytesleft = sectors * DISK_SECTOR_SIZE;
-   int splices = 0;
    while (bytesleft) {
-      pthread_mutex_lock(pmutex);
-      if (list_head(prnode) == pwnode) {
-         pthread_cond_wait(pcond,pmutex);
-         pthread_mutex_unlock(pmutex);
-         continue;
-      } else {
-         pbuffer = (CBuffer*)list_head(prnode);
+      uint64_t ts = Metrics::Now();
+      pbuffer = pring->GetFilled();
+      if (pbuffer == NULL) {
+         break;
       }
-      pthread_mutex_unlock(pmutex);
+      g_metrics.Record(METRIC_STALL_FILE, ts);
       // Now either write the data to the buffer or handle given
-      splices++;
+      ts = Metrics::Now();
       ssize_t bytes = emmcdl_write(hWrite, pbuffer->data, pbuffer->len);
-      if (bytes < 0 && errno != EAGAIN) {
-         printf("recv copy pipe to file error is %d:%s\n", __LINE__, strerror(errno));
-         break;
-      } else if (bytes < 0 && errno == EAGAIN) {
+      if (bytes < 0) {
          printf("recv copy pipe to file error is %d:%s\n", __LINE__, strerror(errno));
+         info->status = errno;
          break;
       } else if (bytes == pbuffer->len) {
+         g_metrics.Record(METRIC_FILE_WRITE, ts, bytes);
          bytesleft -= bytes;
-         //printf("recv  copy pipe to file len:%ld return info is %d:%s\n", bytes, errno, strerror(errno));
       } else {
          perror("writer to file fail");
+         info->status = EIO;
          break;
       }
+      pring->Release();
+   }
 
-      pthread_mutex_lock(pmutex);
-      list_remove(prnode);
-      list_add_head(&pbuffer->blist,prnode);
-      pthread_mutex_unlock(pmutex);
+   // Don't leave the USB reader waiting on a full ring if we gave up
+   if (bytesleft) {
+      pring->Close();
    }
 
    ret = emmcdl_lseek(hWrite, 0, SEEK_CUR);
@@ -661,37 +1177,92 @@ void *WriterThread(void *arg) {
       printf("Finish recv image recv len mismatch %ld != %ld\n", sectors * DISK_SECTOR_SIZE , ret);
    }
 
-   pthread_cleanup_pop(0);
-   pthread_exit(&ret);
+   return NULL;
+}
+
+void *ReaderThread(void *arg) {
+   thread_info *info = (thread_info *)arg;
+   BufRing *pring = info->pring;
+   uint64_t bytesleft = info->sectors * info->DISK_SECTOR_SIZE;
+   CBuffer *pbuffer;
+
+   while (bytesleft) {
+      // Wait for the USB writer to hand back a free buffer
+      uint64_t ts = Metrics::Now();
+      pbuffer = pring->GetFree();
+      if (pbuffer == NULL) {
+         break;
+      }
+      g_metrics.Record(METRIC_STALL_FILE, ts);
+      ts = Metrics::Now();
+
+      // Fill the whole chunk, last partial sector of the file is padded with zeros
+      uint32_t len = (bytesleft < info->dwChunkSize) ? (uint32_t)bytesleft : info->dwChunkSize;
+      uint32_t curpos = 0;
+      while (curpos < len) {
+         ssize_t bytes = emmcdl_read(info->hRead, pbuffer->data + curpos, len - curpos);
+         if (bytes < 0 && errno == EAGAIN) {
+            continue;
+         } else if (bytes < 0) {
+            info->status = errno;
+            printf("read image file error is %d:%s\n", __LINE__, strerror(errno));
+            break;
+         } else if (bytes == 0) {
+            memset(pbuffer->data + curpos, 0, len - curpos);
+            break;
+         }
+         curpos += bytes;
+      }
+
+      if (info->status != 0) {
+         pring->Close();
+         break;
+      }
+
+      // Hash while the USB side is still busy with the previous buffer
+      if (info->psha != NULL) {
+         SHA256Update(info->psha, pbuffer->data, len);
+      }
+
+      // Queue the filled buffer for the USB writer
+      g_metrics.Record(METRIC_FILE_READ, ts, len);
+      pbuffer->len = len;
+      bytesleft -= len;
+      pring->Put();
+   }
+
+   return NULL;
 }
 
 int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sectorWrite, __uint64_t sectors, uint8_t partNum)
 {
    ssize_t dwBytesRead = 0;
-   bool bReadStatus = true;
    int64_t dwWriteOffset = sectorWrite*DISK_SECTOR_SIZE;
    int64_t dwReadOffset = sectorRead*DISK_SECTOR_SIZE;
    int status = 0;
-   list_declare(wnode);
-   list_declare(rnode);
-   list_init(&wnode);
-   list_init(&rnode);
-   list_add_tail(&wnode, &rnode);
-   pthread_mutex_t mutex;
-   pthread_cond_t cond;
-   pthread_mutex_init(&mutex, NULL);
-   pthread_cond_init(&cond,NULL);
-   pthread_t wid1;
+   pthread_t tid;
+   thread_info info;
+   sha256_ctx sha;
+   bool bThread = false;
 
    // If we are provided with a buffer read the data directly into there otherwise read into our internal buffer
    if (hWrite < 0 ) {
       return EINVAL;
    }
 
+   memset(&info, 0, sizeof(info));
+   info.fh = this;
+   info.sectors = sectors;
+   info.pring = &m_ring;
+   info.hRead = hRead;
+   info.hWrite = hWrite;
+   info.DISK_SECTOR_SIZE = DISK_SECTOR_SIZE;
+   info.dwChunkSize = dwMaxPacketSize&(~(DISK_SECTOR_SIZE - 1));
+   m_ring.Reset();
 
    if (hRead < 0) {
       printf("hRead = INVALID_HANDLE_VALUE, zeroing input buffer\n");
-      memset(m_payload, 0, dwMaxPacketSize);
+      FillPayload(0);
       dwBytesRead = dwMaxPacketSize;
    }
    else {
@@ -700,13 +1271,22 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
          if (sectorRead > 0) {
             //int64_t sectorReadHigh = dwReadOffset >> 32;
             //status = SetFilePointer(hRead, (LONG)dwReadOffset, &sectorReadHigh, FILE_BEGIN);
-            status = emmcdl_lseek(hRead,dwReadOffset, SEEK_SET);
-            if (status < 0) {
+            if (emmcdl_lseek(hRead, dwReadOffset, SEEK_SET) < 0) {
                status = errno;
                printf("Failed to set offset 0x%lx status: %i\n", sectorRead, status);
                return status;
             }
          }
+
+         // Start reading the image while we wait for the ACK
+         if (m_verify) {
+            SHA256Init(&sha);
+            info.psha = &sha;
+         }
+         if (pthread_create(&tid, NULL, ReaderThread, &info) != 0) {
+            return errno;
+         }
+         bThread = true;
       }
    }
 
@@ -737,24 +1317,21 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
                "\n</data>", DISK_SECTOR_SIZE, sectors, partNum, sectorRead);
 
       }
-      thread_info *arg;
-      arg = (thread_info*)calloc(sizeof(thread_info), 1);
-      arg->hWrite = hWrite;
-      arg->pmutex = &mutex;
-      arg->pcond = &cond;
-      arg->prnode = &rnode;
-      arg->pwnode = &wnode;
-      arg->sectors = sectors;
-      arg->fh = this;
-      arg->DISK_SECTOR_SIZE = DISK_SECTOR_SIZE;
-      pthread_create(&wid1,NULL,(void* (*)(void*))WriterThread, arg);
+      if (pthread_create(&tid, NULL, WriterThread, &info) != 0) {
+         return errno;
+      }
+      bThread = true;
    }
 
    // Write out the command and wait for ACK/NAK coming back
-   status = sport->Write((unsigned char*)program_pkt, strlen(program_pkt));
+   status = SendCommand(program_pkt, strlen(program_pkt));
    Log((char *)program_pkt);
+   if (status > 0) {
+      // Sent in full, the port reports the byte count
+      status = 0;
+   }
 
-   if (hWrite == hDisk){
+   if (hWrite == hDisk && status == 0){
       // Wait until device returns with ACK or NAK
       while ((status = ReadStatus()) == EBUSY);
    } //else {
@@ -764,12 +1341,8 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
    if (status == 0)
    {
       struct timespec ts;
-      int ret;
 
-      ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-      if (ret < 0) {
-         return ret;
-      }
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       uint64_t ticks = ts.tv_sec * NANO + ts.tv_nsec;
       uint32_t bytesToRead = dwMaxPacketSize&(~(DISK_SECTOR_SIZE - 1));
       for (uint64_t tmp_sectors = sectors; tmp_sectors > 0; tmp_sectors -= (bytesToRead / DISK_SECTOR_SIZE)) {
@@ -778,65 +1351,57 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
          }
          if (hWrite == hDisk)
          {
-            // Writing to disk and reading from file...
-            dwBytesRead = 0;
-            if (hRead != -1) {
-               uint32_t curpos = 0;
-               do {
-                  dwBytesRead = emmcdl_read(hRead, m_payload+curpos, bytesToRead - curpos);
-                  if (dwBytesRead < 0 && errno == EAGAIN) {
-                     // Read not complete
-                     printf("\n%s EAGAIN\n", __func__);
-                     continue;
-                  } else if (dwBytesRead > 0) {
-                     curpos += dwBytesRead;
-                  }
-               } while(dwBytesRead < 0);
-            }
-
-            if (dwBytesRead >= 0) {
-               status = sport->Write(m_payload, bytesToRead);
-               if (status != 0) {
+            // Writing to disk, data comes from the reader thread or is all zeros
+            CBuffer *pbuffer = NULL;
+            unsigned char *pData = m_fill;
+            if (bThread) {
+               uint64_t stallTs = Metrics::Now();
+               pbuffer = m_ring.GetFilled();
+               if (pbuffer == NULL) {
+                  status = info.status ? info.status : EIO;
                   break;
                }
-               dwWriteOffset += dwBytesRead;
-               if (sport->InputBufferCount() > 0) {
-                  Log("\n");
-                  status =  ReadStatus();
-                  if (status == EBUSY || status == 0) {
-                     continue;
-                  } else {
-                     status = ERROR_INVALID_DATA;
-                     break;
-                  }
-               }
+               g_metrics.Record(METRIC_STALL_USB, stallTs);
+               pData = pbuffer->data;
             }
-            else {
-               // If there is partial data read out then write out next chunk to finish this up
-               status = errno;
-               break;
+
+            uint64_t usbTs = Metrics::Now();
+            status = sport->Write(pData, bytesToRead);
+            g_metrics.Record(METRIC_USB_WRITE, usbTs, bytesToRead);
+
+            if (bThread) {
+               // Hand the buffer back so the reader can refill it
+               m_ring.Release();
             }
 
+            if (status < 0) {
+               break;
+            }
+            status = 0;
+            dwWriteOffset += bytesToRead;
+            if (sport->InputBufferCount() > 0) {
+               Log("\n");
+               status =  ReadStatus();
+               if (status == EBUSY || status == 0) {
+                  continue;
+               } else {
+                  status = ERROR_INVALID_DATA;
+                  break;
+               }
+            }
          }// Else this is a read command so read data from device in dwMaxPacketSize chunks
          else {
             uint32_t offset = 0;
-            CBuffer *pbuffer;
-            pthread_mutex_lock(&mutex);
-            if (list_head(&wnode) == &rnode) {
-               pbuffer = (CBuffer*)malloc(sizeof(*pbuffer) - sizeof(pbuffer->data) + dwMaxPacketSize);
-               if (!pbuffer) {
-                  status = errno;
-                  pthread_mutex_unlock(&mutex);
-                  break;
-               }
-               pbuffer->len = bytesToRead;
-               list_init(&pbuffer->blist);
-               list_add_head(&wnode, &pbuffer->blist);
-            } else {
-               pbuffer = (CBuffer*)list_head(&wnode);
-               pbuffer->len = bytesToRead;
+            uint64_t usbTs = Metrics::Now();
+            CBuffer *pbuffer = m_ring.GetFree();
+            if (pbuffer == NULL) {
+               // Writer thread gave up on the output file
+               status = info.status ? info.status : EIO;
+               break;
             }
-            pthread_mutex_unlock(&mutex);
+            g_metrics.Record(METRIC_STALL_USB, usbTs);
+            usbTs = Metrics::Now();
+            pbuffer->len = bytesToRead;
             while (offset < bytesToRead) {
                sport->SetTimeout(-1);
                dwBytesRead = ReadData(&pbuffer->data[offset], bytesToRead - offset, false);
@@ -852,20 +1417,13 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
                   break;
                }
             }
-
-            pthread_mutex_lock(&mutex);
-            list_remove(&wnode);
-            list_add_head(&pbuffer->blist, &wnode);
-            pthread_cond_signal(&cond);
-            pthread_mutex_unlock(&mutex);
+            g_metrics.Record(METRIC_USB_READ, usbTs, offset);
+            m_ring.Put();
          }
          printf("Sectors remaining %8lu%-*c\r", (tmp_sectors - (bytesToRead / DISK_SECTOR_SIZE)), speedWidth, '\0');
          //emmcdl_sleep_ms(10);
       }
-      ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-      if (ret < 0) {
-         return ret;
-      }
+      clock_gettime(CLOCK_MONOTONIC, &ts);
 
       uint64_t now =  ts.tv_sec * NANO + ts.tv_nsec;
       time_t  elapse = ts.tv_sec - startTs.tv_sec;
@@ -877,14 +1435,26 @@ int Firehose::FastCopy(int hRead, int64_t sectorRead, int hWrite, int64_t sector
 
    // Get the response after raw transfer is completed
    if (status == 0) {
+      WaitAck(METRIC_DATA_ACK);
       status = ReadStatus();
    }
 
-   if (hWrite != hDisk){
-      pthread_join(wid1,NULL); 
+   if (bThread) {
+      // Program path stops the reader if we bailed out early, dump path lets the writer drain
+      if (hWrite == hDisk || status != 0) {
+         m_ring.Close();
+      }
+      pthread_join(tid, NULL);
+      if (status == 0) {
+         status = info.status;
+      }
+   }
+
+   if (status == 0 && info.psha != NULL) {
+      unsigned char digest[SHA256_DIGEST_LEN];
+      SHA256Final(&sha, digest);
+      status = VerifyDigest(sectorWrite, sectors, partNum, digest);
    }
-   pthread_mutex_destroy(&mutex);
-   pthread_cond_destroy(&cond);
 
    return status;
 }
@@ -0,0 +1,238 @@
+/*****************************************************************************
+ * hdlc.cpp
+ *
+ * This file implements async HDLC framing. Data is copied a run at a time
+ * between flag and escape bytes, found 16 bytes per step with SSE2 or NEON,
+ * and the CRC16 is taken over each run as it is copied.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "hdlc.h"
+#include "crc.h"
+
+#define ERROR_INVALID_DATA  (-10)
+
+// CRC16Update over a frame's data and its own CRC bytes always comes to this
+#define HDLC_CRC_RESIDUE    0x0f47
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+size_t HdlcSpan(const unsigned char *buf, size_t len)
+{
+  const __m128i flag = _mm_set1_epi8(HDLC_FLAG);
+  const __m128i esc = _mm_set1_epi8(HDLC_ESC);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] == HDLC_FLAG || buf[i] == HDLC_ESC) {
+      break;
+    }
+  }
+  return i;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+
+size_t HdlcSpan(const unsigned char *buf, size_t len)
+{
+  const uint8x16_t flag = vdupq_n_u8(HDLC_FLAG);
+  const uint8x16_t esc = vdupq_n_u8(HDLC_ESC);
+  size_t i = 0;
+
+  // Only finds the block, the byte within it is picked out below
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(buf + i);
+    if (vmaxvq_u8(vorrq_u8(vceqq_u8(v, flag), vceqq_u8(v, esc))) != 0) {
+      break;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] == HDLC_FLAG || buf[i] == HDLC_ESC) {
+      break;
+    }
+  }
+  return i;
+}
+#else
+size_t HdlcSpan(const unsigned char *buf, size_t len)
+{
+  size_t i = 0;
+  for (; i < len; i++) {
+    if (buf[i] == HDLC_FLAG || buf[i] == HDLC_ESC) {
+      break;
+    }
+  }
+  return i;
+}
+#endif
+
+int HdlcEncode(const unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length)
+{
+  unsigned char *outPtr = out_buf;
+  unsigned short crc = 0;
+  size_t len = (size_t)in_length;
+  size_t i = 0;
+
+  if (in_length < 0 || *out_length < 2 * (in_length + 2) + 2) {
+    return ENOMEM;
+  }
+
+  // Encoded packets start and end with 0x7E
+  *outPtr++ = HDLC_FLAG;
+  while (i < len) {
+    size_t n = HdlcSpan(in_buf + i, len - i);
+    memcpy(outPtr, in_buf + i, n);
+    crc = CRC16Update(crc, in_buf + i, n);
+    outPtr += n;
+    i += n;
+    if (i < len) {
+      crc = CRC16Update(crc, in_buf + i, 1);
+      *outPtr++ = HDLC_ESC;
+      *outPtr++ = in_buf[i++] ^ HDLC_ESC_MASK;
+    }
+  }
+
+  // CRC goes out low byte first and is escaped like the data
+  unsigned char fcs[2] = { (unsigned char)(crc & 0xff), (unsigned char)(crc >> 8) };
+  for (int j = 0; j < 2; j++) {
+    if (fcs[j] == HDLC_FLAG || fcs[j] == HDLC_ESC) {
+      *outPtr++ = HDLC_ESC;
+      *outPtr++ = fcs[j] ^ HDLC_ESC_MASK;
+    }
+    else {
+      *outPtr++ = fcs[j];
+    }
+  }
+  *outPtr++ = HDLC_FLAG;
+
+  *out_length = (int)(outPtr - out_buf);
+  return 0;
+}
+
+int HdlcDecode(const unsigned char *in_buf, int in_length, unsigned char *out_buf, int *out_length)
+{
+  unsigned char *outPtr = out_buf;
+  unsigned char *outEnd = out_buf + *out_length;
+  unsigned short crc = 0;
+  size_t len = (size_t)in_length;
+  size_t i = 0;
+
+  if (in_length < 0) {
+    return EINVAL;
+  }
+
+  while (i < len) {
+    size_t n = HdlcSpan(in_buf + i, len - i);
+    // make sure our output buffer is large enough
+    if (n > (size_t)(outEnd - outPtr)) {
+      return ENOMEM;
+    }
+    memcpy(outPtr, in_buf + i, n);
+    crc = CRC16Update(crc, in_buf + i, n);
+    outPtr += n;
+    i += n;
+    if (i == len) {
+      break;
+    }
+    if (in_buf[i] == HDLC_FLAG) {
+      i++;
+      continue;
+    }
+    // A frame can't end in the middle of an escape
+    if (i + 1 == len || in_buf[i + 1] == HDLC_FLAG) {
+      return ERROR_INVALID_DATA;
+    }
+    if (outPtr == outEnd) {
+      return ENOMEM;
+    }
+    *outPtr = in_buf[i + 1] ^ HDLC_ESC_MASK;
+    crc = CRC16Update(crc, outPtr, 1);
+    outPtr++;
+    i += 2;
+  }
+
+  *out_length = (int)(outPtr - out_buf);
+  if (*out_length < 2 || crc != HDLC_CRC_RESIDUE) {
+    return ERROR_INVALID_DATA;
+  }
+  return 0;
+}
+
+HdlcFramer::HdlcFramer()
+{
+  buf = (unsigned char *)malloc(HDLC_RX_SIZE);
+  Reset();
+}
+
+HdlcFramer::~HdlcFramer()
+{
+  free(buf);
+}
+
+void HdlcFramer::Reset(void)
+{
+  start = 0;
+  scan = 0;
+  end = 0;
+}
+
+bool HdlcFramer::NextFrame(unsigned char **frame, uint32_t *len)
+{
+  // Flags between frames, a target may send several in a row
+  while (start < end && buf[start] == HDLC_FLAG) {
+    start++;
+  }
+
+  uint32_t pos = start + scan;
+  while (pos < end) {
+    pos += HdlcSpan(buf + pos, end - pos);
+    if (pos == end) {
+      break;
+    }
+    if (buf[pos] == HDLC_FLAG) {
+      *frame = buf + start;
+      *len = pos - start;
+      start = pos + 1;
+      scan = 0;
+      return true;
+    }
+    pos++;
+  }
+  scan = pos - start;
+  return false;
+}
+
+unsigned char *HdlcFramer::FreeSpace(uint32_t *len)
+{
+  if (buf == NULL) {
+    return NULL;
+  }
+  // Move the partial frame down once the end of the buffer runs short
+  if (start > 0 && (start == end || HDLC_RX_SIZE - end < HDLC_RX_SIZE / 4)) {
+    memmove(buf, buf + start, end - start);
+    end -= start;
+    start = 0;
+  }
+  // A frame that doesn't fit can never be completed
+  if (end == HDLC_RX_SIZE) {
+    return NULL;
+  }
+  *len = HDLC_RX_SIZE - end;
+  return buf + end;
+}
+
+void HdlcFramer::Fill(uint32_t bytes)
+{
+  end += bytes;
+}
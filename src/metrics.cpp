@@ -0,0 +1,238 @@
+/*****************************************************************************
+ * metrics.cpp
+ *
+ * This class implements latency histograms and the run summary for transfers
+ *
+ *****************************************************************************/
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "metrics.h"
+
+#define NANO 1000000000ULL
+
+Metrics g_metrics;
+
+static const char *metricNames[METRIC_COUNT] = {
+  "cmd_latency",
+  "data_ack",
+  "usb_write",
+  "usb_read",
+  "file_read",
+  "file_write",
+  "stall_usb",
+  "stall_file"
+};
+
+Metrics::Metrics()
+{
+  bEmitter = false;
+  emitStop = 0;
+  emitSeconds = 0;
+  Reset();
+}
+
+Metrics::~Metrics()
+{
+  StopEmitter();
+}
+
+uint64_t Metrics::Now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NANO + ts.tv_nsec;
+}
+
+void Metrics::Reset(void)
+{
+  for (int i=0; i < METRIC_COUNT; i++) {
+    metric_t *m = &metrics[i];
+    m->count = 0;
+    m->bytes = 0;
+    m->totalNs = 0;
+    m->minNs = UINT64_MAX;
+    m->maxNs = 0;
+    for (int b=0; b < METRIC_BUCKETS; b++) {
+      m->buckets[b] = 0;
+    }
+  }
+  startNs = Now();
+}
+
+void Metrics::Record(metric_e id, uint64_t start, uint64_t bytes)
+{
+  metric_t *m = &metrics[id];
+  uint64_t ns = Now() - start;
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+
+  while (us > 0 && bucket < METRIC_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+
+  m->count.fetch_add(1, std::memory_order_relaxed);
+  m->bytes.fetch_add(bytes, std::memory_order_relaxed);
+  m->totalNs.fetch_add(ns, std::memory_order_relaxed);
+  m->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  if (ns < m->minNs) m->minNs = ns;
+  if (ns > m->maxNs) m->maxNs = ns;
+}
+
+// Upper bound of the bucket holding the given percentile, in microseconds
+uint64_t Metrics::Percentile(metric_e id, uint32_t pct)
+{
+  metric_t *m = &metrics[id];
+  uint64_t count = m->count;
+  uint64_t target = (count * pct + 99) / 100;
+  uint64_t seen = 0;
+
+  if (count == 0) {
+    return 0;
+  }
+  for (int b=0; b < METRIC_BUCKETS; b++) {
+    seen += m->buckets[b];
+    if (seen >= target) {
+      return (uint64_t)1 << b;
+    }
+  }
+  return (uint64_t)1 << (METRIC_BUCKETS - 1);
+}
+
+// Which stage cost the most time. Time the USB side spent waiting on the ring is
+// time the host file side held it up, in either direction.
+const char *Metrics::Bottleneck(void)
+{
+  uint64_t hostNs = metrics[METRIC_STALL_USB].totalNs;
+  uint64_t usbNs = metrics[METRIC_USB_WRITE].totalNs + metrics[METRIC_USB_READ].totalNs;
+  uint64_t targetNs = metrics[METRIC_CMD_LATENCY].totalNs + metrics[METRIC_DATA_ACK].totalNs;
+
+  if (metrics[METRIC_USB_WRITE].count == 0 && metrics[METRIC_USB_READ].count == 0) {
+    return "none";
+  }
+  if (hostNs >= usbNs && hostNs >= targetNs) {
+    return "host_disk";
+  }
+  return (targetNs > usbNs) ? "target_storage" : "usb";
+}
+
+void Metrics::PrintSummary(void)
+{
+  double elapsed = (double)(Now() - startNs) / NANO;
+
+  printf("\nTransfer metrics over %.3f s\n", elapsed);
+  printf("  %-12s %10s %10s %10s %10s %10s %10s\n", "metric", "count", "MB", "MB/s", "avg us", "p50 us", "p99 us");
+  for (int i=0; i < METRIC_COUNT; i++) {
+    metric_t *m = &metrics[i];
+    if (m->count == 0) continue;
+    double mb = (double)m->bytes / 1024 / 1024;
+    double busy = (double)m->totalNs / NANO;
+    printf("  %-12s %10lu %10.1f %10.1f %10.1f %10lu %10lu\n", metricNames[i], (uint64_t)m->count, mb,
+           busy > 0 ? mb / busy : 0.0, (double)m->totalNs / m->count / 1000,
+           Percentile((metric_e)i, 50), Percentile((metric_e)i, 99));
+  }
+  for (int i=0; i < METRIC_COUNT; i++) {
+    metric_t *m = &metrics[i];
+    if (m->count == 0) continue;
+    printf("  %s histogram (us):", metricNames[i]);
+    for (int b=0; b < METRIC_BUCKETS; b++) {
+      if (m->buckets[b] == 0) continue;
+      printf(" <%lu:%lu", (uint64_t)1 << b, (uint64_t)m->buckets[b]);
+    }
+    printf("\n");
+  }
+  printf("  bottleneck: %s\n", Bottleneck());
+}
+
+int Metrics::WriteJSON(const char *szFileName)
+{
+  FILE *fp = fopen(szFileName, "w");
+  if (fp == NULL) {
+    return errno;
+  }
+
+  fprintf(fp, "{\n  \"elapsed_ns\": %lu,\n  \"bottleneck\": \"%s\",\n  \"metrics\": {", Now() - startNs, Bottleneck());
+  for (int i=0; i < METRIC_COUNT; i++) {
+    metric_t *m = &metrics[i];
+    uint64_t count = m->count;
+    fprintf(fp, "%s\n    \"%s\": {\"count\": %lu, \"bytes\": %lu, \"total_ns\": %lu, \"min_ns\": %lu, \"max_ns\": %lu, "
+            "\"p50_us\": %lu, \"p90_us\": %lu, \"p99_us\": %lu, \"buckets_us\": [",
+            i ? "," : "", metricNames[i], count, (uint64_t)m->bytes, (uint64_t)m->totalNs,
+            count ? (uint64_t)m->minNs : 0, (uint64_t)m->maxNs,
+            Percentile((metric_e)i, 50), Percentile((metric_e)i, 90), Percentile((metric_e)i, 99));
+    for (int b=0; b < METRIC_BUCKETS; b++) {
+      fprintf(fp, "%s%lu", b ? ", " : "", (uint64_t)m->buckets[b]);
+    }
+    fprintf(fp, "]}");
+  }
+  fprintf(fp, "\n  }\n}\n");
+
+  if (fclose(fp) != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+// One JSON line per interval with the rates seen since the previous line
+void Metrics::Emit(uint64_t *lastBytes, uint64_t *lastNs)
+{
+  uint64_t now = Now();
+  double secs = (double)(now - *lastNs) / NANO;
+
+  fprintf(stderr, "{\"t_ms\": %lu", (now - startNs) / 1000000);
+  for (int i=0; i < METRIC_COUNT; i++) {
+    uint64_t bytes = metrics[i].bytes;
+    if (i == METRIC_USB_WRITE || i == METRIC_USB_READ || i == METRIC_FILE_READ || i == METRIC_FILE_WRITE) {
+      fprintf(stderr, ", \"%s_mb_s\": %.1f", metricNames[i], secs > 0 ? (double)(bytes - lastBytes[i]) / 1024 / 1024 / secs : 0.0);
+    }
+    lastBytes[i] = bytes;
+  }
+  fprintf(stderr, ", \"stall_usb_ms\": %lu, \"stall_file_ms\": %lu}\n",
+          (uint64_t)metrics[METRIC_STALL_USB].totalNs / 1000000, (uint64_t)metrics[METRIC_STALL_FILE].totalNs / 1000000);
+  *lastNs = now;
+}
+
+void *Metrics::EmitterThread(void *arg)
+{
+  Metrics *pm = (Metrics *)arg;
+  uint64_t lastBytes[METRIC_COUNT] = {0};
+  uint64_t lastNs = Now();
+  uint32_t ticks = 0;
+
+  // Sleep in short steps so StopEmitter doesn't wait out a whole interval
+  while (!pm->emitStop) {
+    usleep(100000);
+    if (++ticks >= pm->emitSeconds * 10) {
+      pm->Emit(lastBytes, &lastNs);
+      ticks = 0;
+    }
+  }
+  return NULL;
+}
+
+int Metrics::StartEmitter(uint32_t seconds)
+{
+  if (seconds == 0) {
+    return EINVAL;
+  }
+  StopEmitter();
+  emitSeconds = seconds;
+  emitStop = 0;
+  if (pthread_create(&emitTid, NULL, EmitterThread, this) != 0) {
+    return errno;
+  }
+  bEmitter = true;
+  return 0;
+}
+
+void Metrics::StopEmitter(void)
+{
+  if (bEmitter) {
+    emitStop = 1;
+    pthread_join(emitTid, NULL);
+    bEmitter = false;
+  }
+}
@@ -25,8 +25,12 @@ when       who     what, where, why
 #include "stdio.h"
 
 #include "partition.h"
+#include "crc.h"
 #include "protocol.h"
 #include "sparse.h"
+#include "zeroscan.h"
+#include "sha256.h"
+#include "digestcache.h"
 
 #include "sysdeps.h"
 #include <stdlib.h>
@@ -103,48 +107,26 @@ void Partition::EnableVerbose()
   bVerbose = true;
 }
 
-
-int Partition::Reflect(int data, int len)
+void Partition::EnableZeroScan()
 {
-    int ref = 0;
+  bZeroScan = true;
+}
 
-    for(int i=0; i < len; i++) {
-        if(data & 0x1) {
-            ref |= (1 << ((len - 1) - i));
-        }
-        data = (data >> 1);
-    }
+void Partition::EnableDelta()
+{
+  bDelta = true;
+}
 
-   return ref;
+// 0 turns read-ahead off
+void Partition::SetReadAhead(__uint64_t bytes)
+{
+  readahead_budget = bytes;
 }
 
+
 unsigned int Partition::CalcCRC32(unsigned char *buffer, int len)
 {
-   int k = 8;                   // length of unit (i.e. byte)
-   int MSB = 0;
-   int gx = 0x04C11DB7;         // IEEE 32bit polynomial
-   int regs = 0xFFFFFFFF;       // init to all ones
-   int regsMask = 0xFFFFFFFF;   // ensure only 32 bit answer
-   int regsMSB = 0;
-
-   for( int i=0; i < len; i++) {
-     unsigned char DataByte = buffer[i];
-     DataByte = (unsigned char)Reflect(DataByte,8);
-     for(int j=0; j < k; j++) {
-       MSB = DataByte >> (k-1);  // get MSB
-       MSB &= 1;                 // ensure just 1 bit
-       regsMSB = (regs>>31) & 1; // MSB of regs
-       regs = regs<<1;           // shift regs for CRC-CCITT
-       if(regsMSB ^ MSB) {       // MSB is a 1
-         regs = regs ^ gx;       // XOR with generator poly
-       }
-       regs = regs & regsMask;   // Mask off excess upper bits
-       DataByte <<= 1;           // get to next bit
-     }
-   }
-
-   regs = regs & regsMask;       // Mask off excess upper bits
-   return Reflect(regs,32) ^ 0xFFFFFFFF;
+   return ::CalcCRC32(buffer, len);
 }
 #if 0
 int Partition::ParseXMLString(char *line, const char *key, char *value)
@@ -165,78 +147,18 @@ int Partition::ParseXMLString(char *line, const char *key, char *value)
 #endif
 int Partition::ParseXMLEvaluate(char *expr, __uint64_t &value, PartitionEntry *pe) const
 {
-  // Parse simple expression understands -+/*, NUM_DISK_SECTORS,CRC32(offset:length)
-  char disk_sectors[64];
-  char *sptr, *sptr1, *sptr2;
-  sprintf(disk_sectors, "%lu", d_sectors);
-  expr = StringReplace(expr,"NUM_DISK_SECTORS",disk_sectors);
-  value = atoll(expr);
-
-  sptr = strstr(expr,"CRC32");
-  if( sptr != NULL ) {
-    char tmp[MAX_STRING_LEN];
-    sptr1 = strstr(sptr,"(") + 1;
-    if( sptr1 == NULL ) return EINVAL;
-    sptr2 = strstr(sptr1,",");
-    if( sptr2 == NULL ) return EINVAL;
-    strncpy(tmp,sptr1,(sptr2-sptr1));
-    tmp[sptr2-sptr1] = 0;
-    ParseXMLEvaluate(tmp, pe->crc_start, pe);
-    sptr1 = sptr2 + 1;
-    sptr2 = strstr(sptr1,")");
-    if( sptr2 == NULL ) return EINVAL;
-    strncpy(tmp,sptr1,(sptr2-sptr1));
-    tmp[sptr2-sptr1] = 0;
-    ParseXMLEvaluate(tmp, pe->crc_size,pe);
-    // Revome the CRC part set value 0
-    memset(sptr,' ',(sptr2-sptr+1));
-    value = 0;
-  }
-
-  sptr = strstr(expr,"*");
-  if( sptr != NULL ) {
-    // Found * do multiplication
-    char val1[64];
-    char val2[64];
-    strncpy(val1,expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,sptr+1);
-    value = atoll(val1) * atoll(val2);
-  }
-
-  sptr = strstr(expr,"/");
-  if( sptr != NULL ) {
-    // Found / do division
-    char val1[64];
-    char val2[64];
-    strncpy(val1,expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,sptr+1);
-    value = atoll(val1) / atoll(val2);
+  // Compiled once per distinct text, then evaluated against this disk size
+  expr_value_t v;
+  int status = exprCache.Evaluate(expr, d_sectors, &v);
+  if (status != 0) {
+    printf("Can't evaluate \"%s\"\n", expr);
+    return status;
   }
-
-  sptr = strstr(expr,"-");
-  if( sptr != NULL ) {
-    // Found - do subtraction
-    char val1[32];
-    char val2[32];
-    strncpy(val1,expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,sptr+1);
-    value = atoll(val1) - atoll(val2);
-  }
-  
-  sptr = strstr(expr,"+");
-  if( sptr != NULL ) {
-    // Found + do addition
-    char val1[32];
-    char val2[32];
-    strncpy(val1,expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,sptr+1);
-    value = atoll(val1) + atoll(val2);
+  value = v.value;
+  if (v.bCrc) {
+    pe->crc_start = v.crcStart;
+    pe->crc_size = v.crcLen;
   }
-
   return 0;
 }
 
@@ -253,15 +175,15 @@ int Partition::ParseXMLInt64(char *line, const char *key, __uint64_t &value, Par
   sptr++;
   eptr = strchr(sptr, '"');
 
-  if( eptr == NULL) return ERROR_INVALID_DATA;
+  if( eptr == NULL ) return ERROR_INVALID_DATA;
+  // Present but unusable is an error of its own, missing attributes may have defaults
+  if( eptr - sptr >= MAX_STRING_LEN ) return EINVAL;
 
   strncpy(tmp,sptr,eptr-sptr);
 
   tmp[eptr-sptr] = 0;
 
-  ParseXMLEvaluate(tmp,value, pe);
-
-  return 0;
+  return ParseXMLEvaluate(tmp,value, pe);
 }
 
 int Partition::ParseXMLOptions()
@@ -329,27 +251,32 @@ int Partition::ParseXMLKey(char *key, PartitionEntry *pe)
   }
 
   // All commands need start_sector, physical_partition_number and num_partition_sectors
-  if( ParseXMLInt64(key,"start_sector", pe->start_sector, pe) != 0 ) {
+  int status = ParseXMLInt64(key,"start_sector", pe->start_sector, pe);
+  if( status != 0 ) {
     Log("start_sector missing in XML line:%s\n",key);
-    return ERROR_INVALID_DATA;
+    return status;
   } else {
     Log("start_sector: %d ",  pe->start_sector);
   }
 	
   __uint64_t partNum;
-  if( ParseXMLInt64(key,"physical_partition_number", partNum, pe) != 0 ) {
+  status = ParseXMLInt64(key,"physical_partition_number", partNum, pe);
+  if( status != 0 ) {
     Log("physical_partition_number missing in XML line\n");
-    return ERROR_INVALID_DATA;
+    return status;
   } else {
     pe->physical_partition_number = (uint8_t)partNum;
     Log("physical_partition_number: %i ", pe->physical_partition_number);
   }
 
-  if( ParseXMLInt64(key,"num_partition_sectors", pe->num_sectors, pe) == 0 ) {
+  status = ParseXMLInt64(key,"num_partition_sectors", pe->num_sectors, pe);
+  if( status == 0 ) {
     Log("num_partition_sectors: %d ", pe->num_sectors);
     // If zero then write out all sectors for size of file
-  } else {
+  } else if( status == ERROR_INVALID_DATA ) {
     pe->num_sectors = (__uint64_t )-1;
+  } else {
+    return status;
   }
 
   if( pe->eCmd == CMD_PATCH || pe->eCmd == CMD_PROGRAM || pe->eCmd == CMD_READ || pe->eCmd == CMD_SIMLOCK) {
@@ -368,10 +295,13 @@ int Partition::ParseXMLKey(char *key, PartitionEntry *pe)
 
 
     // File sector offset is optional for both these otherwise use default
-    if( ParseXMLInt64(key,"file_sector_offset", pe->offset, pe) == 0 ) {
+    status = ParseXMLInt64(key,"file_sector_offset", pe->offset, pe);
+    if( status == 0 ) {
 			Log("file_sector_offset: %d ", pe->offset);
-    } else {
+    } else if( status == ERROR_INVALID_DATA ) {
       pe->offset = (__uint64_t )-1;
+    } else {
+      return status;
     }
 	
     // The following entries should only be used in patching
@@ -379,28 +309,31 @@ int Partition::ParseXMLKey(char *key, PartitionEntry *pe)
       // Get the value parameter
 	  pe->crc_start = (uint64_t) -1;
       pe->crc_size = (uint64_t) -1;
-      if( ParseXMLInt64(key,"value", pe->patch_value, pe) == 0 ) {
+      status = ParseXMLInt64(key,"value", pe->patch_value, pe);
+      if( status == 0 ) {
 	      Log("value: %d ", pe->patch_value);
 	    } else {
         Log("value missing in patch command\n");
-        return ERROR_INVALID_DATA;
+        return status;
       }
       Log("crc_size: %i ", (int)pe->crc_size);
 
       // get byte offset for patch value to be written
-      if( ParseXMLInt64(key,"byte_offset", pe->patch_offset, pe) == 0 ) {
+      status = ParseXMLInt64(key,"byte_offset", pe->patch_offset, pe);
+      if( status == 0 ) {
 	      Log("patch_offset: %d ", pe->patch_offset);
 	    } else {
         Log("byte_offset missing in patch command\n");
-        return ERROR_INVALID_DATA;
+        return status;
       }
 
       // Get the size of the patch in bytes
-      if( ParseXMLInt64(key,"size_in_bytes", pe->patch_size, pe) == 0 ) {
+      status = ParseXMLInt64(key,"size_in_bytes", pe->patch_size, pe);
+      if( status == 0 ) {
 	     Log("patch_size: %d ", pe->patch_size);
 	    } else {
         Log("size_in_bytes missing in patch command\n");
-        return ERROR_INVALID_DATA;
+        return status;
       }
 
     } // end of CMD_PATCH
@@ -411,10 +344,31 @@ int Partition::ParseXMLKey(char *key, PartitionEntry *pe)
 
 
 
+// Images are found in the image directory if given, else next to the XML file
+void Partition::GetImagePath(const char *filename, char *imgfname)
+{
+  const char* ptr = xmlFilename ? rindex(xmlFilename,'/'): NULL;
+  if (ptr != NULL) {
+     if (imgDir != NULL) {
+         sprintf(imgfname, "%s/%s", imgDir, filename);
+     } else {
+         strncpy(imgfname, xmlFilename, ptr - xmlFilename);
+         sprintf(&imgfname[ptr - xmlFilename], "/%s", filename);
+     }
+  } else {
+     if (imgDir != NULL) {
+         sprintf(imgfname, "%s/%s", imgDir, filename);
+     } else {
+         strcpy(imgfname, filename);
+     }
+  }
+}
+
 int Partition::ProgramPartitionEntry(Protocol *proto, PartitionEntry pe, char *key)
 {
   int hRead = -1;
   bool bSparse = false;
+  char imgfname[MAX_PATH];
   int status = 0;
 
   if (proto == NULL) {
@@ -423,34 +377,21 @@ int Partition::ProgramPartitionEntry(Protocol *proto, PartitionEntry pe, char *k
   }
 
   if (strcmp(pe.filename, "ZERO") == 0) {
+    // Let the protocol clear the range on the target rather than sending zeros
     printf("Zeroing out area\n");
+    return proto->EraseSectors(pe.start_sector, pe.num_sectors, pe.physical_partition_number);
   }
   else {
     // First check if the file is a sparse image then program via sparse
     SparseImage sparse;
-    char imgfname[MAX_PATH];
-    const char* ptr = xmlFilename ? rindex(xmlFilename,'/'): NULL;
-    if (ptr != NULL) {
-       if (imgDir != NULL) {
-           sprintf(imgfname, "%s/%s", imgDir, pe.filename);
-       } else {
-           strncpy(imgfname, xmlFilename, ptr - xmlFilename);
-           sprintf(&imgfname[ptr - xmlFilename], "/%s", pe.filename);
-       }
-    } else {
-       if (imgDir != NULL) {
-           sprintf(imgfname, "%s/%s", imgDir, pe.filename);
-       } else {
-           strcpy(imgfname, pe.filename);
-       }
-    }
+    GetImagePath(pe.filename, imgfname);
 
     printf("\nSparse image:%s\n", imgfname);
     status = sparse.PreLoadImage(imgfname);
     if (status == 0) {
       bSparse = true;
       printf("detected \n-- loading sparse...\n");
-      status = sparse.ProgramImage(proto, pe.start_sector*proto->GetDiskSectorSize());
+      status = sparse.ProgramImage(proto, pe.start_sector*proto->GetDiskSectorSize(), pe.physical_partition_number);
     }
     else
     {
@@ -486,30 +427,575 @@ int Partition::ProgramPartitionEntry(Protocol *proto, PartitionEntry pe, char *k
   if (status == 0 && !bSparse) {
     // Fast copy from input file to output disk
     Log("In offset: %lu out offset: %lu sectors: %lu\n", pe.offset, pe.start_sector, pe.num_sectors);
-    status = proto->FastCopy(hRead, pe.offset, proto->GetDiskHandle(),  pe.start_sector, pe.num_sectors,pe.physical_partition_number);
+    if (bDelta) {
+      status = ProgramDelta(proto, hRead, &pe, imgfname);
+    }
+    else {
+      status = ProgramRange(proto, hRead, &pe);
+    }
   }
   if (hRead > 0)
     emmcdl_close(hRead);
   return status;
 }
 
-int Partition::ProgramImage(Protocol *proto)
+// Send bytes [start, end) of the entry, from the file or as an erase of the range
+int Partition::ProgramExtent(Protocol *proto, int hRead, PartitionEntry *pe, __uint64_t start, __uint64_t end, bool bZero)
 {
+  int iSectorSize = proto->GetDiskSectorSize();
+  __uint64_t sectors = (end - start) / iSectorSize;
+
+  if (sectors == 0) {
+    return 0;
+  }
+  if (bZero) {
+    Log("Erase zero run out offset: %lu sectors: %lu\n", pe->start_sector + start / iSectorSize, sectors);
+    return proto->EraseSectors(pe->start_sector + start / iSectorSize, sectors, pe->physical_partition_number);
+  }
+
+  // FastCopy only seeks for a non-zero offset so position the file here,
+  // an entry without file_sector_offset reads from the start of the file
+  __uint64_t fileSector = (pe->offset == (__uint64_t)-1) ? 0 : pe->offset;
+  __uint64_t readSector = fileSector + start / iSectorSize;
+  if (emmcdl_lseek(hRead, readSector * iSectorSize, SEEK_SET) < 0) {
+    return errno;
+  }
+  return proto->FastCopy(hRead, readSector, proto->GetDiskHandle(), pe->start_sector + start / iSectorSize, sectors, pe->physical_partition_number);
+}
+
+// Split a raw image into data and zero extents on the fly. Data is sent at most
+// ZERO_SCAN_WINDOW behind the scan so the second read comes from the page cache.
+int Partition::ProgramZeroScan(Protocol *proto, int hRead, PartitionEntry *pe)
+{
+  int iSectorSize = proto->GetDiskSectorSize();
+  uint32_t block = (ZERO_SCAN_BLOCK % iSectorSize == 0) ? ZERO_SCAN_BLOCK : iSectorSize;
+  __uint64_t len = pe->num_sectors * iSectorSize;
+  __uint64_t base = (pe->offset == (__uint64_t)-1) ? 0 : pe->offset * iSectorSize;
+  __uint64_t dataStart = 0;
+  __uint64_t zeroStart = len;
+  __uint64_t zeroBytes = 0;
   int status = 0;
 
-  PartitionEntry pe;
+  unsigned char *buf = (unsigned char *)malloc(ZERO_SCAN_BUFFER);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+
+  __uint64_t off = 0;
+  while (off < len && status == 0) {
+    uint32_t chunk = (len - off < ZERO_SCAN_BUFFER) ? (uint32_t)(len - off) : ZERO_SCAN_BUFFER;
+    ssize_t bytes = pread(hRead, buf, chunk, base + off);
+    if (bytes < 0) {
+      status = errno;
+      break;
+    }
+    // Past the end of the file reads as zeros, the same padding FastCopy uses
+    if ((uint32_t)bytes < chunk) {
+      memset(buf + bytes, 0, chunk - bytes);
+    }
+
+    for (uint32_t pos = 0; pos < chunk && status == 0; pos += block) {
+      uint32_t n = (chunk - pos < block) ? chunk - pos : block;
+      __uint64_t cur = off + pos;
+      if (IsZeroBlock(buf + pos, n)) {
+        if (zeroStart == len) {
+          zeroStart = cur;
+        }
+        continue;
+      }
+      // Short zero runs stay part of the data around them
+      if (zeroStart != len && cur - zeroStart >= ZERO_RUN_MIN) {
+        status = ProgramExtent(proto, hRead, pe, dataStart, zeroStart, false);
+        if (status == 0) {
+          status = ProgramExtent(proto, hRead, pe, zeroStart, cur, true);
+        }
+        zeroBytes += cur - zeroStart;
+        dataStart = cur;
+      }
+      zeroStart = len;
+    }
+    off += chunk;
+
+    if (status == 0 && zeroStart - dataStart >= ZERO_SCAN_WINDOW && zeroStart != len) {
+      status = ProgramExtent(proto, hRead, pe, dataStart, zeroStart, false);
+      dataStart = zeroStart;
+    }
+    else if (status == 0 && zeroStart == len && off - dataStart >= ZERO_SCAN_WINDOW) {
+      status = ProgramExtent(proto, hRead, pe, dataStart, off, false);
+      dataStart = off;
+    }
+  }
+
+  if (status == 0) {
+    if (zeroStart != len && len - zeroStart >= ZERO_RUN_MIN) {
+      status = ProgramExtent(proto, hRead, pe, dataStart, zeroStart, false);
+      if (status == 0) {
+        status = ProgramExtent(proto, hRead, pe, zeroStart, len, true);
+      }
+      zeroBytes += len - zeroStart;
+    }
+    else {
+      status = ProgramExtent(proto, hRead, pe, dataStart, len, false);
+    }
+  }
+
+  free(buf);
+  if (zeroBytes > 0) {
+    printf("\nErased %lu of %lu MB as zero runs instead of sending them\n", zeroBytes / (1024*1024), len / (1024*1024));
+  }
+  return status;
+}
+
+// Whole raw image of an entry, pe may describe only part of the original entry
+int Partition::ProgramRange(Protocol *proto, int hRead, PartitionEntry *pe)
+{
+  if (bZeroScan) {
+    return ProgramZeroScan(proto, hRead, pe);
+  }
+  if (pe->offset == 0 && emmcdl_lseek(hRead, 0, SEEK_SET) < 0) {
+    return errno;
+  }
+  return proto->FastCopy(hRead, pe->offset, proto->GetDiskHandle(), pe->start_sector, pe->num_sectors, pe->physical_partition_number);
+}
+
+// Block digests of the image behind an entry, computed once per file and range.
+// szImage is the resolved path, XMLs in different directories may share file names.
+delta_digest_t *Partition::GetDeltaDigests(int hRead, PartitionEntry *pe, const char *szImage, int iSectorSize)
+{
+  __uint64_t fileSector = (pe->offset == (__uint64_t)-1) ? 0 : pe->offset;
+  __uint64_t len = pe->num_sectors * iSectorSize;
+  uint32_t blocks = (uint32_t)((len + DELTA_BLOCK - 1) / DELTA_BLOCK);
+  delta_digest_t *dd;
+  uint32_t count = (num_delta_cache < DELTA_CACHE_FILES) ? num_delta_cache : DELTA_CACHE_FILES;
+  sha256_ctx total;
+
+  for (uint32_t i=0; i < count; i++) {
+    dd = &delta_cache[i];
+    if (strcmp(dd->filename, szImage) == 0 && dd->offset == fileSector && dd->num_sectors == pe->num_sectors) {
+      return dd;
+    }
+  }
+
+  // Oldest image makes room once the cache is full
+  dd = &delta_cache[num_delta_cache % DELTA_CACHE_FILES];
+  if (num_delta_cache >= DELTA_CACHE_FILES) {
+    free(dd->digests);
+  }
+  memset(dd, 0, sizeof(*dd));
+  strcpy(dd->filename, szImage);
+  dd->offset = fileSector;
+  dd->num_sectors = pe->num_sectors;
+  dd->num_blocks = blocks;
+
+  // A previous run may already have hashed this very file
+  uint32_t size = 0;
+  if (g_digestcache.Load(hRead, szImage, DIGEST_CACHE_DELTA, DELTA_BLOCK, fileSector * iSectorSize, len,
+                         &dd->digests, &size) == 0) {
+    if (size == (blocks + 1) * SHA256_DIGEST_LEN) {
+      Log("Image digests for %s from %s\n", szImage, g_digestcache.GetDir());
+      num_delta_cache++;
+      return dd;
+    }
+    free(dd->digests);
+  }
+
+  unsigned char *buf = (unsigned char *)malloc(DELTA_BLOCK);
+  dd->digests = (unsigned char *)malloc((blocks + 1) * SHA256_DIGEST_LEN);
+  if (buf == NULL || dd->digests == NULL) {
+    free(buf);
+    free(dd->digests);
+    dd->digests = NULL;
+    return NULL;
+  }
+
+  SHA256Init(&total);
+  for (uint32_t b=0; b < blocks; b++) {
+    __uint64_t off = (__uint64_t)b * DELTA_BLOCK;
+    uint32_t chunk = (len - off < DELTA_BLOCK) ? (uint32_t)(len - off) : DELTA_BLOCK;
+    ssize_t bytes = pread(hRead, buf, chunk, fileSector * iSectorSize + off);
+    if (bytes < 0) {
+      free(buf);
+      free(dd->digests);
+      dd->digests = NULL;
+      return NULL;
+    }
+    // Tail of the last sector is padded with zeros on the target as well
+    if ((uint32_t)bytes < chunk) {
+      memset(buf + bytes, 0, chunk - bytes);
+    }
+    sha256_ctx sha;
+    SHA256Init(&sha);
+    SHA256Update(&sha, buf, chunk);
+    SHA256Final(&sha, dd->digests + b * SHA256_DIGEST_LEN);
+    SHA256Update(&total, buf, chunk);
+  }
+  SHA256Final(&total, dd->digests + blocks * SHA256_DIGEST_LEN);
+  free(buf);
+
+  g_digestcache.Store(hRead, szImage, DIGEST_CACHE_DELTA, DELTA_BLOCK, fileSector * iSectorSize, len,
+                      dd->digests, (blocks + 1) * SHA256_DIGEST_LEN);
+  num_delta_cache++;
+  return dd;
+}
+
+// Program only the DELTA_BLOCK ranges whose content on the target differs from the
+// image. One digest of the whole range settles unchanged partitions in a single
+// round trip, targets without digest support get the whole range programmed.
+int Partition::ProgramDelta(Protocol *proto, int hRead, PartitionEntry *pe, const char *szImage)
+{
+  int iSectorSize = proto->GetDiskSectorSize();
+  __uint64_t len = pe->num_sectors * iSectorSize;
+  unsigned char digest[SHA256_DIGEST_LEN];
+  int status;
+
+  if (DELTA_BLOCK % iSectorSize != 0) {
+    return ProgramRange(proto, hRead, pe);
+  }
+  delta_digest_t *dd = GetDeltaDigests(hRead, pe, szImage, iSectorSize);
+  if (dd == NULL) {
+    return ProgramRange(proto, hRead, pe);
+  }
+
+  status = proto->GetDigest(pe->start_sector, pe->num_sectors, pe->physical_partition_number, digest);
+  if (status != 0) {
+    printf("Target can't report digests, programming the whole image\n");
+    return ProgramRange(proto, hRead, pe);
+  }
+  if (memcmp(digest, dd->digests + dd->num_blocks * SHA256_DIGEST_LEN, SHA256_DIGEST_LEN) == 0) {
+    printf("Unchanged, skipping %lu sectors\n", pe->num_sectors);
+    return 0;
+  }
+
+  // Runs of changed blocks go out as one range
+  __uint64_t changed = 0;
+  __uint64_t runStart = len;
+  for (uint32_t b=0; b <= dd->num_blocks && status == 0; b++) {
+    __uint64_t off = (__uint64_t)b * DELTA_BLOCK;
+    bool bSame = true;
+    if (b < dd->num_blocks) {
+      __uint64_t sectors = ((len - off < DELTA_BLOCK) ? len - off : DELTA_BLOCK) / iSectorSize;
+      status = proto->GetDigest(pe->start_sector + off / iSectorSize, sectors, pe->physical_partition_number, digest);
+      if (status != 0) {
+        break;
+      }
+      bSame = memcmp(digest, dd->digests + b * SHA256_DIGEST_LEN, SHA256_DIGEST_LEN) == 0;
+    }
+    if (!bSame && runStart == len) {
+      runStart = off;
+    }
+    else if (bSame && runStart != len) {
+      __uint64_t end = (off < len) ? off : len;
+      PartitionEntry run = *pe;
+      run.offset = dd->offset + runStart / iSectorSize;
+      run.start_sector = pe->start_sector + runStart / iSectorSize;
+      run.num_sectors = (end - runStart) / iSectorSize;
+      Log("Delta program out offset: %lu sectors: %lu\n", run.start_sector, run.num_sectors);
+      status = ProgramRange(proto, hRead, &run);
+      changed += end - runStart;
+      runStart = len;
+    }
+  }
+
+  if (status == 0) {
+    printf("\nProgrammed %lu of %lu KB that differ on the target\n", changed / 1024, len / 1024);
+  }
+  return status;
+}
+
+void Partition::FreeDeltaCache(void)
+{
+  uint32_t count = (num_delta_cache < DELTA_CACHE_FILES) ? num_delta_cache : DELTA_CACHE_FILES;
+  for (uint32_t i=0; i < count; i++) {
+    free(delta_cache[i].digests);
+    delta_cache[i].digests = NULL;
+  }
+  num_delta_cache = 0;
+}
+
+// Walk the XML once and resolve every element before anything is sent. Parse errors
+// and missing images are reported here instead of halfway through a download.
+int Partition::CompilePlan(void)
+{
   char keyName[MAX_STRING_LEN];
   char *key;
+  uint32_t max_plan = num_plan;
+  int status = 0;
+
   while (GetNextXMLKey(keyName, &key) == 0) {
+    if (num_plan == max_plan) {
+      plan_entry_t *grown = (plan_entry_t *)realloc(plan, (max_plan + PLAN_GROW) * sizeof(plan_entry_t));
+      if (grown == NULL) {
+        return ENOMEM;
+      }
+      plan = grown;
+      max_plan += PLAN_GROW;
+    }
+    plan_entry_t *entry = &plan[num_plan++];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->status = ParseEntryKey(key, &entry->pe);
+    if (status != 0) {
+      continue;
+    }
+    if (entry->status == 0) {
+      status = ResolvePlanEntry(entry);
+    }
+    // Entries missing attributes are skipped as always, but one of ours whose
+    // attributes don't evaluate can't be sent raw either
+    else if (entry->status != ERROR_INVALID_DATA && entry->pe.eCmd != CMD_INVALID) {
+      printf("Can't compile %s entry %u\n", keyName, num_plan - 1);
+      status = entry->status;
+    }
+  }
+  bPlanned = true;
+  return status;
+}
+
+// Find the image behind a program or simlock entry and note its size and format
+int Partition::ResolvePlanEntry(plan_entry_t *entry)
+{
+  struct stat st;
+  uint32_t magic = 0;
+
+  if ((entry->pe.eCmd != CMD_PROGRAM && entry->pe.eCmd != CMD_SIMLOCK) || strcmp(entry->pe.filename, "ZERO") == 0) {
+    return 0;
+  }
+  GetImagePath(entry->pe.filename, entry->path);
+  int fd = emmcdl_open(entry->path, O_RDONLY);
+  if (fd < 0 && entry->pe.eCmd == CMD_SIMLOCK) {
+    // Simlock images are optional, SimlockPartitionEntry skips a missing one
+    entry->path[0] = '\0';
+    return 0;
+  }
+  if (fd < 0) {
+    int status = errno;
+    printf("Can't open image %s: %s\n", entry->path, strerror(status));
+    return status;
+  }
+  if (fstat(fd, &st) == 0) {
+    entry->file_size = st.st_size;
+  }
+  entry->bSparse = (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SPARSE_MAGIC);
+  emmcdl_close(fd);
+  return 0;
+}
+
+static void *ReadAheadThread(void *arg)
+{
+  readahead_batch_t *batch = (readahead_batch_t *)arg;
+
+  for (uint32_t i = batch->first; i < batch->last; i++) {
+    plan_entry_t *entry = &batch->plan[i];
+    if (entry->readahead == 0) {
+      continue;
+    }
+#ifndef _WIN32
+    int fd = emmcdl_open(entry->path, O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, (off_t)entry->readahead_off, (off_t)entry->readahead, POSIX_FADV_WILLNEED);
+      emmcdl_close(fd);
+    }
+#endif
+  }
+  batch->busy = false;
+  return NULL;
+}
+
+void Partition::ReadAheadJoin(void)
+{
+  if (bReadAheadThread) {
+    pthread_join(readahead_tid, NULL);
+    bReadAheadThread = false;
+  }
+}
+
+// Called as entry cur starts. Hints the images of the entries after it to the page
+// cache so the link goes from one partition to the next without a cold first read.
+// What is hinted but not yet sent stays within readahead_budget.
+void Partition::ReadAhead(uint32_t cur, int iSectorSize)
+{
+  if (cur < readahead_next) {
+    readahead_bytes -= plan[cur].readahead;
+  }
+  else {
+    readahead_next = cur + 1;
+  }
+
+  // The last batch is still being hinted, pick up from here next entry
+  if (readahead_batch.busy) {
+    return;
+  }
+  ReadAheadJoin();
+
+  uint32_t first = readahead_next;
+  while (readahead_next < num_plan && readahead_bytes < readahead_budget) {
+    plan_entry_t *entry = &plan[readahead_next++];
+    if (entry->status != 0 || entry->path[0] == '\0') {
+      continue;
+    }
+
+    // Raw images are read from file_sector_offset for num_partition_sectors, sparse ones whole
+    __uint64_t off = 0;
+    __uint64_t len = entry->file_size;
+    if (!entry->bSparse) {
+      if (entry->pe.offset != (__uint64_t)-1) {
+        off = entry->pe.offset * iSectorSize;
+      }
+      len = (off < entry->file_size) ? entry->file_size - off : 0;
+      if (entry->pe.num_sectors != 0 && entry->pe.num_sectors != (__uint64_t)-1 && len > entry->pe.num_sectors * iSectorSize) {
+        len = entry->pe.num_sectors * iSectorSize;
+      }
+    }
+    // An image larger than what is left gets its start hinted, that is the cold part
+    if (len > readahead_budget - readahead_bytes) {
+      len = readahead_budget - readahead_bytes;
+    }
+    entry->readahead_off = off;
+    entry->readahead = len;
+    readahead_bytes += len;
+    if (len > 0) {
+      Log("Read ahead %s %lu bytes at %lu\n", entry->path, len, off);
+    }
+  }
+
+  if (readahead_next > first) {
+    readahead_batch.plan = plan;
+    readahead_batch.first = first;
+    readahead_batch.last = readahead_next;
+    readahead_batch.busy = true;
+    if (pthread_create(&readahead_tid, NULL, ReadAheadThread, &readahead_batch) == 0) {
+      bReadAheadThread = true;
+    }
+    else {
+      readahead_batch.busy = false;
+    }
+  }
+}
+
+void Partition::FreePlan(void)
+{
+  free(plan);
+  plan = NULL;
+  num_plan = 0;
+  bPlanned = false;
+}
+
+// Largest image the plan programs
+__uint64_t Partition::GetPartitionSize(void)
+{
+  __uint64_t size = 0;
+  for (uint32_t i=0; i < num_plan; i++) {
+    if (plan[i].file_size > size) {
+      size = plan[i].file_size;
+    }
+  }
+  return size;
+}
+
+static void JSONString(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(fp, "\\%c", *str);
+    }
+    else if ((unsigned char)*str < 0x20) {
+      fprintf(fp, "\\u%04x", (unsigned char)*str);
+    }
+    else {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+// Plan as one JSON object, sector values that count back from the end of the disk are negative
+int Partition::WritePlanJSON(FILE *fp)
+{
+  static const char *cmdNames[] = {
+    "raw", "patch", "zeroout", "program", "options", "search_path", "read", "erase", "nop", "peek", "simlock"
+  };
+  uint32_t n = 0;
+
+  fprintf(fp, "{\"xml\": ");
+  JSONString(fp, xmlFilename ? xmlFilename : "");
+  fprintf(fp, ", \"entries\": [");
+  for (uint32_t i=0; i < num_plan; i++) {
+    plan_entry_t *entry = &plan[i];
+    PartitionEntry *pe = &entry->pe;
+    if (entry->status != 0 && pe->eCmd != CMD_INVALID) {
+      continue;
+    }
+    if (pe->eCmd == CMD_NOP || pe->eCmd > CMD_SIMLOCK) {
+      continue;
+    }
+    fprintf(fp, "%s\n  {\"cmd\": \"%s\"", n++ ? "," : "", cmdNames[pe->eCmd]);
+    if (entry->status != 0) {
+      fprintf(fp, ", \"element\": ");
+      JSONString(fp, entry->key);
+      fprintf(fp, "}");
+      continue;
+    }
+    fprintf(fp, ", \"lun\": %u, \"start_sector\": %li, \"num_sectors\": %li",
+            pe->physical_partition_number, (int64_t)pe->start_sector, (int64_t)pe->num_sectors);
+    if (pe->eCmd == CMD_PROGRAM || pe->eCmd == CMD_SIMLOCK || pe->eCmd == CMD_READ || pe->eCmd == CMD_PATCH) {
+      fprintf(fp, ", \"filename\": ");
+      JSONString(fp, pe->filename);
+    }
+    if (entry->path[0] != '\0') {
+      fprintf(fp, ", \"path\": ");
+      JSONString(fp, entry->path);
+      fprintf(fp, ", \"file_size\": %lu, \"file_sector_offset\": %li, \"sparse\": %s",
+              entry->file_size, (int64_t)pe->offset, entry->bSparse ? "true" : "false");
+    }
+    if (pe->eCmd == CMD_PATCH) {
+      fprintf(fp, ", \"byte_offset\": %lu, \"size_in_bytes\": %lu, \"value\": %li",
+              pe->patch_offset, pe->patch_size, (int64_t)pe->patch_value);
+      if (pe->crc_size != (__uint64_t)-1) {
+        fprintf(fp, ", \"crc_start\": %li, \"crc_size\": %lu", (int64_t)pe->crc_start, pe->crc_size);
+      }
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n]}");
+  return ferror(fp) ? EIO : 0;
+}
+
+int Partition::ProgramImage(Protocol *proto)
+{
+  int status = 0;
+
+  if (!bPlanned) {
+    status = CompilePlan();
+    if (status != 0) {
+      return status;
+    }
+  }
+
+  readahead_bytes = 0;
+  readahead_next = 0;
+  for (uint32_t i=0; i < num_plan; i++) {
+    plan[i].readahead = 0;
+  }
+
+  for (uint32_t i=0; i < num_plan; i++) {
+    PartitionEntry pe = plan[i].pe;
+    char *key = plan[i].key;
+    ReadAhead(i, proto->GetDiskSectorSize());
     // parse the XML key if we don't understand it then continue
-    if (ParseXMLKey(key, &pe) != 0) {
+    if (plan[i].status != 0) {
       // If we don't understand the command just try sending it otherwise ignore command
       if (pe.eCmd == CMD_INVALID) {
         status = proto->ProgramRawCommand(key);
       }
     }
     else if (pe.eCmd == CMD_PROGRAM) {
-      status = ProgramPartitionEntry(proto, pe, key);
+      if (HostPatchTouches(&pe, proto->GetDiskSectorSize())) {
+        status = LoadHostImage(proto, &pe);
+      }
+      else {
+        status = ProgramPartitionEntry(proto, pe, key);
+      }
     }
     else if (pe.eCmd == CMD_SIMLOCK) {
       status = SimlockPartitionEntry(proto, pe, key);
@@ -532,9 +1018,243 @@ int Partition::ProgramImage(Protocol *proto)
     }
   }
 
+  ReadAheadJoin();
+
+  // Held images go out once the patches are in them
+  if (status == 0 && num_host_patches > 0) {
+    status = ApplyHostPatches(proto);
+  }
+  FreeHostPatches();
+
+  // Patches may still be queued by the protocol
+  if (status == 0) {
+    status = proto->FlushPatches();
+  }
+  return status;
+}
+
+int Partition::ParseEntryKey(char *key, PartitionEntry *pe)
+{
+  int status = ParseXMLKey(key, pe);
+
+  // Only the host patched LUN has a known size, NUM_DISK_SECTORS elsewhere is left to the target
+  if (status == 0 && num_host_patches > 0 && pe->physical_partition_number != host_lun) {
+    __uint64_t sectors = d_sectors;
+    d_sectors = 0;
+    status = ParseXMLKey(key, pe);
+    d_sectors = sectors;
+  }
+  return status;
+}
+
+// Read the DISK patches of a patch file so they can be applied to the images on the host
+// instead of on the target. The disk size is asked for once to resolve NUM_DISK_SECTORS.
+int Partition::LoadHostPatches(Protocol *proto, char *szPatchFile)
+{
+  Partition patch(0);
+  PartitionEntry pe;
+  char keyName[MAX_STRING_LEN];
+  char *key;
+  __uint64_t sectors = d_sectors;
+
+  int status = patch.PreLoadImage(szPatchFile);
+  if (status != 0) {
+    return status;
+  }
+
+  FreeHostPatches();
+  while (status == 0 && patch.GetNextXMLKey(keyName, &key) == 0) {
+    if (patch.ParseXMLKey(key, &pe) != 0 || pe.eCmd != CMD_PATCH || strcmp(pe.filename, "DISK") != 0) {
+      continue;
+    }
+    if (host_lun < 0) {
+      host_lun = pe.physical_partition_number;
+      status = proto->GetStorageSectors(pe.physical_partition_number, &d_sectors);
+      if (status != 0) {
+        break;
+      }
+      Log("LUN %i has %lu sectors\n", host_lun, d_sectors);
+      patch.d_sectors = d_sectors;
+      patch.ParseXMLKey(key, &pe);
+    }
+    else if (pe.physical_partition_number != host_lun) {
+      // One disk size per patch file
+      status = EINVAL;
+      break;
+    }
+
+    if (strlen(key) >= MAX_STRING_LEN) {
+      status = EINVAL;
+      break;
+    }
+    host_patch_t *patches = (host_patch_t *)realloc(host_patches, (num_host_patches + 1) * sizeof(host_patch_t));
+    if (patches == NULL) {
+      status = ENOMEM;
+      break;
+    }
+    host_patches = patches;
+    host_patch_t *p = &host_patches[num_host_patches++];
+    p->start_sector = pe.start_sector;
+    p->patch_value = pe.patch_value;
+    p->patch_offset = pe.patch_offset;
+    p->patch_size = pe.patch_size;
+    p->crc_start = pe.crc_start;
+    p->crc_size = pe.crc_size;
+    strcpy(p->key, key);
+  }
+
+  if (status != 0 || num_host_patches == 0) {
+    FreeHostPatches();
+    d_sectors = sectors;
+    host_lun = -1;
+    return (status != 0) ? status : ENOENT;
+  }
+  return 0;
+}
+
+// True if the program entry holds bytes that a DISK patch writes or checksums
+bool Partition::HostPatchTouches(PartitionEntry *pe, int iSectorSize)
+{
+  if (num_host_patches == 0 || num_host_images == HOST_PATCH_IMAGES || pe->physical_partition_number != host_lun ||
+      pe->num_sectors == (__uint64_t)-1 || pe->num_sectors * iSectorSize > HOST_PATCH_MAX_SIZE ||
+      strcmp(pe->filename, "ZERO") == 0) {
+    return false;
+  }
+
+  __uint64_t start = pe->start_sector * iSectorSize;
+  __uint64_t end = start + pe->num_sectors * iSectorSize;
+  for (uint32_t i=0; i < num_host_patches; i++) {
+    host_patch_t *p = &host_patches[i];
+    __uint64_t off = p->start_sector * iSectorSize + p->patch_offset;
+    if (off < end && off + p->patch_size > start) {
+      return true;
+    }
+    off = p->crc_start * iSectorSize;
+    if (p->crc_size != (__uint64_t)-1 && off < end && off + p->crc_size > start) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int Partition::LoadHostImage(Protocol *proto, PartitionEntry *pe)
+{
+  int iSectorSize = proto->GetDiskSectorSize();
+  char imgfname[MAX_PATH];
+  struct stat st;
+  int status = 0;
+
+  GetImagePath(pe->filename, imgfname);
+  int hRead = emmcdl_open(imgfname, O_RDONLY);
+  if (hRead < 0) {
+    return errno;
+  }
+  if (fstat(hRead, &st) != 0) {
+    status = errno;
+    emmcdl_close(hRead);
+    return status;
+  }
+
+  // Same sizing as programming from the file, rounded up to whole sectors
+  __uint64_t sectors = (st.st_size + iSectorSize - 1) / iSectorSize;
+  __uint64_t offset = (pe->offset == (__uint64_t)-1) ? 0 : pe->offset * iSectorSize;
+  if (sectors > pe->num_sectors) {
+    sectors = pe->num_sectors;
+  }
+  unsigned char *data = (unsigned char *)calloc(1, sectors * iSectorSize);
+  if (data == NULL) {
+    emmcdl_close(hRead);
+    return ENOMEM;
+  }
+  if (pread(hRead, data, sectors * iSectorSize, offset) < 0) {
+    status = errno;
+    free(data);
+  }
+  emmcdl_close(hRead);
+
+  if (status == 0) {
+    host_image_t *img = &host_images[num_host_images++];
+    img->start_sector = pe->start_sector;
+    img->num_sectors = sectors;
+    img->data = data;
+    Log("Holding %s (%lu sectors) for host patching\n", pe->filename, sectors);
+  }
+  return status;
+}
+
+host_image_t *Partition::FindHostImage(__uint64_t offset, __uint64_t len, int iSectorSize)
+{
+  for (uint32_t i=0; i < num_host_images; i++) {
+    __uint64_t start = host_images[i].start_sector * iSectorSize;
+    if (offset >= start && offset + len <= start + host_images[i].num_sectors * iSectorSize) {
+      return &host_images[i];
+    }
+  }
+  return NULL;
+}
+
+// Apply the patches in file order then program the held images. If a patch reaches
+// outside them the images go out as they are and the target patches like before.
+int Partition::ApplyHostPatches(Protocol *proto)
+{
+  int iSectorSize = proto->GetDiskSectorSize();
+  bool bHost = true;
+  int status = 0;
+
+  for (uint32_t i=0; i < num_host_patches && bHost; i++) {
+    host_patch_t *p = &host_patches[i];
+    if (p->patch_size > sizeof(p->patch_value) ||
+        FindHostImage(p->start_sector * iSectorSize + p->patch_offset, p->patch_size, iSectorSize) == NULL ||
+        (p->crc_size != (__uint64_t)-1 && FindHostImage(p->crc_start * iSectorSize, p->crc_size, iSectorSize) == NULL)) {
+      Log("Patch outside held images: %s\n", p->key);
+      bHost = false;
+    }
+  }
+
+  if (bHost) {
+    for (uint32_t i=0; i < num_host_patches; i++) {
+      host_patch_t *p = &host_patches[i];
+      __uint64_t value = p->patch_value;
+      if (p->crc_size != (__uint64_t)-1) {
+        host_image_t *img = FindHostImage(p->crc_start * iSectorSize, p->crc_size, iSectorSize);
+        value += CalcCRC32(&img->data[(p->crc_start - img->start_sector) * iSectorSize], (int)p->crc_size);
+      }
+      host_image_t *img = FindHostImage(p->start_sector * iSectorSize + p->patch_offset, p->patch_size, iSectorSize);
+      memcpy(&img->data[(p->start_sector - img->start_sector) * iSectorSize + p->patch_offset], &value, (size_t)p->patch_size);
+    }
+    printf("Applied %u patches on the host\n", num_host_patches);
+  }
+  else {
+    printf("Patches reach outside the images held on the host, patching on the target\n");
+  }
+
+  for (uint32_t i=0; i < num_host_images && status == 0; i++) {
+    host_image_t *img = &host_images[i];
+    uint32_t bytesWritten = 0;
+    status = proto->WriteData(img->data, img->start_sector * iSectorSize, img->num_sectors * iSectorSize, &bytesWritten, host_lun);
+  }
+
+  for (uint32_t i=0; i < num_host_patches && !bHost && status == 0; i++) {
+    PartitionEntry pe;
+    ParseXMLKey(host_patches[i].key, &pe);
+    status = proto->ProgramPatchEntry(pe, host_patches[i].key);
+  }
   return status;
 }
 
+void Partition::FreeHostPatches(void)
+{
+  for (uint32_t i=0; i < num_host_images; i++) {
+    free(host_images[i].data);
+  }
+  num_host_images = 0;
+  if (host_patches != NULL) {
+    free(host_patches);
+    host_patches = NULL;
+  }
+  num_host_patches = 0;
+}
+
 int Partition::SimlockPartitionEntry(Protocol *proto, PartitionEntry pe, char *key)
 {
   int hRead = -1;
@@ -0,0 +1,169 @@
+/*****************************************************************************
+ * progcache.cpp
+ *
+ * This class implements the process wide flash programmer cache
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "progcache.h"
+
+#define NANO 1000000000ULL
+
+ProgCache g_progcache;
+
+static int64_t MtimeNs(struct stat *st)
+{
+#ifdef _WIN32
+  return (int64_t)st->st_mtime * NANO;
+#else
+  return (int64_t)st->st_mtim.tv_sec * NANO + st->st_mtim.tv_nsec;
+#endif
+}
+
+ProgCache::ProgCache()
+{
+  memset(images, 0, sizeof(images));
+  useCount = 0;
+  pthread_mutex_init(&lock, NULL);
+}
+
+ProgCache::~ProgCache()
+{
+  for (int i=0; i < PROG_CACHE_FILES; i++) {
+    Unload(&images[i]);
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+// Programmers are a few MB at most, so they are read into memory rather than
+// mapped. A copy is unaffected by the file being rewritten in place while a
+// session still sends it, where a mapping would fault or change under it.
+int ProgCache::Load(prog_image_t *image, int fd, const char *szFile)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) != 0) {
+    return errno;
+  }
+  if (st.st_size == 0) {
+    return EINVAL;
+  }
+
+  image->data = (unsigned char *)malloc((size_t)st.st_size);
+  if (image->data == NULL) {
+    return ENOMEM;
+  }
+  for (off_t off = 0; off < st.st_size; ) {
+    ssize_t bytes = pread(fd, image->data + off, (size_t)(st.st_size - off), off);
+    if (bytes <= 0) {
+      free(image->data);
+      image->data = NULL;
+      return (bytes < 0) ? errno : EIO;
+    }
+    off += bytes;
+  }
+
+  snprintf(image->path, sizeof(image->path), "%s", szFile);
+  image->dev = st.st_dev;
+  image->ino = st.st_ino;
+  image->mtimeNs = MtimeNs(&st);
+  image->size = st.st_size;
+  image->bStale = false;
+  image->refs = 0;
+  return 0;
+}
+
+void ProgCache::Unload(prog_image_t *image)
+{
+  free(image->data);
+  memset(image, 0, sizeof(*image));
+}
+
+int ProgCache::Acquire(const char *szFile, prog_image_t **image)
+{
+  struct stat st;
+  prog_image_t *slot = NULL;
+  int status = 0;
+
+  *image = NULL;
+  int fd = emmcdl_open(szFile, O_RDONLY);
+  if (fd < 0) {
+    return ENOENT;
+  }
+  if (fstat(fd, &st) != 0) {
+    status = errno;
+    emmcdl_close(fd);
+    return status;
+  }
+
+  pthread_mutex_lock(&lock);
+  for (int i=0; i < PROG_CACHE_FILES; i++) {
+    prog_image_t *p = &images[i];
+    if (p->data == NULL || p->bStale || strcmp(p->path, szFile) != 0) {
+      continue;
+    }
+    if (p->dev == (uint64_t)st.st_dev && p->ino == (uint64_t)st.st_ino &&
+        p->size == (uint64_t)st.st_size && p->mtimeNs == MtimeNs(&st)) {
+      *image = p;
+      break;
+    }
+    // Rebuilt since it was loaded, sessions still using it keep the old copy
+    p->bStale = true;
+    if (p->refs == 0) {
+      Unload(p);
+    }
+  }
+
+  if (*image == NULL) {
+    // A free slot, else the least recently used image nobody is sending
+    for (int i=0; i < PROG_CACHE_FILES; i++) {
+      prog_image_t *p = &images[i];
+      if (p->data == NULL) {
+        slot = p;
+        break;
+      }
+      if (p->refs == 0 && (slot == NULL || p->lastUse < slot->lastUse)) {
+        slot = p;
+      }
+    }
+    if (slot == NULL) {
+      status = EBUSY;
+    }
+    else {
+      Unload(slot);
+      status = Load(slot, fd, szFile);
+      if (status == 0) {
+        *image = slot;
+      }
+    }
+  }
+
+  if (*image != NULL) {
+    (*image)->refs++;
+    (*image)->lastUse = ++useCount;
+  }
+  pthread_mutex_unlock(&lock);
+  emmcdl_close(fd);
+  return status;
+}
+
+void ProgCache::Release(prog_image_t *image)
+{
+  if (image == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  if (image->refs > 0) {
+    image->refs--;
+  }
+  if (image->refs == 0 && image->bStale) {
+    Unload(image);
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -192,10 +192,71 @@ int Protocol::GetDiskHandle(void)
   return hDisk;
 }
 
+uint32_t Protocol::GetMaxPayloadSize(void)
+{
+  return MAX_TRANSFER_SIZE;
+}
+
 int Protocol::WriteSimlockData(unsigned char *writeBuffer, int64_t writeOffset, uint32_t writeBytes, uint32_t *bytesWritten, uint8_t partNum) {
   return -1;
 }
 
+int Protocol::FillSectors(uint32_t pattern, int64_t start_sector, __uint64_t num_sectors, uint8_t partNum)
+{
+  uint32_t bytesWritten = 0;
+  int status = 0;
+
+  // All zeros is the same as a ZERO entry so let the protocol pick how to do that
+  if (pattern == 0) {
+    return EraseSectors(start_sector, num_sectors, partNum);
+  }
+
+  if (buffer1 == NULL) {
+    return ENOMEM;
+  }
+
+  // Build the pattern once and send the same buffer for the whole range
+  uint32_t *fill = (uint32_t *)buffer1;
+  for (uint32_t i = 0; i < MAX_TRANSFER_SIZE / sizeof(uint32_t); i++) {
+    fill[i] = pattern;
+  }
+
+  __uint64_t stride = MAX_TRANSFER_SIZE / DISK_SECTOR_SIZE;
+  while (num_sectors > 0 && status == 0) {
+    __uint64_t sectors = (num_sectors < stride) ? num_sectors : stride;
+    status = WriteData(buffer1, start_sector*DISK_SECTOR_SIZE, (uint32_t)(sectors*DISK_SECTOR_SIZE), &bytesWritten, partNum);
+    start_sector += sectors;
+    num_sectors -= sectors;
+  }
+
+  return status;
+}
+
+int Protocol::EraseSectors(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum)
+{
+  // No target side erase here, write zeros over the whole range
+  return FastCopy(-1, 0, hDisk, start_sector, num_sectors, partNum);
+}
+
+int Protocol::FlushPatches(void)
+{
+  // Patches are applied as they come unless the protocol queues them
+  return 0;
+}
+
+int Protocol::GetStorageSectors(uint8_t partNum, __uint64_t *sectors)
+{
+  // Only one disk here, its size is known once it is opened
+  *sectors = GetNumDiskSectors();
+  return (*sectors > 0) ? 0 : EINVAL;
+}
+
+int Protocol::GetDigest(int64_t start_sector, __uint64_t num_sectors, uint8_t partNum, unsigned char *digest)
+{
+  // Nothing on the other side to hash the range for us
+  return EINVAL;
+}
+
 int Protocol::DumpDiskContents(__uint64_t start_sector, __uint64_t num_sectors, char *szOutFile, uint8_t partNum, char *szPartName)
 {
   int status = 0;
@@ -20,14 +20,55 @@ when       who     what, where, why
 30/10/12   pgw     Initial version.
 =============================================================================*/
 
+#include <stdlib.h>
 #include "sahara.h"
+#include "metrics.h"
 #define ERROR_INVALID_DATA  (-10)
 #define ERROR_WRITE_FAULT (-19)
 
+// Longest the host waits in each state before giving up on the target. A PBL
+// that is there answers within a few ms, only image authentication takes longer.
+static const int stateTimeoutMs[SAHARA_STATE_COUNT] = {
+  50,     // SAHARA_STATE_WAIT_HELLO
+  200,    // SAHARA_STATE_WAIT_CMD_READY
+  1000,   // SAHARA_STATE_COMMAND
+  5000,   // SAHARA_STATE_IMAGE_TX
+  5000,   // SAHARA_STATE_WAIT_DONE
+  1000,   // SAHARA_STATE_WAIT_MEM_DEBUG
+  5000,   // SAHARA_STATE_MEM_READ
+  0       // SAHARA_STATE_DONE, nothing more is read
+};
+
+static const char *stateName[SAHARA_STATE_COUNT] = {
+  "hello", "cmdready", "command", "image", "done", "memdebug", "memread", "running"
+};
+
+// Where the handshake goes once the hello is answered with mode
+static sahara_state_e HelloState(int mode)
+{
+  if (mode == SAHARA_MODE_COMMAND) {
+    return SAHARA_STATE_WAIT_CMD_READY;
+  }
+  if (mode == SAHARA_MODE_MEMORY_DEBUG) {
+    return SAHARA_STATE_WAIT_MEM_DEBUG;
+  }
+  return SAHARA_STATE_IMAGE_TX;
+}
+
 Sahara::Sahara(SerialPort *port, int hLogFile)
 {
   sport = port;
   hLog = hLogFile;
+  hostMode = SAHARA_MODE_IMAGE_TX_PENDING;
+  prog = NULL;
+  memTableAddr = 0;
+  memTableLen = 0;
+  bMem64 = false;
+  rxLen = 0;
+  rxUsed = 0;
+  memset(stateNs, 0, sizeof(stateNs));
+  state = SAHARA_STATE_WAIT_HELLO;
+  stateStart = Metrics::Now();
 }
 
 void Sahara::Log(const char *str,...)
@@ -39,46 +80,311 @@ void Sahara::Log(const char *str,...)
   va_end(ap);
 }
 
+void Sahara::SetState(sahara_state_e next)
+{
+  uint64_t now = Metrics::Now();
+  stateNs[state] += now - stateStart;
+  stateStart = now;
+  state = next;
+}
+
+uint64_t Sahara::StateTime(sahara_state_e s)
+{
+  uint64_t ns = stateNs[s];
+  if (s == state) {
+    ns += Metrics::Now() - stateStart;
+  }
+  return ns;
+}
+
+void Sahara::LogStateTimes(void)
+{
+  Log("Sahara state times:");
+  for (int i=0; i < SAHARA_STATE_DONE; i++) {
+    uint64_t ns = StateTime((sahara_state_e)i);
+    if (ns > 0) {
+      Log(" %s %.1f ms", stateName[i], (double)ns / 1000000);
+    }
+  }
+  Log("\n");
+}
+
 int Sahara::DeviceReset()
 {
   execute_cmd_t exe_cmd;
   exe_cmd.cmd = SAHARA_RESET_REQ;
   exe_cmd.len = 0x8;
-  return sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd));
+  if (sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd)) < 0) {
+    return ERROR_WRITE_FAULT;
+  }
+  return 0;
+}
+
+// USB delivers one packet per read, a byte stream may split or join them so
+// anything past the packet returned is kept for the next call
+int Sahara::ReadPacket(unsigned char **pkt)
+{
+  unsigned char *buf = (unsigned char *)rxBuf;
+  cmd_hdr_t hdr;
+
+  if (rxUsed > 0) {
+    memmove(buf, buf + rxUsed, rxLen - rxUsed);
+    rxLen -= rxUsed;
+    rxUsed = 0;
+  }
+
+  sport->SetTimeout(stateTimeoutMs[state]);
+  for (;;) {
+    if (rxLen >= sizeof(hdr)) {
+      memcpy(&hdr, buf, sizeof(hdr));
+      if (hdr.len < sizeof(hdr) || hdr.len > sizeof(rxBuf)) {
+        Log("Invalid Sahara packet cmd:%i len:%i\n", hdr.cmd, hdr.len);
+        rxLen = 0;
+        return ERROR_INVALID_DATA;
+      }
+      if (rxLen >= hdr.len) {
+        break;
+      }
+    }
+    uint32_t bytesRead = sizeof(rxBuf) - rxLen;
+    if (sport->Read(buf + rxLen, &bytesRead) != 0 || bytesRead == 0) {
+      return ETIMEDOUT;
+    }
+    rxLen += bytesRead;
+  }
+
+  rxUsed = hdr.len;
+  *pkt = buf;
+  return 0;
+}
+
+// Data that isn't a packet, leftovers from the last read come first
+int Sahara::ReadRaw(unsigned char *buf, uint32_t len)
+{
+  unsigned char *rx = (unsigned char *)rxBuf;
+  uint32_t bytes = rxLen - rxUsed;
+
+  if (bytes > len) {
+    bytes = len;
+  }
+  memcpy(buf, rx + rxUsed, bytes);
+  rxUsed += bytes;
+
+  sport->SetTimeout(stateTimeoutMs[state]);
+  while (bytes < len) {
+    uint32_t bytesRead = len - bytes;
+    if (sport->Read(buf + bytes, &bytesRead) != 0 || bytesRead == 0) {
+      break;
+    }
+    bytes += bytesRead;
+  }
+  return (int)bytes;
+}
+
+int Sahara::SendHello(int mode)
+{
+  hello_req_t hello_rsp = {0};
+
+  hello_rsp.cmd = SAHARA_HELLO_RSP;
+  hello_rsp.len = 0x30;
+  hello_rsp.version = SAHARA_VERSION;
+  hello_rsp.version_min = SAHARA_VERSION_SUPPORTED;
+  hello_rsp.max_cmd_len = 0;
+  hello_rsp.mode = mode;
+
+  if (sport->Write((unsigned char *)&hello_rsp, sizeof(hello_rsp)) < 0) {
+    Log("Failed to write hello response back to device\n");
+    return -1;
+  }
+  SetState(HelloState(mode));
+  return 0;
+}
+
+int Sahara::SendImageData(unsigned char *pkt)
+{
+  cmd_hdr_t hdr;
+  uint64_t read_data_offset, read_data_len;
+
+  memcpy(&hdr, pkt, sizeof(hdr));
+  // Check if it is a 32-bit or 64-bit read
+  if (hdr.cmd == SAHARA_64BIT_MEMORY_READ_DATA && hdr.len >= sizeof(hdr) + sizeof(read_data_64_t)) {
+    read_data_64_t read_data64_req;
+    memcpy(&read_data64_req, pkt + sizeof(hdr), sizeof(read_data64_req));
+    read_data_offset = read_data64_req.data_offset;
+    read_data_len = read_data64_req.data_len;
+  }
+  else if (hdr.cmd == SAHARA_READ_DATA && hdr.len >= sizeof(hdr) + sizeof(read_data_t)) {
+    read_data_t read_data_req;
+    memcpy(&read_data_req, pkt + sizeof(hdr), sizeof(read_data_req));
+    read_data_offset = read_data_req.data_offset;
+    read_data_len = read_data_req.data_len;
+  }
+  else {
+    Log("Truncated read data request cmd:%i len:%i\n", hdr.cmd, hdr.len);
+    return ERROR_INVALID_DATA;
+  }
+
+  if (prog == NULL) {
+    Log("Read data request without a flash programmer to send\n");
+    return ERROR_INVALID_DATA;
+  }
+
+  // Past the end of the file is answered short, as a read() would have been
+  if (read_data_offset > prog->size) {
+    Log("Read at %lu is past the end of the flash programmer\n", read_data_offset);
+    return ERROR_INVALID_DATA;
+  }
+  if (read_data_len > prog->size - read_data_offset) {
+    read_data_len = prog->size - read_data_offset;
+  }
+
+  Log("FileOffset %lu bytesRead %lu\n", read_data_offset, read_data_len);
+
+  // One write of whatever length the target asked for
+  if (sport->Write(prog->data + read_data_offset, (uint32_t)read_data_len) < 0) {
+    Log("Failed to write data to device in IMEM\n");
+    return ERROR_WRITE_FAULT;
+  }
+  return 0;
+}
+
+// Moves the handshake on by one packet from the target
+int Sahara::HandlePacket(unsigned char *pkt)
+{
+  cmd_hdr_t hdr;
+
+  memcpy(&hdr, pkt, sizeof(hdr));
+  switch (state) {
+  case SAHARA_STATE_WAIT_HELLO:
+    if (hdr.cmd == SAHARA_HELLO_REQ && hdr.len >= sizeof(hello_req_t)) {
+      hello_req_t hello_req;
+      memcpy(&hello_req, pkt, sizeof(hello_req));
+      Log((char *)"Sahara version %d--%d \nmode %d.\n", hello_req.version_min, hello_req.version, hello_req.mode);
+      return SendHello(hostMode);
+    }
+    break;
+
+  case SAHARA_STATE_WAIT_CMD_READY:
+    if (hdr.cmd == SAHARA_CMD_READY) {
+      SetState(SAHARA_STATE_COMMAND);
+      return 0;
+    }
+    break;
+
+  case SAHARA_STATE_IMAGE_TX:
+    if (hdr.cmd == SAHARA_READ_DATA || hdr.cmd == SAHARA_64BIT_MEMORY_READ_DATA) {
+      return SendImageData(pkt);
+    }
+    if (hdr.cmd == SAHARA_END_TRANSFER && hdr.len >= sizeof(hdr) + sizeof(image_end_t)) {
+      image_end_t read_img_end;
+      memcpy(&read_img_end, pkt + sizeof(hdr), sizeof(read_img_end));
+      if (read_img_end.status != SAHARA_ERROR_SUCCESS) {
+        Log("Image load failed with status: %i\n", read_img_end.status);
+        return read_img_end.status;
+      }
+      done_t done_pkt = {0};
+      done_pkt.cmd = SAHARA_DONE_REQ;
+      done_pkt.len = 8;
+      if (sport->Write((unsigned char *)&done_pkt, 8) < 0) {
+        return ERROR_WRITE_FAULT;
+      }
+      SetState(SAHARA_STATE_WAIT_DONE);
+      return 0;
+    }
+    break;
+
+  case SAHARA_STATE_WAIT_DONE:
+    if (hdr.cmd == SAHARA_DONE_RSP) {
+      SetState(SAHARA_STATE_DONE);
+      return 0;
+    }
+    break;
+
+  case SAHARA_STATE_WAIT_MEM_DEBUG:
+    if (hdr.cmd == SAHARA_MEMORY_DEBUG && hdr.len >= sizeof(hdr) + sizeof(memory_debug_t)) {
+      memory_debug_t mem_debug;
+      memcpy(&mem_debug, pkt + sizeof(hdr), sizeof(mem_debug));
+      memTableAddr = mem_debug.table_addr;
+      memTableLen = mem_debug.table_len;
+      bMem64 = false;
+      SetState(SAHARA_STATE_MEM_READ);
+      return 0;
+    }
+    if (hdr.cmd == SAHARA_64BIT_MEMORY_DEBUG && hdr.len >= sizeof(hdr) + sizeof(memory_debug_64_t)) {
+      memory_debug_64_t mem_debug;
+      memcpy(&mem_debug, pkt + sizeof(hdr), sizeof(mem_debug));
+      memTableAddr = mem_debug.table_addr;
+      memTableLen = mem_debug.table_len;
+      bMem64 = true;
+      SetState(SAHARA_STATE_MEM_READ);
+      return 0;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  // PBL ends the transfer with a NAK status when it doesn't like what we sent
+  if (hdr.cmd == SAHARA_END_TRANSFER && hdr.len >= sizeof(hdr) + sizeof(image_end_t)) {
+    image_end_t read_img_end;
+    memcpy(&read_img_end, pkt + sizeof(hdr), sizeof(read_img_end));
+    Log("Sahara %s: target ended transfer with status: %i\n", stateName[state], read_img_end.status);
+    return read_img_end.status ? (int)read_img_end.status : ERROR_INVALID_DATA;
+  }
+  Log("Sahara %s: unexpected packet cmd:%i\n", stateName[state], hdr.cmd);
+  return ERROR_INVALID_DATA;
+}
+
+int Sahara::RunUntil(sahara_state_e target)
+{
+  unsigned char *pkt;
+  int status = 0;
+
+  while (state != target) {
+    status = ReadPacket(&pkt);
+    if (status == 0) {
+      status = HandlePacket(pkt);
+    }
+    if (status != 0) {
+      break;
+    }
+  }
+  return status;
 }
 
 int Sahara::ReadData(int cmd, unsigned char *buf, int len)
 {
+  unsigned char *pkt;
   int status;
-  uint32_t bytesRead; 
 
   execute_cmd_t exe_cmd;
   exe_cmd.cmd = SAHARA_EXECUTE_REQ;
   exe_cmd.len = sizeof(exe_cmd);
   exe_cmd.client_cmd = cmd;
 
-  status = sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd));
-  if (status != 0) {
+  if (sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd)) < 0) {
     return -1;
   }
 
-  execute_rsp_t exe_rsp;
-  bytesRead = sizeof(exe_rsp);
-  status = sport->Read((unsigned char*)&exe_rsp, &bytesRead);
-  if (exe_rsp.data_len > 0 && bytesRead == sizeof(exe_rsp)) {
-    exe_cmd.cmd = SAHARA_EXECUTE_DATA;
-    exe_cmd.len = sizeof(exe_cmd);
-    exe_cmd.client_cmd = cmd;
-    status = sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd));
-    if (status != 0) {
-      return -1;
-    }
-    bytesRead = len;
-    status = sport->Read((unsigned char *)buf, &bytesRead);
-    return bytesRead;
+  status = ReadPacket(&pkt);
+  if (status != 0) {
+    return -1;
+  }
+  execute_rsp_t exe_rsp = {0};
+  uint32_t rspLen = ((cmd_hdr_t *)pkt)->len;
+  memcpy(&exe_rsp, pkt, (rspLen < sizeof(exe_rsp)) ? rspLen : sizeof(exe_rsp));
+  if (exe_rsp.cmd != SAHARA_EXECUTE_RSP || exe_rsp.data_len == 0) {
+    return -1;
   }
 
-  return -ERROR_INVALID_DATA;
+  exe_cmd.cmd = SAHARA_EXECUTE_DATA;
+  exe_cmd.len = sizeof(exe_cmd);
+  exe_cmd.client_cmd = cmd;
+  if (sport->Write((unsigned char *)&exe_cmd, sizeof(exe_cmd)) < 0) {
+    return -1;
+  }
+  return ReadRaw(buf, (exe_rsp.data_len < (uint32_t)len) ? exe_rsp.data_len : (uint32_t)len);
 }
 
 int Sahara::DumpDeviceInfo(pbl_info_t *pbl_info)
@@ -86,22 +392,13 @@ int Sahara::DumpDeviceInfo(pbl_info_t *pbl_info)
   uint32_t dataBuf[64];
   int status = 0;
 
-  // Connect to the device in command mode
+  // Connect to the device in command mode and make sure we get command ready back
   status = ConnectToDevice(true, SAHARA_MODE_COMMAND);
-  if( status != 0) {
-    return status;
+  if (status == 0) {
+    status = RunUntil(SAHARA_STATE_COMMAND);
   }
-
-  // Make sure we get command ready back
-  execute_rsp_t cmd_rdy;
-  uint32_t bytesRead = sizeof(cmd_rdy);
-
-  status = sport->Read((unsigned char *)&cmd_rdy, &bytesRead);
-  if (status != 0 || bytesRead == 0 ) {
-    Log("No response from device after switch mode command\n");
-    return EINVAL;
-  } else if (cmd_rdy.cmd != SAHARA_CMD_READY) {
-    Log("Unexpected response for command mode %i\n", cmd_rdy.cmd);
+  if (status != 0) {
+    Log("No command ready from device after hello response\n");
     return EINVAL;
   }
 
@@ -122,243 +419,453 @@ int Sahara::DumpDeviceInfo(pbl_info_t *pbl_info)
   if (status > 0 && status < sizeof(dataBuf)) {
     pbl_info->pbl_sw = dataBuf[0];
   }
-  
-  ModeSwitch(SAHARA_MODE_COMMAND, false);
+
+  ModeSwitch(SAHARA_MODE_IMAGE_TX_PENDING);
   return 0;
 }
 
-int Sahara::ModeSwitch(int mode, bool rsp)
+// PBL answers a mode switch with a fresh HELLO_REQ for the new mode
+int Sahara::ModeSwitch(int mode)
 {
-  // Finally at the end send switch mode to put us back in original EDL state
-  int status = 0;
   execute_cmd_t cmd_switch_mode;
-  unsigned char read_data_req[256];
-  uint32_t bytesRead = sizeof(read_data_req);
 
   cmd_switch_mode.cmd = SAHARA_SWITCH_MODE;
   cmd_switch_mode.len = sizeof(cmd_switch_mode);
   cmd_switch_mode.client_cmd = mode;
-  status = sport->Write((unsigned char*)&cmd_switch_mode, sizeof(cmd_switch_mode));
-  
-  // Read the response to switch mode if the device responds
-  if (rsp) {
-      status = sport->Read((unsigned char *)&read_data_req, &bytesRead);
+  if (sport->Write((unsigned char*)&cmd_switch_mode, sizeof(cmd_switch_mode)) < 0) {
+    return ERROR_WRITE_FAULT;
   }
-  //sport->UnRead((unsigned char *)&read_data_req, &bytesRead);
-  return status;
+  SetState(SAHARA_STATE_WAIT_HELLO);
+  return 0;
 }
 
 int Sahara::LoadFlashProg(char *szFlashPrg)
 {
-  read_data_t read_data_req = {0};
-  read_data_64_t read_data64_req = {0};
-  cmd_hdr_t read_cmd_hdr = { 0 };
-  image_end_t read_img_end = { 0 };
-  uint32_t status = 0;
-  uint32_t bytesRead = sizeof(read_data64_req);
-  uint32_t totalBytes = 0, read_data_offset = 0, read_data_len = 0;
-  unsigned char dataBuf[8192];
+  int status = 0;
 
-  int hFlashPrg = emmcdl_open( szFlashPrg, O_RDONLY);
-  if( hFlashPrg < 0 ) {
-    return ENOENT;
+  // Loaded once per process, every request is answered straight from memory
+  status = g_progcache.Acquire(szFlashPrg, &prog);
+  if (status != 0) {
+    return status;
   }
 
   Log("Successfully open flash programmer to write: %s\n",szFlashPrg);
 
-  for(;;) {
-
-    memset(&read_cmd_hdr,0,sizeof(read_cmd_hdr));
-    bytesRead = sizeof(read_cmd_hdr);
-    status = sport->Read((unsigned char *)&read_cmd_hdr,&bytesRead);
-
-    // Check if it is a 32-bit or 64-bit read
-    if (read_cmd_hdr.cmd == SAHARA_64BIT_MEMORY_READ_DATA)
-    {
-      memset(&read_data64_req, 0, sizeof(read_data64_req));
-      bytesRead = sizeof(read_data64_req);
-      status = sport->Read((unsigned char *)&read_data64_req, &bytesRead);
-      read_data_offset = (uint32_t)read_data64_req.data_offset;
-      read_data_len = (uint32_t)read_data64_req.data_len;
-    }
-    else if (read_cmd_hdr.cmd == SAHARA_READ_DATA)
-    {
-      memset(&read_data_req, 0, sizeof(read_data_req));
-      bytesRead = sizeof(read_data_req);
-      status = sport->Read((unsigned char *)&read_data_req, &bytesRead);
-      read_data_offset = read_data_req.data_offset;
-      read_data_len = read_data_req.data_len;
+  // Normally ConnectToDevice has answered the hello already, if not do it here.
+  // The programmer is running once DONE_RSP is in, firehose takes it from there
+  // without waiting on a timer.
+  hostMode = SAHARA_MODE_IMAGE_TX_PENDING;
+  status = RunUntil(SAHARA_STATE_DONE);
+  if (status != 0) {
+    Log("Sahara image transfer failed in state %s: %i\n", stateName[state], status);
+  }
+
+  g_progcache.Release(prog);
+  prog = NULL;
+  LogStateTimes();
+  return status;
+}
+
+// Decides from the first thing the target sends. A HELLO_REQ is PBL, anything
+// else means the target is already past Sahara and EPROTO tells the caller not
+// to probe it any further. Only a silent target gets a blind hello response,
+// PBL answers it if an earlier session already read its HELLO_REQ.
+int Sahara::CheckDevice(void)
+{
+  unsigned char *pkt;
+  int status;
+
+  hostMode = SAHARA_MODE_COMMAND;
+  status = ReadPacket(&pkt);
+  if (status == 0) {
+    if (HandlePacket(pkt) != 0) {
+      return EPROTO;
     }
-    else {
-      // Didn't find any read data command so break
-      break;
+  }
+  else if (status == ETIMEDOUT) {
+    status = SendHello(SAHARA_MODE_COMMAND);
+    if (status != 0) {
+      return status;
     }
+  }
+  else {
+    return EPROTO;
+  }
 
-    // Set the offset in the file requested
-    if (emmcdl_lseek(hFlashPrg, read_data_offset, SEEK_SET) < 0) {
-      Log("Failed to update FlashProgrammer pointer offset\n");
-      emmcdl_close(hFlashPrg);
-      return errno;
-    }
+  status = RunUntil(SAHARA_STATE_COMMAND);
+  if (status != 0) {
+    return status;
+  }
+
+  // Put PBL back in image transfer mode, its new HELLO_REQ is for whoever loads the programmer
+  return ModeSwitch(SAHARA_MODE_IMAGE_TX_PENDING);
+}
+
+int Sahara::ConnectToDevice(bool bReadHello, int mode)
+{
+  int status = 0;
+
+  hostMode = mode;
+  if (!bReadHello) {
+    // Assume that we already got the hello req so send hello response
+    rxLen = rxUsed = 0;
+    return SendHello(mode);
+  }
 
-    if ((bytesRead = emmcdl_read(hFlashPrg, dataBuf, read_data_len)) < 0) {
-      Log("Failed to read data from flash programmer file\n");
-      emmcdl_close(hFlashPrg);
-      return errno;
+  SetState(SAHARA_STATE_WAIT_HELLO);
+  status = RunUntil(HelloState(mode));
+  if (status == ETIMEDOUT) {
+    // If no hello packet is waiting then try PBL hack to bring device to good state
+    status = PblHack();
+    if (status == 0) {
+      hostMode = mode;
+      status = RunUntil(HelloState(mode));
     }
+    if (status != 0) {
+      Log("Did not receive Sahara hello packet from device\n");
+      return -1;
+    }
+  }
+  return status;
+}
 
-    Log("FileOffset %i bytesRead %i\n", read_data_offset, bytesRead);
+// This function is to fix issue where PBL does not propery handle PIPE reset need to make sure 1 TX and 1 RX is working we may be out of sync...
+int Sahara::PblHack(void)
+{
+  int status = 0;
 
-    if (sport->Write(dataBuf,bytesRead) != 0 ) {
-      Log("Failed to write data to device in IMEM\n");
-      emmcdl_close(hFlashPrg);
-      return errno;
+  // Assume that we already got the hello req so send hello response
+  status = ConnectToDevice(false, SAHARA_MODE_COMMAND);
+  if (status != 0) {
+    return status;
+  }
+
+  // Make sure we get command ready back, with no answer assume there was a data
+  // toggle issue and send the mode switch command anyway
+  status = RunUntil(SAHARA_STATE_COMMAND);
+  if (status != 0 && status != ETIMEDOUT && status != SAHARA_NAK_INVALID_CMD) {
+    Log("PblHack: Error - state:%s, status:%i\n", stateName[state], status);
+    return ERROR_INVALID_DATA;
+  }
+
+  // Back to normal mode, PBL sends a new hello for it
+  return ModeSwitch(SAHARA_MODE_IMAGE_TX_PENDING);
+}
+
+int Sahara::SendMemoryRead(uint64_t addr, uint64_t len)
+{
+  int status;
+
+  if (bMem64) {
+    memory_read_64_t read_req;
+    read_req.cmd = SAHARA_64BIT_MEMORY_READ;
+    read_req.len = sizeof(read_req);
+    read_req.addr = addr;
+    read_req.read_len = len;
+    status = sport->Write((unsigned char *)&read_req, sizeof(read_req));
+  }
+  else {
+    memory_read_t read_req;
+    read_req.cmd = SAHARA_MEMORY_READ;
+    read_req.len = sizeof(read_req);
+    read_req.addr = (uint32_t)addr;
+    read_req.read_len = (uint32_t)len;
+    status = sport->Write((unsigned char *)&read_req, sizeof(read_req));
+  }
+  return (status < 0) ? ERROR_WRITE_FAULT : 0;
+}
+
+// A MEMORY_READ is answered with the raw memory, or with END_TRANSFER when the
+// target refuses it
+int Sahara::ReadMemory(unsigned char *buf, uint32_t len)
+{
+  uint64_t ts = Metrics::Now();
+  int bytes = ReadRaw(buf, len);
+  cmd_hdr_t hdr;
+
+  if ((uint32_t)bytes == len) {
+    g_metrics.Record(METRIC_USB_READ, ts, len);
+    return 0;
+  }
+  if (bytes >= (int)(sizeof(hdr) + sizeof(image_end_t))) {
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.cmd == SAHARA_END_TRANSFER && hdr.len == sizeof(hdr) + sizeof(image_end_t)) {
+      image_end_t read_end;
+      memcpy(&read_end, buf + sizeof(hdr), sizeof(read_end));
+      Log("Memory read refused with status: %i\n", read_end.status);
+      return read_end.status ? (int)read_end.status : ERROR_INVALID_DATA;
     }
-    totalBytes += bytesRead;
   }
+  Log("Memory read returned %i of %u bytes\n", bytes, len);
+  return EIO;
+}
 
-  // Done loading flash programmer so close handle
-  emmcdl_close(hFlashPrg);
+int Sahara::ReadRegionTable(sahara_region_t **regions, uint32_t *count)
+{
+  uint32_t entrySize = bMem64 ? sizeof(dload_debug_64_t) : sizeof(dload_debug_t);
+  uint32_t num = (uint32_t)(memTableLen / entrySize);
+  int status = 0;
 
-  if (read_cmd_hdr.cmd != SAHARA_END_TRANSFER) {
-	Log("Expecting SAHARA_END_TRANSFER but found: %i\n", read_cmd_hdr.cmd);
-    return ERROR_WRITE_FAULT;
+  *regions = NULL;
+  *count = 0;
+  if (num == 0 || num > SAHARA_MAX_REGIONS) {
+    Log("Unexpected memory region table length %lu\n", memTableLen);
+    return ERROR_INVALID_DATA;
   }
 
-  // Read the remaining part of the end transfer packet
-  bytesRead = sizeof(read_img_end);
-  status = sport->Read((unsigned char *)&read_img_end, &bytesRead);
-  if (read_img_end.status != SAHARA_ERROR_SUCCESS) {
-	  Log("Image load failed with status: %i\n", read_img_end.status);
-	  return read_img_end.status;
+  unsigned char *table = (unsigned char *)malloc(num * entrySize);
+  sahara_region_t *r = (sahara_region_t *)calloc(num, sizeof(sahara_region_t));
+  if (table == NULL || r == NULL) {
+    free(table);
+    free(r);
+    return ENOMEM;
   }
 
-  done_t done_pkt = {0};
-  done_pkt.cmd = SAHARA_DONE_REQ;
-  done_pkt.len = 8;
-  status = sport->Write((unsigned char *)&done_pkt,8);
-  if( status != 0) {
-    return status;
+  status = SendMemoryRead(memTableAddr, num * entrySize);
+  if (status == 0) {
+    status = ReadMemory(table, num * entrySize);
   }
-  
-  bytesRead = sizeof(done_pkt);
-  status = sport->Read((unsigned char*)&done_pkt,&bytesRead);
-  if( done_pkt.cmd != SAHARA_DONE_RSP) {
-	Log("Expecting SAHARA_DONE_RSP but found: %i", done_pkt.cmd);
-    return ERROR_WRITE_FAULT;
+  for (uint32_t i=0; i < num && status == 0; i++) {
+    const char *desc, *filename;
+    if (bMem64) {
+      dload_debug_64_t *entry = (dload_debug_64_t *)(table + i * entrySize);
+      r[i].base = entry->mem_base;
+      r[i].length = entry->length;
+      desc = entry->desc;
+      filename = entry->filename;
+    }
+    else {
+      dload_debug_t *entry = (dload_debug_t *)(table + i * entrySize);
+      r[i].base = entry->mem_base;
+      r[i].length = entry->length;
+      desc = entry->desc;
+      filename = entry->filename;
+    }
+    memcpy(r[i].desc, desc, sizeof(r[i].desc) - 1);
+    memcpy(r[i].filename, filename, sizeof(r[i].filename) - 1);
+
+    // The name comes from the target, keep it inside the dump directory
+    for (char *p = r[i].filename; *p; p++) {
+      if (*p == '/' || *p == '\\') {
+        *p = '_';
+      }
+    }
+    if (r[i].filename[0] == '\0' || strcmp(r[i].filename, ".") == 0 || strcmp(r[i].filename, "..") == 0) {
+      snprintf(r[i].filename, sizeof(r[i].filename), "region%u.bin", i);
+    }
   }
 
-  // After Sahara is done set timeout back to 500ms for firehose
-  sport->SetTimeout(500);
-  emmcdl_sleep_ms(500);
+  free(table);
+  if (status != 0) {
+    free(r);
+    return status;
+  }
+  *regions = r;
+  *count = num;
   return 0;
 }
 
-int Sahara::CheckDevice(void)
+// Region filenames or descriptions, comma separated and case insensitive
+static bool RegionSelected(const char *szList, sahara_region_t *region)
 {
-  hello_req_t hello_req = {0};
-  int status = -1;
-  uint32_t bytesRead = sizeof(hello_req);
-  if (sport->InputBufferCount()) {
-      status = sport->Read((unsigned char *)&hello_req,&bytesRead);
-      //sport->UnRead((unsigned char *)&hello_req, &bytesRead);
-      if (hello_req.cmd == SAHARA_HELLO_REQ ) {
-          status = ModeSwitch(SAHARA_MODE_COMMAND, false);
-      }
-  } else {
+  const char *p = szList;
 
-      // Assume that we already got the hello req so send hello response
-      status = ConnectToDevice(false, SAHARA_MODE_COMMAND);
-      if (status != 0) {
-        return status;
+  if (szList == NULL) {
+    return true;
+  }
+  for (;;) {
+    const char *end = strchr(p, ',');
+    size_t len = (end != NULL) ? (size_t)(end - p) : strlen(p);
+    if (len > 0) {
+      if ((strlen(region->filename) == len && strncasecmp(region->filename, p, len) == 0) ||
+          (strlen(region->desc) == len && strncasecmp(region->desc, p, len) == 0)) {
+        return true;
       }
+    }
+    if (end == NULL) {
+      break;
+    }
+    p = end + 1;
+  }
+  return false;
+}
 
-      // Make sure we get command ready back
-      execute_rsp_t cmd_rdy;
-      uint32_t bytesRead = sizeof(cmd_rdy);
-
-      sport->SetTimeout(10);
-      status = sport->Read((unsigned char *)&cmd_rdy, &bytesRead);
-      if (status != 0 || bytesRead == 0 || (cmd_rdy.cmd == SAHARA_END_TRANSFER && cmd_rdy.data_len == SAHARA_NAK_INVALID_CMD)) {
-        // Assume there was a data toggle issue and send the mode switch command
-        //return ModeSwitch(SAHARA_MODE_COMMAND, false);
-      } else if (cmd_rdy.cmd != SAHARA_CMD_READY) {
-        Log("PblHack: Error - cmd:%i, status:%i\n", cmd_rdy.cmd, cmd_rdy.data_len);
-        return ERROR_INVALID_DATA;
-      }
-      ModeSwitch(SAHARA_MODE_COMMAND, false);
-      status = 0;
+typedef struct {
+  BufRing *ring;
+  int fd;
+  uint64_t left;
+  int status;
+} dump_writer_t;
+
+// Writes a region to its file so the USB side only ever waits on a full ring
+static void *DumpWriterThread(void *arg)
+{
+  dump_writer_t *writer = (dump_writer_t *)arg;
+
+  while (writer->left > 0) {
+    uint64_t ts = Metrics::Now();
+    CBuffer *pbuffer = writer->ring->GetFilled();
+    if (pbuffer == NULL) {
+      break;
+    }
+    g_metrics.Record(METRIC_STALL_FILE, ts);
+    ts = Metrics::Now();
+    ssize_t bytes = emmcdl_write(writer->fd, pbuffer->data, pbuffer->len);
+    if (bytes < 0) {
+      writer->status = errno;
+      break;
+    }
+    if (bytes != (ssize_t)pbuffer->len) {
+      writer->status = EIO;
+      break;
+    }
+    g_metrics.Record(METRIC_FILE_WRITE, ts, bytes);
+    writer->left -= bytes;
+    writer->ring->Release();
   }
-  return status;
+
+  // Don't leave the USB side waiting on a full ring if we gave up
+  if (writer->left > 0) {
+    writer->ring->Close();
+  }
+  return NULL;
 }
 
-int Sahara::ConnectToDevice(bool bReadHello, int mode)
+int Sahara::DumpRegion(sahara_region_t *region, sahara_dump_t *opt, BufRing *ring)
 {
-  hello_req_t hello_req = {0};
+  char szPath[1024];
+  dump_writer_t writer;
+  pthread_t tid;
+  uint64_t window = (uint64_t)opt->readSize * opt->depth;
+  uint64_t issued = 0, received = 0;
+  uint64_t start = Metrics::Now();
   int status = 0;
-  uint32_t bytesRead = sizeof(hello_req);
-
-  if (bReadHello) {
-    sport->SetTimeout(10);
-    status = sport->Read((unsigned char *)&hello_req, &bytesRead);
-    if (status < 0) return -1;
-    if (hello_req.cmd != SAHARA_HELLO_REQ) {
-      // If no hello packet is waiting then try PBL hack to bring device to good state
-      if (PblHack() != 0) {
-        // If we fail to connect try to do a mode switch command to get hello packet and try again
-        Log("Did not receive Sahara hello packet from device\n");
-        return -1;
+
+  snprintf(szPath, sizeof(szPath), "%s/%s", opt->szDir, region->filename);
+  int fd = emmcdl_open_mode(szPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("Failed to create %s: %s\n", szPath, strerror(errno));
+    return errno;
+  }
+
+  ring->Reset();
+  writer.ring = ring;
+  writer.fd = fd;
+  writer.left = region->length;
+  writer.status = 0;
+  status = pthread_create(&tid, NULL, DumpWriterThread, &writer);
+  if (status != 0) {
+    emmcdl_close(fd);
+    return status;
+  }
+
+  while (received < region->length) {
+    // With a depth above 1 requests go out ahead of the data so the target streams back to back
+    while (issued < region->length && issued - received < window && status == 0) {
+      uint64_t len = region->length - issued;
+      if (len > opt->readSize) {
+        len = opt->readSize;
       }
+      status = SendMemoryRead(region->base + issued, len);
+      issued += len;
+    }
+    if (status != 0) {
+      break;
     }
-    Log((char *)"Sahara version %d--%d \nmode %d.\n", hello_req.version_min, hello_req.version, hello_req.mode);
-    sport->SetTimeout(2000);
-  } else {
-    // Read any pending data
-    sport->Flush();
-  }
 
-  hello_req.cmd = SAHARA_HELLO_RSP;
-  hello_req.len = 0x30;
-  hello_req.version = SAHARA_VERSION;
-  hello_req.version_min=SAHARA_VERSION_SUPPORTED;
-  hello_req.max_cmd_len = 0;
-  hello_req.mode = mode;
+    uint64_t ts = Metrics::Now();
+    CBuffer *pbuffer = ring->GetFree();
+    if (pbuffer == NULL) {
+      status = EIO;
+      break;
+    }
+    g_metrics.Record(METRIC_STALL_USB, ts);
 
-  status = sport->Write((unsigned char *)&hello_req, sizeof(hello_req));
+    uint32_t len = (region->length - received < opt->readSize) ? (uint32_t)(region->length - received) : opt->readSize;
+    status = ReadMemory(pbuffer->data, len);
+    if (status != 0) {
+      break;
+    }
+    pbuffer->len = len;
+    ring->Put();
+
+    // Progress every 16MB and at the end of the region
+    if (((received + len) >> 24) != (received >> 24) || received + len == region->length) {
+      double secs = (double)(Metrics::Now() - start) / 1000000000;
+      printf("\r%-20s %8lu / %lu MB %8.1f MB/s", region->filename, (received + len) >> 20,
+             region->length >> 20, secs > 0 ? (double)(received + len) / 1024 / 1024 / secs : 0);
+    }
+    received += len;
+  }
+  printf("\n");
 
   if (status != 0) {
-    Log("Failed to write hello response back to device\n");
-    return -1;
- }
-
-  return 0;
+    ring->Close();
+  }
+  pthread_join(tid, NULL);
+  emmcdl_close(fd);
+  if (writer.status != 0) {
+    printf("Failed to write %s: %s\n", szPath, strerror(writer.status));
+    status = writer.status;
+  }
+  return status;
 }
 
-// This function is to fix issue where PBL does not propery handle PIPE reset need to make sure 1 TX and 1 RX is working we may be out of sync...
-int Sahara::PblHack(void)
+// Collects the RAM dump a crashed target offers in memory debug mode. Every
+// selected region is streamed into its own file, the target is left in memory
+// debug mode so another pass can pick up other regions.
+int Sahara::MemoryDump(sahara_dump_t *opt)
 {
+  sahara_region_t *regions = NULL;
+  uint32_t count = 0, dumped = 0;
+  uint64_t total = 0;
+  BufRing ring;
   int status = 0;
 
-  // Assume that we already got the hello req so send hello response
-  status = ConnectToDevice(false, SAHARA_MODE_COMMAND);
+  if (opt->szDir == NULL || opt->readSize == 0 || opt->depth == 0) {
+    return EINVAL;
+  }
+  if (emmcdl_mkdir(opt->szDir, 0755) != 0 && errno != EEXIST) {
+    printf("Failed to create %s: %s\n", opt->szDir, strerror(errno));
+    return errno;
+  }
+
+  status = ConnectToDevice(true, SAHARA_MODE_MEMORY_DEBUG);
+  if (status == 0) {
+    status = RunUntil(SAHARA_STATE_MEM_READ);
+  }
+  if (status == 0) {
+    status = ReadRegionTable(&regions, &count);
+  }
   if (status != 0) {
+    Log("Target did not offer a memory dump\n");
     return status;
   }
 
-  // Make sure we get command ready back
-  execute_rsp_t cmd_rdy;
-  uint32_t bytesRead = sizeof(cmd_rdy);
+  printf("%-3s %-20s %-20s %18s %12s\n", "", "File", "Description", "Base", "Length");
+  for (uint32_t i=0; i < count; i++) {
+    regions[i].bSelected = RegionSelected(opt->szRegions, &regions[i]);
+    printf("%-3s %-20s %-20s 0x%016lx %12lu\n", regions[i].bSelected ? "*" : "", regions[i].filename,
+           regions[i].desc, regions[i].base, regions[i].length);
+  }
 
-  sport->SetTimeout(10);
-  status = sport->Read((unsigned char *)&cmd_rdy, &bytesRead);
-  if (status != 0 || bytesRead == 0) {
-    // Assume there was a data toggle issue and send the mode switch command
-    return ModeSwitch(SAHARA_MODE_IMAGE_TX_PENDING);
-  } else if (cmd_rdy.cmd != SAHARA_CMD_READY) {
-    Log("PblHack: Error - cmd:%i, status:%i\n", cmd_rdy.cmd, cmd_rdy.data_len);
-    return ERROR_INVALID_DATA;
+  status = ring.Init(SAHARA_DUMP_SLOTS, opt->readSize);
+  uint64_t start = Metrics::Now();
+  for (uint32_t i=0; i < count && status == 0; i++) {
+    if (!regions[i].bSelected || regions[i].length == 0) {
+      continue;
+    }
+    status = DumpRegion(&regions[i], opt, &ring);
+    if (status == 0) {
+      total += regions[i].length;
+      dumped++;
+    }
   }
 
-  // Successfully got the CMD_READY so now switch back to normal mode
-  return ModeSwitch(SAHARA_MODE_IMAGE_TX_PENDING);
+  double secs = (double)(Metrics::Now() - start) / 1000000000;
+  printf("Dumped %u regions, %lu MB in %.1f s (%.1f MB/s)\n", dumped, total >> 20, secs,
+         secs > 0 ? (double)total / 1024 / 1024 / secs : 0);
+  LogStateTimes();
+  free(regions);
+  return status;
 }
@@ -221,56 +221,70 @@ int SerialPort::Flush() {
 	SetTimeout(1);
 	Read(tmpBuf, &len);
 	SetTimeout(1000);
+	hdlcRx.Reset();
 
 	tcflush(hPort, TCIOFLUSH);
 	return 0;
 }
 
-int SerialPort::SendSync(unsigned char *out_buf, int out_length,
-		unsigned char *in_buf, int *in_length) {
-	uint32_t status = 0;
-	uint32_t bytesOut = 0;
-	uint32_t bytesIn = 0;
+int SerialPort::SendPacket(unsigned char *out_buf, int out_length) {
+	int bytesOut = MAX_PACKET_SIZE;
+	int status;
 
-	// As long as hPort is valid write the data to the serial port and wait for response for timeout
+	// As long as hPort is valid write the data to the serial port
 	if (hPort == -1) {
 		return EBADF;
 	}
 
 	// Do HDLC encoding then send out packet
-	bytesOut = MAX_PACKET_SIZE;
-	status = HDLCEncodePacket(out_buf, out_length, HDLCBuf, (int *) &bytesOut);
-
-	// We know we have a good handle now so write out data and wait for response
-	status = Write(HDLCBuf, bytesOut);
+	status = HdlcEncode(out_buf, out_length, HDLCBuf, &bytesOut);
 	if (status != 0)
 		return status;
 
-	// Keep looping through until we have received 0x7e with size > 1
-	for (int i = 0; i < MAX_PACKET_SIZE; i++) {
-		// Now read response and and wait for up to timeout
-		bytesIn = 1;
-		status = Read(&HDLCBuf[i], &bytesIn);
+	// Write returns the byte count on some ports, only a negative value is a failure
+	if (Write(HDLCBuf, bytesOut) < 0)
+		return EIO;
+	return 0;
+}
+
+int SerialPort::ReadPacket(unsigned char *in_buf, int *in_length) {
+	unsigned char *frame;
+	uint32_t frameLen;
+
+	if (hPort == -1) {
+		return EBADF;
+	}
+
+	// Read as much as the target has sent and split frames out of the buffer,
+	// a response often arrives together with the next one
+	while (!hdlcRx.NextFrame(&frame, &frameLen)) {
+		uint32_t bytesIn = 0;
+		unsigned char *space = hdlcRx.FreeSpace(&bytesIn);
+		if (space == NULL) {
+			hdlcRx.Reset();
+			return ENOMEM;
+		}
+		int status = Read(space, &bytesIn);
 		if (status != 0)
 			return status;
-		if (bytesIn == 0)
-			break;
-		if (HDLCBuf[i] == 0x7E) {
-			if (i > 1) {
-				bytesIn = i + 1;
-				break;
-			} else {
-				// If packet starts with multiple 0x7E ignore
-				i = 0;
-			}
+		if (bytesIn == 0) {
+			*in_length = 0;
+			return 0;
 		}
-
+		hdlcRx.Fill(bytesIn);
 	}
 
-	// Remove HDLC encoding and return the packet
-	status = HDLCDecodePacket(HDLCBuf, bytesIn, in_buf, in_length);
+	// Remove HDLC encoding and check the CRC
+	return HdlcDecode(frame, frameLen, in_buf, in_length);
+}
 
-	return status;
+int SerialPort::SendSync(unsigned char *out_buf, int out_length,
+		unsigned char *in_buf, int *in_length) {
+	// We know we have a good handle now so write out data and wait for response
+	int status = SendPacket(out_buf, out_length);
+	if (status != 0)
+		return status;
+	return ReadPacket(in_buf, in_length);
 }
 
 int SerialPort::SetTimeout(int ms) {
@@ -294,59 +308,3 @@ int SerialPort::SetTimeout(int ms) {
 	to_ms = ms;
 	return 0;
 }
-
-int SerialPort::HDLCEncodePacket(unsigned char *in_buf, int in_length,
-		unsigned char *out_buf, int *out_length) {
-	unsigned char *outPtr = out_buf;
-	unsigned short crc = (unsigned short) CalcCRC16(in_buf, in_length);
-
-	// Encoded packets start and end with 0x7E
-	*outPtr++ = ASYNC_HDLC_FLAG;
-	for (int i = 0; i < in_length + 2; i++) {
-		// Read last two bytes of data from crc value
-		if (i == in_length) {
-			in_buf = (unsigned char *) &crc;
-		}
-
-		if (*in_buf == ASYNC_HDLC_FLAG || *in_buf == ASYNC_HDLC_ESC) {
-			*outPtr++ = ASYNC_HDLC_ESC;
-			*outPtr++ = *in_buf++ ^ ASYNC_HDLC_ESC_MASK;
-		} else {
-			*outPtr++ = *in_buf++;
-		}
-	}
-	*outPtr++ = ASYNC_HDLC_FLAG;
-
-	// Update length of packet
-	*out_length = outPtr - out_buf;
-	return 0;
-}
-
-int SerialPort::HDLCDecodePacket(unsigned char *in_buf, int in_length,
-		unsigned char *out_buf, int *out_length) {
-	unsigned char *outPtr = out_buf;
-	// make sure our output buffer is large enough
-	if (*out_length < in_length) {
-		return ENOMEM;
-	}
-
-	for (int i = 0; i < in_length; i++) {
-		switch (*in_buf) {
-		case ASYNC_HDLC_FLAG:
-			// Do nothing it is an escape flag
-			in_buf++;
-			break;
-		case ASYNC_HDLC_ESC:
-			in_buf++;
-			*outPtr++ = *in_buf++ ^ ASYNC_HDLC_ESC_MASK;
-			break;
-		default:
-			*outPtr++ = *in_buf++;
-		}
-	}
-
-	*out_length = outPtr - out_buf;
-	// Should do CRC check here but for now we are using USB so assume good
-
-	return 0;
-}
@@ -0,0 +1,749 @@
+/*****************************************************************************
+ * simport.cpp
+ *
+ * This file implements SerialPort on top of an in-process Firehose target,
+ * the Sahara PBL that loads one or a streaming download programmer, so the
+ * real protocol code can be benchmarked without a device attached.
+ * Only the benchmark links it, emmcdl itself uses usbport.cpp.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "serialport.h"
+#include "simport.h"
+#include "metrics.h"
+#include "crc.h"
+#include "sha256.h"
+#include "sahara.h"
+#include "dload.h"
+
+#define NANO            1000000000ULL
+#define SIM_RX_SIZE     (64*1024)
+
+simport_config_t g_simport = {
+  false,          // sahara
+  0,              // ackLatencyUs
+  0,              // linkMBps
+  1024*1024,      // maxPayload
+  true,           // rawmode
+  true,           // erase
+  true,           // batch
+  true,           // digest
+  256,            // diskMB
+  512,            // sectorSize
+  0,              // saharaImageSize
+  1024*1024,      // saharaReadSize
+  false,          // saharaMemDebug
+  4,              // saharaRegions
+  false,          // dload
+  4096,           // dloadBlock
+  8,              // dloadWindow
+  0               // dloadDropEvery
+};
+simport_stats_t g_simstats;
+
+static unsigned char *simDisk = NULL;
+static uint64_t simDiskSize = 0;
+
+// Data queued for the host. Responses only become readable once rxReadyNs has
+// passed, raw read data is served straight out of the simulated disk first.
+static char simRx[SIM_RX_SIZE];
+static uint32_t simRxLen = 0;
+static uint64_t simRxReadyNs = 0;
+static uint64_t simReadOffset = 0;
+static uint64_t simReadLeft = 0;
+
+// Raw data still expected from the host for the current <program>
+static uint64_t simProgOffset = 0;
+static uint64_t simProgLeft = 0;
+
+static uint64_t simLinkBusyNs = 0;
+
+// Sahara image transfer, next offset PBL asks for and data still due for the last request
+static bool simSahara = false;
+static uint64_t simSaharaOffset = 0;
+static uint64_t simSaharaLeft = 0;
+
+// MEMORY_READ requests waiting behind the one being answered
+#define SIM_MEM_READS 64
+static uint64_t simMemOffset[SIM_MEM_READS];
+static uint64_t simMemLen[SIM_MEM_READS];
+static uint64_t simMemReadyNs[SIM_MEM_READS];
+static uint32_t simMemHead = 0;
+static uint32_t simMemCount = 0;
+
+// Streaming download responses, each readable once the ack latency has passed
+#define SIM_DLOAD_RSPS      64
+#define SIM_DLOAD_RSP_SIZE  256
+static unsigned char simDloadRsp[SIM_DLOAD_RSPS][SIM_DLOAD_RSP_SIZE];
+static uint32_t simDloadRspLen[SIM_DLOAD_RSPS];
+static uint64_t simDloadReadyNs[SIM_DLOAD_RSPS];
+static uint32_t simDloadHead = 0;
+static uint32_t simDloadCount = 0;
+static uint64_t simDloadSeed = 0;
+static bool simDloadSector = false;
+
+static void SleepUntil(uint64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / NANO;
+  ts.tv_nsec = ns % NANO;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Serialize transfers on the simulated bus at the configured bandwidth
+static void LinkDelay(uint64_t bytes)
+{
+  if (g_simport.linkMBps == 0) {
+    return;
+  }
+  uint64_t now = Metrics::Now();
+  if (simLinkBusyNs < now) {
+    simLinkBusyNs = now;
+  }
+  simLinkBusyNs += bytes * NANO / ((uint64_t)g_simport.linkMBps * 1024 * 1024);
+  SleepUntil(simLinkBusyNs);
+}
+
+// Patch values are literals or NUM_DISK_SECTORS relative
+static uint64_t Evaluate(const char *expr)
+{
+  if (strncmp(expr, "NUM_DISK_SECTORS", 16) == 0) {
+    return simDiskSize / g_simport.sectorSize + strtoll(expr + 16, NULL, 10);
+  }
+  return strtoull(expr, NULL, 10);
+}
+
+static uint64_t AttrValue(const char *cmd, const char *name)
+{
+  const char *p = strstr(cmd, name);
+  if (p == NULL || (p = strchr(p, '"')) == NULL) {
+    return 0;
+  }
+  return strtoull(p + 1, NULL, 10);
+}
+
+static void QueueResponse(const char *fmt, const char *extra)
+{
+  int len = snprintf(&simRx[simRxLen], SIM_RX_SIZE - simRxLen, fmt, extra);
+  if (len > 0 && simRxLen + len < SIM_RX_SIZE) {
+    simRxLen += len;
+  }
+  simRxReadyNs = Metrics::Now() + (uint64_t)g_simport.ackLatencyUs * 1000;
+}
+
+static void Ack(const char *rawmode)
+{
+  char attrs[64] = "";
+  if (rawmode != NULL && g_simport.rawmode) {
+    snprintf(attrs, sizeof(attrs), " rawmode=\"%s\"", rawmode);
+  }
+  QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"ACK\"%s />\n</data>", attrs);
+}
+
+// Sector offset of a command, start_sector may be relative to the end of the disk
+static uint64_t SectorOffset(const char *cmd)
+{
+  const char *p = strstr(cmd, "start_sector=\"NUM_DISK_SECTORS");
+  if (p != NULL) {
+    return simDiskSize + strtoll(p + 30, NULL, 10) * g_simport.sectorSize;
+  }
+  return AttrValue(cmd, "start_sector") * g_simport.sectorSize;
+}
+
+static void HandleCommand(const char *cmd)
+{
+  g_simstats.commands++;
+
+  if (strstr(cmd, "<configure") != NULL) {
+    char attrs[160];
+    uint64_t req = AttrValue(cmd, "MaxPayloadSizeToTargetInBytes");
+    if (req > g_simport.maxPayload) {
+      snprintf(attrs, sizeof(attrs), "MaxPayloadSizeToTargetInBytes=\"%u\" MaxPayloadSizeToTargetInBytesSupported=\"%u\"",
+               g_simport.maxPayload, g_simport.maxPayload);
+      QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"NAK\" %s />\n</data>", attrs);
+    }
+    else {
+      QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"ACK\" %s />\n</data>",
+                    "MaxXMLSizeInBytes=\"4096\"");
+    }
+  }
+  else if (strstr(cmd, "<program") != NULL) {
+    simProgOffset = SectorOffset(cmd);
+    simProgLeft = AttrValue(cmd, "num_partition_sectors") * g_simport.sectorSize;
+    if (simProgOffset + simProgLeft > simDiskSize) {
+      QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"NAK\" %s/>\n</data>", "");
+      simProgLeft = 0;
+      return;
+    }
+    Ack("true");
+  }
+  else if (strstr(cmd, "<erase") != NULL) {
+    uint64_t offset = SectorOffset(cmd);
+    uint64_t len = AttrValue(cmd, "num_partition_sectors") * g_simport.sectorSize;
+    if (!g_simport.erase || offset + len > simDiskSize) {
+      QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"NAK\" %s/>\n</data>", "");
+      return;
+    }
+    memset(simDisk + offset, 0, len);
+    Ack(NULL);
+  }
+  else if (strstr(cmd, "<patch") != NULL) {
+    // Values are evaluated against the disk as it is now, like the real target does
+    const char *p = strstr(cmd, "value=\"");
+    uint64_t offset = SectorOffset(cmd) + AttrValue(cmd, "byte_offset");
+    uint64_t size = AttrValue(cmd, "size_in_bytes");
+    uint64_t value = 0;
+    if (p != NULL && strncmp(p + 7, "CRC32(", 6) == 0) {
+      uint64_t crcStart = Evaluate(p + 13) * g_simport.sectorSize;
+      const char *c = strchr(p + 13, ',');
+      uint64_t crcLen = (c != NULL) ? strtoull(c + 1, NULL, 10) : 0;
+      if (crcStart + crcLen <= simDiskSize) {
+        value = CalcCRC32(simDisk + crcStart, crcLen);
+      }
+    }
+    else if (p != NULL) {
+      value = Evaluate(p + 7);
+    }
+    if (strstr(cmd, "filename=\"DISK\"") != NULL && size <= sizeof(value) && offset + size <= simDiskSize) {
+      memcpy(simDisk + offset, &value, size);
+    }
+    Ack(NULL);
+  }
+  else if (strstr(cmd, "<getstorageinfo") != NULL) {
+    char info[200];
+    snprintf(info, sizeof(info), "INFO: {&quot;storage_info&quot;: {&quot;total_blocks&quot;:%lu, &quot;block_size&quot;:%u}}",
+             simDiskSize / g_simport.sectorSize, g_simport.sectorSize);
+    QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<log value=\"%s\" />\n</data>", info);
+    Ack(NULL);
+  }
+  else if (strstr(cmd, "<getsha256digest") != NULL) {
+    unsigned char digest[SHA256_DIGEST_LEN];
+    char info[100] = "INFO: Digest ";
+    uint64_t offset = SectorOffset(cmd);
+    uint64_t len = AttrValue(cmd, "num_partition_sectors") * g_simport.sectorSize;
+    sha256_ctx sha;
+    if (!g_simport.digest || offset + len > simDiskSize) {
+      QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<response value=\"NAK\" %s/>\n</data>", "");
+      return;
+    }
+    SHA256Init(&sha);
+    SHA256Update(&sha, simDisk + offset, len);
+    SHA256Final(&sha, digest);
+    for (int i=0; i < SHA256_DIGEST_LEN; i++) {
+      sprintf(info + 13 + i*2, "%02x", digest[i]);
+    }
+    QueueResponse("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n<data>\n<log value=\"%s\" />\n</data>", info);
+    Ack(NULL);
+  }
+  else if (strstr(cmd, "<read") != NULL) {
+    simReadOffset = SectorOffset(cmd);
+    simReadLeft = AttrValue(cmd, "num_partition_sectors") * g_simport.sectorSize;
+    if (simReadOffset + simReadLeft > simDiskSize) {
+      simReadLeft = 0;
+    }
+    // Data goes out first, the closing ACK follows it
+    Ack("false");
+  }
+  else {
+    Ack(NULL);
+  }
+}
+
+static void QueuePacket(const void *pkt, uint32_t len)
+{
+  if (simRxLen + len <= SIM_RX_SIZE) {
+    memcpy(&simRx[simRxLen], pkt, len);
+    simRxLen += len;
+  }
+  simRxReadyNs = Metrics::Now() + (uint64_t)g_simport.ackLatencyUs * 1000;
+}
+
+static void SaharaHello(void)
+{
+  hello_req_t hello;
+  memset(&hello, 0, sizeof(hello));
+  hello.cmd = SAHARA_HELLO_REQ;
+  hello.len = sizeof(hello);
+  hello.version = SAHARA_VERSION;
+  hello.version_min = SAHARA_VERSION_SUPPORTED;
+  hello.max_cmd_len = 0x400;
+  hello.mode = g_simport.saharaMemDebug ? SAHARA_MODE_MEMORY_DEBUG : SAHARA_MODE_IMAGE_TX_PENDING;
+  QueuePacket(&hello, sizeof(hello));
+}
+
+// Region table at the start of the disk, the regions share out the rest of it
+static void SaharaMemTable(void)
+{
+  uint32_t regions = g_simport.saharaRegions;
+  uint64_t regionSize = ((simDiskSize - SIM_MEM_TABLE_SIZE) / regions) & ~4095ULL;
+
+  for (uint32_t i=0; i < regions; i++) {
+    dload_debug_64_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.save_pref = 1;
+    entry.mem_base = SIM_MEM_TABLE_SIZE + i * regionSize;
+    entry.length = regionSize;
+    snprintf(entry.desc, sizeof(entry.desc), "Sim region %hu", (unsigned short)i);
+    snprintf(entry.filename, sizeof(entry.filename), "REGION%hu.BIN", (unsigned short)i);
+    memcpy(simDisk + i * sizeof(entry), &entry, sizeof(entry));
+  }
+}
+
+static void SaharaMemRead(uint64_t addr, uint64_t len)
+{
+  if (addr + len > simDiskSize || simMemCount == SIM_MEM_READS) {
+    struct {
+      cmd_hdr_t hdr;
+      image_end_t end;
+    } pkt;
+    pkt.hdr.cmd = SAHARA_END_TRANSFER;
+    pkt.hdr.len = sizeof(pkt);
+    pkt.end.id = 0;
+    pkt.end.status = SAHARA_NAK_INVALID_MEMORY_READ;
+    QueuePacket(&pkt, sizeof(pkt));
+    return;
+  }
+  // Each request takes the ack latency to turn around, outstanding ones overlap it
+  uint32_t slot = (simMemHead + simMemCount) % SIM_MEM_READS;
+  simMemOffset[slot] = addr;
+  simMemLen[slot] = len;
+  simMemReadyNs[slot] = Metrics::Now() + (uint64_t)g_simport.ackLatencyUs * 1000;
+  simMemCount++;
+}
+
+// PBL asks for the programmer a request at a time, then ends the transfer
+static void SaharaNextRequest(void)
+{
+  if (simSaharaOffset < g_simport.saharaImageSize) {
+    struct {
+      cmd_hdr_t hdr;
+      read_data_64_t req;
+    } pkt;
+    uint64_t len = g_simport.saharaImageSize - simSaharaOffset;
+    if (len > g_simport.saharaReadSize) {
+      len = g_simport.saharaReadSize;
+    }
+    pkt.hdr.cmd = SAHARA_64BIT_MEMORY_READ_DATA;
+    pkt.hdr.len = sizeof(pkt);
+    pkt.req.id = 13;
+    pkt.req.data_offset = simSaharaOffset;
+    pkt.req.data_len = len;
+    simSaharaLeft = len;
+    QueuePacket(&pkt, sizeof(pkt));
+  }
+  else {
+    struct {
+      cmd_hdr_t hdr;
+      image_end_t end;
+    } pkt;
+    pkt.hdr.cmd = SAHARA_END_TRANSFER;
+    pkt.hdr.len = sizeof(pkt);
+    pkt.end.id = 13;
+    pkt.end.status = SAHARA_ERROR_SUCCESS;
+    QueuePacket(&pkt, sizeof(pkt));
+  }
+}
+
+static void HandleSahara(unsigned char *data, uint32_t length)
+{
+  cmd_hdr_t hdr;
+
+  if (simSaharaLeft > 0) {
+    uint32_t bytes = (length < simSaharaLeft) ? length : (uint32_t)simSaharaLeft;
+    if (simSaharaOffset + bytes <= simDiskSize) {
+      memcpy(simDisk + simSaharaOffset, data, bytes);
+    }
+    simSaharaOffset += bytes;
+    simSaharaLeft -= bytes;
+    if (simSaharaLeft == 0) {
+      SaharaNextRequest();
+    }
+    return;
+  }
+
+  if (length < sizeof(hdr)) {
+    return;
+  }
+  memcpy(&hdr, data, sizeof(hdr));
+  g_simstats.commands++;
+  if (hdr.cmd == SAHARA_HELLO_RSP && length >= sizeof(hello_req_t)) {
+    hello_req_t rsp;
+    memcpy(&rsp, data, sizeof(rsp));
+    if (rsp.mode == SAHARA_MODE_COMMAND) {
+      cmd_hdr_t ready;
+      ready.cmd = SAHARA_CMD_READY;
+      ready.len = sizeof(ready);
+      QueuePacket(&ready, sizeof(ready));
+    }
+    else if (rsp.mode == SAHARA_MODE_MEMORY_DEBUG) {
+      struct {
+        cmd_hdr_t hdr;
+        memory_debug_64_t table;
+      } pkt;
+      pkt.hdr.cmd = SAHARA_64BIT_MEMORY_DEBUG;
+      pkt.hdr.len = sizeof(pkt);
+      pkt.table.table_addr = 0;
+      pkt.table.table_len = g_simport.saharaRegions * sizeof(dload_debug_64_t);
+      QueuePacket(&pkt, sizeof(pkt));
+    }
+    else {
+      simSaharaOffset = 0;
+      SaharaNextRequest();
+    }
+  }
+  else if (hdr.cmd == SAHARA_SWITCH_MODE) {
+    SaharaHello();
+  }
+  else if (hdr.cmd == SAHARA_64BIT_MEMORY_READ && length >= sizeof(memory_read_64_t)) {
+    memory_read_64_t req;
+    memcpy(&req, data, sizeof(req));
+    SaharaMemRead(req.addr, req.read_len);
+  }
+  else if (hdr.cmd == SAHARA_MEMORY_READ && length >= sizeof(memory_read_t)) {
+    memory_read_t req;
+    memcpy(&req, data, sizeof(req));
+    SaharaMemRead(req.addr, req.read_len);
+  }
+  else if (hdr.cmd == SAHARA_DONE_REQ) {
+    done_t rsp;
+    rsp.cmd = SAHARA_DONE_RSP;
+    rsp.len = sizeof(rsp);
+    rsp.status = SAHARA_MODE_IMAGE_TX_COMPLETE;
+    QueuePacket(&rsp, sizeof(rsp));
+    // The programmer is running, everything after this is Firehose
+    simSahara = false;
+  }
+}
+
+// Each response goes back HDLC framed as a transfer of its own
+static void DloadQueue(const unsigned char *rsp, uint32_t len)
+{
+  if (simDloadCount == SIM_DLOAD_RSPS) {
+    return;
+  }
+  uint32_t slot = (simDloadHead + simDloadCount) % SIM_DLOAD_RSPS;
+  int frameLen = SIM_DLOAD_RSP_SIZE;
+  if (HdlcEncode(rsp, len, simDloadRsp[slot], &frameLen) != 0) {
+    return;
+  }
+  simDloadRspLen[slot] = frameLen;
+  simDloadReadyNs[slot] = Metrics::Now() + (uint64_t)g_simport.ackLatencyUs * 1000;
+  simDloadCount++;
+}
+
+static void HandleDload(unsigned char *data, uint32_t length)
+{
+  unsigned char rsp[64];
+
+  if (length == 0) {
+    return;
+  }
+  g_simstats.commands++;
+  memset(rsp, 0, sizeof(rsp));
+  switch (data[0]) {
+  case EHOST_HELLO_REQ:
+    simDloadSector = (length > 35) && (data[35] & FEATURE_SECTOR_ADDRESSES);
+    rsp[0] = EHOST_HELLO_RSP;
+    memcpy(&rsp[1], "QCOM fast download protocol targ", 32);
+    rsp[33] = 3;
+    rsp[34] = 2;
+    rsp[35] = g_simport.dloadBlock & 0xff;
+    rsp[36] = (g_simport.dloadBlock >> 8) & 0xff;
+    rsp[37] = (g_simport.dloadBlock >> 16) & 0xff;
+    rsp[38] = (g_simport.dloadBlock >> 24) & 0xff;
+    rsp[43] = 4;
+    memcpy(&rsp[44], "eMMC", 4);
+    rsp[48] = g_simport.dloadWindow & 0xff;
+    rsp[49] = (g_simport.dloadWindow >> 8) & 0xff;
+    rsp[52] = simDloadSector ? FEATURE_SECTOR_ADDRESSES : 0;
+    DloadQueue(rsp, 53);
+    break;
+  case EHOST_SECURITY_REQ:
+    rsp[0] = EHOST_SECURITY_RSP;
+    DloadQueue(rsp, 1);
+    break;
+  case EHOST_OPEN_MULTI_REQ:
+    rsp[0] = EHOST_OPEN_MULTI_RSP;
+    DloadQueue(rsp, 2);
+    break;
+  case EHOST_CLOSE_REQ:
+    rsp[0] = EHOST_CLOSE_RSP;
+    DloadQueue(rsp, 1);
+    break;
+  case EHOST_STREAM_WRITE_REQ:
+    if (length >= 5) {
+      // A lost packet is neither written nor answered, which ones is pseudo random so
+      // a resend doesn't keep landing on the same beat as the losses
+      simDloadSeed = simDloadSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+      if (g_simport.dloadDropEvery != 0 && ((simDloadSeed >> 33) % g_simport.dloadDropEvery) == 0) {
+        break;
+      }
+      uint64_t offset = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+      if (simDloadSector) {
+        offset *= g_simport.sectorSize;
+      }
+      if (offset + length - 5 <= simDiskSize) {
+        memcpy(simDisk + offset, &data[5], length - 5);
+      }
+      rsp[0] = EHOST_STREAM_WRITE_RSP;
+      memcpy(&rsp[1], &data[1], 4);
+      DloadQueue(rsp, 5);
+    }
+    break;
+  default:
+    rsp[0] = EHOST_ERROR;
+    DloadQueue(rsp, 1);
+    break;
+  }
+}
+
+unsigned char *SimPortDisk(void)
+{
+  return simDisk;
+}
+
+SerialPort::SerialPort()
+{
+  hPort = NULL;
+  HDLCBuf = (unsigned char *)malloc(MAX_PACKET_SIZE);
+  to_ms = 1000;
+  queueDepth = USB_DEFAULT_QUEUE_DEPTH;
+}
+
+SerialPort::~SerialPort()
+{
+  Close();
+  free(HDLCBuf);
+}
+
+int SerialPort::Open(int port)
+{
+  (void)port;
+  Close();
+  simDiskSize = (uint64_t)g_simport.diskMB * 1024 * 1024;
+  simDisk = (unsigned char *)calloc(1, simDiskSize);
+  if (simDisk == NULL) {
+    return ENOMEM;
+  }
+  memset(&g_simstats, 0, sizeof(g_simstats));
+  simRxLen = 0;
+  simReadLeft = 0;
+  simProgLeft = 0;
+  simLinkBusyNs = 0;
+
+  // PBL greets the host as soon as the device enumerates
+  simSahara = g_simport.sahara;
+  simSaharaLeft = 0;
+  simMemHead = 0;
+  simMemCount = 0;
+  simDloadHead = 0;
+  simDloadCount = 0;
+  simDloadSeed = 0;
+  simDloadSector = false;
+  if (simSahara) {
+    if (g_simport.saharaMemDebug) {
+      SaharaMemTable();
+    }
+    SaharaHello();
+  }
+  return 0;
+}
+
+int SerialPort::EnableBinaryLog(char *szFileName)
+{
+  (void)szFileName;
+  return 0;
+}
+
+int SerialPort::Close()
+{
+  if (simDisk != NULL) {
+    free(simDisk);
+    simDisk = NULL;
+  }
+  return 0;
+}
+
+int SerialPort::Write(unsigned char *data, uint32_t length)
+{
+  LinkDelay(length);
+  g_simstats.bytesIn += length;
+
+  if (simSahara) {
+    HandleSahara(data, length);
+    return length;
+  }
+
+  if (g_simport.dload) {
+    // SendPacket writes one whole frame at a time
+    static unsigned char pkt[MAX_PACKET_SIZE];
+    int len = sizeof(pkt);
+    if (HdlcDecode(data, length, pkt, &len) != 0) {
+      pkt[0] = EHOST_ERROR;
+      DloadQueue(pkt, 1);
+      return length;
+    }
+    HandleDload(pkt, len - 2);
+    return length;
+  }
+
+  if (simProgLeft > 0) {
+    uint32_t bytes = (length < simProgLeft) ? length : (uint32_t)simProgLeft;
+    memcpy(simDisk + simProgOffset, data, bytes);
+    simProgOffset += bytes;
+    simProgLeft -= bytes;
+    if (simProgLeft == 0) {
+      Ack("false");
+    }
+    return length;
+  }
+
+  // Commands are small, copy so the parser can rely on a terminator
+  char doc[4096];
+  uint32_t len = (length < sizeof(doc) - 1) ? length : sizeof(doc) - 1;
+  memcpy(doc, data, len);
+  doc[len] = '\0';
+
+  // Each element inside <data> is a command of its own
+  char *p = strstr(doc, "<data>");
+  p = (p != NULL) ? p + 6 : doc;
+  while ((p = strchr(p, '<')) != NULL && p[1] != '/') {
+    char *end = strchr(p, '>');
+    if (end == NULL) {
+      break;
+    }
+    char save = end[1];
+    end[1] = '\0';
+    HandleCommand(p);
+    end[1] = save;
+    p = end + 1;
+    if (!g_simport.batch) {
+      break;
+    }
+  }
+  return length;
+}
+
+int SerialPort::Read(unsigned char *data, uint32_t *length)
+{
+  uint32_t bytes = 0;
+
+  if (simDloadCount > 0) {
+    SleepUntil(simDloadReadyNs[simDloadHead]);
+    bytes = simDloadRspLen[simDloadHead];
+    if (bytes > *length) {
+      bytes = *length;
+    }
+    memcpy(data, simDloadRsp[simDloadHead], bytes);
+    simDloadHead = (simDloadHead + 1) % SIM_DLOAD_RSPS;
+    simDloadCount--;
+    LinkDelay(bytes);
+    g_simstats.bytesOut += bytes;
+    *length = bytes;
+    return 0;
+  }
+  if (simReadLeft == 0 && simMemCount > 0) {
+    SleepUntil(simMemReadyNs[simMemHead]);
+    simReadOffset = simMemOffset[simMemHead];
+    simReadLeft = simMemLen[simMemHead];
+    simMemHead = (simMemHead + 1) % SIM_MEM_READS;
+    simMemCount--;
+  }
+  if (simReadLeft > 0) {
+    bytes = (*length < simReadLeft) ? *length : (uint32_t)simReadLeft;
+    memcpy(data, simDisk + simReadOffset, bytes);
+    simReadOffset += bytes;
+    simReadLeft -= bytes;
+  }
+  else if (simRxLen > 0) {
+    SleepUntil(simRxReadyNs);
+    bytes = (*length < simRxLen) ? *length : simRxLen;
+    memcpy(data, simRx, bytes);
+    memmove(simRx, simRx + bytes, simRxLen - bytes);
+    simRxLen -= bytes;
+  }
+
+  LinkDelay(bytes);
+  g_simstats.bytesOut += bytes;
+  *length = bytes;
+  return bytes ? 0 : -1;
+}
+
+int SerialPort::Flush()
+{
+  simRxLen = 0;
+  simDloadCount = 0;
+  hdlcRx.Reset();
+  return 0;
+}
+
+// Same framing as usbport.cpp, the streaming download target unframes it in Write
+int SerialPort::SendPacket(unsigned char *out_buf, int out_length)
+{
+  int bytesOut = MAX_PACKET_SIZE;
+  int status = HdlcEncode(out_buf, out_length, HDLCBuf, &bytesOut);
+  if (status != 0) {
+    return status;
+  }
+  if (Write(HDLCBuf, bytesOut) < 0) {
+    return EIO;
+  }
+  return 0;
+}
+
+int SerialPort::ReadPacket(unsigned char *in_buf, int *in_length)
+{
+  unsigned char *frame;
+  uint32_t frameLen;
+
+  while (!hdlcRx.NextFrame(&frame, &frameLen)) {
+    uint32_t bytesIn = 0;
+    unsigned char *space = hdlcRx.FreeSpace(&bytesIn);
+    if (space == NULL) {
+      hdlcRx.Reset();
+      return ENOMEM;
+    }
+    // Nothing queued is a timeout, as on usbport
+    if (Read(space, &bytesIn) != 0) {
+      *in_length = 0;
+      return ETIMEDOUT;
+    }
+    hdlcRx.Fill(bytesIn);
+  }
+  return HdlcDecode(frame, frameLen, in_buf, in_length);
+}
+
+int SerialPort::SendSync(unsigned char *out_buf, int out_length, unsigned char *in_buf, int *in_length)
+{
+  int status = SendPacket(out_buf, out_length);
+  if (status != 0) {
+    *in_length = 0;
+    return status;
+  }
+  return ReadPacket(in_buf, in_length);
+}
+
+int SerialPort::SetTimeout(int ms)
+{
+  to_ms = ms;
+  return 0;
+}
+
+int SerialPort::SetQueueDepth(int depth)
+{
+  queueDepth = depth;
+  return 0;
+}
+
+int64_t SerialPort::OutputBufferCount()
+{
+  return 0;
+}
+
+int64_t SerialPort::InputBufferCount()
+{
+  return 0;
+}
@@ -23,13 +23,25 @@ when       who     what, where, why
 #include "stdio.h"
 #include "stdlib.h"
 #include "sparse.h"
+#include "metrics.h"
+#include "digestcache.h"
 #include "string.h"
+#include <sys/stat.h>
 
 // Constructor
 SparseImage::SparseImage()
 {
   bSparseImage = false;
   hSparseImage = -1;
+  bpBufAlloc = NULL;
+  bpBuffer = NULL;
+  dwBufferSize = 0;
+  dwBufferLen = 0;
+  dwBufferOffset = 0;
+  dwBytesOut = 0;
+  szImageFile[0] = '\0';
+  pChunkMap = NULL;
+  dwChunkMapLen = 0;
 }
 
 // Destructor
@@ -39,6 +51,8 @@ SparseImage::~SparseImage()
   {
     emmcdl_close(hSparseImage);
   }
+  if (bpBufAlloc) free(bpBufAlloc);
+  if (pChunkMap) free(pChunkMap);
 }
 
 // This will load a sparse image into memory and read headers if it is a sparse image
@@ -65,16 +79,116 @@ int SparseImage::PreLoadImage(char *szSparseFile)
     return errno;
   }
 
+  snprintf(szImageFile, sizeof(szImageFile), "%s", szSparseFile);
   bSparseImage = true;
   return 0;
 }
 
-int SparseImage::ProgramImage(Protocol *pProtocol, int64_t dwOffset)
+// Read exactly dwBytes at qwOffset in the sparse file, short reads are retried
+int SparseImage::ReadAt(unsigned char *pBuf, uint32_t dwBytes, uint64_t qwOffset)
+{
+  while (dwBytes > 0) {
+    ssize_t bytes = pread(hSparseImage, pBuf, dwBytes, qwOffset);
+    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+      continue;
+    }
+    else if (bytes <= 0) {
+      return (bytes < 0) ? errno : ERROR_INVALID_DATA;
+    }
+    pBuf += bytes;
+    dwBytes -= bytes;
+    qwOffset += bytes;
+  }
+  return 0;
+}
+
+// Chunk layout of the image, from the digest cache or by walking the chunk headers.
+// Every header is checked here so a broken image fails before anything is sent.
+int SparseImage::LoadChunkMap(void)
 {
   CHUNK_HEADER ChunkHeader;
-  unsigned char *bpDataBuf;
-  uint32_t dwBytesRead;
-  uint32_t dwBytesOut = 0;
+  struct stat st;
+  unsigned char *pData = NULL;
+  uint32_t dwSize = 0;
+  int status = 0;
+
+  if (pChunkMap != NULL) {
+    return 0;
+  }
+  if (fstat(hSparseImage, &st) != 0) {
+    return errno;
+  }
+  if (g_digestcache.Load(hSparseImage, szImageFile, DIGEST_CACHE_SPARSE, SparseHeader.dwBlockSize, 0, st.st_size,
+                         &pData, &dwSize) == 0) {
+    if (dwSize == SparseHeader.dwTotalChunks * sizeof(SPARSE_CHUNK)) {
+      pChunkMap = (SPARSE_CHUNK *)pData;
+      dwChunkMapLen = SparseHeader.dwTotalChunks;
+      return 0;
+    }
+    free(pData);
+  }
+
+  if (SparseHeader.wSparseHeaderSize < sizeof(SPARSE_HEADER) || SparseHeader.wChunkHeaderSize < sizeof(CHUNK_HEADER)) {
+    return ERROR_INVALID_DATA;
+  }
+  pChunkMap = (SPARSE_CHUNK *)calloc(SparseHeader.dwTotalChunks + 1, sizeof(SPARSE_CHUNK));
+  if (pChunkMap == NULL) {
+    return -ENOMEM;
+  }
+
+  uint64_t qwOffset = SparseHeader.wSparseHeaderSize;
+  for (uint32_t i=0; i < SparseHeader.dwTotalChunks && status == 0; i++) {
+    SPARSE_CHUNK *pChunk = &pChunkMap[i];
+    status = ReadAt((unsigned char *)&ChunkHeader, sizeof(ChunkHeader), qwOffset);
+    if (status != 0) {
+      break;
+    }
+    pChunk->wChunkType = ChunkHeader.wChunkType;
+    pChunk->dwChunkSize = ChunkHeader.dwChunkSize;
+    pChunk->qwDataOffset = qwOffset + SparseHeader.wChunkHeaderSize;
+    if (ChunkHeader.dwTotalSize < SparseHeader.wChunkHeaderSize) {
+      status = ERROR_INVALID_DATA;
+    }
+    else if (ChunkHeader.wChunkType == SPARSE_RAW_CHUNK) {
+      // RAW data must fill the chunk exactly or everything after it is misread
+      if ((uint64_t)ChunkHeader.dwChunkSize * SparseHeader.dwBlockSize != ChunkHeader.dwTotalSize - SparseHeader.wChunkHeaderSize) {
+        status = ERROR_INVALID_DATA;
+      }
+    }
+    else if (ChunkHeader.wChunkType == SPARSE_FILL_CHUNK) {
+      status = ReadAt((unsigned char *)&pChunk->dwFillValue, sizeof(pChunk->dwFillValue), pChunk->qwDataOffset);
+    }
+    else if (ChunkHeader.wChunkType != SPARSE_DONT_CARE && ChunkHeader.wChunkType != SPARSE_CRC32_CHUNK) {
+      status = ERROR_INVALID_DATA;
+    }
+    qwOffset += ChunkHeader.dwTotalSize;
+  }
+
+  if (status != 0) {
+    free(pChunkMap);
+    pChunkMap = NULL;
+    return status;
+  }
+  dwChunkMapLen = SparseHeader.dwTotalChunks;
+  g_digestcache.Store(hSparseImage, szImageFile, DIGEST_CACHE_SPARSE, SparseHeader.dwBlockSize, 0, st.st_size,
+                      (unsigned char *)pChunkMap, dwChunkMapLen * sizeof(SPARSE_CHUNK));
+  return 0;
+}
+
+// Send whatever RAW data is staged as a single program command
+int SparseImage::FlushBuffer(Protocol *pProtocol, uint8_t partNum)
+{
+  int status = 0;
+
+  if (dwBufferLen > 0) {
+    status = pProtocol->WriteData(bpBuffer, dwBufferOffset, dwBufferLen, &dwBytesOut, partNum);
+    dwBufferLen = 0;
+  }
+  return status;
+}
+
+int SparseImage::ProgramImage(Protocol *pProtocol, int64_t dwOffset, uint8_t partNum)
+{
   int status = 0;
 
   // Make sure we have first successfully found a sparse file and headers are loaded okay
@@ -83,49 +197,84 @@ int SparseImage::ProgramImage(Protocol *pProtocol, int64_t dwOffset)
     return -EBADF;
   }
 
-  // Allocated a buffer 
+  // One staging buffer for the whole image, a multiple of the target payload size so
+  // each flush is a full transfer. Large chunks are streamed through it.
+  uint32_t dwPayload = pProtocol->GetMaxPayloadSize();
+  uint32_t dwSize = dwPayload;
+  while (dwSize < SPARSE_BUFFER_SIZE) {
+    dwSize += dwPayload;
+  }
+  dwSize -= dwSize % SparseHeader.dwBlockSize;
+  if (dwSize == 0) {
+    return ERROR_INVALID_DATA;
+  }
+  if (bpBufAlloc == NULL || dwBufferSize < dwSize) {
+    if (bpBufAlloc) free(bpBufAlloc);
+    bpBufAlloc = (unsigned char *)malloc(dwSize + SPARSE_BUFFER_ALIGN);
+    if (bpBufAlloc == NULL) {
+      return -ENOMEM;
+    }
+    bpBuffer = (unsigned char *)(((uintptr_t)bpBufAlloc + SPARSE_BUFFER_ALIGN - 1) & ~(uintptr_t)(SPARSE_BUFFER_ALIGN - 1));
+  }
+  dwBufferSize = dwSize;
+  dwBufferLen = 0;
+  dwBytesOut = 0;
+
+  status = LoadChunkMap();
 
   // Main loop through all block entries in the sparse image
-  for (uint32_t i=0; i < SparseHeader.dwTotalChunks; i++){
-    // Read chunk header 
-    if (emmcdl_read(hSparseImage, &ChunkHeader, sizeof(ChunkHeader))){
-      if (ChunkHeader.wChunkType == SPARSE_RAW_CHUNK){
-        uint32_t dwChunkSize = ChunkHeader.dwChunkSize*SparseHeader.dwBlockSize;
-        // Allocate a buffer the size of the chunk and read in the data
-        bpDataBuf = (unsigned char *)malloc(dwChunkSize);
-        if (bpDataBuf == NULL){
-          return -ENOMEM;
+  for (uint32_t i=0; i < dwChunkMapLen && status == 0; i++){
+    SPARSE_CHUNK *pChunk = &pChunkMap[i];
+    uint64_t dwChunkSize = (uint64_t)pChunk->dwChunkSize*SparseHeader.dwBlockSize;
+    uint64_t qwDataOffset = pChunk->qwDataOffset;
+    if (pChunk->wChunkType == SPARSE_RAW_CHUNK){
+      // Append to the staged data, RAW chunks that follow each other on disk share a program command
+      while (dwChunkSize > 0 && status == 0) {
+        if (dwBufferLen == 0) {
+          dwBufferOffset = dwOffset;
         }
-        if (emmcdl_read(hSparseImage, bpDataBuf, dwChunkSize)) {
-          // Now we have the data so use whatever protocol we need to write this out
-          pProtocol->WriteData(bpDataBuf, dwOffset, dwChunkSize, &dwBytesOut,0);
-          dwOffset += dwChunkSize;
+        uint32_t dwBytes = dwBufferSize - dwBufferLen;
+        if (dwChunkSize < dwBytes) {
+          dwBytes = (uint32_t)dwChunkSize;
         }
-        else {
-          status = errno;
+        uint64_t ts = Metrics::Now();
+        status = ReadAt(bpBuffer + dwBufferLen, dwBytes, qwDataOffset);
+        if (status != 0) {
           break;
         }
-        free(bpDataBuf);
-      }
-      else if (ChunkHeader.wChunkType == SPARSE_FILL_CHUNK){
-        // Fill chunk with data byte given for now just skip over this area
-        dwOffset += ChunkHeader.dwChunkSize*SparseHeader.dwBlockSize;
-      }
-      else if (ChunkHeader.wChunkType == SPARSE_DONT_CARE){
-        // Skip the specified number of bytes in the output file
-        dwOffset += ChunkHeader.dwChunkSize*SparseHeader.dwBlockSize;
+        g_metrics.Record(METRIC_FILE_READ, ts, dwBytes);
+        dwBufferLen += dwBytes;
+        dwOffset += dwBytes;
+        qwDataOffset += dwBytes;
+        dwChunkSize -= dwBytes;
+        if (dwBufferLen == dwBufferSize) {
+          status = FlushBuffer(pProtocol, partNum);
+        }
       }
-      else {
-        // We have no idea what type of chunk this is return a failure and close file
-        status = ERROR_INVALID_DATA;
-        break;
+    }
+    else if (pChunk->wChunkType == SPARSE_FILL_CHUNK){
+      // Fill chunk carries a 32 bit pattern repeated over every block
+      status = FlushBuffer(pProtocol, partNum);
+      if (status == 0) {
+        int iSectorSize = pProtocol->GetDiskSectorSize();
+        status = pProtocol->FillSectors(pChunk->dwFillValue, dwOffset / iSectorSize, dwChunkSize / iSectorSize, partNum);
       }
+      dwOffset += dwChunkSize;
     }
-    else {
-      // Failed to read data something is wrong with the file
-      status = errno;
-      break;
+    else if (pChunk->wChunkType == SPARSE_DONT_CARE){
+      // Skip the specified number of bytes in the output file
+      status = FlushBuffer(pProtocol, partNum);
+      dwOffset += dwChunkSize;
     }
+    else if (pChunk->wChunkType != SPARSE_CRC32_CHUNK){
+      // We have no idea what type of chunk this is return a failure and close file
+      status = ERROR_INVALID_DATA;
+    }
+  }
+
+  // Push out anything still staged
+  if (status == 0) {
+    status = FlushBuffer(pProtocol, partNum);
   }
 
   // If we failed to load the file close the handle and set sparse image back to false
@@ -51,35 +51,13 @@
 #include <asm/byteorder.h>
 
 #include "usb.h"
-
-#define MAX_RETRIES 10  // Increased from 5 for Xiaomi devices
+#include "usbfs.h"
 
 /* Timeout in seconds for usb_wait_for_disconnect.
  * Increased for Xiaomi devices which may take longer to disconnect
  */
 #define WAIT_FOR_DISCONNECT_TIMEOUT  5
 
-#ifdef TRACE_USB
-#define DBG1(x...) fprintf(stderr, x)
-#define DBG(x...) fprintf(stderr, x)
-#else
-#define DBG(x...)
-#define DBG1(x...)
-#endif
-
-/* The max bulk size for linux is 16384 which is defined
- * in drivers/usb/core/devio.c.
- */
-#define MAX_USBFS_BULK_SIZE (16 * 1024)
-
-struct usb_handle
-{
-    char fname[64];
-    int desc;
-    unsigned char ep_in;
-    unsigned char ep_out;
-};
-
 // Add Xiaomi-specific USB VID/PID for EDL mode
 #define XIAOMI_VENDOR_ID 0x05c6
 #define XIAOMI_EDL_PRODUCT_ID 0x9008
@@ -185,11 +163,7 @@ static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
 
             if(filter_usb_device(de->d_name, desc, n, writable, callback,
                                  &in, &out, &ifc) == 0) {
-                usb = calloc(1, sizeof(usb_handle));
-                strcpy(usb->fname, devname);
-                usb->ep_in = in;
-                usb->ep_out = out;
-                usb->desc = fd;
+                usb = usbfs_handle_new(devname, fd, in, out);
 
                 // Add retry logic for interface claim
                 int retries = 0;
@@ -216,86 +190,6 @@ static usb_handle *find_usb_device(const char *base, ifc_match_func callback)
     return usb;
 }
 
-int usb_write(usb_handle *h, const void *_data, int len)
-{
-    unsigned char *data = (unsigned char*) _data;
-    unsigned count = 0;
-    struct usbdevfs_bulktransfer bulk;
-    int n;
-
-    if(h->ep_out == 0 || h->desc == -1) {
-        return -1;
-    }
-
-    do {
-        int xfer;
-        xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
-
-        bulk.ep = h->ep_out;
-        bulk.len = xfer;
-        bulk.data = data;
-        bulk.timeout = 5000; // Increased timeout for Xiaomi devices (5 seconds)
-
-        n = ioctl(h->desc, USBDEVFS_BULK, &bulk);
-        if(n != xfer) {
-            DBG("ERROR: n = %d, errno = %d (%s)\n",
-                n, errno, strerror(errno));
-            return -1;
-        }
-
-        count += xfer;
-        len -= xfer;
-        data += xfer;
-    } while(len > 0);
-
-    return count;
-}
-
-int usb_read(usb_handle *h, void *_data, int len)
-{
-    unsigned char *data = (unsigned char*) _data;
-    unsigned count = 0;
-    struct usbdevfs_bulktransfer bulk;
-    int n, retry;
-
-    if(h->ep_in == 0 || h->desc == -1) {
-        return -1;
-    }
-
-    while(len > 0) {
-        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
-
-        bulk.ep = h->ep_in;
-        bulk.len = xfer;
-        bulk.data = data;
-        bulk.timeout = 5000; // Increased timeout for Xiaomi devices (5 seconds)
-        retry = 0;
-
-        do {
-           DBG("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
-           n = ioctl(h->desc, USBDEVFS_BULK, &bulk);
-           DBG("[ usb read %d ] = %d, fname=%s, Retry %d \n", xfer, n, h->fname, retry);
-
-           if( n < 0 ) {
-            DBG1("ERROR: n = %d, errno = %d (%s)\n",n, errno, strerror(errno));
-            if ( ++retry > MAX_RETRIES ) return -1;
-            usleep(200000); // Increased delay from 1s to 200ms
-           }
-        }
-        while( n < 0 );
-
-        count += n;
-        len -= n;
-        data += n;
-
-        if(n < xfer) {
-            break;
-        }
-    }
-
-    return count;
-}
-
 [Previous usb_kick(), usb_close(), and usb_open() functions remain the same]
 
 double now()
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <linux/usbdevice_fs.h>
+
+#include "usb.h"
+#include "usbfs.h"
+
+static int usbfs_ioctl_default(int fd, unsigned long request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static int usbfs_wait_default(int fd, int timeout_ms)
+{
+    struct pollfd pfd;
+
+    /* usbfs reports reapable URBs as writable */
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static struct usbfs_ops usbfs_default_ops = {
+    usbfs_ioctl_default,
+    usbfs_wait_default,
+};
+
+static struct usbfs_ops *usbfs = &usbfs_default_ops;
+
+usb_handle *usbfs_handle_new(const char *fname, int desc, unsigned char ep_in, unsigned char ep_out)
+{
+    usb_handle *h = (usb_handle *)calloc(1, sizeof(usb_handle));
+
+    if(h == 0) {
+        return 0;
+    }
+    strncpy(h->fname, fname, sizeof(h->fname) - 1);
+    h->desc = desc;
+    h->ep_in = ep_in;
+    h->ep_out = ep_out;
+    h->queue_depth = 1;
+    return h;
+}
+
+void usbfs_handle_free(usb_handle *h)
+{
+    if(h) {
+        free(h->urbs);
+        free(h);
+    }
+}
+
+void usb_set_ops(struct usbfs_ops *ops)
+{
+    usbfs = ops ? ops : &usbfs_default_ops;
+}
+
+int usb_set_queue_depth(usb_handle *h, int depth)
+{
+    struct usbdevfs_urb *urbs = 0;
+
+    if(h == 0) {
+        return -1;
+    }
+
+    /* A depth of 0 or 1 keeps the synchronous USBDEVFS_BULK path */
+    if(depth > 1) {
+        urbs = (struct usbdevfs_urb *)calloc(depth, sizeof(struct usbdevfs_urb));
+        if(urbs == 0) {
+            return -1;
+        }
+    } else {
+        depth = 1;
+    }
+
+    free(h->urbs);
+    h->urbs = urbs;
+    h->queue_depth = depth;
+    return 0;
+}
+
+int usb_set_timeout(usb_handle *h, int timeout_ms)
+{
+    if(h == 0) {
+        return -1;
+    }
+    h->timeout_ms = (timeout_ms > 0) ? timeout_ms : 0;
+    return 0;
+}
+
+/* Wait up to timeout_ms for the next completed URB on this handle */
+static int usb_reap_urb(usb_handle *h, int timeout_ms, struct usbdevfs_urb **urb)
+{
+    int n;
+
+    for(;;) {
+        n = usbfs->ioctl(h->desc, USBDEVFS_REAPURBNDELAY, urb);
+        if(n == 0) {
+            return 0;
+        }
+        if(errno != EAGAIN) {
+            return -1;
+        }
+
+        n = usbfs->wait(h->desc, timeout_ms);
+        if(n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(n < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Cancel everything between done and submitted and wait for the kernel to hand the URBs back */
+static void usb_discard_urbs(usb_handle *h, int done, int submitted)
+{
+    struct usbdevfs_urb *urb;
+    int i;
+
+    for(i = done; i < submitted; i++) {
+        usbfs->ioctl(h->desc, USBDEVFS_DISCARDURB, &h->urbs[i % h->queue_depth]);
+    }
+    for(i = done; i < submitted; i++) {
+        if(usb_reap_urb(h, USB_BULK_TIMEOUT, &urb) < 0) {
+            DBG1("ERROR: lost URB on discard, errno = %d (%s)\n", errno, strerror(errno));
+            break;
+        }
+    }
+}
+
+static int usb_write_async(usb_handle *h, const unsigned char *data, int len)
+{
+    struct usbdevfs_urb *urb;
+    int submitted = 0;
+    int done = 0;
+    int offset = 0;
+    unsigned count = 0;
+
+    while(offset < len || done < submitted) {
+        /* Keep queue_depth URBs on the bus so it never idles between chunks */
+        while(offset < len && submitted - done < h->queue_depth) {
+            int xfer = (len - offset > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len - offset;
+
+            urb = &h->urbs[submitted % h->queue_depth];
+            memset(urb, 0, sizeof(*urb));
+            urb->type = USBDEVFS_URB_TYPE_BULK;
+            urb->endpoint = h->ep_out;
+            urb->buffer = (void *)(data + offset);
+            urb->buffer_length = xfer;
+
+            if(usbfs->ioctl(h->desc, USBDEVFS_SUBMITURB, urb) < 0) {
+                DBG("ERROR: submit errno = %d (%s)\n", errno, strerror(errno));
+                usb_discard_urbs(h, done, submitted);
+                return -1;
+            }
+            offset += xfer;
+            submitted++;
+        }
+
+        if(usb_reap_urb(h, USB_BULK_TIMEOUT, &urb) < 0) {
+            DBG("ERROR: reap errno = %d (%s)\n", errno, strerror(errno));
+            usb_discard_urbs(h, done, submitted);
+            return -1;
+        }
+        done++;
+
+        if(urb->status != 0 || urb->actual_length != urb->buffer_length) {
+            DBG("ERROR: urb status = %d, %d of %d\n",
+                urb->status, urb->actual_length, urb->buffer_length);
+            usb_discard_urbs(h, done, submitted);
+            errno = urb->status ? -urb->status : EIO;
+            return -1;
+        }
+        count += urb->actual_length;
+    }
+
+    return count;
+}
+
+static int usb_read_async(usb_handle *h, unsigned char *data, int len)
+{
+    struct usbdevfs_urb *urb;
+    int submitted = 0;
+    int done = 0;
+    int offset = 0;
+    int stopped = 0;
+    int ended = 0;
+    int error = 0;
+    unsigned count = 0;
+
+    while((offset < len && !stopped) || done < submitted) {
+        /* All URBs of one read form a continuation chain so a short packet
+         * makes the kernel cancel the rest instead of letting them eat the
+         * next response.
+         */
+        while(offset < len && !stopped && submitted - done < h->queue_depth) {
+            int xfer = (len - offset > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len - offset;
+
+            urb = &h->urbs[submitted % h->queue_depth];
+            memset(urb, 0, sizeof(*urb));
+            urb->type = USBDEVFS_URB_TYPE_BULK;
+            urb->endpoint = h->ep_in;
+            urb->buffer = data + offset;
+            urb->buffer_length = xfer;
+            if(offset + xfer < len) {
+                urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+            }
+            if(submitted > 0) {
+                urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+            }
+
+            if(usbfs->ioctl(h->desc, USBDEVFS_SUBMITURB, urb) < 0) {
+                /* The chain was already cut short by an earlier URB */
+                if(submitted > 0 && errno == EREMOTEIO) {
+                    stopped = 1;
+                    break;
+                }
+                DBG1("ERROR: submit errno = %d (%s)\n", errno, strerror(errno));
+                usb_discard_urbs(h, done, submitted);
+                return -1;
+            }
+            offset += xfer;
+            submitted++;
+        }
+
+        if(done == submitted) {
+            break;
+        }
+
+        if(usb_reap_urb(h, h->timeout_ms ? h->timeout_ms : USB_BULK_TIMEOUT * MAX_RETRIES, &urb) < 0) {
+            int err = errno;
+            DBG1("ERROR: reap errno = %d (%s)\n", err, strerror(err));
+            usb_discard_urbs(h, done, submitted);
+            /* Running out of the caller's time is an answer, not a fault */
+            if(h->timeout_ms && err == ETIMEDOUT) {
+                return count;
+            }
+            errno = err;
+            return -1;
+        }
+        done++;
+
+        if(ended) {
+            /* Leftovers cancelled by the kernel after the short packet */
+            continue;
+        }
+
+        if(urb->status == 0 || urb->status == -EREMOTEIO) {
+            count += urb->actual_length;
+            if(urb->actual_length < urb->buffer_length) {
+                stopped = ended = 1;
+            }
+        } else {
+            DBG1("ERROR: urb status = %d (%s)\n", urb->status, strerror(-urb->status));
+            error = -urb->status;
+            stopped = ended = 1;
+        }
+    }
+
+    if(error && count == 0) {
+        errno = error;
+        return -1;
+    }
+
+    return count;
+}
+
+int usb_write(usb_handle *h, const void *_data, int len)
+{
+    unsigned char *data = (unsigned char*) _data;
+    unsigned count = 0;
+    struct usbdevfs_bulktransfer bulk;
+    int n;
+
+    if(h->ep_out == 0 || h->desc == -1) {
+        return -1;
+    }
+
+    if(h->queue_depth > 1) {
+        return usb_write_async(h, data, len);
+    }
+
+    do {
+        int xfer;
+        xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
+
+        bulk.ep = h->ep_out;
+        bulk.len = xfer;
+        bulk.data = data;
+        bulk.timeout = USB_BULK_TIMEOUT;
+
+        n = usbfs->ioctl(h->desc, USBDEVFS_BULK, &bulk);
+        if(n != xfer) {
+            DBG("ERROR: n = %d, errno = %d (%s)\n",
+                n, errno, strerror(errno));
+            return -1;
+        }
+
+        count += xfer;
+        len -= xfer;
+        data += xfer;
+    } while(len > 0);
+
+    return count;
+}
+
+int usb_read(usb_handle *h, void *_data, int len)
+{
+    unsigned char *data = (unsigned char*) _data;
+    unsigned count = 0;
+    struct usbdevfs_bulktransfer bulk;
+    int n, retry;
+
+    if(h->ep_in == 0 || h->desc == -1) {
+        return -1;
+    }
+
+    if(h->queue_depth > 1) {
+        return usb_read_async(h, data, len);
+    }
+
+    while(len > 0) {
+        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
+
+        bulk.ep = h->ep_in;
+        bulk.len = xfer;
+        bulk.data = data;
+        bulk.timeout = h->timeout_ms ? h->timeout_ms : USB_BULK_TIMEOUT;
+        retry = 0;
+
+        do {
+           DBG("[ usb read %d fd = %d], fname=%s\n", xfer, h->desc, h->fname);
+           n = usbfs->ioctl(h->desc, USBDEVFS_BULK, &bulk);
+           DBG("[ usb read %d ] = %d, fname=%s, Retry %d \n", xfer, n, h->fname, retry);
+
+           if( n < 0 ) {
+            DBG1("ERROR: n = %d, errno = %d (%s)\n",n, errno, strerror(errno));
+            /* Running out of the caller's time is an answer, not a fault */
+            if (h->timeout_ms && errno == ETIMEDOUT) return count;
+            if ( ++retry > MAX_RETRIES ) return -1;
+            usleep(200000); // Increased delay from 1s to 200ms
+           }
+        }
+        while( n < 0 );
+
+        count += n;
+        len -= n;
+        data += n;
+
+        if(n < xfer) {
+            break;
+        }
+    }
+
+    return count;
+}
@@ -33,6 +33,7 @@ static char ERROR[128];
 SerialPort::SerialPort() {
 	hPort = NULL;
 	to_ms = 1000;  // 1 second default timeout for packets to send/rcv
+	queueDepth = USB_DEFAULT_QUEUE_DEPTH;
 	HDLCBuf = (unsigned char *) malloc(MAX_PACKET_SIZE);
 
 }
@@ -120,6 +121,12 @@ void list_devices(void) {
 int SerialPort::Open(int port) {
   usb_handle *usb = open_device();
   hPort = usb;
+  // Keep several bulk URBs in flight instead of one blocking ioctl per chunk
+  if (usb_set_queue_depth(hPort, queueDepth) != 0) {
+    fprintf(stderr, "Failed to set USB queue depth %i, using synchronous transfers\n", queueDepth);
+    usb_set_queue_depth(hPort, 1);
+  }
+  usb_set_timeout(hPort, to_ms);
   return 0;
 }
 
@@ -135,15 +142,20 @@ int SerialPort::Close() {
 int SerialPort::Write(unsigned char *data, uint32_t length) {
     int r;
 
+    if (hPort == NULL) {
+        return -1;
+    }
     r = usb_write(hPort, data, length);
     if(r < 0) {
         sprintf(ERROR, "data transfer failure (%s)", strerror(errno));
         usb_close(hPort);
+        hPort = NULL;
         return -1;
     }
     if(r != ((int) length)) {
         sprintf(ERROR, "data transfer failure (short transfer)");
         usb_close(hPort);
+        hPort = NULL;
         return -1;
     }
 
@@ -152,10 +164,19 @@ int SerialPort::Write(unsigned char *data, uint32_t length) {
 
 int SerialPort::Read(unsigned char *data, uint32_t *length) {
     int r;
+
+    if (hPort == NULL) {
+        *length = 0;
+        return -1;
+    }
+        // A timeout comes back as 0 bytes with the port still open, and is
+        // reported like any read that got nothing
         r = usb_read(hPort, data, *length);
         if(r < 0) {
             sprintf(ERROR, "status read failed (%s)", strerror(errno));
             usb_close(hPort);
+            hPort = NULL;
+            *length = 0;
             return -1;
         }
 
@@ -183,115 +204,84 @@ int SerialPort::Flush() {
 	SetTimeout(1);
 	Read(tmpBuf, &len);
 	SetTimeout(1000);
+	hdlcRx.Reset();
 
 	//tcflush(hPort, TCIOFLUSH);
 	return 0;
 }
 
-int SerialPort::SendSync(unsigned char *out_buf, int out_length,
-		unsigned char *in_buf, int *in_length) {
-	uint32_t status = 0;
-	uint32_t bytesOut = 0;
-	uint32_t bytesIn = 0;
+int SerialPort::SendPacket(unsigned char *out_buf, int out_length) {
+	int bytesOut = MAX_PACKET_SIZE;
+	int status;
 
-	// As long as hPort is valid write the data to the serial port and wait for response for timeout
+	// As long as hPort is valid write the data to the serial port
 	if (hPort == NULL) {
 		return EBADF;
 	}
 
 	// Do HDLC encoding then send out packet
-	bytesOut = MAX_PACKET_SIZE;
-	status = HDLCEncodePacket(out_buf, out_length, HDLCBuf, (int *) &bytesOut);
-
-	// We know we have a good handle now so write out data and wait for response
-	status = Write(HDLCBuf, bytesOut);
+	status = HdlcEncode(out_buf, out_length, HDLCBuf, &bytesOut);
 	if (status != 0)
 		return status;
 
-	// Keep looping through until we have received 0x7e with size > 1
-	for (int i = 0; i < MAX_PACKET_SIZE; i++) {
-		// Now read response and and wait for up to timeout
-		bytesIn = 1;
-		status = Read(&HDLCBuf[i], &bytesIn);
-		if (status != 0)
-			return status;
-		if (bytesIn == 0)
-			break;
-		if (HDLCBuf[i] == 0x7E) {
-			if (i > 1) {
-				bytesIn = i + 1;
-				break;
-			} else {
-				// If packet starts with multiple 0x7E ignore
-				i = 0;
-			}
-		}
+	// Write returns the byte count on some ports, only a negative value is a failure
+	if (Write(HDLCBuf, bytesOut) < 0)
+		return EIO;
+	return 0;
+}
+
+int SerialPort::ReadPacket(unsigned char *in_buf, int *in_length) {
+	unsigned char *frame;
+	uint32_t frameLen;
 
+	if (hPort == NULL) {
+		return EBADF;
 	}
 
-	// Remove HDLC encoding and return the packet
-	status = HDLCDecodePacket(HDLCBuf, bytesIn, in_buf, in_length);
+	// Read as much as the target has sent and split frames out of the buffer,
+	// a response often arrives together with the next one
+	while (!hdlcRx.NextFrame(&frame, &frameLen)) {
+		uint32_t bytesIn = 0;
+		unsigned char *space = hdlcRx.FreeSpace(&bytesIn);
+		if (space == NULL) {
+			hdlcRx.Reset();
+			return ENOMEM;
+		}
+		// A timeout leaves the port open, any other failure has closed it
+		int status = Read(space, &bytesIn);
+		if (status != 0) {
+			*in_length = 0;
+			return (hPort == NULL) ? EBADF : ETIMEDOUT;
+		}
+		hdlcRx.Fill(bytesIn);
+	}
 
-	return status;
+	// Remove HDLC encoding and check the CRC
+	return HdlcDecode(frame, frameLen, in_buf, in_length);
 }
 
-int SerialPort::SetTimeout(int ms) {
-	to_ms = ms;
-	return 0;
+int SerialPort::SendSync(unsigned char *out_buf, int out_length,
+		unsigned char *in_buf, int *in_length) {
+	// We know we have a good handle now so write out data and wait for response
+	int status = SendPacket(out_buf, out_length);
+	if (status != 0)
+		return status;
+	return ReadPacket(in_buf, in_length);
 }
 
-int SerialPort::HDLCEncodePacket(unsigned char *in_buf, int in_length,
-		unsigned char *out_buf, int *out_length) {
-	unsigned char *outPtr = out_buf;
-	unsigned short crc = (unsigned short) CalcCRC16(in_buf, in_length);
-
-	// Encoded packets start and end with 0x7E
-	*outPtr++ = ASYNC_HDLC_FLAG;
-	for (int i = 0; i < in_length + 2; i++) {
-		// Read last two bytes of data from crc value
-		if (i == in_length) {
-			in_buf = (unsigned char *) &crc;
-		}
-
-		if (*in_buf == ASYNC_HDLC_FLAG || *in_buf == ASYNC_HDLC_ESC) {
-			*outPtr++ = ASYNC_HDLC_ESC;
-			*outPtr++ = *in_buf++ ^ ASYNC_HDLC_ESC_MASK;
-		} else {
-			*outPtr++ = *in_buf++;
-		}
+int SerialPort::SetTimeout(int ms) {
+	to_ms = ms;
+	// Values of 0 and below leave usbfs on its long default
+	if (hPort) {
+		return usb_set_timeout(hPort, ms);
 	}
-	*outPtr++ = ASYNC_HDLC_FLAG;
-
-	// Update length of packet
-	*out_length = outPtr - out_buf;
 	return 0;
 }
 
-int SerialPort::HDLCDecodePacket(unsigned char *in_buf, int in_length,
-		unsigned char *out_buf, int *out_length) {
-	unsigned char *outPtr = out_buf;
-	// make sure our output buffer is large enough
-	if (*out_length < in_length) {
-		return ENOMEM;
-	}
-
-	for (int i = 0; i < in_length; i++) {
-		switch (*in_buf) {
-		case ASYNC_HDLC_FLAG:
-			// Do nothing it is an escape flag
-			in_buf++;
-			break;
-		case ASYNC_HDLC_ESC:
-			in_buf++;
-			*outPtr++ = *in_buf++ ^ ASYNC_HDLC_ESC_MASK;
-			break;
-		default:
-			*outPtr++ = *in_buf++;
-		}
+int SerialPort::SetQueueDepth(int depth) {
+	queueDepth = depth;
+	if (hPort) {
+		return usb_set_queue_depth(hPort, depth);
 	}
-
-	*out_length = outPtr - out_buf;
-	// Should do CRC check here but for now we are using USB so assume good
-
 	return 0;
 }
@@ -0,0 +1,289 @@
+/*****************************************************************************
+ * usbreplay.cpp
+ *
+ * This file implements a usbfs backend that plays back bulk IN transfers
+ * captured from a device, so the URB handling in usbfs.c can be run without
+ * one attached. URBs complete in submission order the way the kernel reaps
+ * them on a single interface, including the continuation chain being cut off
+ * after a short packet. Only the benchmark links it.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include "usb.h"
+#include "usbreplay.h"
+
+#define REPLAY_MAX_URBS   64
+
+typedef struct {
+  struct usbdevfs_urb *urb;
+  bool done;
+} replay_urb_t;
+
+usb_replay_stats_t g_usbreplay;
+
+static const usb_replay_xfer_t *replayIn;
+static int replayCount;
+static int replayIdx;
+static int replayOff;
+static unsigned char *replayOut;
+static uint64_t replayOutSize;
+static uint64_t replayOutFailAt;
+static bool replayStalled;
+static bool replayHalted[32];
+static replay_urb_t replayUrbs[REPLAY_MAX_URBS];
+static int replayHead;
+
+// usbfs numbers the bulk endpoints it tracks like this
+static int ReplayEp(unsigned char ep)
+{
+  return (ep & 0x0f) | ((ep & 0x80) >> 3);
+}
+
+static bool ReplayQuiet(void)
+{
+  return replayIdx >= replayCount || replayIn[replayIdx].data == NULL;
+}
+
+// Next part of the current IN transfer, the transfer ends with the first read it can't fill
+static int ReplayRead(void *buf, int len, bool *shortPkt)
+{
+  const usb_replay_xfer_t *x = &replayIn[replayIdx];
+  int n = x->len - replayOff;
+
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buf, x->data + replayOff, n);
+  replayOff += n;
+  *shortPkt = n < len;
+  if (*shortPkt) {
+    replayIdx++;
+    replayOff = 0;
+  }
+  return n;
+}
+
+// Once the endpoint stalls every later OUT transfer fails the same way
+static int ReplayWrite(const void *buf, int len)
+{
+  int n = len;
+
+  if (replayStalled) {
+    return 0;
+  }
+  if (replayOutFailAt && g_usbreplay.bytesOut + n > replayOutFailAt) {
+    n = (int)(replayOutFailAt - g_usbreplay.bytesOut);
+    replayStalled = true;
+  }
+  if (replayOut && g_usbreplay.bytesOut + n <= replayOutSize) {
+    memcpy(replayOut + g_usbreplay.bytesOut, buf, n);
+  }
+  g_usbreplay.bytesOut += n;
+  return n;
+}
+
+static replay_urb_t *ReplayPending(int i)
+{
+  return &replayUrbs[(replayHead + i) % REPLAY_MAX_URBS];
+}
+
+// Runs the URB on the bus if the device has something for it, false while it waits
+static bool ReplayComplete(int i)
+{
+  replay_urb_t *p = ReplayPending(i);
+  struct usbdevfs_urb *urb = p->urb;
+
+  if (p->done) {
+    return true;
+  }
+  if (urb->endpoint & 0x80) {
+    bool shortPkt;
+    if (ReplayQuiet()) {
+      return false;
+    }
+    urb->actual_length = ReplayRead(urb->buffer, urb->buffer_length, &shortPkt);
+    if (shortPkt && (urb->flags & USBDEVFS_URB_SHORT_NOT_OK)) {
+      // The kernel cancels the rest of the chain and refuses continuations
+      // until a URB starts a new transfer
+      int ep = ReplayEp(urb->endpoint);
+      urb->status = -EREMOTEIO;
+      replayHalted[ep] = true;
+      for (uint32_t j = i + 1; j < g_usbreplay.pending; j++) {
+        replay_urb_t *q = ReplayPending(j);
+        if (!q->done && ReplayEp(q->urb->endpoint) == ep && (q->urb->flags & USBDEVFS_URB_BULK_CONTINUATION)) {
+          q->urb->status = -ECONNRESET;
+          q->done = true;
+          g_usbreplay.cancelled++;
+        }
+      }
+    }
+  }
+  else {
+    urb->actual_length = ReplayWrite(urb->buffer, urb->buffer_length);
+    if (urb->actual_length < urb->buffer_length) {
+      urb->status = -EPIPE;
+    }
+  }
+  p->done = true;
+  return true;
+}
+
+// Data the device already has goes into the URBs queued for it straight away
+static void ReplayRun(void)
+{
+  for (uint32_t i = 0; i < g_usbreplay.pending; i++) {
+    replay_urb_t *p = ReplayPending(i);
+    if (p->done) {
+      continue;
+    }
+    if (!(p->urb->endpoint & 0x80) || ReplayQuiet() || !replayIn[replayIdx].ready) {
+      break;
+    }
+    ReplayComplete(i);
+  }
+}
+
+static int ReplaySubmit(struct usbdevfs_urb *urb)
+{
+  int ep = ReplayEp(urb->endpoint);
+
+  if (urb->type != USBDEVFS_URB_TYPE_BULK || g_usbreplay.pending == REPLAY_MAX_URBS) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (urb->flags & USBDEVFS_URB_BULK_CONTINUATION) {
+    if (replayHalted[ep]) {
+      g_usbreplay.refused++;
+      errno = EREMOTEIO;
+      return -1;
+    }
+  }
+  else {
+    replayHalted[ep] = false;
+  }
+
+  urb->status = 0;
+  urb->actual_length = 0;
+  replay_urb_t *p = ReplayPending(g_usbreplay.pending);
+  p->urb = urb;
+  p->done = false;
+  g_usbreplay.pending++;
+  g_usbreplay.submitted++;
+  ReplayRun();
+  return 0;
+}
+
+static int ReplayReap(struct usbdevfs_urb **urb)
+{
+  if (g_usbreplay.pending == 0 || !ReplayComplete(0)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  *urb = replayUrbs[replayHead].urb;
+  replayHead = (replayHead + 1) % REPLAY_MAX_URBS;
+  g_usbreplay.pending--;
+  g_usbreplay.reaped++;
+  return 0;
+}
+
+static int ReplayDiscard(struct usbdevfs_urb *urb)
+{
+  for (uint32_t i = 0; i < g_usbreplay.pending; i++) {
+    replay_urb_t *p = ReplayPending(i);
+    if (p->urb == urb) {
+      if (!p->done) {
+        urb->status = -ECONNRESET;
+        p->done = true;
+        g_usbreplay.discarded++;
+      }
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+static int ReplayBulk(struct usbdevfs_bulktransfer *bulk)
+{
+  g_usbreplay.bulk++;
+  if (bulk->ep & 0x80) {
+    bool shortPkt;
+    if (ReplayQuiet()) {
+      if (replayIdx < replayCount) {
+        replayIdx++;
+      }
+      g_usbreplay.timeouts++;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    return ReplayRead(bulk->data, bulk->len, &shortPkt);
+  }
+  if (ReplayWrite(bulk->data, bulk->len) < (int)bulk->len) {
+    errno = EPIPE;
+    return -1;
+  }
+  return bulk->len;
+}
+
+static int ReplayIoctl(int fd, unsigned long request, void *arg)
+{
+  (void)fd;
+  switch (request) {
+  case USBDEVFS_SUBMITURB:
+    return ReplaySubmit((struct usbdevfs_urb *)arg);
+  case USBDEVFS_REAPURBNDELAY:
+    return ReplayReap((struct usbdevfs_urb **)arg);
+  case USBDEVFS_DISCARDURB:
+    return ReplayDiscard((struct usbdevfs_urb *)arg);
+  case USBDEVFS_BULK:
+    return ReplayBulk((struct usbdevfs_bulktransfer *)arg);
+  }
+  errno = ENOTTY;
+  return -1;
+}
+
+// Nothing runs in the background, a URB the device has no data for times out at once
+static int ReplayWait(int fd, int timeout_ms)
+{
+  (void)fd;
+  (void)timeout_ms;
+  if (g_usbreplay.pending > 0 && ReplayComplete(0)) {
+    return 1;
+  }
+  if (replayIdx < replayCount && replayIn[replayIdx].data == NULL) {
+    replayIdx++;
+  }
+  g_usbreplay.timeouts++;
+  return 0;
+}
+
+static struct usbfs_ops replayOps = {
+  ReplayIoctl,
+  ReplayWait,
+};
+
+void UsbReplayStart(const usb_replay_xfer_t *in, int count, unsigned char *outBuf, uint64_t outSize, uint64_t outFailAt)
+{
+  memset(&g_usbreplay, 0, sizeof(g_usbreplay));
+  memset(replayHalted, 0, sizeof(replayHalted));
+  replayIn = in;
+  replayCount = count;
+  replayIdx = 0;
+  replayOff = 0;
+  replayOut = outBuf;
+  replayOutSize = outSize;
+  replayOutFailAt = outFailAt;
+  replayStalled = false;
+  replayHead = 0;
+  usb_set_ops(&replayOps);
+}
+
+void UsbReplayStop(void)
+{
+  usb_set_ops(NULL);
+}
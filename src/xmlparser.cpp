@@ -178,89 +178,13 @@ char *XMLParser::StringReplace(char *inp, const char *find, const char *rep) con
 
 int XMLParser::ParseXMLEvaluate(char *expr, __uint64_t &value) const
 {
-  // Parse simple expression understands -+/*, NUM_DISK_SECTORS,CRC32(offset:length)
-  char *sptr, *sptr1, *sptr2;
-  expr = StringReplace(expr,"NUM_DISK_SECTORS","1");
-  value = atoll(expr);
-
-  sptr = strstr(expr,"CRC32");
-  if( sptr != NULL ) {
-    char tmp[MAX_STRING_LEN];
-    __uint64_t crc;
-    sptr1 = strstr(sptr,"(") + 1;
-    if( sptr1 == NULL ) {
-      return EINVAL;
-    }
-    sptr2 = strstr(sptr1,",");
-    if( sptr2 == NULL ) {
-      return EINVAL;
-    }
-    strncpy(tmp,(const char*)sptr1,(sptr2-sptr1));
-    tmp[sptr2-sptr1] = 0;
-    ParseXMLEvaluate(tmp, crc);
-    sptr1 = sptr2 + 1;
-    sptr2 = strstr(sptr1,")");
-    if( sptr2 == NULL ) {
-      return EINVAL;
-    }
-    strncpy(tmp,(const char*)sptr1,(sptr2-sptr1));
-    tmp[sptr2-sptr1] = 0;
-    ParseXMLEvaluate(tmp, crc);
-    // Revome the CRC part set value 0
-    memset(sptr,' ',(sptr2-sptr+1));
-    value = 0;
-  }
-
-  sptr = strstr(expr,"*");
-  if( sptr != NULL ) {
-    // Found * do multiplication
-    char val1[64];
-    char val2[64];
-    strncpy(val1, (const char*)expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,sptr+1);
-    value = atoll(val1) * atoll(val2);
-  }
-
-  sptr = strstr(expr,"/");
-  if( sptr != NULL ) {
-    // Found / do division
-    char val1[64];
-    char val2[64];
-    strncpy(val1, (const char*)expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2, (const char*)sptr+1);
-
-    // Prevent division by 0
-    if( atoll(val2) > 0 ) {
-      value = atoll(val1) / atoll(val2);
-    } else {
-      value = 0;
-    }
+  // Without a disk NUM_DISK_SECTORS reads as 1, CRC32 terms add nothing
+  expr_value_t v;
+  int status = exprCache.Evaluate(expr, 1, &v);
+  if (status != 0) {
+    return status;
   }
-
-  sptr = strstr(expr,"-");
-  if( sptr != NULL ) {
-    // Found - do subtraction
-    char val1[32];
-    char val2[32];
-    strncpy(val1, (const char*)expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,(const char*)sptr+1);
-    value = atoll(val1) - atoll(val2);
-  }
-  
-  sptr = strstr(expr,"+");
-  if( sptr != NULL ) {
-    // Found + do addition
-    char val1[32];
-    char val2[32];
-    strncpy(val1,(const char*)expr,(sptr-expr));
-    val1[sptr-expr] = 0;
-    strcpy(val2,(const char*)sptr+1);
-    value = atoll(val1) + atoll(val2);
-  }
-
+  value = v.value;
   return 0;
 }
 
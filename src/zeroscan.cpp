@@ -0,0 +1,55 @@
+/*****************************************************************************
+ * zeroscan.cpp
+ *
+ * This file implements the zero block test used to find runs of zeros in
+ * raw images. SSE2 and NEON are part of the base x86_64 and aarch64 ABIs so
+ * no runtime dispatch is needed.
+ *
+ *****************************************************************************/
+
+#include <string.h>
+#include "zeroscan.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static bool IsZero64(const unsigned char *buf)
+{
+  __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)buf), _mm_loadu_si128((const __m128i *)(buf + 16))),
+                             _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + 32)), _mm_loadu_si128((const __m128i *)(buf + 48))));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static bool IsZero64(const unsigned char *buf)
+{
+  uint8x16_t acc = vorrq_u8(vorrq_u8(vld1q_u8(buf), vld1q_u8(buf + 16)), vorrq_u8(vld1q_u8(buf + 32), vld1q_u8(buf + 48)));
+  uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+  return (vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) == 0;
+}
+#else
+static bool IsZero64(const unsigned char *buf)
+{
+  uint64_t w[8];
+  memcpy(w, buf, sizeof(w));
+  return (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) == 0;
+}
+#endif
+
+bool IsZeroBlock(const unsigned char *buf, size_t len)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    if (!IsZero64(buf + i)) {
+      return false;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}